@@ -99,6 +99,61 @@ GIT_EXTERN(void) git_odb_free(git_odb *db);
  */
 GIT_EXTERN(int) git_odb_read(git_odb_object **out, git_odb *db, const git_oid *id);
 
+/**
+ * Read several objects from the database at once.
+ *
+ * This is equivalent to calling `git_odb_read` for every id in
+ * `ids`, but gives backends which are able to look up many objects
+ * in a single operation (e.g. over the network) the opportunity
+ * to do so.
+ *
+ * The returned objects are reference counted and internally
+ * cached, so each one should be closed by the user once it's no
+ * longer in use.  Objects that could not be found are set to NULL.
+ *
+ * @param out array of `count` object pointers to fill in
+ * @param db database to search for the objects in.
+ * @param ids array of `count` identities of the objects to read.
+ * @param count number of objects to read
+ * @return
+ * - 0 if all the objects were read;
+ * - GIT_ENOTFOUND if at least one object is not in the database.
+ */
+GIT_EXTERN(int) git_odb_read_many(
+	git_odb_object **out, git_odb *db, const git_oid *ids, size_t count);
+
+/**
+ * Hint that the given objects are about to be read.
+ *
+ * Backends which are able to fetch objects in the background (e.g.
+ * over the network) may start doing so, so that later reads of these
+ * objects do not have to wait for them.  Objects which are already
+ * available locally are not passed on.  This is purely advisory:
+ * nothing is read when no backend supports it, and failures to
+ * prefetch are not reported.
+ *
+ * @param db database the objects will be read from
+ * @param ids array of `count` identities of the objects
+ * @param count number of objects
+ * @return 0 or an error code
+ */
+GIT_EXTERN(int) git_odb_prefetch(
+	git_odb *db, const git_oid *ids, size_t count);
+
+/**
+ * Hint that a tree is about to be walked.
+ *
+ * Backends which fetch objects over the network may fetch the tree
+ * along with all of its subtrees, rather than having them read one
+ * level at a time.  Like `git_odb_prefetch`, this is purely advisory,
+ * and nothing happens when the tree is available locally.
+ *
+ * @param db database the tree will be read from
+ * @param id identity of the tree
+ * @return 0 or an error code
+ */
+GIT_EXTERN(int) git_odb_prefetch_tree(git_odb *db, const git_oid *id);
+
 /**
  * Read an object from the database, given a prefix
  * of its identifier.
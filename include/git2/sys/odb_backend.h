@@ -21,6 +21,17 @@
  */
 GIT_BEGIN_DECL
 
+/**
+ * Callback used by backends to hand over objects found by `read_many`.
+ *
+ * The `data` buffer must have been allocated with
+ * `git_odb_backend_malloc`; ownership of it passes to the callback,
+ * regardless of the return value.  A non-zero return value aborts
+ * the read and must be returned by the backend.
+ */
+typedef int (*git_odb_backend_read_cb)(
+	const git_oid *id, void *data, size_t len, git_otype type, void *payload);
+
 /**
  * An instance for a custom backend
  */
@@ -95,6 +106,33 @@ struct git_odb_backend {
 	 */
 	int (* freshen)(git_odb_backend *, const git_oid *);
 
+	/**
+	 * Read many objects in a single operation.  Every object which is
+	 * found is passed to the given callback; objects that are not found
+	 * are simply not reported.  Backends that can look up objects in
+	 * batches (for example over the network) should implement this;
+	 * libgit2 falls back to calling `read` for every object otherwise.
+	 */
+	int (* read_many)(
+		git_odb_backend *, const git_oid *, size_t,
+		git_odb_backend_read_cb, void *);
+
+	/**
+	 * Start fetching the given objects in the background, because they
+	 * are expected to be read soon.  This is only a hint; backends
+	 * should return quickly and may ignore some or all of the objects.
+	 */
+	int (* prefetch)(git_odb_backend *, const git_oid *, size_t);
+
+	/**
+	 * Fetch a tree along with the trees reachable from it, because
+	 * they are about to be walked.  Backends fetching objects over
+	 * the network can get them all at once this way, instead of one
+	 * level at a time.  Like `prefetch`, this is only a hint, but it
+	 * may block until the trees are available.
+	 */
+	int (* prefetch_tree)(git_odb_backend *, const git_oid *);
+
 	/**
 	 * Frees any resources held by the odb (including the `git_odb_backend`
 	 * itself). An odb backend implementation must provide this function.
@@ -156,7 +156,10 @@ struct git_refdb_backend {
 	int (*reflog_delete)(git_refdb_backend *backend, const char *name);
 
 	/**
-	 * Lock a reference. The opaque parameter will be passed to the unlock function
+	 * Lock a reference. The opaque parameter will be passed to the unlock function.
+	 * If it is not NULL on entry, it is the payload of another lock which is
+	 * still held and which the new one is taken along with, as part of the
+	 * same transaction.
 	 */
 	int (*lock)(void **payload_out, git_refdb_backend *backend, const char *refname);
 
@@ -0,0 +1,329 @@
+/*
+ * Copyright (C) the libgit2 contributors. All rights reserved.
+ *
+ * This file is part of libgit2, distributed under the GNU GPL v2 with
+ * a Linking Exception. For full terms see the included COPYING file.
+ */
+#ifndef INCLUDE_sys_git_repospanner_h__
+#define INCLUDE_sys_git_repospanner_h__
+
+#include "git2/common.h"
+#include "git2/types.h"
+#include "git2/strarray.h"
+
+/**
+ * @file git2/sys/repospanner.h
+ * @brief Introspection of repositories backed by repoSpanner
+ * @defgroup git_repospanner repoSpanner support
+ * @ingroup Git
+ * @{
+ */
+GIT_BEGIN_DECL
+
+/**
+ * Usage counters of the HTTP handles of a repoSpanner client.
+ *
+ * All repositories opened from the same directory share a client, so
+ * these cover all of them.
+ */
+typedef struct {
+	/** Requests made */
+	size_t requests;
+
+	/** Handles that had to be created for a request */
+	size_t created;
+
+	/** Requests that were served by a pooled handle */
+	size_t reused;
+
+	/** Reused handles that were last used by the same thread */
+	size_t affine;
+
+	/** Handles freed because the pool was full */
+	size_t discarded;
+
+	/** Connections opened, as opposed to reused, by all requests */
+	size_t connections;
+
+	/** Connections which resumed an earlier TLS session */
+	size_t resumed;
+
+	/** Handles currently idle in the pool */
+	size_t idle;
+} git_repospanner_handle_stats;
+
+/**
+ * Get the handle usage counters of the repoSpanner client serving
+ * a repository.
+ *
+ * @param out the counters
+ * @param repo the repository
+ * @return 0 on success, GIT_ENOTFOUND if the repository is not
+ *         backed by repoSpanner, or an error code
+ */
+GIT_EXTERN(int) git_repospanner_get_handle_stats(
+	git_repospanner_handle_stats *out, git_repository *repo);
+
+/**
+ * Endpoints of the repoSpanner server, which requests are counted by.
+ */
+typedef enum {
+	/** `simple/object`, single objects or their headers */
+	GIT_REPOSPANNER_ENDPOINT_OBJECT = 0,
+
+	/** `simple/objects`, batches of objects */
+	GIT_REPOSPANNER_ENDPOINT_OBJECTS,
+
+	/** `simple/objects/tree`, trees with their subtrees */
+	GIT_REPOSPANNER_ENDPOINT_TREE,
+
+	/** `simple/objects/prefix`, resolving abbreviated ids */
+	GIT_REPOSPANNER_ENDPOINT_PREFIX,
+
+	/** `simple/objects/list`, listing all objects */
+	GIT_REPOSPANNER_ENDPOINT_LIST,
+
+	/** `simple/objects/pack`, uploading objects */
+	GIT_REPOSPANNER_ENDPOINT_UPLOAD,
+
+	/** `simple/refs`, reading refs */
+	GIT_REPOSPANNER_ENDPOINT_REFS,
+
+	/** `simple/refs/update`, updating refs */
+	GIT_REPOSPANNER_ENDPOINT_REFS_UPDATE,
+
+	/** Anything else */
+	GIT_REPOSPANNER_ENDPOINT_OTHER,
+
+	GIT_REPOSPANNER_ENDPOINT__LAST
+} git_repospanner_endpoint_t;
+
+/**
+ * Number of buckets of the latency histograms.  Bucket 0 counts the
+ * requests which took less than a millisecond, bucket `i` the ones
+ * which took less than 2^i milliseconds but at least 2^(i-1), and the
+ * last one all slower requests.
+ */
+#define GIT_REPOSPANNER_LATENCY_BUCKETS 16
+
+/** Requests made to one endpoint of a repoSpanner server */
+typedef struct {
+	/** Requests made */
+	size_t requests;
+
+	/** Requests for something the server does not have */
+	size_t not_found;
+
+	/**
+	 * Requests which got no response, or an error other than not
+	 * found.  This includes reads sent to several nodes, which are
+	 * abandoned on all but the first one to answer.
+	 */
+	size_t failures;
+
+	/** Bytes of request bodies sent */
+	uint64_t bytes_sent;
+
+	/** Bytes of response bodies received, before decompressing them */
+	uint64_t bytes_received;
+
+	/** Time spent in these requests, in seconds */
+	double time;
+
+	/** How long requests took, see `GIT_REPOSPANNER_LATENCY_BUCKETS` */
+	size_t latency[GIT_REPOSPANNER_LATENCY_BUCKETS];
+} git_repospanner_endpoint_stats;
+
+/**
+ * Requests made by a repoSpanner client, and lookups it answered
+ * without making one.
+ *
+ * Lookups answered by the loose objects and packs of the repository
+ * itself never reach the client, and are not counted.
+ */
+typedef struct {
+	/** Requests, by endpoint */
+	git_repospanner_endpoint_stats endpoints[GIT_REPOSPANNER_ENDPOINT__LAST];
+
+	/**
+	 * Objects or headers read from the local cache of fetched
+	 * objects, from prefetched objects or from objects not written
+	 * to the cache yet
+	 */
+	size_t cache_hits;
+
+	/** Lookups of objects the server recently said it does not have */
+	size_t negative_hits;
+
+	/** Reads which waited for another thread downloading the object */
+	size_t coalesced;
+
+	/** Reads also sent to another node, as the first one was slow */
+	size_t hedged;
+} git_repospanner_stats;
+
+/**
+ * Get the request counters of the repoSpanner client serving a
+ * repository.
+ *
+ * Like the handle counters, these cover all repositories sharing the
+ * client.  Every request is also traced at `GIT_TRACE_DEBUG`, or at
+ * `GIT_TRACE_WARN` if it failed, when tracing is enabled.
+ *
+ * @param out the counters
+ * @param repo the repository
+ * @return 0 on success, GIT_ENOTFOUND if the repository is not
+ *         backed by repoSpanner, or an error code
+ */
+GIT_EXTERN(int) git_repospanner_get_stats(
+	git_repospanner_stats *out, git_repository *repo);
+
+/**
+ * Get the name of an endpoint, as in the server's URLs.
+ *
+ * @param endpoint the endpoint
+ * @return its name, or NULL if it is not a valid endpoint
+ */
+GIT_EXTERN(const char *) git_repospanner_endpoint_name(
+	git_repospanner_endpoint_t endpoint);
+
+/**
+ * Compact the local cache of objects fetched from repoSpanner.
+ *
+ * All packs of the cache are merged into one.  The oldest objects are
+ * dropped, so that the result takes up at most half of the configured
+ * `repospanner.cachesize`.
+ *
+ * The cache is kept in the repository, unless `repospanner.cachedir`
+ * names a directory to share with the other clones of the same
+ * repoSpanner repository on the machine.
+ *
+ * @param repo the repository
+ * @return 0 on success, GIT_ENOTFOUND if the repository is not
+ *         backed by repoSpanner, GIT_ELOCKED if another process is
+ *         merging the packs of a shared cache, or an error code
+ */
+GIT_EXTERN(int) git_repospanner_cache_compact(git_repository *repo);
+
+/**
+ * Upload the objects written to a repository backed by repoSpanner.
+ *
+ * Objects are written locally and queued, until there are
+ * `repospanner.uploadbatch` of them or this is called.  They are then
+ * sent to the server as a single pack.  If that fails, they stay
+ * queued for the next attempt.  The queue is kept in the repository,
+ * so objects this process fails to upload are left to the next one
+ * that opens it, as long as they are still in the local object store.
+ *
+ * @param repo the repository
+ * @return 0 on success, GIT_ENOTFOUND if the repository is not
+ *         backed by repoSpanner, or an error code
+ */
+GIT_EXTERN(int) git_repospanner_upload_objects(git_repository *repo);
+
+/**
+ * Options for fetching a tree along with the objects reachable from it.
+ *
+ * Initialize with `GIT_REPOSPANNER_FETCH_TREE_OPTIONS_INIT`.
+ */
+typedef struct {
+	unsigned int version;
+
+	/**
+	 * How many levels of subtrees to fetch below the tree, or 0 to
+	 * fetch all of them.
+	 */
+	unsigned int depth;
+
+	/** Whether to fetch the blobs of these trees too */
+	int blobs;
+
+	/**
+	 * If given, only descend into the subtrees leading to, or below,
+	 * these paths.
+	 */
+	git_strarray paths;
+} git_repospanner_fetch_tree_options;
+
+#define GIT_REPOSPANNER_FETCH_TREE_OPTIONS_VERSION 1
+#define GIT_REPOSPANNER_FETCH_TREE_OPTIONS_INIT {GIT_REPOSPANNER_FETCH_TREE_OPTIONS_VERSION}
+
+/**
+ * Fetch a tree and the trees reachable from it into the local cache of
+ * a repository backed by repoSpanner.
+ *
+ * Everything comes in a single pack, so walking or checking out the
+ * tree afterwards does not need a round trip per directory.  Trees are
+ * also fetched like this when they are about to be walked, unless
+ * `repospanner.treedepth` is negative; it otherwise limits how many
+ * levels of subtrees are fetched at once.
+ *
+ * @param repo the repository
+ * @param tree the tree to fetch
+ * @param opts options, or NULL for the defaults
+ * @return 0 on success, GIT_ENOTFOUND if the repository is not
+ *         backed by repoSpanner or does not have the tree, or an
+ *         error code
+ */
+GIT_EXTERN(int) git_repospanner_fetch_tree(
+	git_repository *repo, const git_oid *tree,
+	const git_repospanner_fetch_tree_options *opts);
+
+/**
+ * Callback for a change of the refs of a repository backed by repoSpanner.
+ *
+ * @param name the name of the ref
+ * @param id the object the ref points to now, or NULL if it was
+ *           deleted or is symbolic
+ * @param target the ref it points to now if it is symbolic, or NULL
+ * @param payload the payload given to `git_repospanner_subscribe`
+ */
+typedef void (*git_repospanner_ref_change_cb)(
+	const char *name, const git_oid *id, const char *target, void *payload);
+
+/** A subscription to changes of the refs of a repository */
+typedef struct git_repospanner_subscription git_repospanner_subscription;
+
+/**
+ * Subscribe to changes of the refs of a repository backed by repoSpanner.
+ *
+ * All refs are loaded, and a background thread then keeps asking the
+ * server for what changed since.  The server may hold each of these
+ * requests for up to `repospanner.refswait` seconds (60 by default),
+ * until there are changes to send; servers that answer right away are
+ * asked every `repospanner.refsinterval` milliseconds.  Changes are
+ * applied to the refs of the repository as they arrive, and while the
+ * requests succeed, looking up refs does not ask the server again.
+ *
+ * The callback is called on the background thread, for the changes it
+ * got as well as those other threads found or made, but not for
+ * refs which changed and then changed back in between.
+ *
+ * A repository can have one subscription at a time, which has to be
+ * ended before the repository is freed.  This needs thread support.
+ *
+ * @param out the subscription
+ * @param repo the repository
+ * @param cb the callback to call for every changed ref
+ * @param payload payload passed to the callback
+ * @return 0 on success, GIT_ENOTFOUND if the refs of the repository are
+ *         not backed by repoSpanner, GIT_EEXISTS if it already has a
+ *         subscription, or an error code
+ */
+GIT_EXTERN(int) git_repospanner_subscribe(
+	git_repospanner_subscription **out, git_repository *repo,
+	git_repospanner_ref_change_cb cb, void *payload);
+
+/**
+ * End a subscription.  Once this returns, its callback is not called
+ * anymore.  Interrupting the request the server may be holding can
+ * take up to a second.  This must not be called from the callback.
+ *
+ * @param subscription the subscription, or NULL
+ */
+GIT_EXTERN(void) git_repospanner_unsubscribe(
+	git_repospanner_subscription *subscription);
+
+/** @} */
+GIT_END_DECL
+#endif
@@ -0,0 +1,480 @@
+#!/usr/bin/env python3
+#
+# A stand-in for a repoSpanner server, serving the `simple/` API from a
+# bare repository so that the repoSpanner backends can be tested and
+# benchmarked without a cluster.
+#
+# The repository is copied before being served, so that pushes do not
+# modify it.  Serving takes `git` for reading objects and refs, and
+# `openssl` for creating the certificates if they do not exist yet:
+#
+#     ca.crt                    the CA both sides are verified against
+#     server.crt, server.key    for the server, valid for localhost
+#     client.crt, client.key    for the client
+#
+# Either serve until interrupted:
+#
+#     repospanner-mock.py --repo tests/resources/testrepo.git --port 8443
+#
+# or run a command while serving, with GITTEST_REPOSPANNER_URL and
+# GITTEST_REPOSPANNER_CERTS set for it, and exit with its status:
+#
+#     repospanner-mock.py --repo tests/resources/testrepo.git \
+#         --run ./libgit2_clar -sonline::repospanner
+#
+# Ref listings come as lines, or in the binary format if the client
+# accepts it, and listings of refs or objects are compressed with gzip
+# for clients accepting that.  Requests for changes of the refs that
+# ask for it with "Prefer: wait=N" are held until there are some, or
+# for N seconds.
+#
+# Every request can be delayed by --latency milliseconds, plus a
+# random part of up to --jitter milliseconds, to make it behave like
+# a server that is not on the same machine.
+#
+# Repositories under /legacy/ are served like an older server would,
+# which does not answer HEAD requests for objects, nor know how to
+# send trees with their subtrees.  The ones under
+# /lagging/ are served like a replica that has yet to catch up, which
+# has none of the objects.  Under /corrupt/, objects come with their
+# contents reversed, and under /truncated/ the connection is closed
+# halfway through sending them.
+#
+# When running a command with --jitter, GITTEST_REPOSPANNER_JITTER is
+# set for it as well.
+
+import argparse
+import gzip
+import hashlib
+import http.server
+import os
+import random
+import shutil
+import ssl
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import urllib.parse
+import zlib
+
+ZERO_ID = "0" * 40
+
+
+def is_id(s):
+    return len(s) == 40 and all(c in "0123456789abcdef" for c in s)
+
+
+class Repository:
+    def __init__(self, path):
+        self.path = path
+        self.lock = threading.Lock()
+        self.states = {}
+        self.changed = threading.Condition()
+        self.generation = 0
+        self.batch = subprocess.Popen(
+            ["git", "--git-dir", path, "cat-file", "--batch"],
+            stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+
+    def bump(self):
+        with self.changed:
+            self.generation += 1
+            self.changed.notify_all()
+
+    def git(self, *args, input=None, check=True):
+        return subprocess.run(
+            ["git", "--git-dir", self.path] + list(args), input=input,
+            stdout=subprocess.PIPE, stderr=subprocess.PIPE, check=check)
+
+    def object(self, hexid):
+        """The type and contents of an object, or None if it is missing"""
+        if not is_id(hexid):
+            return None
+        with self.lock:
+            self.batch.stdin.write(hexid.encode() + b"\n")
+            self.batch.stdin.flush()
+            header = self.batch.stdout.readline().split()
+            if len(header) != 3:
+                return None
+            data = self.batch.stdout.read(int(header[2]))
+            self.batch.stdout.readline()
+        return header[1], data
+
+    def ids(self):
+        out = self.git("cat-file", "--batch-all-objects", "--batch-check=%(objectname)")
+        return sorted(out.stdout.decode().split())
+
+    def refs(self):
+        out = self.git("for-each-ref", "--format=%(objectname) %(refname)")
+        return dict(reversed(line.split(" ", 1)) for line in out.stdout.decode().splitlines())
+
+    def head(self):
+        out = self.git("symbolic-ref", "HEAD", check=False)
+        return out.stdout.decode().strip() if out.returncode == 0 else None
+
+
+def loose(obj):
+    kind, data = obj
+    return zlib.compress(kind + b" " + str(len(data)).encode() + b"\0" + data)
+
+
+REFS_BINARY = "application/x-repospanner-refs"
+
+
+def varint(value):
+    out = [value & 127]
+    value >>= 7
+    while value:
+        value -= 1
+        out.insert(0, 128 | (value & 127))
+        value >>= 7
+    return bytes(out)
+
+
+def ref_listing(entries, binary):
+    """Encode (type, name, value) entries, where type is real, symb or dele"""
+    if not binary:
+        return b"".join(t + b"\0" + n.encode() + b"\0" + v.encode() + b"\n" for t, n, v in entries)
+
+    out, previous = [b"RSRL"], b""
+    for kind, name, value in sorted(entries, key=lambda e: e[1]):
+        name = name.encode()
+        common = len(os.path.commonprefix([previous, name]))
+        out.append(kind[:1] + varint(len(previous) - common) + name[common:] + b"\0")
+        if kind == b"real":
+            out.append(bytes.fromhex(value))
+        elif kind == b"symb":
+            out.append(value.encode() + b"\0")
+        previous = name
+    return b"".join(out)
+
+
+def prefer_wait(prefer):
+    for preference in prefer.split(","):
+        name, _, value = preference.strip().partition("=")
+        if name == "wait" and value.isdigit():
+            return int(value)
+    return 0
+
+
+def real(refs):
+    return [(b"real", n, o) for n, o in refs]
+
+
+class Server(http.server.ThreadingHTTPServer):
+    daemon_threads = True
+
+    def handle_error(self, request, client_address):
+        # clients drop the reads they sent to several nodes but the first
+        # to answer, which is no error of ours
+        if not isinstance(sys.exc_info()[1], (ConnectionError, ssl.SSLError)):
+            super().handle_error(request, client_address)
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    disable_nagle_algorithm = True
+
+    def log_message(self, *args):
+        pass
+
+    def send(self, code, body=b"", headers=None, compress=False):
+        self.send_response(code)
+        for name, value in (headers or {}).items():
+            self.send_header(name, value)
+        if compress and body and "gzip" in self.headers.get("Accept-Encoding", ""):
+            body = gzip.compress(body)
+            self.send_header("Content-Encoding", "gzip")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        if self.command != "HEAD":
+            self.wfile.write(body)
+
+    def send_truncated(self, body):
+        self.send_response(200)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body[:len(body) // 2])
+        self.wfile.flush()
+        self.close_connection = True
+
+    def route(self):
+        url = urllib.parse.urlparse(self.path)
+        pos = url.path.find("/simple/")
+        if pos < 0:
+            return None, None
+        self.legacy = url.path.startswith("/legacy/")
+        self.lagging = url.path.startswith("/lagging/")
+        self.corrupt = url.path.startswith("/corrupt/")
+        self.truncated = url.path.startswith("/truncated/")
+        options = self.server.options
+        time.sleep((options.latency + random.random() * options.jitter) / 1000.0)
+        return url.path[pos + 8:], urllib.parse.parse_qs(url.query)
+
+    def body(self):
+        if self.headers.get("Transfer-Encoding", "").lower() != "chunked":
+            return self.rfile.read(int(self.headers.get("Content-Length", 0)))
+        out = b""
+        while True:
+            size = int(self.rfile.readline().split(b";")[0].strip(), 16)
+            if size == 0:
+                while self.rfile.readline().strip():
+                    pass
+                return out
+            out += self.rfile.read(size)
+            self.rfile.readline()
+
+    def do_HEAD(self):
+        path, _ = self.route()
+        if path and self.legacy:
+            return self.send(405)
+        obj = self.server.repo.object(path[7:]) if path and path.startswith("object/") else None
+        if obj is None or self.lagging:
+            return self.send(404)
+        self.send(200, b"", {
+            "X-RepoSpanner-Object-Type": obj[0].decode(),
+            "X-RepoSpanner-Object-Size": str(len(obj[1])),
+        })
+
+    def do_GET(self):
+        repo = self.server.repo
+        path, query = self.route()
+        if path is None:
+            return self.send(404)
+
+        if path.startswith("object/"):
+            obj = repo.object(path[7:])
+            if obj is None or self.lagging:
+                return self.send(404)
+            if self.corrupt:
+                obj = (obj[0], obj[1][::-1])
+            if self.truncated:
+                return self.send_truncated(loose(obj))
+            return self.send(200, loose(obj))
+
+        if path.startswith("objects/prefix/"):
+            ids = [i for i in repo.ids() if i.startswith(path[15:])][:16]
+            return self.send(200, "".join(i + "\n" for i in ids).encode(), compress=True)
+
+        if path == "objects/list":
+            after = query.get("after", [""])[0]
+            limit = int(query.get("limit", ["1000"])[0])
+            ids = [i for i in repo.ids() if i > after][:limit]
+            return self.send(200, "".join(i + "\n" for i in ids).encode(), compress=True)
+
+        if path != "refs":
+            return self.send(404)
+
+        binary = REFS_BINARY in self.headers.get("Accept", "")
+        kind = {"Content-Type": REFS_BINARY if binary else "text/plain"}
+
+        def listing(code, entries, headers={}):
+            self.send(code, ref_listing(entries, binary), dict(kind, **headers), compress=True)
+
+        if "name" in query:
+            name = query["name"][0]
+            if name == "HEAD" and repo.head():
+                return listing(200, [(b"symb", "HEAD", repo.head())])
+            return listing(200, real((n, o) for n, o in repo.refs().items() if n == name))
+
+        if "prefix" in query:
+            prefix = query["prefix"][0]
+            return listing(200, real((n, o) for n, o in repo.refs().items() if n.startswith(prefix)))
+
+        # all refs, or what changed since a listing the client has
+        deadline = time.time() + prefer_wait(self.headers.get("Prefer", ""))
+        while True:
+            generation = repo.generation
+            refs = repo.refs()
+            etag = '"%s"' % hashlib.sha1(repr(sorted(refs.items())).encode()).hexdigest()
+            if self.headers.get("If-None-Match") != etag or time.time() >= deadline:
+                break
+            with repo.changed:
+                repo.changed.wait_for(lambda: repo.generation != generation, deadline - time.time())
+        with repo.lock:
+            repo.states[etag] = refs
+            previous = repo.states.get(self.headers.get("If-None-Match", ""))
+
+        if self.headers.get("If-None-Match") == etag:
+            return self.send(304, b"", {"ETag": etag})
+
+        if previous is not None and self.headers.get("A-IM") == "repospanner-refs":
+            entries = real((n, o) for n, o in refs.items() if previous.get(n) != o)
+            entries += [(b"dele", n, "") for n in previous if n not in refs]
+            return listing(226, entries, {"ETag": etag, "IM": "repospanner-refs"})
+
+        entries = real(refs.items())
+        if repo.head():
+            entries.append((b"symb", "HEAD", repo.head()))
+        listing(200, entries, {"ETag": etag})
+
+    def do_POST(self):
+        repo = self.server.repo
+        path, _ = self.route()
+        data = self.body()
+
+        if path == "objects":
+            body = b""
+            for hexid in data.decode().split():
+                obj = repo.object(hexid)
+                if obj is not None:
+                    compressed = loose(obj)
+                    body += hexid.encode() + b" " + str(len(compressed)).encode() + b"\n" + compressed
+            return self.send(200, body, compress=True)
+
+        if path == "objects/tree" and not self.legacy:
+            return self.fetch_tree(data.decode().split("\n"))
+
+        if path == "objects/pack":
+            result = repo.git("index-pack", "--stdin", "--fix-thin", input=data, check=False)
+            return self.send(400 if result.returncode else 200, result.stderr if result.returncode else b"")
+
+        if path == "refs/update":
+            return self.update_refs([line.split(b"\0") for line in data.split(b"\n") if line])
+
+        self.send(404)
+
+    def fetch_tree(self, lines):
+        repo = self.server.repo
+        root, depth, blobs, paths = lines[0], 0, False, []
+        for line in lines[1:]:
+            if line.startswith("depth "):
+                depth = int(line[6:])
+            elif line == "blobs":
+                blobs = True
+            elif line.startswith("path "):
+                paths.append(line[5:].strip("/"))
+
+        obj = repo.object(root)
+        if obj is None or obj[0] != b"tree":
+            return self.send(404)
+
+        def wanted(path):
+            return not paths or path == "" or any(
+                path == p or p.startswith(path + "/") or path.startswith(p + "/") for p in paths)
+
+        ids = [root]
+        for entry in repo.git("ls-tree", "-r", "-t", "-z", root).stdout.split(b"\0"):
+            if not entry:
+                continue
+            meta, path = entry.decode().split("\t", 1)
+            _, kind, hexid = meta.split()
+            level = path.count("/") + 1
+            parent = path.rsplit("/", 1)[0] if "/" in path else ""
+            if kind == "tree" and (depth == 0 or level <= depth) and wanted(path):
+                ids.append(hexid)
+            elif kind == "blob" and blobs and (depth == 0 or level <= depth + 1) and wanted(parent):
+                ids.append(hexid)
+
+        pack = repo.git("pack-objects", "--stdout", input=("\n".join(ids) + "\n").encode())
+        self.send(200, pack.stdout, compress=True)
+
+    def update_refs(self, updates):
+        repo = self.server.repo
+        with repo.lock:
+            refs = repo.refs()
+            if repo.head():
+                refs["HEAD"] = "ref: " + repo.head()
+
+            for name, old, _ in updates:
+                name, old = name.decode(), old.decode()
+                if old and refs.get(name, ZERO_ID) != old:
+                    return self.send(409, ("%s is %s, not %s" % (name, refs.get(name, ZERO_ID), old)).encode())
+
+            commands = b"start\n"
+            for name, _, new in updates:
+                if new == ZERO_ID.encode():
+                    commands += b"delete " + name + b"\n"
+                elif not new.startswith(b"ref: "):
+                    commands += b"update " + name + b" " + new + b"\n"
+            commands += b"prepare\ncommit\n"
+
+            result = repo.git("update-ref", "--stdin", input=commands, check=False)
+            if result.returncode:
+                return self.send(400, result.stderr)
+
+            for name, _, new in updates:
+                if new.startswith(b"ref: "):
+                    repo.git("symbolic-ref", name.decode(), new[5:].decode())
+
+        repo.bump()
+        self.send(200)
+
+
+def make_certificates(directory):
+    def openssl(*args):
+        subprocess.run(["openssl"] + list(args), cwd=directory, check=True,
+                       stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+    os.makedirs(directory, exist_ok=True)
+    if os.path.exists(os.path.join(directory, "ca.crt")):
+        return
+
+    openssl("req", "-x509", "-newkey", "rsa:2048", "-nodes", "-days", "3650",
+            "-subj", "/CN=repoSpanner mock CA", "-keyout", "ca.key", "-out", "ca.crt")
+
+    with open(os.path.join(directory, "san.ext"), "w") as f:
+        f.write("subjectAltName=DNS:localhost,IP:127.0.0.1\n")
+
+    for name in ("server", "client"):
+        openssl("req", "-newkey", "rsa:2048", "-nodes", "-subj", "/CN=localhost",
+                "-keyout", name + ".key", "-out", name + ".csr")
+        openssl("x509", "-req", "-days", "3650", "-in", name + ".csr",
+                "-CA", "ca.crt", "-CAkey", "ca.key", "-CAcreateserial",
+                "-extfile", "san.ext", "-out", name + ".crt")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Serve a repository like a repoSpanner server would.")
+    parser.add_argument("--repo", required=True, help="bare repository to serve a copy of")
+    parser.add_argument("--port", type=int, default=0, help="port to listen on, any free one by default")
+    parser.add_argument("--certs", help="directory with the certificates, created if needed")
+    parser.add_argument("--latency", type=float, default=0, help="milliseconds to delay every request by")
+    parser.add_argument("--jitter", type=float, default=0, help="up to this many more milliseconds, at random")
+    parser.add_argument("--run", nargs=argparse.REMAINDER, help="command to run while serving")
+    options = parser.parse_args()
+
+    workdir = tempfile.mkdtemp(prefix="repospanner-mock-")
+    try:
+        served = os.path.join(workdir, "repo.git")
+        shutil.copytree(options.repo, served)
+
+        certs = os.path.abspath(options.certs or os.path.join(workdir, "certs"))
+        make_certificates(certs)
+
+        server = Server(("127.0.0.1", options.port), Handler)
+        server.options = options
+        server.repo = Repository(served)
+
+        context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+        context.load_cert_chain(os.path.join(certs, "server.crt"), os.path.join(certs, "server.key"))
+        context.load_verify_locations(os.path.join(certs, "ca.crt"))
+        context.verify_mode = ssl.CERT_REQUIRED
+        server.socket = context.wrap_socket(server.socket, server_side=True)
+
+        url = "https://localhost:%d/repo/test.git" % server.server_address[1]
+
+        if not options.run:
+            print("serving %s at %s, certificates in %s" % (options.repo, url, certs), flush=True)
+            try:
+                server.serve_forever()
+            except KeyboardInterrupt:
+                pass
+            return 0
+
+        threading.Thread(target=server.serve_forever, daemon=True).start()
+
+        env = dict(os.environ, GITTEST_REPOSPANNER_URL=url, GITTEST_REPOSPANNER_CERTS=certs)
+        if options.jitter:
+            env["GITTEST_REPOSPANNER_JITTER"] = str(options.jitter)
+        result = subprocess.run(options.run, env=env)
+
+        server.shutdown()
+        return result.returncode
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
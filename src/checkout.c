@@ -34,6 +34,8 @@
 #include "attr.h"
 #include "pool.h"
 #include "strmap.h"
+#include "odb.h"
+#include "tree.h"
 
 /* See docs/checkout-internals.md for more information */
 
@@ -1875,6 +1877,44 @@ static int checkout_deferred_remove(git_repository *repo, const char *path)
 #endif
 }
 
+static void checkout_prefetch_blobs(
+	unsigned int *actions,
+	checkout_data *data)
+{
+	git_array_t(git_oid) ids = GIT_ARRAY_INIT;
+	git_diff_delta *delta;
+	git_oid *id;
+	git_odb *odb;
+	size_t i;
+
+	if (git_repository_odb__weakptr(&odb, data->repo) < 0)
+		goto on_error;
+
+	if (!git_odb__has_prefetch(odb))
+		return;
+
+	git_vector_foreach(&data->diff->deltas, i, delta) {
+		if ((actions[i] & CHECKOUT_ACTION__UPDATE_BLOB) == 0 ||
+		    S_ISGITLINK(delta->new_file.mode))
+			continue;
+
+		if ((id = git_array_alloc(ids)) == NULL)
+			goto on_error;
+		git_oid_cpy(id, &delta->new_file.id);
+	}
+
+	if (git_odb_prefetch(odb, ids.ptr, ids.size) < 0)
+		goto on_error;
+
+	git_array_clear(ids);
+	return;
+
+on_error:
+	/* this is only an optimization, so failing here is not an error */
+	giterr_clear();
+	git_array_clear(ids);
+}
+
 static int checkout_create_the_new(
 	unsigned int *actions,
 	checkout_data *data)
@@ -1883,6 +1923,8 @@ static int checkout_create_the_new(
 	git_diff_delta *delta;
 	size_t i;
 
+	checkout_prefetch_blobs(actions, data);
+
 	git_vector_foreach(&data->diff->deltas, i, delta) {
 		if (actions[i] & CHECKOUT_ACTION__DEFER_REMOVE) {
 			/* this had a blocker directory that should only be removed iff
@@ -2773,6 +2815,10 @@ int git_checkout_tree(
 		iter_opts.pathlist.strings = opts->paths.strings;
 	}
 
+	/* the whole tree is only walked when no paths are given */
+	if (!opts || !opts->paths.count)
+		git_tree__prefetch_closure(tree);
+
 	if (!(error = git_iterator_for_tree(&tree_i, tree, &iter_opts)))
 		error = git_checkout_iterator(tree_i, index, opts);
 
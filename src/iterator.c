@@ -584,6 +584,11 @@ static int tree_iterator_frame_init(
 	git_vector_set_sorted(&new_frame->entries,
 		!iterator__ignore_case(&iter->base));
 
+	/* unless we were told which paths to look at, we will descend into
+	 * every subtree in turn; let them be fetched in the meantime */
+	if (!iter->base.pathlist.length)
+		git_tree__prefetch(dup, false);
+
 done:
 	if (error < 0) {
 		git_tree_free(dup);
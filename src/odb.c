@@ -15,6 +15,8 @@
 #include "delta.h"
 #include "filter.h"
 #include "repository.h"
+#include "oidmap.h"
+#include "array.h"
 
 #include "git2/odb_backend.h"
 #include "git2/oid.h"
@@ -29,6 +31,7 @@
 #define GIT_REPOSPANNER_PRIORITY 0
 #define GIT_LOOSE_PRIORITY 1
 #define GIT_PACKED_PRIORITY 2
+#define GIT_REPOSPANNER_WRITER_PRIORITY 3
 
 #define GIT_ALTERNATES_MAX_DEPTH 5
 
@@ -579,6 +582,7 @@ int git_odb__add_repospanner_backend(
 {
 	int error;
 	git_odb_backend *backend;
+	git_odb_backend *writer;
 	git_odb_backend *fsdb;
 
 	if ((error = git_odb_get_backend(&fsdb, db, GIT_LOOSE_PRIORITY)) != GIT_OK)
@@ -592,7 +596,14 @@ int git_odb__add_repospanner_backend(
 		return error;
 	}
 
-	return add_backend_internal(db, backend, GIT_REPOSPANNER_PRIORITY, false, 0);
+	if ((error = add_backend_internal(db, backend, GIT_REPOSPANNER_PRIORITY, false, 0)) < 0)
+		return error;
+
+	/* the ODB frees it before the backend it writes to */
+	if ((error = git_odb__repospanner_writer(&writer, backend)) < 0)
+		return error;
+
+	return add_backend_internal(db, writer, GIT_REPOSPANNER_WRITER_PRIORITY, false, 0);
 }
 
 static int load_alternates(git_odb *odb, const char *objects_dir, int alternate_depth)
@@ -1051,13 +1062,46 @@ int git_odb__read_header_or_object(
 	return error;
 }
 
+/*
+ * Verify a freshly read raw object and put it into the cache.  Takes
+ * ownership of `raw->data`, which is freed on failure.
+ */
+static int odb_store_raw(git_odb_object **out, git_odb *db,
+		const git_oid *id, git_rawobj *raw)
+{
+	git_odb_object *object;
+	git_oid hashed;
+	int error = 0;
+
+	if (git_odb__strict_hash_verification) {
+		if ((error = git_odb_hash(&hashed, raw->data, raw->len, raw->type)) < 0)
+			goto out;
+
+		if (!git_oid_equal(id, &hashed)) {
+			error = git_odb__error_mismatch(id, &hashed);
+			goto out;
+		}
+	}
+
+	giterr_clear();
+	if ((object = odb_object__alloc(id, raw)) == NULL) {
+		error = -1;
+		goto out;
+	}
+
+	*out = git_cache_store_raw(odb_cache(db), object);
+
+out:
+	if (error)
+		git__free(raw->data);
+	return error;
+}
+
 static int odb_read_1(git_odb_object **out, git_odb *db, const git_oid *id,
 		bool only_refreshed)
 {
 	size_t i;
 	git_rawobj raw;
-	git_odb_object *object;
-	git_oid hashed;
 	bool found = false;
 	int error = 0;
 
@@ -1088,28 +1132,7 @@ static int odb_read_1(git_odb_object **out, git_odb *db, const git_oid *id,
 	if (!found)
 		return GIT_ENOTFOUND;
 
-	if (git_odb__strict_hash_verification) {
-		if ((error = git_odb_hash(&hashed, raw.data, raw.len, raw.type)) < 0)
-			goto out;
-
-		if (!git_oid_equal(id, &hashed)) {
-			error = git_odb__error_mismatch(id, &hashed);
-			goto out;
-		}
-	}
-
-	giterr_clear();
-	if ((object = odb_object__alloc(id, &raw)) == NULL) {
-		error = -1;
-		goto out;
-	}
-
-	*out = git_cache_store_raw(odb_cache(db), object);
-
-out:
-	if (error)
-		git__free(raw.data);
-	return error;
+	return odb_store_raw(out, db, id, &raw);
 }
 
 int git_odb_read(git_odb_object **out, git_odb *db, const git_oid *id)
@@ -1136,6 +1159,300 @@ int git_odb_read(git_odb_object **out, git_odb *db, const git_oid *id)
 	return error;
 }
 
+typedef struct {
+	git_odb *db;
+	git_oidmap *wanted;
+	size_t remaining;
+} read_many_data;
+
+static int read_many_cb(
+	const git_oid *id, void *data, size_t len, git_otype type, void *payload)
+{
+	read_many_data *rm = payload;
+	git_odb_object **slot;
+	git_rawobj raw;
+	size_t pos;
+	int error;
+
+	raw.data = data;
+	raw.len = len;
+	raw.type = type;
+
+	pos = git_oidmap_lookup_index(rm->wanted, id);
+	if (!git_oidmap_valid_index(rm->wanted, pos) ||
+	    *(slot = git_oidmap_value_at(rm->wanted, pos)) != NULL) {
+		/* not something we asked for, or reported twice */
+		git__free(data);
+		return 0;
+	}
+
+	if ((error = odb_store_raw(slot, rm->db, id, &raw)) < 0)
+		return error;
+
+	rm->remaining--;
+	return 0;
+}
+
+static int odb_read_many_1(read_many_data *rm, bool only_refreshed)
+{
+	git_array_t(git_oid) missing = GIT_ARRAY_INIT;
+	git_odb_object **slot;
+	git_oid *id;
+	size_t i, pos;
+	int error = 0;
+
+	for (i = 0; i < rm->db->backends.length && rm->remaining; ++i) {
+		backend_internal *internal = git_vector_get(&rm->db->backends, i);
+		git_odb_backend *b = internal->backend;
+
+		if (only_refreshed && !b->refresh)
+			continue;
+
+		if (b->read_many != NULL) {
+			git_array_clear(missing);
+
+			for (pos = git_oidmap_begin(rm->wanted);
+			     pos != git_oidmap_end(rm->wanted); pos++) {
+				if (!git_oidmap_has_data(rm->wanted, pos))
+					continue;
+
+				slot = git_oidmap_value_at(rm->wanted, pos);
+				if (*slot != NULL)
+					continue;
+
+				id = git_array_alloc(missing);
+				GITERR_CHECK_ALLOC(id);
+				git_oid_cpy(id, git_oidmap_key(rm->wanted, pos));
+			}
+
+			error = b->read_many(b, missing.ptr, missing.size, read_many_cb, rm);
+		} else if (b->read != NULL) {
+			for (pos = git_oidmap_begin(rm->wanted);
+			     pos != git_oidmap_end(rm->wanted); pos++) {
+				git_rawobj raw;
+
+				if (!git_oidmap_has_data(rm->wanted, pos))
+					continue;
+
+				slot = git_oidmap_value_at(rm->wanted, pos);
+				if (*slot != NULL)
+					continue;
+
+				error = b->read(&raw.data, &raw.len, &raw.type, b,
+					git_oidmap_key(rm->wanted, pos));
+				if (error == GIT_PASSTHROUGH || error == GIT_ENOTFOUND)
+					continue;
+				if (error < 0 || (error = odb_store_raw(slot, rm->db,
+						git_oidmap_key(rm->wanted, pos), &raw)) < 0)
+					break;
+
+				rm->remaining--;
+			}
+		}
+
+		if (error == GIT_PASSTHROUGH || error == GIT_ENOTFOUND)
+			error = 0;
+		if (error < 0)
+			break;
+	}
+
+	git_array_clear(missing);
+	return error;
+}
+
+int git_odb_read_many(
+	git_odb_object **out, git_odb *db, const git_oid *ids, size_t count)
+{
+	read_many_data rm;
+	git_odb_object **first;
+	size_t i, pos;
+	int error = 0, rval;
+
+	assert(out && db && (ids || !count));
+
+	memset(out, 0, count * sizeof(git_odb_object *));
+
+	rm.db = db;
+	rm.remaining = 0;
+	rm.wanted = git_oidmap_alloc();
+	GITERR_CHECK_ALLOC(rm.wanted);
+
+	for (i = 0; i < count; i++) {
+		if (git_oid_iszero(&ids[i]) ||
+		    git_oidmap_exists(rm.wanted, &ids[i]))
+			continue;
+
+		if ((out[i] = git_cache_get_raw(odb_cache(db), &ids[i])) != NULL)
+			continue;
+
+		if (odb_hardcoded_type(&ids[i]) != GIT_OBJ_BAD) {
+			if ((error = odb_read_1(&out[i], db, &ids[i], false)) < 0)
+				goto done;
+			continue;
+		}
+
+		git_oidmap_insert(rm.wanted, &ids[i], &out[i], &rval);
+		if (rval < 0) {
+			error = -1;
+			goto done;
+		}
+		rm.remaining++;
+	}
+
+	if ((error = odb_read_many_1(&rm, false)) < 0)
+		goto done;
+
+	if (rm.remaining && !git_odb_refresh(db) &&
+	    (error = odb_read_many_1(&rm, true)) < 0)
+		goto done;
+
+	for (i = 0; i < count; i++) {
+		if (out[i] != NULL || git_oid_iszero(&ids[i]))
+			continue;
+
+		/* duplicate ids share the object read for their first occurrence */
+		pos = git_oidmap_lookup_index(rm.wanted, &ids[i]);
+		if (git_oidmap_valid_index(rm.wanted, pos)) {
+			first = git_oidmap_value_at(rm.wanted, pos);
+			if (*first != NULL)
+				git_odb_object_dup(&out[i], *first);
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (out[i] == NULL) {
+			error = git_odb__error_notfound(
+				"no match for id", &ids[i], GIT_OID_HEXSZ);
+			break;
+		}
+	}
+
+done:
+	if (error && error != GIT_ENOTFOUND) {
+		for (i = 0; i < count; i++) {
+			git_odb_object_free(out[i]);
+			out[i] = NULL;
+		}
+	}
+
+	git_oidmap_free(rm.wanted);
+	return error;
+}
+
+bool git_odb__has_prefetch(git_odb *db)
+{
+	size_t i;
+
+	for (i = 0; i < db->backends.length; ++i) {
+		backend_internal *internal = git_vector_get(&db->backends, i);
+
+		if (internal->backend->prefetch != NULL)
+			return true;
+	}
+
+	return false;
+}
+
+bool git_odb__exists_local(git_odb *db, const git_oid *id)
+{
+	size_t i;
+
+	for (i = 0; i < db->backends.length; ++i) {
+		backend_internal *internal = git_vector_get(&db->backends, i);
+		git_odb_backend *b = internal->backend;
+
+		if (!b->prefetch && !b->prefetch_tree &&
+		    b->exists != NULL && b->exists(b, id))
+			return true;
+	}
+
+	return false;
+}
+
+int git_odb_prefetch(git_odb *db, const git_oid *ids, size_t count)
+{
+	git_array_t(git_oid) wanted = GIT_ARRAY_INIT;
+	git_odb_object *object;
+	git_oid *id;
+	size_t i;
+	int error = 0;
+
+	assert(db && (ids || !count));
+
+	if (!git_odb__has_prefetch(db))
+		return 0;
+
+	for (i = 0; i < count; i++) {
+		if (git_oid_iszero(&ids[i]) ||
+		    odb_hardcoded_type(&ids[i]) != GIT_OBJ_BAD)
+			continue;
+
+		if ((object = git_cache_get_raw(odb_cache(db), &ids[i])) != NULL) {
+			git_odb_object_free(object);
+			continue;
+		}
+
+		if (git_odb__exists_local(db, &ids[i]))
+			continue;
+
+		if ((id = git_array_alloc(wanted)) == NULL) {
+			error = -1;
+			goto done;
+		}
+		git_oid_cpy(id, &ids[i]);
+	}
+
+	for (i = 0; i < db->backends.length && wanted.size; ++i) {
+		backend_internal *internal = git_vector_get(&db->backends, i);
+		git_odb_backend *b = internal->backend;
+
+		if (b->prefetch == NULL)
+			continue;
+
+		/* this is only a hint, so a backend failing to act on it is fine */
+		if (b->prefetch(b, wanted.ptr, wanted.size) < 0)
+			giterr_clear();
+		else
+			break;
+	}
+
+done:
+	git_array_clear(wanted);
+	return error;
+}
+
+int git_odb_prefetch_tree(git_odb *db, const git_oid *id)
+{
+	size_t i;
+	bool wanted = false;
+
+	assert(db && id);
+
+	for (i = 0; i < db->backends.length && !wanted; ++i) {
+		backend_internal *internal = git_vector_get(&db->backends, i);
+		wanted = (internal->backend->prefetch_tree != NULL);
+	}
+
+	if (!wanted || git_odb__exists_local(db, id))
+		return 0;
+
+	for (i = 0; i < db->backends.length; ++i) {
+		backend_internal *internal = git_vector_get(&db->backends, i);
+		git_odb_backend *b = internal->backend;
+
+		if (b->prefetch_tree == NULL)
+			continue;
+
+		/* this is only a hint, so a backend failing to act on it is fine */
+		if (b->prefetch_tree(b, id) < 0)
+			giterr_clear();
+		else
+			break;
+	}
+
+	return 0;
+}
+
 static int odb_otype_fast(git_otype *type_p, git_odb *db, const git_oid *id)
 {
 	git_odb_object *object;
@@ -1256,11 +1573,9 @@ int git_odb_read_prefix(
 	if (len > GIT_OID_HEXSZ)
 		len = GIT_OID_HEXSZ;
 
-	if (len == GIT_OID_HEXSZ) {
-		*out = git_cache_get_raw(odb_cache(db), short_id);
-		if (*out != NULL)
-			return 0;
-	}
+	/* a full id cannot be ambiguous, so the first backend having it wins */
+	if (len == GIT_OID_HEXSZ)
+		return git_odb_read(out, db, short_id);
 
 	git_oid__cpy_prefix(&key, short_id, len);
 
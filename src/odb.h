@@ -68,6 +68,29 @@ int git_odb__add_repospanner_backend(
 	git_odb *db, const char *objects_dir,
 	git_repository *repo);
 
+/*
+ * Create the backend which passes writes on to a repoSpanner backend,
+ * ahead of the local ones.
+ */
+int git_odb__repospanner_writer(git_odb_backend **out, git_odb_backend *repospanner);
+
+/*
+ * Upload whatever was written to repoSpanner backends and has not been
+ * sent yet.  Failures are traced; the objects are still there locally.
+ */
+void git_odb__repospanner_flush(git_odb *odb);
+
+/*
+ * Whether any backend is able to act on `git_odb_prefetch` hints.
+ */
+bool git_odb__has_prefetch(git_odb *db);
+
+/*
+ * Whether the object is in a backend which is not going to prefetch
+ * it, that is, one which has it locally.
+ */
+bool git_odb__exists_local(git_odb *db, const git_oid *id);
+
 /*
  * Hash a git_rawobj internally.
  * The `git_rawobj` is supposed to be previously initialized
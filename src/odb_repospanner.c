@@ -9,164 +9,2968 @@
 
 #include "git2/object.h"
 #include "git2/sys/odb_backend.h"
-#include "fileops.h"
-#include "hash.h"
 #include "odb.h"
+#include "repository.h"
 #include "array.h"
 #include "oidmap.h"
+#include "oidarray.h"
+#include "zstream.h"
+#include "hash.h"
+#include "vector.h"
+#include "thread-utils.h"
+#include "trace.h"
+#include "filebuf.h"
+#include "fileops.h"
+
+#include <zlib.h>
 
 #include "repospanner.h"
 
-#include "git2/odb_backend.h"
-#include "git2/types.h"
-#include "git2/pack.h"
+#include "git2/odb_backend.h"
+#include "git2/types.h"
+#include "git2/pack.h"
+#include "git2/sys/repospanner.h"
+
+/* Maximum number of objects requested from the batch endpoint at once */
+#define REPOSPANNER_BATCH_MAX 512
+
+/* Largest loose object header we accept ("<type> <size>\0") */
+#define REPOSPANNER_HDR_MAX 64
+
+/* Upper bound on the number of object headers we remember */
+#define REPOSPANNER_HEADER_CACHE_MAX 65536
+
+/* Defaults for fetching objects we were told will be read soon */
+#define REPOSPANNER_PREFETCH_CONCURRENCY 16
+#define REPOSPANNER_PREFETCH_MEMORY (32 * 1024 * 1024)
+
+/* Upper bound on the number of objects being prefetched at a time */
+#define REPOSPANNER_PREFETCH_MAX 4096
+
+/* Most objects written to the cache as a single pack */
+#define REPOSPANNER_WRITE_BATCH 1024
+
+/* Number of written objects which triggers an upload */
+#define REPOSPANNER_UPLOAD_BATCH 4096
+
+/* Where the objects written but not uploaded yet are listed, in the gitdir */
+#define REPOSPANNER_PENDING_FILE "repospanner-pending"
+
+/* How much of the pack being uploaded we generate ahead of curl */
+#define REPOSPANNER_UPLOAD_BUFFER (64 * 1024)
+
+/* Number of objects asked for per page when listing all of them */
+#define REPOSPANNER_LIST_PAGE 4096
+
+/* Most compressed data a read stream holds on to */
+#define REPOSPANNER_STREAM_WINDOW (1024 * 1024)
+
+/* Most trees we remember having fetched along with their subtrees */
+#define REPOSPANNER_TREES_MAX 4096
+
+/* Response headers carrying object metadata on HEAD requests */
+#define REPOSPANNER_HEADER_TYPE "X-RepoSpanner-Object-Type"
+#define REPOSPANNER_HEADER_SIZE "X-RepoSpanner-Object-Size"
+
+struct repospanner_odb {
+	git_odb_backend parent;
+
+	repoSpanner_client *client;
+
+	git_odb_backend *fsdb;
+	repospanner_cache *cache;
+	git_repository *repo;
+
+	/* type and size of objects we know to exist on the server */
+	git_oidmap *headers;
+	git_mutex headers_lock;
+
+	/*
+	 * Set once the server turned out not to tell the type and size
+	 * of objects on HEAD requests.  We then inflate no more than the
+	 * start of the objects themselves.
+	 */
+	git_atomic head_unsupported;
+
+	/*
+	 * Objects written locally which have not been uploaded yet.  They
+	 * are sent as a single pack once there are `upload_batch` of them,
+	 * or when asked to.  They are listed in `pending_path` too, so that
+	 * the next process to open the repository uploads them if we do
+	 * not get to it.
+	 */
+	git_mutex upload_lock;
+	git_array_t(git_oid) upload_pending;
+	size_t upload_batch;
+	git_buf pending_path;
+	git_file pending_fd;
+
+	/*
+	 * Trees about to be walked are fetched along with all of their
+	 * subtrees, as one pack which goes into the cache, down to
+	 * `tree_depth` levels (zero for all of them).  We remember which
+	 * ones we fetched so far, and whether the server turned out not
+	 * to have the endpoint for it.
+	 */
+	bool fetch_trees;
+	unsigned int tree_depth;
+	git_oidmap *trees;
+	git_mutex trees_lock;
+	git_atomic tree_unsupported;
+
+	/*
+	 * Objects read from repoSpanner are kept in the client's local
+	 * cache, so we will find them there next time.  They are written
+	 * in batches by a background thread, off the read path, and read
+	 * from memory until then.
+	 */
+	bool persist;
+	git_vector writebehind;
+	git_oidmap *unwritten;
+	git_mutex writer_lock;
+#ifdef GIT_THREADS
+	git_thread writer;
+	git_cond writer_cond;
+	bool writer_running;
+	bool writer_stop;
+
+	/*
+	 * Objects we were told are going to be read soon are fetched in
+	 * the background, in the order they were hinted, through the
+	 * client's transfer thread.  Those that are not persisted are
+	 * kept in memory until they are read, up to a limit.
+	 */
+	git_mutex prefetch_lock;
+	git_cond prefetch_cond;
+	git_oidmap *prefetched;
+	struct prefetch *prefetch_head;
+	struct prefetch *prefetch_tail;
+	size_t prefetch_running;
+	size_t prefetch_concurrency;
+	size_t prefetch_bytes;
+	size_t prefetch_max_bytes;
+	bool prefetch_stop;
+#endif
+};
+
+/*
+ * Writes go to the first backend able to take them, and the loose one
+ * comes before us.  This is added with a higher priority than that,
+ * and hands them to us.
+ */
+struct repospanner_odb_writer {
+	git_odb_backend parent;
+	struct repospanner_odb *backend;
+};
+
+/*
+ * An object being streamed to the reader.  The response is inflated
+ * as the reader asks for more of it; we stop curl whenever we have
+ * a window's worth of compressed data which was not read yet.  Objects
+ * we have locally are handed out from memory instead.
+ */
+struct read_stream {
+	git_odb_stream parent;
+	struct repospanner_odb *backend;
+	git_oid oid;
+
+	CURLM *multi;
+	CURL *req;
+	bool running;
+	bool paused;
+	int error;
+
+	z_stream zs;
+	bool zs_init;
+	bool zs_done;
+
+	git_buf in;
+	size_t in_pos;
+
+	/* what we inflated of the object along with its header */
+	char hdr[REPOSPANNER_HDR_MAX];
+	size_t hdr_len;
+	size_t hdr_pos;
+
+	git_rawobj local;
+	size_t len;
+	size_t produced;
+};
+
+struct fetch_tree {
+	repospanner_cache_stream *stream;
+	int error;
+};
+
+struct object_header {
+	git_oid oid;
+	git_otype type;
+	size_t size;
+};
+
+#ifdef GIT_THREADS
+enum prefetch_state {
+	PREFETCH_QUEUED,
+	PREFETCH_RUNNING,
+	PREFETCH_DONE,
+};
+#endif
+
+/*
+ * Incrementally inflates a loose object as it arrives over the wire,
+ * straight into the buffer which will be handed to the ODB.
+ */
+struct object_reader {
+	z_stream zs;
+	bool zs_init;
+	bool done;
+
+	char hdr[REPOSPANNER_HDR_MAX];
+	size_t hdr_len;
+
+	git_rawobj raw;
+	size_t filled;
+};
+
+static int get_request_for_object(CURL **out, struct repospanner_odb *backend, const git_oid *oid)
+{
+	git_buf pathbuf = GIT_BUF_INIT;
+	int error;
+
+	if (git_buf_puts(&pathbuf, "simple/object/") != GIT_OK ||
+	    git_buf_puts(&pathbuf, git_oid_tostr_s(oid)) != GIT_OK)
+		error = GIT_ERROR;
+	else
+		error = repospanner_prepare_request(out, backend->client, git_buf_cstr(&pathbuf));
+
+	git_buf_dispose(&pathbuf);
+	return error;
+}
+
+static bool header_cache_get(
+	size_t *len_p, git_otype *type_p,
+	struct repospanner_odb *backend, const git_oid *oid)
+{
+	struct object_header *hdr = NULL;
+	size_t pos;
+
+	if (git_mutex_lock(&backend->headers_lock) < 0)
+		return false;
+
+	pos = git_oidmap_lookup_index(backend->headers, oid);
+	if (git_oidmap_valid_index(backend->headers, pos)) {
+		hdr = git_oidmap_value_at(backend->headers, pos);
+		*len_p = hdr->size;
+		*type_p = hdr->type;
+	}
+
+	git_mutex_unlock(&backend->headers_lock);
+	return hdr != NULL;
+}
+
+static void header_cache_clear(struct repospanner_odb *backend)
+{
+	struct object_header *hdr;
+
+	git_oidmap_foreach_value(backend->headers, hdr, {
+		git__free(hdr);
+	});
+	git_oidmap_clear(backend->headers);
+}
+
+static void header_cache_put(
+	struct repospanner_odb *backend, const git_oid *oid,
+	size_t len, git_otype type)
+{
+	struct object_header *hdr;
+	int rval;
+
+	if (git_mutex_lock(&backend->headers_lock) < 0)
+		return;
+
+	if (git_oidmap_exists(backend->headers, oid))
+		goto done;
+
+	/* this is only a cache; just start over once it is full */
+	if (git_oidmap_size(backend->headers) >= REPOSPANNER_HEADER_CACHE_MAX)
+		header_cache_clear(backend);
+
+	if ((hdr = git__malloc(sizeof(struct object_header))) == NULL) {
+		giterr_clear();
+		goto done;
+	}
+
+	git_oid_cpy(&hdr->oid, oid);
+	hdr->type = type;
+	hdr->size = len;
+
+	git_oidmap_insert(backend->headers, &hdr->oid, hdr, &rval);
+	if (rval < 0)
+		git__free(hdr);
+
+done:
+	git_mutex_unlock(&backend->headers_lock);
+}
+
+static void cache_object_free(repospanner_cache_object *obj)
+{
+	if (!obj)
+		return;
+
+	git__free(obj->raw.data);
+	git__free(obj);
+}
+
+/* Writes a batch of objects to the cache; called without any locks held */
+static void writebehind_flush(struct repospanner_odb *backend, git_vector *batch)
+{
+	/* this is only a cache, so failing to write it is not fatal */
+	if (repospanner_cache_add(backend->cache,
+		(repospanner_cache_object **)batch->contents, batch->length) < 0)
+		giterr_clear();
+}
+
+static void writebehind_done(struct repospanner_odb *backend, git_vector *batch)
+{
+	repospanner_cache_object *obj;
+	size_t i;
+
+	git_vector_foreach(batch, i, obj) {
+		git_oidmap_delete(backend->unwritten, &obj->oid);
+		cache_object_free(obj);
+	}
+
+	git_vector_clear(batch);
+}
+
+#ifdef GIT_THREADS
+
+static void *writebehind_thread(void *arg)
+{
+	struct repospanner_odb *backend = arg;
+	git_vector batch = GIT_VECTOR_INIT;
+
+	git_mutex_lock(&backend->writer_lock);
+
+	while (true) {
+		while (!backend->writer_stop && !git_vector_length(&backend->writebehind))
+			git_cond_wait(&backend->writer_cond, &backend->writer_lock);
+
+		if (!git_vector_length(&backend->writebehind))
+			break;
+
+		/*
+		 * Take everything that queued up while we were busy, so
+		 * it becomes a single pack.  The objects stay in
+		 * `unwritten` until the pack is in place.
+		 */
+		git_vector_swap(&batch, &backend->writebehind);
+		git_mutex_unlock(&backend->writer_lock);
+
+		writebehind_flush(backend, &batch);
+
+		git_mutex_lock(&backend->writer_lock);
+		writebehind_done(backend, &batch);
+	}
+
+	git_mutex_unlock(&backend->writer_lock);
+	git_vector_free(&batch);
+	return NULL;
+}
+
+#endif
+
+/* Queue a copy of an object to be written to the cache */
+static void writebehind_queue(
+	struct repospanner_odb *backend, const git_oid *oid, const git_rawobj *raw)
+{
+	repospanner_cache_object *obj;
+	int rval;
+
+	if ((obj = git__calloc(1, sizeof(repospanner_cache_object))) == NULL ||
+	    (obj->raw.data = git__malloc(raw->len + 1)) == NULL) {
+		giterr_clear();
+		git__free(obj);
+		return;
+	}
+
+	git_oid_cpy(&obj->oid, oid);
+	memcpy(obj->raw.data, raw->data, raw->len + 1);
+	obj->raw.len = raw->len;
+	obj->raw.type = raw->type;
+
+	git_mutex_lock(&backend->writer_lock);
+
+#ifdef GIT_THREADS
+	if (!backend->writer_running) {
+		if (git_thread_create(&backend->writer, writebehind_thread, backend) != 0) {
+			git_mutex_unlock(&backend->writer_lock);
+			giterr_clear();
+			cache_object_free(obj);
+			return;
+		}
+		backend->writer_running = true;
+	}
+#endif
+
+	/* someone else fetched it at the same time */
+	if (git_oidmap_exists(backend->unwritten, &obj->oid)) {
+		git_mutex_unlock(&backend->writer_lock);
+		cache_object_free(obj);
+		return;
+	}
+
+	git_oidmap_insert(backend->unwritten, &obj->oid, obj, &rval);
+	if (rval < 0 || git_vector_insert(&backend->writebehind, obj) < 0) {
+		if (rval >= 0)
+			git_oidmap_delete(backend->unwritten, &obj->oid);
+		giterr_clear();
+		cache_object_free(obj);
+	}
+
+#ifdef GIT_THREADS
+	git_cond_signal(&backend->writer_cond);
+#else
+	/* without a writer thread, write once we have a batch together */
+	if (git_vector_length(&backend->writebehind) >= REPOSPANNER_WRITE_BATCH) {
+		writebehind_flush(backend, &backend->writebehind);
+		writebehind_done(backend, &backend->writebehind);
+	}
+#endif
+
+	git_mutex_unlock(&backend->writer_lock);
+}
+
+static void writebehind_shutdown(struct repospanner_odb *backend)
+{
+#ifdef GIT_THREADS
+	if (backend->writer_running) {
+		git_mutex_lock(&backend->writer_lock);
+		backend->writer_stop = true;
+		git_cond_signal(&backend->writer_cond);
+		git_mutex_unlock(&backend->writer_lock);
+
+		git_thread_join(&backend->writer, NULL);
+	}
+#endif
+
+	/* whatever the writer did not get to */
+	writebehind_flush(backend, &backend->writebehind);
+	writebehind_done(backend, &backend->writebehind);
+
+	git_vector_free(&backend->writebehind);
+	git_oidmap_free(backend->unwritten);
+
+	git_cond_free(&backend->writer_cond);
+	git_mutex_free(&backend->writer_lock);
+}
+
+/*
+ * Objects waiting to be written to the cache are not in there yet, so
+ * serve them from memory rather than the network.
+ */
+static int read_unwritten(git_rawobj *out, struct repospanner_odb *backend, const git_oid *oid)
+{
+	repospanner_cache_object *obj;
+	size_t pos;
+	int error = GIT_ENOTFOUND;
+
+	if (!backend->persist)
+		return GIT_ENOTFOUND;
+
+	if (git_mutex_lock(&backend->writer_lock) < 0)
+		return -1;
+
+	pos = git_oidmap_lookup_index(backend->unwritten, oid);
+	if (git_oidmap_valid_index(backend->unwritten, pos)) {
+		obj = git_oidmap_value_at(backend->unwritten, pos);
+
+		if ((out->data = git__malloc(obj->raw.len + 1)) == NULL) {
+			error = -1;
+		} else {
+			memcpy(out->data, obj->raw.data, obj->raw.len + 1);
+			out->len = obj->raw.len;
+			out->type = obj->raw.type;
+			error = 0;
+		}
+	}
+
+	git_mutex_unlock(&backend->writer_lock);
+	return error;
+}
+
+/*
+ * Look in the cache.  This has to come after looking at the unwritten
+ * objects, as they only leave those once they made it into the cache.
+ */
+static int read_cached(git_rawobj *out, struct repospanner_odb *backend, const git_oid *oid)
+{
+	if (!backend->persist)
+		return GIT_ENOTFOUND;
+
+	return repospanner_cache_read(out, backend->cache, oid);
+}
+
+static bool is_unwritten(struct repospanner_odb *backend, const git_oid *oid)
+{
+	bool found;
+
+	if (!backend->persist || git_mutex_lock(&backend->writer_lock) < 0)
+		return false;
+
+	found = git_oidmap_exists(backend->unwritten, oid);
+
+	git_mutex_unlock(&backend->writer_lock);
+	return found;
+}
+
+static bool is_cached(struct repospanner_odb *backend, const git_oid *oid)
+{
+	return backend->persist && repospanner_cache_exists(backend->cache, oid);
+}
+
+static int object_reader_init(struct object_reader *reader)
+{
+	memset(reader, 0, sizeof(struct object_reader));
+
+	if (inflateInit(&reader->zs) != Z_OK) {
+		giterr_set(GITERR_ZLIB, "failed to init zlib stream");
+		return -1;
+	}
+
+	reader->zs_init = true;
+	return 0;
+}
+
+static void object_reader_dispose(struct object_reader *reader)
+{
+	if (reader->zs_init)
+		inflateEnd(&reader->zs);
+
+	git__free(reader->raw.data);
+	reader->raw.data = NULL;
+	reader->zs_init = false;
+}
+
+static int object_reader_corrupt(void)
+{
+	giterr_set(GITERR_ODB, "invalid loose object received from repoSpanner");
+	return -1;
+}
+
+/*
+ * Parse the "<type> <size>\0" header at the start of `hdr`.  Returns
+ * 1 and sets `hdr_len` to its length once all of it is there, or 0
+ * if more of it is needed.
+ */
+static int loose_header_parse(
+	git_otype *type_p, size_t *len_p, size_t *hdr_len,
+	char *hdr, size_t len, size_t max)
+{
+	char *hdr_end, *space;
+	const char *size_end;
+	int64_t size;
+
+	if ((hdr_end = memchr(hdr, '\0', len)) == NULL)
+		return (len == max) ? object_reader_corrupt() : 0;
+
+	if ((space = memchr(hdr, ' ', hdr_end - hdr)) == NULL)
+		return object_reader_corrupt();
+
+	*space = '\0';
+	*type_p = git_object_string2type(hdr);
+
+	if (!git_object_typeisloose(*type_p) ||
+	    git__strntol64(&size, space + 1, hdr_end - space - 1, &size_end, 10) < 0 ||
+	    size_end != hdr_end || size < 0)
+		return object_reader_corrupt();
+
+	*len_p = (size_t)size;
+	*hdr_len = hdr_end - hdr + 1;
+	return 1;
+}
+
+/* Parse the header once we have inflated all of it */
+static int object_reader_parse_header(struct object_reader *reader)
+{
+	size_t hdr_len, extra, alloclen;
+	int error;
+
+	if ((error = loose_header_parse(&reader->raw.type, &reader->raw.len,
+		&hdr_len, reader->hdr, reader->hdr_len, sizeof(reader->hdr))) <= 0)
+		return error;
+
+	extra = reader->hdr_len - hdr_len;
+
+	if (extra > reader->raw.len)
+		return object_reader_corrupt();
+
+	GITERR_CHECK_ALLOC_ADD(&alloclen, reader->raw.len, 1);
+	reader->raw.data = git__malloc(alloclen);
+	GITERR_CHECK_ALLOC(reader->raw.data);
+
+	memcpy(reader->raw.data, reader->hdr + hdr_len, extra);
+	reader->filled = extra;
+	return 0;
+}
+
+static int object_reader_feed(struct object_reader *reader, const char *data, size_t len)
+{
+	int zerr;
+
+	reader->zs.next_in = (Bytef *)data;
+	reader->zs.avail_in = (uInt)len;
+
+	while (reader->zs.avail_in && !reader->done) {
+		if (reader->raw.data == NULL) {
+			reader->zs.next_out = (Bytef *)reader->hdr + reader->hdr_len;
+			reader->zs.avail_out = (uInt)(sizeof(reader->hdr) - reader->hdr_len);
+		} else {
+			/* leave room for one byte more, to detect excess data */
+			reader->zs.next_out = (Bytef *)reader->raw.data + reader->filled;
+			reader->zs.avail_out = (uInt)(reader->raw.len + 1 - reader->filled);
+		}
+
+		zerr = inflate(&reader->zs, Z_NO_FLUSH);
+		if (zerr != Z_OK && zerr != Z_STREAM_END)
+			return object_reader_corrupt();
+
+		if (reader->raw.data == NULL) {
+			reader->hdr_len = sizeof(reader->hdr) - reader->zs.avail_out;
+			if (object_reader_parse_header(reader) < 0)
+				return -1;
+		} else {
+			reader->filled = reader->raw.len + 1 - reader->zs.avail_out;
+		}
+
+		if (reader->raw.data && reader->filled > reader->raw.len)
+			return object_reader_corrupt();
+
+		reader->done = (zerr == Z_STREAM_END);
+	}
+
+	/* anything after the end of the zlib stream is garbage */
+	if (reader->zs.avail_in)
+		return object_reader_corrupt();
+
+	return 0;
+}
+
+/* Hand over the inflated object, once the whole stream was fed */
+static int object_reader_finish(git_rawobj *out, struct object_reader *reader)
+{
+	if (!reader->done || !reader->raw.data || reader->filled != reader->raw.len)
+		return object_reader_corrupt();
+
+	((char *)reader->raw.data)[reader->raw.len] = '\0';
+	memcpy(out, &reader->raw, sizeof(git_rawobj));
+	reader->raw.data = NULL;
+	return 0;
+}
+
+/*
+ * State for parsing the response of the batch object endpoint, which
+ * is a sequence of objects, each framed as
+ *
+ *     <40 hex oid> SP <decimal length> LF <length bytes of loose object>
+ *
+ * Objects the server does not have are simply left out.
+ */
+struct batch_read {
+	struct repospanner_odb *backend;
+	git_odb_backend_read_cb cb;
+	void *payload;
+	int error;
+
+	git_buf line;
+	struct object_reader reader;
+	git_oid current;
+	size_t body_remaining;
+
+	/* requested objects the server has not sent (yet) */
+	git_oidmap *missing;
+};
+
+static int batch_read_header(struct batch_read *br)
+{
+	const char *end;
+	int64_t len;
+
+	if (git_buf_len(&br->line) < GIT_OID_HEXSZ + 2 ||
+	    br->line.ptr[GIT_OID_HEXSZ] != ' ' ||
+	    git_oid_fromstrn(&br->current, br->line.ptr, GIT_OID_HEXSZ) < 0 ||
+	    git__strntol64(&len, br->line.ptr + GIT_OID_HEXSZ + 1,
+		git_buf_len(&br->line) - GIT_OID_HEXSZ - 1, &end, 10) < 0 ||
+	    end != br->line.ptr + git_buf_len(&br->line) || len <= 0) {
+		giterr_set(GITERR_ODB, "invalid object header in repoSpanner batch response");
+		return -1;
+	}
+
+	br->body_remaining = (size_t)len;
+	git_buf_clear(&br->line);
+
+	object_reader_dispose(&br->reader);
+	return object_reader_init(&br->reader);
+}
+
+static int batch_read_object(struct batch_read *br)
+{
+	git_rawobj raw;
+	int error;
+
+	if ((error = object_reader_finish(&raw, &br->reader)) < 0)
+		return error;
+
+	header_cache_put(br->backend, &br->current, raw.len, raw.type);
+	git_oidmap_delete(br->missing, &br->current);
+
+	if (br->backend->persist)
+		writebehind_queue(br->backend, &br->current, &raw);
+
+	if ((error = br->cb(&br->current, raw.data, raw.len, raw.type, br->payload)) != 0)
+		giterr_set_after_callback_function(error, "git_odb_read_many");
+
+	return error;
+}
+
+static size_t batch_read_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	struct batch_read *br = (struct batch_read *)userdata;
+	const char *end = ptr + size * nmemb, *nl;
+	size_t chunk;
+
+	while (ptr < end) {
+		if (br->body_remaining == 0) {
+			if ((nl = memchr(ptr, '\n', end - ptr)) == NULL) {
+				if (git_buf_put(&br->line, ptr, end - ptr) < 0)
+					goto on_error;
+				break;
+			}
+
+			if (git_buf_put(&br->line, ptr, nl - ptr) < 0 ||
+			    batch_read_header(br) < 0)
+				goto on_error;
+
+			ptr = (char *)nl + 1;
+			continue;
+		}
+
+		chunk = min(br->body_remaining, (size_t)(end - ptr));
+		if (object_reader_feed(&br->reader, ptr, chunk) < 0)
+			goto on_error;
+
+		ptr += chunk;
+		br->body_remaining -= chunk;
+
+		if (br->body_remaining == 0 &&
+		    (br->error = batch_read_object(br)) != 0)
+			return 0;
+	}
+
+	return size * nmemb;
+
+on_error:
+	br->error = -1;
+	return 0;
+}
+
+static int impl__read(void **buffer_p, size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid);
+
+/*
+ * Fall back to reading objects one by one, for servers which do not
+ * support the batch object endpoint.
+ */
+static int read_many_single(
+	struct repospanner_odb *backend, const git_oid *ids, size_t count,
+	git_odb_backend_read_cb cb, void *payload)
+{
+	git_rawobj raw;
+	size_t i;
+	int error;
+
+	for (i = 0; i < count; i++) {
+		error = impl__read(&raw.data, &raw.len, &raw.type, &backend->parent, &ids[i]);
+		if (error == GIT_ENOTFOUND)
+			continue;
+		if (error < 0)
+			return error;
+
+		if ((error = cb(&ids[i], raw.data, raw.len, raw.type, payload)) != 0)
+			return giterr_set_after_callback_function(error, "git_odb_read_many");
+	}
+
+	return 0;
+}
+
+static int read_many_batch(
+	struct repospanner_odb *backend, const git_oid *ids, size_t count,
+	git_odb_backend_read_cb cb, void *payload)
+{
+	struct batch_read br = { 0 };
+	git_buf request = GIT_BUF_INIT;
+	struct curl_slist *headers = NULL;
+	CURL *req = NULL;
+	size_t i;
+	int error, rval = 0;
+
+	br.backend = backend;
+	br.cb = cb;
+	br.payload = payload;
+
+	if ((br.missing = git_oidmap_alloc()) == NULL) {
+		error = -1;
+		goto done;
+	}
+
+	for (i = 0; i < count && rval >= 0; i++) {
+		git_buf_put(&request, git_oid_tostr_s(&ids[i]), GIT_OID_HEXSZ);
+		git_buf_putc(&request, '\n');
+		git_oidmap_insert(br.missing, &ids[i], (void *)&ids[i], &rval);
+	}
+
+	if (git_buf_oom(&request) || rval < 0) {
+		error = -1;
+		goto done;
+	}
+
+	if ((error = repospanner_prepare_request(&req, backend->client, "simple/objects")) != GIT_OK)
+		goto done;
+
+	repospanner_accept_compression(backend->client, req);
+
+	/* avoid waiting for a "100 Continue" on larger batches */
+	headers = curl_slist_append(headers, "Expect:");
+	headers = curl_slist_append(headers, "Content-Type: text/plain");
+
+	curl_easy_setopt(req, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(req, CURLOPT_POSTFIELDS, request.ptr);
+	curl_easy_setopt(req, CURLOPT_POSTFIELDSIZE, (long)request.size);
+	curl_easy_setopt(req, CURLOPT_WRITEFUNCTION, batch_read_callback);
+	curl_easy_setopt(req, CURLOPT_WRITEDATA, &br);
+
+	error = repospanner_check_curl(req);
+
+	if (br.error) {
+		error = br.error;
+	} else if (error == GIT_OK && (br.body_remaining || git_buf_len(&br.line))) {
+		giterr_set(GITERR_ODB, "truncated repoSpanner batch response");
+		error = -1;
+	} else if (error == GIT_OK) {
+		const git_oid *missing;
+
+		git_oidmap_foreach_value(br.missing, missing, {
+			repospanner_negative_cache_add(backend->client, missing);
+		});
+	}
+
+done:
+	git_oidmap_free(br.missing);
+	repospanner_release_request(backend->client, req);
+	curl_slist_free_all(headers);
+	object_reader_dispose(&br.reader);
+	git_buf_dispose(&request);
+	git_buf_dispose(&br.line);
+	return error;
+}
+
+static int impl__read_many(
+	git_odb_backend *_backend, const git_oid *ids, size_t count,
+	git_odb_backend_read_cb cb, void *payload)
+{
+	struct repospanner_odb *backend = (struct repospanner_odb *)_backend;
+	git_array_t(git_oid) wanted = GIT_ARRAY_INIT;
+	const git_oid *pos;
+	git_rawobj raw;
+	git_oid *id;
+	size_t i, batch, remaining;
+	int error = 0;
+
+	for (i = 0; i < count; i++) {
+		if (repospanner_negative_cache_contains(backend->client, &ids[i]))
+			continue;
+
+		/* we may have it locally already */
+		if ((error = read_unwritten(&raw, backend, &ids[i])) != GIT_ENOTFOUND ||
+		    (error = read_cached(&raw, backend, &ids[i])) != GIT_ENOTFOUND) {
+			if (error < 0)
+				goto done;
+
+			repospanner_count_cache_hit(backend->client);
+			error = cb(&ids[i], raw.data, raw.len, raw.type, payload);
+			git__free(raw.data);
+
+			if (error != 0) {
+				giterr_set_after_callback_function(error, "git_odb_read_many");
+				goto done;
+			}
+			continue;
+		}
+
+		id = git_array_alloc(wanted);
+		GITERR_CHECK_ALLOC(id);
+		git_oid_cpy(id, &ids[i]);
+	}
+
+	pos = wanted.ptr;
+	remaining = wanted.size;
+
+	while (remaining > 0) {
+		batch = min(remaining, REPOSPANNER_BATCH_MAX);
+
+		error = read_many_batch(backend, pos, batch, cb, payload);
+
+		/* the server does not know about batches, go the slow way */
+		if (error == GIT_ENOTFOUND) {
+			error = read_many_single(backend, pos, remaining, cb, payload);
+			break;
+		}
+		if (error < 0)
+			break;
+
+		pos += batch;
+		remaining -= batch;
+	}
+
+done:
+	git_array_clear(wanted);
+	return error;
+}
+
+struct header_read {
+	git_otype type;
+	int64_t size;
+};
+
+static bool header_matches(const char *line, size_t len, const char *name, const char **value)
+{
+	size_t name_len = strlen(name);
+
+	if (len <= name_len || line[name_len] != ':' ||
+	    git__strncasecmp(line, name, name_len) != 0)
+		return false;
+
+	for (*value = line + name_len + 1; **value == ' '; (*value)++)
+		/* skip */;
+
+	return true;
+}
+
+static size_t header_read_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	struct header_read *hr = (struct header_read *)userdata;
+	size_t len = size * nmemb;
+	const char *value, *end;
+	char type[16];
+
+	while (len > 0 && (ptr[len - 1] == '\n' || ptr[len - 1] == '\r'))
+		len--;
+
+	if (header_matches(ptr, len, REPOSPANNER_HEADER_TYPE, &value) &&
+	    (size_t)(ptr + len - value) < sizeof(type)) {
+		memcpy(type, value, ptr + len - value);
+		type[ptr + len - value] = '\0';
+		hr->type = git_object_string2type(type);
+	} else if (header_matches(ptr, len, REPOSPANNER_HEADER_SIZE, &value)) {
+		if (git__strntol64(&hr->size, value, ptr + len - value, &end, 10) < 0 ||
+		    end != ptr + len)
+			hr->size = -1;
+		giterr_clear();
+	}
+
+	return size * nmemb;
+}
+
+/* Inflates no more of an object than its "<type> <size>\0" header */
+struct header_peek {
+	z_stream zs;
+	char hdr[REPOSPANNER_HDR_MAX];
+	size_t hdr_len;
+	git_otype type;
+	size_t size;
+	bool found;
+	int error;
+};
+
+static size_t header_peek_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	struct header_peek *hp = (struct header_peek *)userdata;
+	size_t hdr_len;
+	int zerr;
+
+	hp->zs.next_in = (Bytef *)ptr;
+	hp->zs.avail_in = (uInt)(size * nmemb);
+	hp->zs.next_out = (Bytef *)hp->hdr + hp->hdr_len;
+	hp->zs.avail_out = (uInt)(sizeof(hp->hdr) - hp->hdr_len);
+
+	zerr = inflate(&hp->zs, Z_NO_FLUSH);
+	if (zerr != Z_OK && zerr != Z_STREAM_END && zerr != Z_BUF_ERROR) {
+		hp->error = object_reader_corrupt();
+		return 0;
+	}
+
+	hp->hdr_len = sizeof(hp->hdr) - hp->zs.avail_out;
+
+	if ((hp->error = loose_header_parse(&hp->type, &hp->size, &hdr_len,
+			hp->hdr, hp->hdr_len, sizeof(hp->hdr))) < 0)
+		return 0;
+
+	/* having the header, we stop the transfer */
+	if ((hp->found = (hp->error == 1)) == true) {
+		hp->error = 0;
+		return 0;
+	}
+
+	if (zerr == Z_STREAM_END) {
+		hp->error = object_reader_corrupt();
+		return 0;
+	}
+
+	return size * nmemb;
+}
+
+/*
+ * Get the type and size of an object from the server by downloading
+ * the start of the object, for servers which do not tell on HEAD.
+ */
+static int read_header_peek(
+	size_t *len_p, git_otype *type_p,
+	struct repospanner_odb *backend, const git_oid *oid)
+{
+	struct header_peek hp;
+	CURL *req = NULL;
+	int error;
+
+	memset(&hp, 0, sizeof(struct header_peek));
+
+	if (inflateInit(&hp.zs) != Z_OK) {
+		giterr_set(GITERR_ZLIB, "failed to init zlib stream");
+		return -1;
+	}
+
+	if ((error = get_request_for_object(&req, backend, oid)) != GIT_OK)
+		goto done;
+
+	curl_easy_setopt(req, CURLOPT_WRITEFUNCTION, header_peek_callback);
+	curl_easy_setopt(req, CURLOPT_WRITEDATA, &hp);
+
+	error = repospanner_check_curl(req);
+
+	if (hp.found) {
+		giterr_clear();
+		error = 0;
+	} else if (hp.error < 0) {
+		error = hp.error;
+	} else if (error == 0) {
+		error = object_reader_corrupt();
+	}
+
+	if (error == GIT_ENOTFOUND)
+		repospanner_negative_cache_add(backend->client, oid);
+	if (error < 0)
+		goto done;
+
+	*len_p = hp.size;
+	*type_p = hp.type;
+
+	header_cache_put(backend, oid, *len_p, *type_p);
+
+done:
+	repospanner_release_request(backend->client, req);
+	inflateEnd(&hp.zs);
+	return error;
+}
+
+/*
+ * Ask the server for the type and size of an object, without
+ * transferring it.  Servers which do not answer HEAD requests (405 or
+ * 501), or not with the type and size, are asked for no more than the
+ * start of the object from then on.
+ */
+static int read_header_remote(
+	size_t *len_p, git_otype *type_p,
+	struct repospanner_odb *backend, const git_oid *oid)
+{
+	struct header_read hr;
+	long response_code = 0;
+	CURL *req;
+	int error;
+
+	hr.type = GIT_OBJ_BAD;
+	hr.size = -1;
+
+	if (repospanner_negative_cache_contains(backend->client, oid))
+		return GIT_ENOTFOUND;
+
+	if (git_atomic_get(&backend->head_unsupported))
+		return read_header_peek(len_p, type_p, backend, oid);
+
+	if ((error = get_request_for_object(&req, backend, oid)) != GIT_OK)
+		return error;
+
+	curl_easy_setopt(req, CURLOPT_NOBODY, 1L);
+	curl_easy_setopt(req, CURLOPT_HEADERFUNCTION, header_read_callback);
+	curl_easy_setopt(req, CURLOPT_HEADERDATA, &hr);
+
+	error = repospanner_check_curl(req);
+	curl_easy_getinfo(req, CURLINFO_RESPONSE_CODE, &response_code);
+	repospanner_release_request(backend->client, req);
+
+	if (error == GIT_ENOTFOUND)
+		repospanner_negative_cache_add(backend->client, oid);
+
+	if ((error < 0 && (response_code == 405 || response_code == 501)) ||
+	    (error == 0 && (!git_object_typeisloose(hr.type) || hr.size < 0))) {
+		giterr_clear();
+		git_atomic_set(&backend->head_unsupported, 1);
+		return read_header_peek(len_p, type_p, backend, oid);
+	}
+
+	if (error < 0)
+		return error;
+
+	*len_p = (size_t)hr.size;
+	*type_p = hr.type;
+
+	header_cache_put(backend, oid, *len_p, *type_p);
+	return 0;
+}
+
+static int impl__exists(git_odb_backend *_backend, const git_oid *oid)
+{
+	struct repospanner_odb *backend = (struct repospanner_odb *)_backend;
+	git_otype type;
+	size_t len;
+	int error;
+
+	if (header_cache_get(&len, &type, backend, oid) ||
+	    is_unwritten(backend, oid) || is_cached(backend, oid)) {
+		repospanner_count_cache_hit(backend->client);
+		return 1;
+	}
+
+	error = read_header_remote(&len, &type, backend, oid);
+
+	if (error == GIT_ENOTFOUND)
+		return 0;
+	if (error < 0)
+		return error;
+
+	return 1;
+}
+
+struct single_read {
+	struct object_reader reader;
+	int error;
+};
+
+static size_t single_read_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	struct single_read *sr = (struct single_read *)userdata;
+
+	if ((sr->error = object_reader_feed(&sr->reader, ptr, size * nmemb)) < 0)
+		return 0;
+
+	return size * nmemb;
+}
+
+#ifdef GIT_THREADS
+
+struct prefetch {
+	struct repospanner_odb *backend;
+	struct prefetch *next;
+
+	git_oid oid;
+	enum prefetch_state state;
+	bool cancelled;
+
+	struct object_reader reader;
+	git_rawobj raw;
+	int error;
+};
+
+static void prefetch_free(struct prefetch *pf)
+{
+	object_reader_dispose(&pf->reader);
+	git__free(pf->raw.data);
+	git__free(pf);
+}
+
+static size_t prefetch_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	struct prefetch *pf = (struct prefetch *)userdata;
+
+	if ((pf->error = object_reader_feed(&pf->reader, ptr, size * nmemb)) < 0)
+		return 0;
+
+	return size * nmemb;
+}
+
+static void prefetch_done(CURL *req, int error, void *payload);
+
+static int prefetch_start(struct repospanner_odb *backend, struct prefetch *pf)
+{
+	CURL *req = NULL;
+	int error;
+
+	if ((error = object_reader_init(&pf->reader)) < 0 ||
+	    (error = get_request_for_object(&req, backend, &pf->oid)) < 0)
+		return error;
+
+	curl_easy_setopt(req, CURLOPT_WRITEFUNCTION, prefetch_write_callback);
+	curl_easy_setopt(req, CURLOPT_WRITEDATA, pf);
+
+	if ((error = repospanner_transfer_submit(backend->client, req, prefetch_done, pf)) < 0) {
+		repospanner_release_request(backend->client, req);
+		return error;
+	}
+
+	pf->state = PREFETCH_RUNNING;
+	backend->prefetch_running++;
+	return 0;
+}
+
+/* Start queued prefetches while we have room; called with the lock held */
+static void prefetch_pump(struct repospanner_odb *backend)
+{
+	struct prefetch *pf;
+
+	while (!backend->prefetch_stop && backend->prefetch_head &&
+	       backend->prefetch_running < backend->prefetch_concurrency) {
+		pf = backend->prefetch_head;
+		backend->prefetch_head = pf->next;
+		if (!backend->prefetch_head)
+			backend->prefetch_tail = NULL;
+
+		/* somebody needed it before we got to it */
+		if (pf->cancelled) {
+			prefetch_free(pf);
+			continue;
+		}
+
+		/* it will just be read when it is needed */
+		if (prefetch_start(backend, pf) < 0) {
+			giterr_clear();
+			git_oidmap_delete(backend->prefetched, &pf->oid);
+			prefetch_free(pf);
+		}
+	}
+}
+
+/* Runs on the client's transfer thread */
+static void prefetch_done(CURL *req, int error, void *payload)
+{
+	struct prefetch *pf = (struct prefetch *)payload;
+	struct repospanner_odb *backend = pf->backend;
+
+	repospanner_release_request(backend->client, req);
+
+	if (pf->error)
+		error = pf->error;
+	else if (error == GIT_ENOTFOUND)
+		repospanner_negative_cache_add(backend->client, &pf->oid);
+
+	if (!error && !(error = object_reader_finish(&pf->raw, &pf->reader))) {
+		header_cache_put(backend, &pf->oid, pf->raw.len, pf->raw.type);
+
+		if (backend->persist)
+			writebehind_queue(backend, &pf->oid, &pf->raw);
+	}
+
+	object_reader_dispose(&pf->reader);
+
+	git_mutex_lock(&backend->prefetch_lock);
+
+	backend->prefetch_running--;
+	pf->state = PREFETCH_DONE;
+
+	/*
+	 * Persisted objects can be read from the write-behind queue, and
+	 * failed ones will simply be read again.
+	 */
+	if (!error && !backend->persist && !backend->prefetch_stop &&
+	    backend->prefetch_bytes + pf->raw.len <= backend->prefetch_max_bytes) {
+		backend->prefetch_bytes += pf->raw.len;
+	} else {
+		git_oidmap_delete(backend->prefetched, &pf->oid);
+		prefetch_free(pf);
+	}
+
+	prefetch_pump(backend);
+
+	git_cond_broadcast(&backend->prefetch_cond);
+	git_mutex_unlock(&backend->prefetch_lock);
+}
+
+/*
+ * Take the result of prefetching an object, waiting for it if it is
+ * being transferred.  Returns GIT_ENOTFOUND if it has to be read
+ * some other way.
+ */
+static int prefetch_take(git_rawobj *out, struct repospanner_odb *backend, const git_oid *oid)
+{
+	struct prefetch *pf;
+	size_t pos;
+	int error = GIT_ENOTFOUND;
+
+	if (!backend->prefetched)
+		return GIT_ENOTFOUND;
+
+	if (git_mutex_lock(&backend->prefetch_lock) < 0)
+		return -1;
+
+	while (true) {
+		pos = git_oidmap_lookup_index(backend->prefetched, oid);
+		if (!git_oidmap_valid_index(backend->prefetched, pos))
+			break;
+
+		pf = git_oidmap_value_at(backend->prefetched, pos);
+
+		/* not started yet, so we are quicker reading it ourselves */
+		if (pf->state == PREFETCH_QUEUED) {
+			git_oidmap_delete(backend->prefetched, oid);
+			pf->cancelled = true;
+			break;
+		}
+
+		if (pf->state == PREFETCH_DONE) {
+			git_oidmap_delete(backend->prefetched, oid);
+			backend->prefetch_bytes -= pf->raw.len;
+
+			memcpy(out, &pf->raw, sizeof(git_rawobj));
+			pf->raw.data = NULL;
+			prefetch_free(pf);
+
+			error = 0;
+			break;
+		}
+
+		git_cond_wait(&backend->prefetch_cond, &backend->prefetch_lock);
+	}
+
+	git_mutex_unlock(&backend->prefetch_lock);
+	return error;
+}
+
+static int impl__prefetch(git_odb_backend *_backend, const git_oid *ids, size_t count)
+{
+	struct repospanner_odb *backend = (struct repospanner_odb *)_backend;
+	struct prefetch *pf;
+	size_t i;
+	int rval, error = 0;
+
+	if (git_mutex_lock(&backend->prefetch_lock) < 0)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		if (git_oidmap_size(backend->prefetched) >= REPOSPANNER_PREFETCH_MAX)
+			break;
+
+		if (git_oidmap_exists(backend->prefetched, &ids[i]) ||
+		    repospanner_negative_cache_contains(backend->client, &ids[i]) ||
+		    is_unwritten(backend, &ids[i]) ||
+		    is_cached(backend, &ids[i]))
+			continue;
+
+		if ((pf = git__calloc(1, sizeof(struct prefetch))) == NULL) {
+			error = -1;
+			break;
+		}
+
+		pf->backend = backend;
+		git_oid_cpy(&pf->oid, &ids[i]);
+
+		git_oidmap_insert(backend->prefetched, &pf->oid, pf, &rval);
+		if (rval < 0) {
+			git__free(pf);
+			error = -1;
+			break;
+		}
+
+		if (backend->prefetch_tail)
+			backend->prefetch_tail->next = pf;
+		else
+			backend->prefetch_head = pf;
+		backend->prefetch_tail = pf;
+	}
+
+	prefetch_pump(backend);
+
+	git_mutex_unlock(&backend->prefetch_lock);
+	return error;
+}
+
+static int prefetch_init(struct repospanner_odb *backend)
+{
+	int64_t concurrency, memory;
+	int error;
+
+	if ((error = repospanner_config_get_int64(&concurrency, backend->repo,
+		"repospanner.prefetchconcurrency", REPOSPANNER_PREFETCH_CONCURRENCY)) < 0 ||
+	    (error = repospanner_config_get_int64(&memory, backend->repo,
+		"repospanner.prefetchmemory", REPOSPANNER_PREFETCH_MEMORY)) < 0)
+		return error;
+
+	/* a concurrency of zero disables prefetching */
+	if (concurrency <= 0)
+		return 0;
+
+	backend->prefetch_concurrency = (size_t)concurrency;
+	backend->prefetch_max_bytes = memory > 0 ? (size_t)memory : 0;
+
+	if ((backend->prefetched = git_oidmap_alloc()) == NULL) {
+		giterr_set_oom();
+		return -1;
+	}
+
+	if (git_mutex_init(&backend->prefetch_lock) < 0 ||
+	    git_cond_init(&backend->prefetch_cond) < 0) {
+		giterr_set(GITERR_OS, "failed to initialize repoSpanner prefetch lock");
+		return -1;
+	}
+
+	backend->parent.prefetch = &impl__prefetch;
+	return 0;
+}
+
+static void prefetch_shutdown(struct repospanner_odb *backend)
+{
+	struct prefetch *pf;
+
+	if (!backend->prefetched)
+		return;
+
+	git_mutex_lock(&backend->prefetch_lock);
+	backend->prefetch_stop = true;
+
+	while ((pf = backend->prefetch_head) != NULL) {
+		backend->prefetch_head = pf->next;
+		if (!pf->cancelled)
+			git_oidmap_delete(backend->prefetched, &pf->oid);
+		prefetch_free(pf);
+	}
+	backend->prefetch_tail = NULL;
+
+	/* the transfer thread still has pointers to the running ones */
+	while (backend->prefetch_running)
+		git_cond_wait(&backend->prefetch_cond, &backend->prefetch_lock);
+
+	git_oidmap_foreach_value(backend->prefetched, pf, {
+		prefetch_free(pf);
+	});
+
+	git_mutex_unlock(&backend->prefetch_lock);
+
+	git_oidmap_free(backend->prefetched);
+	git_cond_free(&backend->prefetch_cond);
+	git_mutex_free(&backend->prefetch_lock);
+}
+
+#else
+
+static int prefetch_take(git_rawobj *out, struct repospanner_odb *backend, const git_oid *oid)
+{
+	GIT_UNUSED(out);
+	GIT_UNUSED(backend);
+	GIT_UNUSED(oid);
+
+	return GIT_ENOTFOUND;
+}
+
+#endif
+
+static int read_remote_single(git_rawobj *out, struct repospanner_odb *backend, const git_oid *oid)
+{
+	struct single_read sr;
+	CURL *req = NULL;
+	int error;
+
+	if ((error = object_reader_init(&sr.reader)) < 0)
+		return error;
+	sr.error = 0;
+
+	if ((error = get_request_for_object(&req, backend, oid)) != GIT_OK)
+		goto done;
+
+	curl_easy_setopt(req, CURLOPT_WRITEFUNCTION, single_read_callback);
+	curl_easy_setopt(req, CURLOPT_WRITEDATA, &sr);
+
+	error = repospanner_check_curl(req);
+	if (sr.error)
+		error = sr.error;
+
+	if (error == 0)
+		error = object_reader_finish(out, &sr.reader);
+
+done:
+	repospanner_release_request(backend->client, req);
+	object_reader_dispose(&sr.reader);
+	return error;
+}
+
+/* Most nodes a single read goes to: the best one, a hedge, and the primary */
+#define REPOSPANNER_READ_ATTEMPTS 3
+
+struct read_attempt {
+	CURL *req;
+	size_t node;
+	double started;
+	bool running;
+	struct single_read sr;
+};
+
+static int read_attempt_start(
+	struct read_attempt *attempt, CURLM *multi,
+	struct repospanner_odb *backend, size_t node, const char *path)
+{
+	int error;
+
+	memset(attempt, 0, sizeof(struct read_attempt));
+	attempt->node = node;
+
+	if ((error = object_reader_init(&attempt->sr.reader)) < 0 ||
+	    (error = repospanner_prepare_node_request(&attempt->req, backend->client, node, path)) < 0)
+		return error;
+
+	curl_easy_setopt(attempt->req, CURLOPT_WRITEFUNCTION, single_read_callback);
+	curl_easy_setopt(attempt->req, CURLOPT_WRITEDATA, &attempt->sr);
+	curl_easy_setopt(attempt->req, CURLOPT_PRIVATE, attempt);
+
+	if (curl_multi_add_handle(multi, attempt->req) != CURLM_OK) {
+		giterr_set(GITERR_NET, "failed to start repoSpanner request");
+		return -1;
+	}
+
+	attempt->started = git__timer();
+	attempt->running = true;
+	return 0;
+}
+
+/*
+ * Read an object from the fastest node we know of.  If it takes longer
+ * than that node usually does, ask the next one too, and take whichever
+ * answers first.  A node failing makes us try the next one; a replica
+ * not having an object has it checked with the primary node, since the
+ * replica may be lagging behind.  The object is only missing if the
+ * primary node says so.
+ */
+static int read_remote_nodes(git_rawobj *out, struct repospanner_odb *backend, const git_oid *oid)
+{
+	struct read_attempt attempts[REPOSPANNER_READ_ATTEMPTS], *attempt, *winner = NULL;
+	size_t nodes[REPOSPANNER_READ_ATTEMPTS], nodes_len, started = 0, running = 0, i;
+	bool primary_tried = false, notfound = false;
+	git_buf path = GIT_BUF_INIT;
+	double hedge_at = -1, now;
+	CURLM *multi = NULL;
+	CURLMsg *msg;
+	int error = 0, last_error = GIT_ERROR, left, timeout;
+
+	nodes_len = repospanner_nodes_rank(nodes, REPOSPANNER_READ_ATTEMPTS - 1, backend->client);
+
+	if ((error = git_buf_printf(&path, "simple/object/%s", git_oid_tostr_s(oid))) < 0)
+		goto done;
+
+	if ((multi = repospanner_multi_acquire(backend->client)) == NULL) {
+		error = -1;
+		goto done;
+	}
+
+	while (!winner) {
+		/* start the next node if the others failed, or are too slow */
+		now = git__timer();
+
+		if ((!running || (hedge_at >= 0 && now >= hedge_at)) && started < nodes_len) {
+			attempt = &attempts[started];
+
+			if ((error = read_attempt_start(attempt, multi, backend, nodes[started], path.ptr)) < 0) {
+				object_reader_dispose(&attempt->sr.reader);
+				repospanner_release_request(backend->client, attempt->req);
+				goto done;
+			}
+
+			primary_tried |= (nodes[started] == 0);
+			if (running)
+				repospanner_count_hedge(backend->client);
+
+			hedge_at = running ? -1 : repospanner_node_hedge_delay(backend->client, nodes[started]);
+			if (hedge_at >= 0)
+				hedge_at += now;
+
+			started++;
+			running++;
+		}
+
+		if (!running) {
+			error = notfound ? GIT_ENOTFOUND : last_error;
+
+			if (error != GIT_ENOTFOUND)
+				giterr_set(GITERR_NET, "failed to read object %s from repoSpanner",
+					git_oid_tostr_s(oid));
+			goto done;
+		}
+
+		curl_multi_perform(multi, &left);
+
+		while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&attempt);
+
+			error = repospanner_curl_result(attempt->req, msg->data.result);
+			if (attempt->sr.error)
+				error = attempt->sr.error;
+
+			repospanner_node_report(backend->client, attempt->node,
+				git__timer() - attempt->started, error);
+
+			curl_multi_remove_handle(multi, attempt->req);
+			attempt->running = false;
+			running--;
+
+			if (error == 0) {
+				winner = attempt;
+				break;
+			}
+
+			if (error == GIT_ENOTFOUND && attempt->node == 0) {
+				notfound = true;
+			} else if (error == GIT_ENOTFOUND) {
+				/* only the primary node has the final word */
+				if (!primary_tried && started < REPOSPANNER_READ_ATTEMPTS) {
+					nodes[started] = 0;
+					nodes_len = started + 1;
+				}
+			} else {
+				last_error = error;
+			}
+
+			hedge_at = -1;
+			giterr_clear();
+		}
+
+		if (winner || !running)
+			continue;
+
+		timeout = 100;
+		if (hedge_at >= 0 && started < nodes_len)
+			timeout = max(1, min(timeout, (int)((hedge_at - git__timer()) * 1000)));
+
+		curl_multi_wait(multi, NULL, 0, timeout, NULL);
+	}
+
+	error = object_reader_finish(out, &winner->sr.reader);
+
+done:
+	for (i = 0; i < started; i++) {
+		if (attempts[i].running)
+			curl_multi_remove_handle(multi, attempts[i].req);
+
+		object_reader_dispose(&attempts[i].sr.reader);
+		repospanner_release_request(backend->client, attempts[i].req);
+	}
+
+	if (error == GIT_ENOTFOUND)
+		giterr_set(GITERR_ODB, "object %s not found on repoSpanner", git_oid_tostr_s(oid));
+
+	repospanner_multi_release(backend->client, multi);
+	git_buf_dispose(&path);
+	return error;
+}
+
+static int read_remote(git_rawobj *out, struct repospanner_odb *backend, const git_oid *oid)
+{
+	if (repospanner_node_count(backend->client) > 1)
+		return read_remote_nodes(out, backend, oid);
+
+	return read_remote_single(out, backend, oid);
+}
+
+static int impl__read(void **buffer_p, size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+{
+	struct repospanner_odb *backend = (struct repospanner_odb *)_backend;
+	repospanner_flight *flight;
+	git_rawobj raw;
+	int error;
+
+	if ((error = prefetch_take(&raw, backend, oid)) != GIT_ENOTFOUND ||
+	    (error = read_unwritten(&raw, backend, oid)) != GIT_ENOTFOUND ||
+	    (error = read_cached(&raw, backend, oid)) != GIT_ENOTFOUND) {
+		if (error == 0) {
+			repospanner_count_cache_hit(backend->client);
+			*buffer_p = raw.data;
+			*len_p = raw.len;
+			*type_p = raw.type;
+		}
+		return error;
+	}
+
+	if (repospanner_negative_cache_contains(backend->client, oid))
+		return GIT_ENOTFOUND;
+
+	if ((error = repospanner_flight_join(&flight, &raw, backend->client, oid)) <= 0) {
+		if (error == 0) {
+			*buffer_p = raw.data;
+			*len_p = raw.len;
+			*type_p = raw.type;
+		}
+		return error;
+	}
+
+	error = read_remote(&raw, backend, oid);
+
+	if (error == GIT_ENOTFOUND)
+		repospanner_negative_cache_add(backend->client, oid);
+
+	if (error == 0) {
+		header_cache_put(backend, oid, raw.len, raw.type);
+
+		if (backend->persist)
+			writebehind_queue(backend, oid, &raw);
+
+		*buffer_p = raw.data;
+		*len_p = raw.len;
+		*type_p = raw.type;
+	}
+
+	repospanner_flight_land(backend->client, flight, error, &raw);
+	return error;
+}
+
+static int impl__read_header(size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+{
+	struct repospanner_odb *backend = (struct repospanner_odb *)_backend;
+	int error;
+
+	if (header_cache_get(len_p, type_p, backend, oid)) {
+		repospanner_count_cache_hit(backend->client);
+		return 0;
+	}
+
+	if (backend->persist &&
+	    (error = repospanner_cache_read_header(len_p, type_p, backend->cache, oid)) != GIT_ENOTFOUND) {
+		if (error == 0)
+			repospanner_count_cache_hit(backend->client);
+		return error;
+	}
+
+	return read_header_remote(len_p, type_p, backend, oid);
+}
+
+/* Collect the object ids of a response listing one per line */
+static int parse_oid_list(git_array_oid_t *out, const char *data, size_t len)
+{
+	const char *line = data, *end = data + len, *eol;
+	git_oid *id;
+
+	while (line < end) {
+		if ((eol = memchr(line, '\n', end - line)) == NULL)
+			eol = end;
+
+		if (eol > line) {
+			if ((id = git_array_alloc(*out)) == NULL)
+				return -1;
+
+			if (eol - line != GIT_OID_HEXSZ || git_oid_fromstrn(id, line, GIT_OID_HEXSZ) < 0) {
+				giterr_set(GITERR_ODB, "invalid object listing received from repoSpanner");
+				return -1;
+			}
+		}
+
+		line = eol + 1;
+	}
+
+	return 0;
+}
+
+static size_t buffer_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	git_buf *buf = userdata;
+
+	if (git_buf_put(buf, ptr, size * nmemb) < 0)
+		return 0;
+
+	return size * nmemb;
+}
+
+/* GET a listing of object ids */
+static int get_oid_list(git_array_oid_t *out, struct repospanner_odb *backend, const char *path)
+{
+	git_buf body = GIT_BUF_INIT;
+	CURL *req = NULL;
+	int error;
+
+	if ((error = repospanner_prepare_request(&req, backend->client, path)) < 0)
+		goto done;
+
+	repospanner_accept_compression(backend->client, req);
+	curl_easy_setopt(req, CURLOPT_WRITEFUNCTION, buffer_write_callback);
+	curl_easy_setopt(req, CURLOPT_WRITEDATA, &body);
+
+	if ((error = repospanner_check_curl(req)) == 0)
+		error = parse_oid_list(out, body.ptr, body.size);
+
+done:
+	repospanner_release_request(backend->client, req);
+	git_buf_dispose(&body);
+	return error;
+}
+
+/*
+ * Resolve an abbreviated id, from the objects we know of if possible.
+ * Otherwise, the server lists the objects it has with that prefix;
+ * a single one means the abbreviation is unique.  If the server cannot
+ * be asked, we pass, so that the objects we have locally still resolve.
+ */
+static int resolve_prefix(
+	git_oid *out, struct repospanner_odb *backend,
+	const git_oid *short_id, size_t len)
+{
+	git_array_oid_t found = GIT_ARRAY_INIT;
+	git_buf path = GIT_BUF_INIT;
+	char hex[GIT_OID_HEXSZ + 1];
+	int error;
+
+	if ((error = repospanner_known_resolve(out, backend->client, short_id, len)) != GIT_PASSTHROUGH)
+		goto done;
+
+	git_oid_nfmt(hex, len, short_id);
+	hex[len] = '\0';
+
+	if ((error = git_buf_printf(&path, "simple/objects/prefix/%s", hex)) < 0)
+		goto done;
+
+	if ((error = get_oid_list(&found, backend, path.ptr)) < 0 && error != GIT_ENOTFOUND) {
+		giterr_clear();
+		error = GIT_PASSTHROUGH;
+		goto done;
+	}
+
+	repospanner_known_add(backend->client, found.ptr, found.size, found.size == 1 ? len : 0);
+
+	if (found.size == 1) {
+		git_oid_cpy(out, git_array_get(found, 0));
+		error = 0;
+	} else {
+		error = found.size ? GIT_EAMBIGUOUS : GIT_ENOTFOUND;
+	}
+
+done:
+	if (error == GIT_ENOTFOUND)
+		error = git_odb__error_notfound("no match for prefix on repoSpanner", short_id, len);
+	else if (error == GIT_EAMBIGUOUS)
+		error = git_odb__error_ambiguous("multiple matches for prefix on repoSpanner");
+
+	git_array_clear(found);
+	git_buf_dispose(&path);
+	return error;
+}
+
+static int impl__read_prefix(
+	git_oid *out_oid, void **buffer_p, size_t *len_p, git_otype *type_p,
+	git_odb_backend *_backend, const git_oid *short_oid, size_t len)
+{
+	struct repospanner_odb *backend = (struct repospanner_odb *)_backend;
+	git_oid full;
+	int error;
+
+	if (len >= GIT_OID_HEXSZ)
+		git_oid_cpy(&full, short_oid);
+	else if ((error = resolve_prefix(&full, backend, short_oid, len)) < 0)
+		return error;
+
+	/*
+	 * The local backends come first, and found it already; we are only
+	 * asked to make sure there is no other object like it.
+	 */
+	if (_backend->odb && git_odb__exists_local(_backend->odb, &full))
+		return GIT_PASSTHROUGH;
+
+	if ((error = impl__read(buffer_p, len_p, type_p, _backend, &full)) == 0)
+		git_oid_cpy(out_oid, &full);
+
+	return error;
+}
+
+static int impl__exists_prefix(
+	git_oid *out, git_odb_backend *_backend, const git_oid *short_id, size_t len)
+{
+	struct repospanner_odb *backend = (struct repospanner_odb *)_backend;
+
+	if (len >= GIT_OID_HEXSZ) {
+		if (!impl__exists(_backend, short_id))
+			return git_odb__error_notfound("object not found on repoSpanner", short_id, len);
+
+		git_oid_cpy(out, short_id);
+		return 0;
+	}
+
+	return resolve_prefix(out, backend, short_id, len);
+}
+
+/*
+ * List all objects on the server, a page at a time.  Having seen all
+ * of them, we can resolve any abbreviation locally from then on.  If
+ * the server cannot be asked, only the local objects are listed.
+ */
+static int impl__foreach(git_odb_backend *_backend, git_odb_foreach_cb cb, void *payload)
+{
+	struct repospanner_odb *backend = (struct repospanner_odb *)_backend;
+	git_array_oid_t page = GIT_ARRAY_INIT;
+	git_buf path = GIT_BUF_INIT;
+	git_oid after, *id;
+	unsigned int generation;
+	bool first = true;
+	size_t i;
+	int error = 0;
+
+	generation = repospanner_known_listing_start(backend->client);
+
+	do {
+		git_buf_clear(&path);
+		git_buf_printf(&path, "simple/objects/list?limit=%d", REPOSPANNER_LIST_PAGE);
+		if (!first)
+			git_buf_printf(&path, "&after=%s", git_oid_tostr_s(&after));
+
+		git_array_clear(page);
+
+		if (git_buf_oom(&path)) {
+			error = -1;
+			goto done;
+		}
+
+		if (get_oid_list(&page, backend, path.ptr) < 0) {
+			giterr_clear();
+			goto done;
+		}
+
+		repospanner_known_add(backend->client, page.ptr, page.size, 0);
+
+		git_array_foreach(page, i, id) {
+			if ((error = cb(id, payload)) != 0) {
+				error = giterr_set_after_callback(error);
+				goto done;
+			}
+		}
+
+		if (page.size)
+			git_oid_cpy(&after, git_array_last(page));
+		first = false;
+	} while (page.size == REPOSPANNER_LIST_PAGE);
+
+	repospanner_known_listing_done(backend->client, generation);
+
+done:
+	git_array_clear(page);
+	git_buf_dispose(&path);
+	return error;
+}
+
+static size_t read_stream_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	struct read_stream *rs = userdata;
+	size_t len = size * nmemb;
+
+	if (git_buf_len(&rs->in) - rs->in_pos >= REPOSPANNER_STREAM_WINDOW) {
+		rs->paused = true;
+		return CURL_WRITEFUNC_PAUSE;
+	}
+
+	if (rs->in_pos) {
+		git_buf_consume(&rs->in, rs->in.ptr + rs->in_pos);
+		rs->in_pos = 0;
+	}
+
+	if (git_buf_put(&rs->in, ptr, len) < 0) {
+		rs->error = -1;
+		return 0;
+	}
+
+	return len;
+}
+
+/* Let curl run until more data arrived, or the request finished */
+static int read_stream_pump(struct read_stream *rs)
+{
+	size_t available = git_buf_len(&rs->in) - rs->in_pos;
+	CURLMsg *msg;
+	int left;
+
+	if (rs->paused && available < REPOSPANNER_STREAM_WINDOW) {
+		rs->paused = false;
+		curl_easy_pause(rs->req, CURLPAUSE_CONT);
+	}
+
+	while (rs->running && !rs->error && git_buf_len(&rs->in) - rs->in_pos == available) {
+		curl_multi_perform(rs->multi, &left);
+
+		while ((msg = curl_multi_info_read(rs->multi, &left)) != NULL) {
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+
+			rs->running = false;
+			rs->error = repospanner_curl_result(rs->req, msg->data.result);
+		}
+
+		if (rs->running && !rs->paused &&
+		    git_buf_len(&rs->in) - rs->in_pos == available)
+			curl_multi_wait(rs->multi, NULL, 0, 100, NULL);
+
+		/* we are waiting for the reader to catch up */
+		if (rs->paused)
+			break;
+	}
+
+	return rs->error;
+}
+
+/* Inflate as much as fits into `out`, fetching more if needed */
+static int read_stream_inflate(struct read_stream *rs, char *out, size_t *out_len)
+{
+	size_t avail = *out_len;
+	int zerr, error;
+
+	*out_len = 0;
+
+	while (!rs->zs_done && !*out_len) {
+		if (rs->in_pos == git_buf_len(&rs->in)) {
+			if (!rs->running && !rs->paused)
+				return rs->error ? rs->error : object_reader_corrupt();
+
+			if ((error = read_stream_pump(rs)) < 0)
+				return error;
+
+			continue;
+		}
+
+		rs->zs.next_in = (Bytef *)rs->in.ptr + rs->in_pos;
+		rs->zs.avail_in = (uInt)min(git_buf_len(&rs->in) - rs->in_pos, UINT_MAX);
+		rs->zs.next_out = (Bytef *)out;
+		rs->zs.avail_out = (uInt)min(avail, UINT_MAX);
+
+		zerr = inflate(&rs->zs, Z_NO_FLUSH);
+		if (zerr != Z_OK && zerr != Z_STREAM_END && zerr != Z_BUF_ERROR)
+			return object_reader_corrupt();
+
+		rs->in_pos = (char *)rs->zs.next_in - rs->in.ptr;
+		*out_len = avail - rs->zs.avail_out;
+		rs->zs_done = (zerr == Z_STREAM_END);
+	}
+
+	return 0;
+}
+
+/* Make sure all of the object was there, and that it is the right one */
+static int read_stream_verify(struct read_stream *rs)
+{
+	git_oid actual;
+	int error;
+
+	/* anything after the end of the zlib stream is garbage */
+	if (rs->produced != rs->len || rs->in_pos != git_buf_len(&rs->in))
+		return object_reader_corrupt();
+
+	while (rs->running && (error = read_stream_pump(rs)) == 0) {
+		if (rs->in_pos != git_buf_len(&rs->in))
+			return object_reader_corrupt();
+	}
+
+	if (rs->error)
+		return rs->error;
+
+	if ((error = git_hash_final(&actual, rs->parent.hash_ctx)) < 0)
+		return error;
+
+	if (git_oid__cmp(&actual, &rs->oid)) {
+		giterr_set(GITERR_ODB, "object %s received from repoSpanner is corrupted",
+			git_oid_tostr_s(&rs->oid));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int read_stream_read(git_odb_stream *_stream, char *buffer, size_t len)
+{
+	struct read_stream *rs = (struct read_stream *)_stream;
+	size_t chunk = 0;
+	int error;
+
+	len = min(len, INT_MAX);
+
+	if (rs->local.data) {
+		chunk = min(len, rs->local.len - rs->produced);
+		memcpy(buffer, (char *)rs->local.data + rs->produced, chunk);
+		rs->produced += chunk;
+		return (int)chunk;
+	}
+
+	if (rs->produced == rs->len)
+		return 0;
+
+	/* we may have inflated some of the object along with its header */
+	if (rs->hdr_pos < rs->hdr_len) {
+		chunk = min(len, rs->hdr_len - rs->hdr_pos);
+		memcpy(buffer, rs->hdr + rs->hdr_pos, chunk);
+		rs->hdr_pos += chunk;
+	} else {
+		/* ask for a byte more than left, to detect excess data */
+		chunk = min(len, rs->len - rs->produced + 1);
+
+		if ((error = read_stream_inflate(rs, buffer, &chunk)) < 0)
+			return error;
+	}
+
+	if (!chunk || chunk > rs->len - rs->produced)
+		return object_reader_corrupt();
+
+	if ((error = git_hash_update(rs->parent.hash_ctx, buffer, chunk)) < 0)
+		return error;
+
+	rs->produced += chunk;
+
+	if (rs->produced == rs->len && (error = read_stream_verify(rs)) < 0)
+		return error;
+
+	return (int)chunk;
+}
+
+static void read_stream_free(git_odb_stream *_stream)
+{
+	struct read_stream *rs = (struct read_stream *)_stream;
+
+	if (rs->req) {
+		curl_multi_remove_handle(rs->multi, rs->req);
+		repospanner_release_request(rs->backend->client, rs->req);
+	}
+
+	repospanner_multi_release(rs->backend->client, rs->multi);
+
+	if (rs->zs_init)
+		inflateEnd(&rs->zs);
+
+	git__free(rs->local.data);
+	git_buf_dispose(&rs->in);
+	git__free(rs);
+}
+
+/* Start the request, and wait for the object's header */
+static int read_stream_start(git_otype *type_p, struct read_stream *rs)
+{
+	git_buf path = GIT_BUF_INIT;
+	char hdr[REPOSPANNER_HDR_MAX];
+	size_t hdr_len, chunk;
+	int error;
+
+	if (inflateInit(&rs->zs) != Z_OK) {
+		giterr_set(GITERR_ZLIB, "failed to init zlib stream");
+		return -1;
+	}
+	rs->zs_init = true;
+
+	if ((error = git_buf_printf(&path, "simple/object/%s", git_oid_tostr_s(&rs->oid))) < 0 ||
+	    (error = repospanner_prepare_request(&rs->req, rs->backend->client, path.ptr)) < 0)
+		goto done;
+
+	if ((rs->multi = repospanner_multi_acquire(rs->backend->client)) == NULL) {
+		error = -1;
+		goto done;
+	}
+
+	curl_easy_setopt(rs->req, CURLOPT_WRITEFUNCTION, read_stream_callback);
+	curl_easy_setopt(rs->req, CURLOPT_WRITEDATA, rs);
+
+	if (curl_multi_add_handle(rs->multi, rs->req) != CURLM_OK) {
+		giterr_set(GITERR_NET, "failed to start repoSpanner request");
+		error = -1;
+		goto done;
+	}
+	rs->running = true;
+
+	while ((error = loose_header_parse(type_p, &rs->len, &hdr_len,
+		rs->hdr, rs->hdr_len, sizeof(rs->hdr))) == 0) {
+		chunk = sizeof(rs->hdr) - rs->hdr_len;
+
+		if ((error = read_stream_inflate(rs, rs->hdr + rs->hdr_len, &chunk)) < 0)
+			goto done;
+
+		if (!chunk) {
+			error = object_reader_corrupt();
+			goto done;
+		}
+
+		rs->hdr_len += chunk;
+	}
+
+	if (error < 0)
+		goto done;
+
+	/* the object's data starts right after the header */
+	memmove(rs->hdr, rs->hdr + hdr_len, rs->hdr_len - hdr_len);
+	rs->hdr_len -= hdr_len;
+
+	if (rs->hdr_len > rs->len) {
+		error = object_reader_corrupt();
+		goto done;
+	}
+
+	if ((error = git_odb__format_object_header(&hdr_len, hdr, sizeof(hdr), rs->len, *type_p)) < 0 ||
+	    (error = git_hash_update(rs->parent.hash_ctx, hdr, hdr_len)) < 0)
+		goto done;
+
+	/* an empty object is complete as soon as it starts */
+	if (!rs->len)
+		error = read_stream_verify(rs);
+
+done:
+	git_buf_dispose(&path);
+	return error;
+}
+
+static int impl__readstream(
+	git_odb_stream **stream_out, size_t *len_p, git_otype *type_p,
+	git_odb_backend *_backend, const git_oid *oid)
+{
+	struct repospanner_odb *backend = (struct repospanner_odb *)_backend;
+	struct read_stream *rs;
+	git_hash_ctx *hash_ctx;
+	int error;
+
+	if (repospanner_negative_cache_contains(backend->client, oid))
+		return git_odb__error_notfound("object not found on repoSpanner", oid, GIT_OID_HEXSZ);
+
+	rs = git__calloc(1, sizeof(struct read_stream));
+	GITERR_CHECK_ALLOC(rs);
+
+	rs->backend = backend;
+	git_oid_cpy(&rs->oid, oid);
+
+	rs->parent.backend = _backend;
+	rs->parent.mode = GIT_STREAM_RDONLY;
+	rs->parent.read = &read_stream_read;
+	rs->parent.free = &read_stream_free;
+
+	if ((hash_ctx = git__malloc(sizeof(git_hash_ctx))) == NULL) {
+		git__free(rs);
+		return -1;
+	}
+
+	if (git_hash_ctx_init(hash_ctx) < 0) {
+		git__free(hash_ctx);
+		git__free(rs);
+		return -1;
+	}
+
+	rs->parent.hash_ctx = hash_ctx;
+
+	if ((error = read_unwritten(&rs->local, backend, oid)) == GIT_ENOTFOUND &&
+	    (error = read_cached(&rs->local, backend, oid)) == GIT_ENOTFOUND) {
+		error = read_stream_start(type_p, rs);
+		*len_p = rs->len;
+	} else if (error == 0) {
+		repospanner_count_cache_hit(backend->client);
+		*len_p = rs->local.len;
+		*type_p = rs->local.type;
+	}
+
+	if (error == GIT_ENOTFOUND)
+		repospanner_negative_cache_add(backend->client, oid);
+
+	if (error < 0) {
+		git_odb_stream_free(&rs->parent);
+		return error;
+	}
+
+	*stream_out = &rs->parent;
+	return 0;
+}
+
+static size_t fetch_tree_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	struct fetch_tree *ft = userdata;
+	size_t len = size * nmemb;
+
+	if ((ft->error = repospanner_cache_stream_append(ft->stream, ptr, len)) < 0)
+		return 0;
+
+	return len;
+}
+
+/*
+ * Fetch a tree with the trees reachable from it, and optionally their
+ * blobs too, as a single pack which is indexed into the cache as it
+ * arrives.  The request lists the tree, followed by the options:
+ *
+ *   <tree>
+ *   depth <levels below the tree to include>
+ *   blobs
+ *   path <only descend along this path>
+ *
+ * Servers without the endpoint answer 405 or 501, or 404 even for a
+ * tree they gave us before; we then do not ask them again.
+ */
+static int fetch_tree(
+	struct repospanner_odb *backend, const git_oid *tree,
+	unsigned int depth, bool blobs, const git_strarray *paths)
+{
+	struct fetch_tree ft = { 0 };
+	git_buf request = GIT_BUF_INIT;
+	struct curl_slist *headers = NULL;
+	CURL *req = NULL;
+	long response_code = 0;
+	size_t i;
+	int error;
+
+	if (!backend->persist) {
+		giterr_set(GITERR_ODB, "cannot fetch trees without repospanner.persistobjects");
+		return -1;
+	}
+
+	if (git_atomic_get(&backend->tree_unsupported)) {
+		giterr_set(GITERR_ODB, "repoSpanner server cannot fetch trees");
+		return -1;
+	}
+
+	git_buf_printf(&request, "%s\n", git_oid_tostr_s(tree));
+	if (depth)
+		git_buf_printf(&request, "depth %u\n", depth);
+	if (blobs)
+		git_buf_puts(&request, "blobs\n");
+
+	for (i = 0; paths && i < paths->count; i++) {
+		if (strchr(paths->strings[i], '\n') != NULL) {
+			giterr_set(GITERR_INVALID, "invalid path '%s'", paths->strings[i]);
+			error = -1;
+			goto done;
+		}
+
+		git_buf_printf(&request, "path %s\n", paths->strings[i]);
+	}
+
+	if (git_buf_oom(&request)) {
+		error = -1;
+		goto done;
+	}
+
+	if ((error = repospanner_cache_stream_new(&ft.stream, backend->cache)) < 0 ||
+	    (error = repospanner_prepare_request(&req, backend->client, "simple/objects/tree")) < 0)
+		goto done;
+
+	repospanner_accept_compression(backend->client, req);
+
+	headers = curl_slist_append(headers, "Expect:");
+	headers = curl_slist_append(headers, "Content-Type: text/plain");
+
+	curl_easy_setopt(req, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(req, CURLOPT_POSTFIELDS, request.ptr);
+	curl_easy_setopt(req, CURLOPT_POSTFIELDSIZE, (long)request.size);
+	curl_easy_setopt(req, CURLOPT_WRITEFUNCTION, fetch_tree_callback);
+	curl_easy_setopt(req, CURLOPT_WRITEDATA, &ft);
+
+	error = repospanner_check_curl(req);
+	curl_easy_getinfo(req, CURLINFO_RESPONSE_CODE, &response_code);
+	if (ft.error)
+		error = ft.error;
+
+	if (response_code == 405 || response_code == 501 ||
+	    (response_code == 404 && is_cached(backend, tree))) {
+		git_atomic_set(&backend->tree_unsupported, 1);
+		giterr_set(GITERR_ODB, "repoSpanner server cannot fetch trees");
+		error = -1;
+	} else if (error == 0)
+		error = repospanner_cache_stream_commit(ft.stream);
+	else if (error == GIT_ENOTFOUND)
+		giterr_set(GITERR_ODB, "tree %s not found on repoSpanner", git_oid_tostr_s(tree));
+
+done:
+	repospanner_release_request(backend->client, req);
+	repospanner_cache_stream_free(ft.stream);
+	curl_slist_free_all(headers);
+	git_buf_dispose(&request);
+	return error;
+}
+
+/*
+ * Whether the subtrees of a tree we have are all there.  If so, we
+ * most likely fetched it along with them before, so there is no need
+ * to do it again.
+ */
+static bool subtrees_cached(struct repospanner_odb *backend, const git_oid *tree)
+{
+	git_rawobj raw;
+	const char *ptr, *end, *name;
+	git_oid id;
+	bool cached = true;
+
+	if (read_unwritten(&raw, backend, tree) < 0 &&
+	    read_cached(&raw, backend, tree) < 0) {
+		giterr_clear();
+		return false;
+	}
+
+	ptr = raw.data;
+	end = ptr + raw.len;
+
+	/* entries are "<mode> <name>\0<raw id>", trees having mode 40000 */
+	while (cached && ptr < end) {
+		if ((name = memchr(ptr, '\0', end - ptr)) == NULL ||
+		    (size_t)(end - name) <= GIT_OID_RAWSZ)
+			break;
 
-struct repospanner_odb {
-	git_odb_backend parent;
+		if (raw.type == GIT_OBJ_TREE && !git__prefixcmp(ptr, "40000 ")) {
+			git_oid_fromraw(&id, (const unsigned char *)name + 1);
+			cached = is_unwritten(backend, &id) || is_cached(backend, &id);
+		}
 
-	repoSpanner_client *client;
+		ptr = name + 1 + GIT_OID_RAWSZ;
+	}
 
-	git_odb_backend *fsdb;
-	const char *objects_dir;
-	size_t objects_dirlen;
-	git_repository *repo;
-};
+	git__free(raw.data);
+	return cached;
+}
 
-static int object_file_name(
-	git_buf *name, const struct repospanner_odb *be, const git_oid *id)
+static int impl__prefetch_tree(git_odb_backend *_backend, const git_oid *tree)
 {
-	size_t alloclen;
-	size_t objects_dirlen = be->objects_dirlen;
+	struct repospanner_odb *backend = (struct repospanner_odb *)_backend;
+	git_oid *id;
+	int rval, error;
+
+	if (!backend->fetch_trees || git_atomic_get(&backend->tree_unsupported) ||
+	    git_mutex_lock(&backend->trees_lock) < 0)
+		return 0;
+
+	if (git_oidmap_exists(backend->trees, tree) ||
+	    git_oidmap_size(backend->trees) >= REPOSPANNER_TREES_MAX) {
+		git_mutex_unlock(&backend->trees_lock);
+		return 0;
+	}
+
+	/* whoever comes along while we are at it walks the tree as usual */
+	if ((id = git__malloc(sizeof(git_oid))) != NULL) {
+		git_oid_cpy(id, tree);
+		git_oidmap_insert(backend->trees, id, id, &rval);
 
-	/* expand length for object root + 40 hex sha1 chars + 2 * '/' + '\0' */
-	GITERR_CHECK_ALLOC_ADD(&alloclen, objects_dirlen, GIT_OID_HEXSZ);
-	GITERR_CHECK_ALLOC_ADD(&alloclen, alloclen, 3);
-	if (git_buf_grow(name, alloclen) < 0)
+		if (rval < 0) {
+			git__free(id);
+			id = NULL;
+		}
+	}
+
+	git_mutex_unlock(&backend->trees_lock);
+
+	if (id == NULL)
 		return -1;
 
-	git_buf_set(name, be->objects_dir, objects_dirlen);
-	git_path_to_dir(name);
+	if (subtrees_cached(backend, tree))
+		return 0;
+
+	if ((error = fetch_tree(backend, tree, backend->tree_depth, false, NULL)) < 0 &&
+	    git_mutex_lock(&backend->trees_lock) == 0) {
+		git_oidmap_delete(backend->trees, id);
+		git_mutex_unlock(&backend->trees_lock);
+		git__free(id);
+	}
+
+	return error;
+}
+
+static void trees_clear(struct repospanner_odb *backend)
+{
+	git_oid *id;
+
+	if (!backend->trees)
+		return;
 
-	/* loose object filename: aa/aaa... (41 bytes) */
-	git_oid_pathfmt(name->ptr + name->size, id);
-	name->size += GIT_OID_HEXSZ + 1;
-	name->ptr[name->size] = '\0';
+	git_oidmap_foreach_value(backend->trees, id, {
+		git__free(id);
+	});
 
-	return git_futils_mkdir_relative(
-		name->ptr + objects_dirlen, be->objects_dir, 0755,
-		GIT_MKDIR_PATH | GIT_MKDIR_SKIP_LAST | GIT_MKDIR_VERIFY_DIR, NULL);
+	git_oidmap_free(backend->trees);
+	git_mutex_free(&backend->trees_lock);
 }
 
+/*
+ * State of a pack upload.  The pack is generated on our thread, and
+ * every so often we let curl send what we have so far, so that neither
+ * needs to hold the whole pack.
+ */
+struct upload {
+	CURLM *multi;
+	CURL *req;
+
+	git_buf buf;
+	size_t pos;
+
+	bool finished;
+	bool paused;
+	bool done;
+	CURLcode result;
+};
 
-static int rs_odb_not_implemented(const char *fname)
+static size_t upload_read_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
 {
-	giterr_set(GITERR_INVALID, "function %s not implemented for repoSpanner", fname);
-	return GIT_EINVALID;
+	struct upload *up = (struct upload *)userdata;
+	size_t len = min(size * nmemb, up->buf.size - up->pos);
+
+	/* wait for the pack builder to give us more */
+	if (!len && !up->finished) {
+		up->paused = true;
+		return CURL_READFUNC_PAUSE;
+	}
+
+	memcpy(ptr, up->buf.ptr + up->pos, len);
+	up->pos += len;
+	return len;
 }
 
-static int get_request_for_object(CURL **out, struct repospanner_odb *backend, const git_oid *oid)
+/* Let curl make progress with what we have generated */
+static int upload_pump(struct upload *up)
 {
-	git_buf pathbuf = GIT_BUF_INIT;
+	CURLMsg *msg;
+	CURLMcode mcode;
+	int running, left;
+
+	if (up->paused && (up->pos < up->buf.size || up->finished)) {
+		up->paused = false;
+		curl_easy_pause(up->req, CURLPAUSE_CONT);
+	}
 
-	if (git_buf_puts(&pathbuf, "simple/object/") != GIT_OK)
-		return GIT_ERROR;
-	if (git_buf_puts(&pathbuf, git_oid_tostr_s(oid)) != GIT_OK)
-		return GIT_ERROR;
+	if ((mcode = curl_multi_perform(up->multi, &running)) != CURLM_OK)
+		goto on_error;
 
-	return repospanner_prepare_request(out, backend->client, git_buf_cstr(&pathbuf));
+	while ((msg = curl_multi_info_read(up->multi, &left)) != NULL) {
+		if (msg->msg == CURLMSG_DONE) {
+			up->done = true;
+			up->result = msg->data.result;
+		}
+	}
+
+	if (!up->done && !up->paused &&
+	    (mcode = curl_multi_wait(up->multi, NULL, 0, 100, NULL)) != CURLM_OK)
+		goto on_error;
+
+	return 0;
+
+on_error:
+	giterr_set(GITERR_NET, "failed to upload to repoSpanner: %s", curl_multi_strerror(mcode));
+	return -1;
 }
 
-static int impl__write(
-	git_odb_backend *_backend,
-	const git_oid *oid,
-	const void *data,
-	size_t len,
-	git_otype type)
+static int upload_pack_cb(void *data, size_t len, void *payload)
 {
-	(void)_backend;
-	(void)oid;
-	(void)data;
-	(void)len;
-	(void)type;
-	return rs_odb_not_implemented("write");
+	struct upload *up = (struct upload *)payload;
+
+	/* forget about what curl has sent already */
+	if (up->pos) {
+		git_buf_consume(&up->buf, up->buf.ptr + up->pos);
+		up->pos = 0;
+	}
+
+	if (git_buf_put(&up->buf, data, len) < 0)
+		return -1;
+
+	while (!up->done && up->buf.size - up->pos >= REPOSPANNER_UPLOAD_BUFFER) {
+		if (upload_pump(up) < 0)
+			return -1;
+	}
+
+	/* the server is not listening anymore; stop generating the pack */
+	return up->done ? GIT_EUSER : 0;
 }
 
-static int retrieve_file(struct repospanner_odb *backend, const git_oid *oid)
+static int upload_objects(struct repospanner_odb *backend, const git_oid *ids, size_t count)
 {
+	struct upload up = { 0 };
+	struct curl_slist *headers = NULL;
+	git_packbuilder *pb = NULL;
+	size_t i;
 	int error;
-	CURL *req;
-	git_buf final_path = GIT_BUF_INIT;
-	FILE *outfile;
 
-	if ((error = get_request_for_object(&req, backend, oid)) != GIT_OK)
+	if ((error = git_packbuilder_new(&pb, backend->repo)) < 0)
 		return error;
 
-	if ((error = object_file_name(&final_path, backend, oid)) != GIT_OK)
-		return error;
+	for (i = 0; i < count; i++) {
+		if ((error = git_packbuilder_insert(pb, &ids[i], NULL)) < 0)
+			goto done;
+	}
+
+	if ((error = repospanner_prepare_request(&up.req, backend->client, "simple/objects/pack")) < 0)
+		goto done;
 
-	outfile = fopen(git_buf_cstr(&final_path), "wb");
-	if (outfile == NULL) {
-		giterr_set(GITERR_NOMEMORY, "Could not open file buffer at %s", git_buf_cstr(&final_path));
-		return GIT_ERROR;
+	if ((up.multi = curl_multi_init()) == NULL) {
+		giterr_set(GITERR_NET, "failed to create repoSpanner upload");
+		error = -1;
+		goto done;
 	}
 
-	curl_easy_setopt(req, CURLOPT_WRITEDATA, outfile);
-	if ((error = repospanner_check_curl(req)) != GIT_OK)
-		goto fail;
+	headers = curl_slist_append(headers, "Expect:");
+	headers = curl_slist_append(headers, "Content-Type: application/x-git-packfile");
+	headers = curl_slist_append(headers, "Transfer-Encoding: chunked");
 
-	if (fclose(outfile))
-		goto fail;
+	curl_easy_setopt(up.req, CURLOPT_POST, 1L);
+	curl_easy_setopt(up.req, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(up.req, CURLOPT_READFUNCTION, upload_read_callback);
+	curl_easy_setopt(up.req, CURLOPT_READDATA, &up);
+	curl_multi_add_handle(up.multi, up.req);
 
-	return GIT_OK;
-fail:
-	fclose(outfile);
-	unlink(git_buf_cstr(&final_path));
+	error = git_packbuilder_foreach(pb, upload_pack_cb, &up);
+	up.finished = true;
+
+	while (!error && !up.done)
+		error = upload_pump(&up);
+
+	/* whatever the server told us is more interesting */
+	if (up.done && (up.result != CURLE_OK || error == GIT_EUSER))
+		error = repospanner_curl_result(up.req, up.result);
+
+	if (!error) {
+		giterr_clear();
 
+		/* a client shared by URL may have been told they were missing */
+		for (i = 0; i < count; i++)
+			repospanner_negative_cache_remove(backend->client, &ids[i]);
+	}
+
+done:
+	if (up.multi) {
+		curl_multi_remove_handle(up.multi, up.req);
+		curl_multi_cleanup(up.multi);
+	}
+	repospanner_release_request(backend->client, up.req);
+	curl_slist_free_all(headers);
+	git_packbuilder_free(pb);
+	git_buf_dispose(&up.buf);
 	return error;
 }
 
+/* List a written object as pending; call with the upload lock held */
+static int pending_append(struct repospanner_odb *backend, const git_oid *oid)
+{
+	char line[GIT_OID_HEXSZ + 1];
+
+	if (backend->pending_fd < 0 &&
+	    (backend->pending_fd = p_open(git_buf_cstr(&backend->pending_path),
+			O_WRONLY | O_CREAT | O_APPEND, 0666)) < 0) {
+		giterr_set(GITERR_OS, "failed to open '%s'", git_buf_cstr(&backend->pending_path));
+		return -1;
+	}
 
-static int impl__exists(git_odb_backend *_backend, const git_oid *oid)
+	git_oid_fmt(line, oid);
+	line[GIT_OID_HEXSZ] = '\n';
+
+	if (p_write(backend->pending_fd, line, sizeof(line)) < 0) {
+		giterr_set(GITERR_OS, "failed to write '%s'", git_buf_cstr(&backend->pending_path));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Queue the objects a previous process listed as pending, as long as
+ * they are still there to be uploaded.
+ */
+static int pending_load(struct repospanner_odb *backend)
 {
+	git_odb_backend *fsdb = backend->fsdb;
+	git_buf buf = GIT_BUF_INIT;
+	const char *line, *end;
+	git_oid oid, *id;
 	int error;
-	struct repospanner_odb *backend = (struct repospanner_odb *)_backend;
 
-	if ((error = retrieve_file(backend, oid)) != GIT_OK) {
-		if (error == GIT_ENOTFOUND)
-			return 0;
-		else
+	if ((error = git_futils_readbuffer(&buf, git_buf_cstr(&backend->pending_path))) < 0) {
+		if (error != GIT_ENOTFOUND)
 			return error;
+
+		giterr_clear();
+		return 0;
 	}
 
-	return 1;
+	end = buf.ptr + buf.size;
+
+	for (line = buf.ptr; line + GIT_OID_HEXSZ < end; line += GIT_OID_HEXSZ + 1) {
+		/* the last line may have been cut short */
+		if (line[GIT_OID_HEXSZ] != '\n' || git_oid_fromstrn(&oid, line, GIT_OID_HEXSZ) < 0) {
+			giterr_clear();
+			break;
+		}
+
+		if (!fsdb->exists(fsdb, &oid))
+			continue;
+
+		if ((id = git_array_alloc(backend->upload_pending)) == NULL) {
+			error = -1;
+			break;
+		}
+		git_oid_cpy(id, &oid);
+	}
+
+	git_buf_dispose(&buf);
+	return error;
 }
 
-static int impl__read(void **buffer_p, size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+/*
+ * Take uploaded objects off the list, keeping the ones written since,
+ * by us or by another process; call with the upload lock held.  Should
+ * this fail, they are just uploaded once more.
+ */
+static void pending_forget(struct repospanner_odb *backend, const git_oid *ids, size_t count)
 {
+	const char *path = git_buf_cstr(&backend->pending_path);
+	git_filebuf file = GIT_FILEBUF_INIT;
+	git_buf buf = GIT_BUF_INIT, kept = GIT_BUF_INIT;
+	git_oidmap *uploaded;
+	const char *line, *end;
+	git_oid oid;
+	size_t i;
+	int error = -1, rval;
+
+	if (backend->pending_fd >= 0) {
+		p_close(backend->pending_fd);
+		backend->pending_fd = -1;
+	}
+
+	if ((uploaded = git_oidmap_alloc()) == NULL)
+		goto done;
+
+	for (i = 0; i < count; i++) {
+		git_oidmap_insert(uploaded, &ids[i], NULL, &rval);
+		if (rval < 0)
+			goto done;
+	}
+
+	/*
+	 * We append nothing while holding the upload lock; another process
+	 * appending right now may lose its line, and only upload it itself.
+	 */
+	if (git_filebuf_open(&file, path, 0, 0666) < 0 ||
+	    git_futils_readbuffer(&buf, path) < 0)
+		goto done;
+
+	end = buf.ptr + buf.size;
+
+	for (line = buf.ptr; line + GIT_OID_HEXSZ < end; line += GIT_OID_HEXSZ + 1) {
+		if (line[GIT_OID_HEXSZ] != '\n' || git_oid_fromstrn(&oid, line, GIT_OID_HEXSZ) < 0)
+			break;
+
+		if (!git_oidmap_exists(uploaded, &oid))
+			git_buf_put(&kept, line, GIT_OID_HEXSZ + 1);
+	}
+
+	if (git_buf_oom(&kept))
+		goto done;
+
+	if (!git_buf_len(&kept)) {
+		git_filebuf_cleanup(&file);
+		error = p_unlink(path);
+	} else if ((error = git_filebuf_write(&file, kept.ptr, kept.size)) == 0) {
+		error = git_filebuf_commit(&file);
+	}
+
+done:
+	if (error < 0) {
+		git_trace(GIT_TRACE_WARN, "repoSpanner: failed to update '%s'; its objects are uploaded again", path);
+		giterr_clear();
+	}
+
+	git_filebuf_cleanup(&file);
+	git_oidmap_free(uploaded);
+	git_buf_dispose(&kept);
+	git_buf_dispose(&buf);
+}
+
+/* Upload everything written so far; on failure, it stays queued */
+static int upload_pending(struct repospanner_odb *backend)
+{
+	git_array_t(git_oid) pending = GIT_ARRAY_INIT;
+	git_oid *id;
+	size_t i;
 	int error;
-	struct repospanner_odb *backend = (struct repospanner_odb *)_backend;
 
-	if ((error = retrieve_file(backend, oid)) != GIT_OK)
+	if ((error = git_mutex_lock(&backend->upload_lock)) < 0)
 		return error;
 
-	return backend->fsdb->read(buffer_p, len_p, type_p, backend->fsdb, oid);
+	memcpy(&pending, &backend->upload_pending, sizeof(pending));
+	git_array_init(backend->upload_pending);
+
+	git_mutex_unlock(&backend->upload_lock);
+
+	if (!pending.size)
+		goto done;
+
+	if ((error = upload_objects(backend, pending.ptr, pending.size)) == 0) {
+		git_mutex_lock(&backend->upload_lock);
+		pending_forget(backend, pending.ptr, pending.size);
+		git_mutex_unlock(&backend->upload_lock);
+		goto done;
+	}
+
+	/* put them back in front of whatever was written meanwhile */
+	git_mutex_lock(&backend->upload_lock);
+
+	for (i = 0; i < backend->upload_pending.size; i++) {
+		if ((id = git_array_alloc(pending)) == NULL)
+			break;
+		git_oid_cpy(id, git_array_get(backend->upload_pending, i));
+	}
+
+	git_array_clear(backend->upload_pending);
+	memcpy(&backend->upload_pending, &pending, sizeof(pending));
+	git_array_init(pending);
+
+	git_mutex_unlock(&backend->upload_lock);
+
+done:
+	git_array_clear(pending);
+	return error;
 }
 
-static int impl__read_header(size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+/*
+ * Writing an object which already exists only freshens it.  Asking the
+ * server would cost a round trip per written object, so only what we
+ * know about locally counts; uploading something the server already
+ * has is harmless.
+ */
+static int impl__freshen(git_odb_backend *_backend, const git_oid *oid)
+{
+	struct repospanner_odb *backend = (struct repospanner_odb *)_backend;
+	git_otype type;
+	size_t len;
+
+	if (header_cache_get(&len, &type, backend, oid) ||
+	    is_unwritten(backend, oid) || is_cached(backend, oid))
+		return 0;
+
+	return GIT_ENOTFOUND;
+}
+
+static int impl__write(
+	git_odb_backend *_backend, const git_oid *oid,
+	const void *data, size_t len, git_otype type)
 {
-	int error;
 	struct repospanner_odb *backend = (struct repospanner_odb *)_backend;
+	git_odb_backend *fsdb = backend->fsdb;
+	size_t known_len;
+	git_otype known_type;
+	git_oid *id;
+	bool upload;
+	int error;
+
+	/* the pack we upload is built from the local copy */
+	if ((error = fsdb->write(fsdb, oid, data, len, type)) < 0)
+		return error;
+
+	/* we got it from the server in the first place */
+	if (header_cache_get(&known_len, &known_type, backend, oid) || is_cached(backend, oid))
+		return 0;
+
+	if ((error = git_mutex_lock(&backend->upload_lock)) < 0)
+		return error;
 
-	if ((error = retrieve_file(backend, oid)) != GIT_OK)
+	if ((id = git_array_alloc(backend->upload_pending)) != NULL) {
+		git_oid_cpy(id, oid);
+		error = pending_append(backend, oid);
+	}
+
+	upload = backend->upload_batch &&
+		git_array_size(backend->upload_pending) >= backend->upload_batch;
+
+	git_mutex_unlock(&backend->upload_lock);
+	GITERR_CHECK_ALLOC(id);
+
+	if (error < 0)
 		return error;
 
-	return backend->fsdb->read_header(len_p, type_p, backend->fsdb, oid);
+	/* the object is safe locally, so this can be retried later */
+	if (upload && upload_pending(backend) < 0)
+		giterr_clear();
+
+	return 0;
+}
+
+static int writer__write(
+	git_odb_backend *_writer, const git_oid *oid,
+	const void *data, size_t len, git_otype type)
+{
+	struct repospanner_odb_writer *writer = (struct repospanner_odb_writer *)_writer;
+
+	return impl__write(&writer->backend->parent, oid, data, len, type);
+}
+
+/* Not having these would make the ODB fall back to slower paths */
+static int writer__read_header(
+	size_t *len_p, git_otype *type_p, git_odb_backend *_writer, const git_oid *oid)
+{
+	GIT_UNUSED(len_p);
+	GIT_UNUSED(type_p);
+	GIT_UNUSED(_writer);
+	GIT_UNUSED(oid);
+
+	return GIT_ENOTFOUND;
+}
+
+static int writer__foreach(git_odb_backend *_writer, git_odb_foreach_cb cb, void *payload)
+{
+	GIT_UNUSED(_writer);
+	GIT_UNUSED(cb);
+	GIT_UNUSED(payload);
+
+	return 0;
+}
+
+static void writer__free(git_odb_backend *_writer)
+{
+	git__free(_writer);
+}
+
+int git_odb__repospanner_writer(git_odb_backend **out, git_odb_backend *repospanner)
+{
+	struct repospanner_odb_writer *writer;
+
+	assert(out && repospanner);
+
+	writer = git__calloc(1, sizeof(struct repospanner_odb_writer));
+	GITERR_CHECK_ALLOC(writer);
+
+	writer->backend = (struct repospanner_odb *)repospanner;
+	writer->parent.version = GIT_ODB_BACKEND_VERSION;
+	writer->parent.write = &writer__write;
+	writer->parent.read_header = &writer__read_header;
+	writer->parent.foreach = &writer__foreach;
+	writer->parent.free = &writer__free;
+
+	*out = (git_odb_backend *)writer;
+	return 0;
 }
 
 static void impl__free(git_odb_backend *_backend)
 {
 	struct repospanner_odb *backend = (struct repospanner_odb *)_backend;
 
+#ifdef GIT_THREADS
+	/* finished prefetches may still queue up writes */
+	prefetch_shutdown(backend);
+#endif
+	writebehind_shutdown(backend);
+
+	header_cache_clear(backend);
+	git_oidmap_free(backend->headers);
+	git_mutex_free(&backend->headers_lock);
+
+	/* the repository flushes them while it still can build a pack */
+	if (backend->upload_pending.size)
+		git_trace(GIT_TRACE_WARN, "repoSpanner: %" PRIuZ " written objects are left for the next upload",
+			backend->upload_pending.size);
+
+	if (backend->pending_fd >= 0)
+		p_close(backend->pending_fd);
+
+	git_array_clear(backend->upload_pending);
+	git_buf_dispose(&backend->pending_path);
+	git_mutex_free(&backend->upload_lock);
+
+	trees_clear(backend);
+
+	repospanner_client_free(backend->client);
 	git__free(backend);
 }
 
@@ -177,36 +2981,214 @@ int git_odb_backend_repospanner(
 	struct repospanner_odb *db;
 	int error = GIT_OK;
 	repoSpanner_client *client;
-	size_t objects_dirlen;
-	char *new_objects_dir;
+	int64_t upload_batch, tree_depth;
+	int persist;
 
 	assert(out);
 
-	objects_dirlen = strlen(objects_dir);
-	new_objects_dir = git__calloc(objects_dirlen + 1, sizeof(char));
-	memcpy(new_objects_dir, objects_dir, objects_dirlen);
-	// Make sure to null-terminate it, since fileops won't behave otherwise
-	new_objects_dir[objects_dirlen] = '\0';
+	/* fetched objects go to the client's cache instead */
+	GIT_UNUSED(objects_dir);
 
 	if ((error = repospanner_get_client(&client, repository)) != 0)
 		return error;
 
 	db = git__calloc(1, sizeof(struct repospanner_odb));
-	GITERR_CHECK_ALLOC(db);
+	if (db == NULL) {
+		repospanner_client_free(client);
+		return -1;
+	}
 
 	db->client = client;
+	db->cache = repospanner_client_cache(client);
 	db->repo = repository;
 	db->fsdb = fsbackend;
-	db->objects_dir = new_objects_dir;
-	db->objects_dirlen = objects_dirlen;
+	db->pending_fd = -1;
+
+	if ((error = git_config_get_bool(&persist, repository->_config, "repospanner.persistobjects")) < 0) {
+		if (error != GIT_ENOTFOUND)
+			goto fail;
+		giterr_clear();
+		persist = 1;
+	}
+	db->persist = !!persist;
+
+	if ((error = repospanner_config_get_int64(&upload_batch, repository,
+		"repospanner.uploadbatch", REPOSPANNER_UPLOAD_BATCH)) < 0)
+		goto fail;
+
+	/* zero means only uploading when asked to */
+	db->upload_batch = upload_batch > 0 ? (size_t)upload_batch : 0;
+
+	if ((error = repospanner_config_get_int64(&tree_depth, repository,
+		"repospanner.treedepth", 0)) < 0)
+		goto fail;
+
+	/* a negative depth disables fetching subtrees ahead of time */
+	db->fetch_trees = db->persist && tree_depth >= 0;
+	db->tree_depth = tree_depth > UINT_MAX ? UINT_MAX : (unsigned int)tree_depth;
+
+	if (db->fetch_trees &&
+	    ((db->trees = git_oidmap_alloc()) == NULL || git_mutex_init(&db->trees_lock) < 0)) {
+		giterr_set_oom();
+		error = -1;
+		goto fail;
+	}
+
+	if ((error = git_vector_init(&db->writebehind, 0, NULL)) < 0)
+		goto fail;
+
+	if ((db->unwritten = git_oidmap_alloc()) == NULL) {
+		giterr_set_oom();
+		error = -1;
+		goto fail;
+	}
+
+	db->headers = git_oidmap_alloc();
+	if (db->headers == NULL || git_mutex_init(&db->headers_lock) < 0) {
+		giterr_set_oom();
+		error = -1;
+		goto fail;
+	}
+
+	if (git_mutex_init(&db->writer_lock) < 0 || git_mutex_init(&db->upload_lock) < 0) {
+		giterr_set(GITERR_OS, "failed to initialize repoSpanner write-behind lock");
+		error = -1;
+		goto fail;
+	}
+
+	if ((error = git_buf_joinpath(&db->pending_path,
+			git_repository_path(repository), REPOSPANNER_PENDING_FILE)) < 0 ||
+	    (error = pending_load(db)) < 0)
+		goto fail;
+
+#ifdef GIT_THREADS
+	if (git_cond_init(&db->writer_cond) < 0) {
+		giterr_set(GITERR_OS, "failed to initialize repoSpanner write-behind lock");
+		error = -1;
+		goto fail;
+	}
+
+	if ((error = prefetch_init(db)) < 0)
+		goto fail;
+#endif
 
 	db->parent.version = GIT_ODB_BACKEND_VERSION;
 	db->parent.read = &impl__read;
 	db->parent.write = &impl__write;
 	db->parent.read_header = &impl__read_header;
 	db->parent.exists = &impl__exists;
+	db->parent.freshen = &impl__freshen;
+	db->parent.read_many = &impl__read_many;
+	db->parent.read_prefix = &impl__read_prefix;
+	db->parent.exists_prefix = &impl__exists_prefix;
+	db->parent.foreach = &impl__foreach;
+	db->parent.readstream = &impl__readstream;
+	db->parent.prefetch_tree = &impl__prefetch_tree;
 	db->parent.free = &impl__free;
 
 	*out = (git_odb_backend *)db;
 	return 0;
+
+fail:
+#ifdef GIT_THREADS
+	git_oidmap_free(db->prefetched);
+#endif
+	git_oidmap_free(db->trees);
+	git_oidmap_free(db->headers);
+	git_oidmap_free(db->unwritten);
+	git_vector_free(&db->writebehind);
+	git_array_clear(db->upload_pending);
+	git_buf_dispose(&db->pending_path);
+	repospanner_client_free(client);
+	git__free(db);
+	return error;
+}
+
+int git_repospanner_upload_objects(git_repository *repo)
+{
+	repoSpanner_client *client;
+	git_odb_backend *backend;
+	git_odb *odb;
+	size_t i;
+	int error;
+
+	assert(repo);
+
+	/* only to tell whether this is a repoSpanner repository */
+	if ((error = repospanner_get_client(&client, repo)) < 0)
+		return error;
+
+	repospanner_client_free(client);
+
+	if ((error = git_repository_odb__weakptr(&odb, repo)) < 0)
+		return error;
+
+	for (i = 0; i < git_odb_num_backends(odb); i++) {
+		if ((error = git_odb_get_backend(&backend, odb, i)) < 0)
+			return error;
+
+		if (backend->free == &impl__free &&
+		    (error = upload_pending((struct repospanner_odb *)backend)) < 0)
+			return error;
+	}
+
+	return 0;
+}
+
+void git_odb__repospanner_flush(git_odb *odb)
+{
+	git_odb_backend *backend;
+	size_t i;
+
+	for (i = 0; i < git_odb_num_backends(odb); i++) {
+		if (git_odb_get_backend(&backend, odb, i) < 0 ||
+		    backend->free != &impl__free ||
+		    upload_pending((struct repospanner_odb *)backend) == 0)
+			continue;
+
+		git_trace(GIT_TRACE_ERROR, "repoSpanner: failed to upload written objects: %s",
+			giterr_last() ? giterr_last()->message : "unknown error");
+		giterr_clear();
+	}
+}
+
+int git_repospanner_fetch_tree(
+	git_repository *repo, const git_oid *tree,
+	const git_repospanner_fetch_tree_options *given_opts)
+{
+	git_repospanner_fetch_tree_options opts = GIT_REPOSPANNER_FETCH_TREE_OPTIONS_INIT;
+	repoSpanner_client *client;
+	git_odb_backend *backend;
+	git_odb *odb;
+	size_t i;
+	int error;
+
+	assert(repo && tree);
+
+	GITERR_CHECK_VERSION(given_opts, GIT_REPOSPANNER_FETCH_TREE_OPTIONS_VERSION,
+		"git_repospanner_fetch_tree_options");
+
+	if (given_opts)
+		memcpy(&opts, given_opts, sizeof(opts));
+
+	/* only to tell whether this is a repoSpanner repository */
+	if ((error = repospanner_get_client(&client, repo)) < 0)
+		return error;
+
+	repospanner_client_free(client);
+
+	if ((error = git_repository_odb__weakptr(&odb, repo)) < 0)
+		return error;
+
+	for (i = 0; i < git_odb_num_backends(odb); i++) {
+		if ((error = git_odb_get_backend(&backend, odb, i)) < 0)
+			return error;
+
+		if (backend->free == &impl__free)
+			return fetch_tree((struct repospanner_odb *)backend,
+				tree, opts.depth, !!opts.blobs, &opts.paths);
+	}
+
+	giterr_set(GITERR_ODB, "repository has no repoSpanner object database");
+	return GIT_ENOTFOUND;
 }
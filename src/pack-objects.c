@@ -11,6 +11,7 @@
 #include "delta.h"
 #include "iterator.h"
 #include "netops.h"
+#include "odb.h"
 #include "pack.h"
 #include "thread-utils.h"
 #include "tree.h"
@@ -1439,6 +1440,21 @@ static int cb_tree_walk(
 	if (git_tree_entry_type(entry) == GIT_OBJ_COMMIT)
 		return 0;
 
+	/*
+	 * The walk descends into this tree next, and we will need every
+	 * object in it; tell the odb so it may start fetching them.
+	 */
+	if (git_tree_entry_type(entry) == GIT_OBJ_TREE &&
+	    git_odb__has_prefetch(ctx->pb->odb)) {
+		git_tree *subtree;
+
+		if ((error = git_tree_lookup(&subtree, ctx->pb->repo, git_tree_entry_id(entry))) < 0)
+			return error;
+
+		git_tree__prefetch(subtree, true);
+		git_tree_free(subtree);
+	}
+
 	if (!(error = git_buf_sets(&ctx->buf, root)) &&
 		!(error = git_buf_puts(&ctx->buf, git_tree_entry_name(entry))))
 		error = git_packbuilder_insert(
@@ -1468,10 +1484,16 @@ int git_packbuilder_insert_tree(git_packbuilder *pb, const git_oid *oid)
 	git_tree *tree = NULL;
 	struct tree_walk_context context = { pb, GIT_BUF_INIT };
 
-	if (!(error = git_tree_lookup(&tree, pb->repo, oid)) &&
-	    !(error = git_packbuilder_insert(pb, oid, NULL)))
+	if ((error = git_tree_lookup(&tree, pb->repo, oid)) < 0)
+		goto done;
+
+	git_tree__prefetch(tree, true);
+
+	if (!(error = git_packbuilder_insert(pb, oid, NULL)))
 		error = git_tree_walk(tree, GIT_TREEWALK_PRE, cb_tree_walk, &context);
 
+done:
+
 	git_tree_free(tree);
 	git_buf_dispose(&context.buf);
 	return error;
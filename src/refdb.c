@@ -16,6 +16,7 @@
 #include "refs.h"
 #include "reflog.h"
 #include "posix.h"
+#include "refdb_repospanner.h"
 
 int git_refdb_new(git_refdb **out, git_repository *repo)
 {
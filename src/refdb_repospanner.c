@@ -17,7 +17,9 @@
 #include "iterator.h"
 #include "sortedcache.h"
 #include "signature.h"
+#include "varint.h"
 #include "repospanner.h"
+#include "refdb_repospanner.h"
 
 #include <git2/tag.h>
 #include <git2/object.h>
@@ -26,6 +28,7 @@
 #include <git2/sys/refdb_backend.h>
 #include <git2/sys/refs.h>
 #include <git2/sys/reflog.h>
+#include <git2/sys/repospanner.h>
 
 #ifdef __GNUC__
 #  define UNUSED(x) UNUSED_ ## x __attribute__((__unused__))
@@ -33,235 +36,1401 @@
 #  define UNUSED(x) UNUSED_ ## x
 #endif
 
-typedef struct refdb_rs_backend {
+/* Default number of milliseconds for which the refs are not checked again */
+#define REPOSPANNER_REFS_INTERVAL 1000
+
+/* Default number of seconds a subscription lets the server hold its requests */
+#define REPOSPANNER_REFS_WAIT 60
+
+/* Seconds on top of that before the server is considered unresponsive */
+#define REPOSPANNER_REFS_WAIT_SLACK 30
+
+/* Delta manipulation we ask for when revalidating the refs (RFC 3229) */
+#define REPOSPANNER_REFS_DELTA "repospanner-refs"
+
+/*
+ * Media type of the binary ref listing, which the server may answer
+ * with instead of lines.  After the signature, each ref is:
+ *
+ *   - its type: 'r' (real), 's' (symbolic) or 'd' (deleted)
+ *   - the number of bytes to strip off the end of the previous ref's
+ *     name as a varint, followed by the NUL-terminated rest of the
+ *     name, like in version 4 indexes
+ *   - the raw object id of real refs, or the NUL-terminated target
+ *     of symbolic ones
+ */
+#define REPOSPANNER_REFS_BINARY "application/x-repospanner-refs"
+#define REPOSPANNER_REFS_SIGNATURE "RSRL"
+#define REPOSPANNER_REFS_SIGNATURE_LEN 4
+
+struct refdb_rs_backend {
 	git_refdb_backend parent;
 
 	git_repository *repo;
 
 	repoSpanner_client *client;
 
+	/*
+	 * Refs we know about.  Until something needs all of them, only
+	 * the refs asked for, or the ones under a prefix that was
+	 * iterated, are fetched; each of these is checked again once it
+	 * is older than the refresh interval.  Refs the server does not
+	 * have are remembered as well, flagged PACKREF_IS_MISSING.
+	 */
+	git_sortedcache *refcache;
+	git_vector prefixes;
+	bool complete;
+
+	/*
+	 * State of the refs the complete cache reflects, as tagged by the
+	 * server.  Refreshes send it back, and the server answers with
+	 * either nothing (the refs did not change), the refs changed
+	 * since, or the complete listing.
+	 */
+	git_mutex refresh_lock;
+	git_buf etag;
+	double refreshed;
+	double refresh_interval;
+
+	/*
+	 * Where the complete refs are kept between processes, if at all,
+	 * and the state last loaded from or written there.  Refs loaded
+	 * from it are `unverified` until the server confirmed them, and
+	 * looked up in the `snapshot` until they have to be unpacked.
+	 */
+	git_buf snapshot_path;
+	git_buf snapshot_etag;
+	struct refs_snapshot *snapshot;
+	bool unverified;
+
+	/*
+	 * The subscription to changes of the refs, if any, set with the
+	 * refcache locked.  While its requests succeed, the refs are known
+	 * to be up to date without asking the server again; its thread
+	 * tells so through `watched`, read without the lock.
+	 */
+	git_repospanner_subscription *subscription;
+	git_atomic watched;
+};
+
+/*
+ * Ref updates to apply atomically.  Each one is sent as a
+ * "<name>\0<old>\0<new>\n" line, where the values are an object id, the
+ * zero id for a ref that does not exist, or "ref: <target>" for
+ * symbolic refs.  The update only applies if every ref still has its
+ * old value; an empty old value skips that check.
+ *
+ * The locks of a transaction share a batch, which stages their updates
+ * as they get unlocked and is sent once the last of them is released,
+ * unless one of them was given up.
+ */
+struct ref_batch {
+	git_buf body;
+	git_sortedcache *updates;
+	size_t locks;
+	bool aborted;
+};
+
+/*
+ * Changes of the refs are collected in `pending` by whichever thread
+ * finds or makes them, with the refcache locked, and reported from
+ * `delivering` by the subscription's thread.  It keeps asking the
+ * server for the changes since the state it knows, which the server
+ * can hold back until there are some.
+ */
+struct git_repospanner_subscription {
+	refdb_rs_backend *backend;
+	git_repospanner_ref_change_cb cb;
+	void *payload;
+
+	int wait;
+	double interval;
+	git_atomic stop;
+
+	git_sortedcache *pending;
+	git_sortedcache *delivering;
+
+#ifdef GIT_THREADS
+	git_thread thread;
+#endif
+};
+
+/* A lock on a ref, with the value it had when it was taken */
+struct ref_lock {
+	struct ref_batch *batch;
+	git_buf expected;
+	char name[GIT_FLEX_ARRAY];
+};
+
+/* A prefix all refs were fetched under */
+struct loaded_prefix {
+	double fetched;
+	char prefix[GIT_FLEX_ARRAY];
+};
+
+typedef struct refdb_rs_iter {
+	git_reference_iterator backend;
+
+	git_pool pool;
+	char *glob;
+
 	git_sortedcache *refcache;
-} refdb_rs_backend;
+	size_t current_pos;
+} refdb_rs_iter;
+
+static int parse_symb_ref(
+	git_sortedcache *target, const char *name, const char *val, size_t val_len)
+{
+	struct packref *ref;
+
+	if (git_sortedcache_upsert((void **)&ref, target, name) < 0) {
+		giterr_set(GITERR_ODB, "Unable to insert into target refcache");
+		return GIT_ERROR;
+	}
+
+	/*
+	 * The target may come later in the listing, or not be part of
+	 * a partial one at all, so it is kept by name.
+	 */
+	if ((ref->targetref = git_pool_strndup(&target->pool, val, val_len)) == NULL)
+		return GIT_ERROR;
+	ref->flags = PACKREF_IS_SYMBOLIC;
+
+	// TODO: Get other flags and peeled
+
+	return GIT_OK;
+}
+
+static int parse_deleted_ref(git_sortedcache *target, const char *name)
+{
+	struct packref *ref;
+
+	if (git_sortedcache_upsert((void **)&ref, target, name) < 0) {
+		giterr_set(GITERR_ODB, "Unable to insert into target refcache");
+		return GIT_ERROR;
+	}
+
+	ref->flags = PACKREF_IS_DELETED;
+	return GIT_OK;
+}
+
+static int parse_real_ref(git_sortedcache *target, const char *name, const git_oid *oid)
+{
+	struct packref *ref;
+
+	if (git_sortedcache_upsert((void **)&ref, target, name) < 0) {
+		giterr_set(GITERR_ODB, "Unable to insert into target refcache");
+		return GIT_ERROR;
+	}
+
+	git_oid_cpy(&ref->oid, oid);
+	return GIT_OK;
+}
+
+/* Parse one "<type>\0<name>\0<value>" line, without its newline */
+static int parse_ref(git_sortedcache *target, const char *line, size_t len)
+{
+	const char *end = line + len, *name, *val;
+	size_t type_len, val_len;
+	git_oid oid;
+
+	if ((name = memchr(line, '\0', len)) == NULL ||
+	    (val = memchr(name + 1, '\0', end - name - 1)) == NULL) {
+		giterr_set(GITERR_ODB, "invalid ref parsed");
+		return GIT_ERROR;
+	}
+
+	type_len = name++ - line;
+	val_len = end - ++val;
+
+	if (type_len == 4 && !memcmp(line, "symb", 4))
+		return parse_symb_ref(target, name, val, val_len);
+
+	if (type_len == 4 && !memcmp(line, "dele", 4))
+		return parse_deleted_ref(target, name);
+
+	if (type_len != 4 || memcmp(line, "real", 4)) {
+		giterr_set(GITERR_ODB, "ref has invalid type '%.*s'", (int)type_len, line);
+		return GIT_ERROR;
+	}
+
+	if (val_len != GIT_OID_HEXSZ) {
+		giterr_set(GITERR_ODB, "ref of type real has invalid val '%.*s'", (int)val_len, val);
+		return GIT_ERROR;
+	}
+
+	if (git_oid_fromstrn(&oid, val, GIT_OID_HEXSZ) != GIT_OK) {
+		giterr_set(GITERR_ODB, "Could not parse oid");
+		return GIT_ERROR;
+	}
+
+	return parse_real_ref(target, name, &oid);
+}
+
+/*
+ * Parse all complete lines of `data`, pointing `out` past the last
+ * one.  Each byte is looked at once, by memchr.
+ */
+static int parse_lines(const char **out, git_sortedcache *target, const char *data, size_t len)
+{
+	const char *end = data + len, *eol;
+	int error;
+
+	while ((eol = memchr(data, '\n', end - data)) != NULL) {
+		if ((error = parse_ref(target, data, eol - data)) != GIT_OK)
+			return error;
+
+		data = eol + 1;
+	}
+
+	*out = data;
+	return GIT_OK;
+}
+
+static int binary_ref_error(void)
+{
+	giterr_set(GITERR_ODB, "invalid ref in binary repoSpanner refs listing");
+	return GIT_ERROR;
+}
+
+/*
+ * Parse one ref of a binary listing, pointing `out` past it, or
+ * return GIT_EBUFS without parsing anything if it is incomplete.
+ */
+static int parse_binary_ref(
+	const char **out, struct refretrieve *data, const char *buf, size_t len)
+{
+	const char *end = buf + len, *p = buf, *suffix, *val = NULL;
+	size_t varint_len, val_len = 0;
+	uintmax_t strip;
+	git_oid oid;
+	char type;
+
+	if (len == 0)
+		return GIT_EBUFS;
+
+	type = *p++;
+
+	/* a varint ends with the first byte without the high bit */
+	for (suffix = p; suffix < end && (*suffix & 0x80); suffix++)
+		;
+
+	if (suffix == end)
+		return GIT_EBUFS;
+
+	strip = git_decode_varint((const unsigned char *)p, &varint_len);
+	if (!varint_len || strip > git_buf_len(&data->name))
+		return binary_ref_error();
+
+	suffix = p + varint_len;
+	if ((p = memchr(suffix, '\0', end - suffix)) == NULL)
+		return GIT_EBUFS;
+	p++;
+
+	if (type == 'r') {
+		if (end - p < GIT_OID_RAWSZ)
+			return GIT_EBUFS;
+
+		git_oid_fromraw(&oid, (const unsigned char *)p);
+		p += GIT_OID_RAWSZ;
+	} else if (type == 's') {
+		val = p;
+		if ((p = memchr(val, '\0', end - val)) == NULL)
+			return GIT_EBUFS;
+
+		val_len = p++ - val;
+	} else if (type != 'd') {
+		return binary_ref_error();
+	}
+
+	git_buf_shorten(&data->name, (size_t)strip);
+	if (git_buf_puts(&data->name, suffix) < 0)
+		return -1;
+
+	*out = p;
+
+	if (type == 'r')
+		return parse_real_ref(data->target, data->name.ptr, &oid);
+	else if (type == 's')
+		return parse_symb_ref(data->target, data->name.ptr, val, val_len);
+	else
+		return parse_deleted_ref(data->target, data->name.ptr);
+}
+
+/*
+ * Parse all complete refs of a binary listing, pointing `out` past the
+ * last one.  Nothing is copied but the names, and ids are taken as is.
+ */
+static int parse_binary(const char **out, struct refretrieve *data, const char *buf, size_t len)
+{
+	const char *end = buf + len;
+	int error;
+
+	if (!data->signature) {
+		if (len < REPOSPANNER_REFS_SIGNATURE_LEN) {
+			*out = buf;
+			return GIT_OK;
+		}
+
+		if (memcmp(buf, REPOSPANNER_REFS_SIGNATURE, REPOSPANNER_REFS_SIGNATURE_LEN)) {
+			giterr_set(GITERR_ODB, "invalid binary repoSpanner refs listing");
+			return GIT_ERROR;
+		}
+
+		buf += REPOSPANNER_REFS_SIGNATURE_LEN;
+		data->signature = true;
+	}
+
+	while ((error = parse_binary_ref(&buf, data, buf, end - buf)) == GIT_OK)
+		;
+
+	*out = buf;
+	return error == GIT_EBUFS ? GIT_OK : error;
+}
+
+static size_t ref_write_binary(struct refretrieve *data, const char *ptr, size_t len)
+{
+	const char *rest;
+
+	/* a ref split between chunks is parsed along with the rest of the chunk */
+	if (git_buf_len(&data->buffer)) {
+		if (git_buf_put(&data->buffer, ptr, len) != GIT_OK ||
+		    parse_binary(&rest, data, data->buffer.ptr, data->buffer.size) != GIT_OK)
+			return 0;
+
+		git_buf_consume(&data->buffer, rest);
+		return len;
+	}
+
+	if (parse_binary(&rest, data, ptr, len) != GIT_OK ||
+	    git_buf_put(&data->buffer, rest, ptr + len - rest) != GIT_OK)
+		return 0;
+
+	return len;
+}
+
+int git_refdb_repospanner__write_finish(struct refretrieve *data)
+{
+	if (git_buf_len(&data->buffer) == 0 && (!data->binary || data->signature))
+		return GIT_OK;
+
+	giterr_set(GITERR_ODB, "truncated repoSpanner refs listing");
+	return GIT_ERROR;
+}
+
+size_t git_refdb_repospanner__write_cb(
+	char *ptr, size_t UNUSED(size), size_t nmemb, void *userdata)
+{
+	struct refretrieve *data = (struct refretrieve *)userdata;
+	const char *end = ptr + nmemb, *rest = ptr, *eol;
+
+	if (data->binary)
+		return ref_write_binary(data, ptr, nmemb);
+
+	/*
+	 * Lines are parsed straight from curl's buffer; only a partial
+	 * line at the end of a chunk is kept, to be completed by the next.
+	 */
+	if (git_buf_len(&data->buffer)) {
+		if ((eol = memchr(ptr, '\n', nmemb)) == NULL)
+			return git_buf_put(&data->buffer, ptr, nmemb) == GIT_OK ? nmemb : 0;
+
+		rest = eol + 1;
+
+		if (git_buf_put(&data->buffer, ptr, rest - ptr) != GIT_OK ||
+		    parse_ref(data->target, data->buffer.ptr, data->buffer.size - 1) != GIT_OK)
+			return 0;
+
+		git_buf_clear(&data->buffer);
+	}
+
+	if (parse_lines(&rest, data->target, rest, end - rest) != GIT_OK ||
+	    git_buf_put(&data->buffer, rest, end - rest) != GIT_OK)  // Sane would be to use "size", but not for curl
+		return 0;
+
+	return nmemb;
+}
+
+static int packref_cmp(const void *a_, const void *b_)
+{
+	const struct packref *a = a_, *b = b_;
+	return strcmp(a->name, b->name);
+}
+
+
+size_t git_refdb_repospanner__header_cb(
+	char *ptr, size_t UNUSED(size), size_t nitems, void *userdata)
+{
+	struct refretrieve *data = (struct refretrieve *)userdata;
+	const char *value;
+	size_t len = nitems;
+
+	while (len && git__isspace(ptr[len - 1]))
+		len--;
+
+	if (len > 5 && !git__strncasecmp(ptr, "ETag:", 5)) {
+		for (value = ptr + 5; value < ptr + len && git__isspace(*value); value++)
+			;
+
+		git_buf_clear(&data->etag);
+		if (git_buf_put(&data->etag, value, len - (value - ptr)) < 0)
+			return 0;
+	} else if (len > 3 && !git__strncasecmp(ptr, "IM:", 3)) {
+		data->delta = true;
+	} else if (len > 13 && !git__strncasecmp(ptr, "Content-Type:", 13)) {
+		for (value = ptr + 13; value < ptr + len && git__isspace(*value); value++)
+			;
+
+		data->binary = !git__prefixncmp_icase(value, len - (value - ptr), REPOSPANNER_REFS_BINARY);
+	}
+
+	return nitems;
+}
+
+/*
+ * Remember a change for the subscription, if any, to report.  Call
+ * with the refcache locked.
+ */
+static int subscription_record(
+	git_repospanner_subscription *subscription, const struct packref *ref, bool deleted)
+{
+	struct packref *change;
+
+	if (!subscription)
+		return 0;
+
+	if (git_sortedcache_upsert((void **)&change, subscription->pending, ref->name) < 0)
+		return -1;
+
+	git_oid_cpy(&change->oid, &ref->oid);
+	change->flags = deleted ? PACKREF_IS_DELETED : ref->flags;
+	change->targetref = NULL;
+
+	if (!deleted && ref->targetref &&
+	    (change->targetref = git_pool_strdup(&subscription->pending->pool, ref->targetref)) == NULL)
+		return -1;
+
+	return 0;
+}
+
+static int packref_update(
+	bool *changed, git_sortedcache *refcache, git_repospanner_subscription *subscription,
+	const struct packref *update, double now)
+{
+	struct packref *ref;
+	size_t pos;
+	int error;
+
+	if (update->flags & PACKREF_IS_DELETED) {
+		if (git_sortedcache_lookup_index(&pos, refcache, update->name) < 0)
+			return 0;
+
+		*changed = true;
+		if ((error = subscription_record(subscription, update, true)) < 0)
+			return error;
+
+		return git_sortedcache_remove(refcache, pos);
+	}
+
+	if ((ref = git_sortedcache_lookup(refcache, update->name)) != NULL &&
+	    ref->flags == update->flags &&
+	    git_oid_equal(&ref->oid, &update->oid) &&
+	    git_oid_equal(&ref->peel, &update->peel) &&
+	    (!ref->targetref || !strcmp(ref->targetref, update->targetref))) {
+		ref->fetched = now;
+		return 0;
+	}
+
+	if ((error = git_sortedcache_upsert((void **)&ref, refcache, update->name)) < 0)
+		return error;
+
+	git_oid_cpy(&ref->oid, &update->oid);
+	git_oid_cpy(&ref->peel, &update->peel);
+	ref->flags = update->flags;
+	ref->targetref = NULL;
+	ref->fetched = now;
+
+	/* the old target stays in the pool, for iterators that still point to it */
+	if (update->targetref &&
+	    (ref->targetref = git_pool_strdup(&refcache->pool, update->targetref)) == NULL)
+		return -1;
+
+	*changed = true;
+	return subscription_record(subscription, update, false);
+}
+
+/*
+ * Bring the refcache in line with what the server sent, in place so
+ * that readers never see it half-empty.  The listing covers all refs
+ * starting with `scope`, so cached ones it does not mention are gone.
+ * Without a scope, as for deltas and single refs, only the refs listed
+ * are touched.  Changes are recorded for the subscription, if any.
+ */
+static int refcache_apply(
+	bool *changed, refdb_rs_backend *backend,
+	git_sortedcache *received, const char *scope, double now)
+{
+	git_sortedcache *refcache = backend->refcache;
+	struct packref *ref;
+	size_t i, scope_len = scope ? strlen(scope) : 0;
+	int error;
+
+	if ((error = git_sortedcache_wlock(refcache)) < 0)
+		return error;
+
+	if (scope) {
+		for (i = git_sortedcache_entrycount(refcache); i > 0; i--) {
+			ref = git_sortedcache_entry(refcache, i - 1);
+
+			if (strncmp(ref->name, scope, scope_len) ||
+			    git_sortedcache_lookup(received, ref->name) != NULL)
+				continue;
+
+			if ((error = subscription_record(backend->subscription, ref, true)) < 0 ||
+			    (error = git_sortedcache_remove(refcache, i - 1)) < 0)
+				goto done;
+			*changed = true;
+		}
+	}
+
+	for (i = 0; i < git_sortedcache_entrycount(received); i++) {
+		ref = git_sortedcache_entry(received, i);
+
+		if ((error = packref_update(changed, refcache, backend->subscription, ref, now)) < 0)
+			goto done;
+	}
+
+done:
+	git_sortedcache_wunlock(refcache);
+	return error;
+}
+
+/* Remember that the server had no ref `name` */
+static int refcache_mark_missing(
+	bool *changed, git_sortedcache *refcache, const char *name, double now)
+{
+	struct packref *ref;
+	int error;
+
+	if ((error = git_sortedcache_wlock(refcache)) < 0)
+		return error;
+
+	/* a ref we did not know about before staying absent is no change */
+	if ((ref = git_sortedcache_lookup(refcache, name)) != NULL &&
+	    ref->flags != PACKREF_IS_MISSING)
+		*changed = true;
+
+	if ((error = git_sortedcache_upsert((void **)&ref, refcache, name)) == 0) {
+		ref->flags = PACKREF_IS_MISSING;
+		ref->fetched = now;
+	}
+
+	git_sortedcache_wunlock(refcache);
+	return error;
+}
+
+static int refresh_lock(refdb_rs_backend *backend)
+{
+	if (git_mutex_lock(&backend->refresh_lock) < 0) {
+		giterr_set(GITERR_OS, "failed to lock repoSpanner refs");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Snapshot of the complete refs, kept in the gitdir so that the next
+ * process can start from it and only has to revalidate it.  All
+ * numbers are in network byte order:
+ *
+ *   the header, followed by the ETag of the refs
+ *   one record per ref, sorted by name
+ *   the NUL-terminated names and targets the records point into
+ *   the SHA-1 of all of the above
+ *
+ * It stays mapped, and single refs are looked up in place, until the
+ * refs are needed as a whole or change; only then are they copied to
+ * the refcache.
+ */
+#define REFS_SNAPSHOT_FILE "repospanner-refs"
+#define REFS_SNAPSHOT_SIGNATURE "RSRF"
+#define REFS_SNAPSHOT_VERSION 1
+#define REFS_SNAPSHOT_NONE 0xffffffff
+
+struct refs_snapshot_header {
+	char signature[4];
+	uint32_t version;
+	uint32_t count;
+	uint32_t etag_len;
+};
+
+struct refs_snapshot_record {
+	uint32_t name;
+	uint32_t target;
+	uint32_t flags;
+	unsigned char oid[GIT_OID_RAWSZ];
+	unsigned char peel[GIT_OID_RAWSZ];
+};
+
+struct refs_snapshot {
+	git_map map;
+	const char *etag;
+	size_t etag_len;
+	const unsigned char *records;
+	size_t count;
+	const char *strings;
+	size_t strings_len;
+};
+
+/*
+ * Write the complete refs to the snapshot; call with the refresh lock
+ * held.  The records are put together with the refcache locked, and
+ * written after unlocking it.
+ */
+static int refs_snapshot_write(refdb_rs_backend *backend)
+{
+	git_filebuf file = GIT_FILEBUF_INIT;
+	struct refs_snapshot_header header;
+	struct refs_snapshot_record record;
+	struct packref *ref;
+	git_buf records = GIT_BUF_INIT, strings = GIT_BUF_INIT;
+	git_oid hash;
+	size_t i, count = 0;
+	int error;
+
+	if ((error = git_sortedcache_rlock(backend->refcache)) < 0)
+		return error;
+
+	for (i = 0; i < git_sortedcache_entrycount(backend->refcache); i++) {
+		ref = git_sortedcache_entry(backend->refcache, i);
+
+		if (ref->flags & PACKREF_IS_MISSING)
+			continue;
+
+		memset(&record, 0, sizeof(record));
+		record.name = htonl((uint32_t)strings.size);
+		git_buf_put(&strings, ref->name, strlen(ref->name) + 1);
+
+		record.target = htonl(ref->targetref ? (uint32_t)strings.size : REFS_SNAPSHOT_NONE);
+		if (ref->targetref)
+			git_buf_put(&strings, ref->targetref, strlen(ref->targetref) + 1);
+
+		record.flags = htonl((uint32_t)ref->flags);
+		memcpy(record.oid, ref->oid.id, GIT_OID_RAWSZ);
+		memcpy(record.peel, ref->peel.id, GIT_OID_RAWSZ);
+
+		git_buf_put(&records, (const char *)&record, sizeof(record));
+		count++;
+	}
+
+	git_sortedcache_runlock(backend->refcache);
+
+	if (git_buf_oom(&records) || git_buf_oom(&strings)) {
+		error = -1;
+		goto done;
+	}
+
+	memcpy(header.signature, REFS_SNAPSHOT_SIGNATURE, sizeof(header.signature));
+	header.version = htonl(REFS_SNAPSHOT_VERSION);
+	header.count = htonl((uint32_t)count);
+	header.etag_len = htonl((uint32_t)git_buf_len(&backend->etag));
+
+	if ((error = git_filebuf_open(&file, git_buf_cstr(&backend->snapshot_path),
+			GIT_FILEBUF_HASH_CONTENTS, GIT_REFS_FILE_MODE)) < 0 ||
+	    (error = git_filebuf_write(&file, &header, sizeof(header))) < 0 ||
+	    (error = git_filebuf_write(&file, backend->etag.ptr, backend->etag.size)) < 0 ||
+	    (error = git_filebuf_write(&file, records.ptr, records.size)) < 0 ||
+	    (error = git_filebuf_write(&file, strings.ptr, strings.size)) < 0)
+		goto done;
+
+	git_filebuf_hash(&hash, &file);
+
+	if ((error = git_filebuf_write(&file, hash.id, GIT_OID_RAWSZ)) < 0 ||
+	    (error = git_filebuf_commit(&file)) < 0)
+		goto done;
+
+	error = git_buf_set(&backend->snapshot_etag, backend->etag.ptr, backend->etag.size);
+
+done:
+	git_filebuf_cleanup(&file);
+	git_buf_dispose(&records);
+	git_buf_dispose(&strings);
+	return error;
+}
+
+static const char *refs_snapshot_string(const struct refs_snapshot *snapshot, uint32_t offset)
+{
+	if (offset >= snapshot->strings_len ||
+	    memchr(snapshot->strings + offset, '\0', snapshot->strings_len - offset) == NULL)
+		return NULL;
+
+	return snapshot->strings + offset;
+}
+
+/*
+ * Read the record at `pos` into `out`, without its name, which is
+ * returned instead.  Returns NULL if the record is not valid.
+ */
+static const char *refs_snapshot_entry(
+	struct packref *out, const struct refs_snapshot *snapshot, size_t pos)
+{
+	struct refs_snapshot_record record;
+	const char *name;
+
+	memcpy(&record, snapshot->records + pos * sizeof(record), sizeof(record));
+
+	if ((name = refs_snapshot_string(snapshot, ntohl(record.name))) == NULL)
+		return NULL;
+
+	memset(out, 0, offsetof(struct packref, name));
+	git_oid_fromraw(&out->oid, record.oid);
+	git_oid_fromraw(&out->peel, record.peel);
+	out->flags = (char)(ntohl(record.flags) & PACKREF_IS_SYMBOLIC);
+
+	if (ntohl(record.target) != REFS_SNAPSHOT_NONE &&
+	    (out->targetref = refs_snapshot_string(snapshot, ntohl(record.target))) == NULL)
+		return NULL;
+
+	return name;
+}
+
+static void refs_snapshot_free(struct refs_snapshot *snapshot)
+{
+	if (!snapshot)
+		return;
+
+	git_futils_mmap_free(&snapshot->map);
+	git__free(snapshot);
+}
+
+/*
+ * Map the snapshot and check its structure, so that its refs can be
+ * looked up as they are.  Hashing all of it would cost more than the
+ * lookups a short-lived process makes, so the checksum is only
+ * verified once the refs get unpacked.  Returns GIT_ENOTFOUND if there
+ * is no snapshot.
+ */
+static int refs_snapshot_open(struct refs_snapshot **out, const char *path)
+{
+	struct refs_snapshot *snapshot;
+	struct refs_snapshot_header header;
+	struct refs_snapshot_record record;
+	struct packref entry;
+	const unsigned char *data;
+	const char *name, *last = NULL;
+	size_t len, i;
+	int error;
+
+	snapshot = git__calloc(1, sizeof(struct refs_snapshot));
+	GITERR_CHECK_ALLOC(snapshot);
+
+	if ((error = git_futils_mmap_ro_file(&snapshot->map, path)) < 0) {
+		git__free(snapshot);
+		return error;
+	}
+
+	data = snapshot->map.data;
+	len = snapshot->map.len;
+
+	if (len < sizeof(header) + GIT_OID_RAWSZ)
+		goto corrupt;
+
+	memcpy(&header, data, sizeof(header));
+	len -= GIT_OID_RAWSZ;
+
+	snapshot->etag = (const char *)data + sizeof(header);
+	snapshot->etag_len = ntohl(header.etag_len);
+	snapshot->count = ntohl(header.count);
+
+	if (memcmp(header.signature, REFS_SNAPSHOT_SIGNATURE, sizeof(header.signature)) ||
+	    ntohl(header.version) != REFS_SNAPSHOT_VERSION ||
+	    snapshot->etag_len == 0 ||
+	    snapshot->etag_len > len - sizeof(header) ||
+	    snapshot->count > (len - sizeof(header) - snapshot->etag_len) / sizeof(record))
+		goto corrupt;
+
+	snapshot->records = data + sizeof(header) + snapshot->etag_len;
+	snapshot->strings = (const char *)snapshot->records + snapshot->count * sizeof(record);
+	snapshot->strings_len = len - (snapshot->strings - (const char *)data);
+
+	for (i = 0; i < snapshot->count; i++) {
+		if ((name = refs_snapshot_entry(&entry, snapshot, i)) == NULL ||
+		    (last && strcmp(last, name) >= 0))
+			goto corrupt;
+
+		last = name;
+	}
+
+	*out = snapshot;
+	return 0;
+
+corrupt:
+	giterr_set(GITERR_REFERENCE, "corrupted repoSpanner refs snapshot '%s'", path);
+	refs_snapshot_free(snapshot);
+	return -1;
+}
+
+/* Look `name` up in the snapshot, reading it into `out` */
+static bool refs_snapshot_lookup(
+	struct packref *out, const struct refs_snapshot *snapshot, const char *name)
+{
+	size_t lo = 0, hi = snapshot->count, mid;
+	int cmp;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if ((cmp = strcmp(name, refs_snapshot_entry(out, snapshot, mid))) == 0)
+			return true;
+
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return false;
+}
+
+/*
+ * The ref `name` from the refcache, or from the snapshot if it is
+ * still mapped, in which case it is read into `scratch`.  Call with
+ * the refcache locked.
+ */
+static struct packref *refcache_lookup(
+	refdb_rs_backend *backend, const char *name, struct packref *scratch)
+{
+	if (backend->snapshot)
+		return refs_snapshot_lookup(scratch, backend->snapshot, name) ? scratch : NULL;
+
+	return git_sortedcache_lookup(backend->refcache, name);
+}
+
+/*
+ * Copy the refs of the snapshot to the refcache, and unmap it.  If it
+ * turns out to be corrupted, everything it held is forgotten, so that
+ * the next refresh fetches the complete listing.  Call with the refresh
+ * lock held.
+ */
+static int refs_snapshot_unpack_locked(refdb_rs_backend *backend)
+{
+	struct refs_snapshot *snapshot = backend->snapshot;
+	struct packref entry, *ref;
+	const char *name;
+	size_t i, len;
+	git_oid hash;
+	int error;
+
+	if (!snapshot)
+		return 0;
+
+	len = snapshot->map.len - GIT_OID_RAWSZ;
+
+	if ((error = git_hash_buf(&hash, snapshot->map.data, len)) < 0)
+		return error;
+
+	if ((error = git_sortedcache_wlock(backend->refcache)) < 0)
+		return error;
+
+	if (memcmp(hash.id, (const char *)snapshot->map.data + len, GIT_OID_RAWSZ)) {
+		giterr_set(GITERR_REFERENCE, "corrupted repoSpanner refs snapshot '%s'",
+			git_buf_cstr(&backend->snapshot_path));
+		p_unlink(git_buf_cstr(&backend->snapshot_path));
+		error = -1;
+		goto done;
+	}
+
+	for (i = 0; i < snapshot->count; i++) {
+		name = refs_snapshot_entry(&entry, snapshot, i);
+
+		if ((error = git_sortedcache_upsert((void **)&ref, backend->refcache, name)) < 0)
+			goto done;
+
+		memcpy(ref, &entry, offsetof(struct packref, name));
+
+		if (entry.targetref &&
+		    (ref->targetref = git_pool_strdup(&backend->refcache->pool, entry.targetref)) == NULL) {
+			error = -1;
+			goto done;
+		}
+	}
+
+done:
+	if (error < 0) {
+		git_sortedcache_clear(backend->refcache, false);
+		git_buf_clear(&backend->etag);
+		git_buf_clear(&backend->snapshot_etag);
+		backend->complete = false;
+		backend->unverified = false;
+	}
+
+	backend->snapshot = NULL;
+	git_sortedcache_wunlock(backend->refcache);
+
+	refs_snapshot_free(snapshot);
+	return error;
+}
+
+static int refs_snapshot_unpack(refdb_rs_backend *backend)
+{
+	int error;
+
+	if (!backend->snapshot)
+		return 0;
+
+	if ((error = refresh_lock(backend)) < 0)
+		return error;
+
+	error = refs_snapshot_unpack_locked(backend);
+
+	git_mutex_unlock(&backend->refresh_lock);
+	return error;
+}
+
+/*
+ * Start from the refs the last process left behind.  They still have
+ * to be revalidated, unless the snapshot was confirmed more recently
+ * than the refresh interval.  A snapshot that cannot be used is
+ * ignored, the refs are then fetched as usual.
+ */
+static void refs_snapshot_load(refdb_rs_backend *backend)
+{
+	struct refs_snapshot *snapshot;
+	struct stat st;
+	time_t age;
+
+	if (p_stat(git_buf_cstr(&backend->snapshot_path), &st) < 0 ||
+	    refs_snapshot_open(&snapshot, git_buf_cstr(&backend->snapshot_path)) < 0) {
+		giterr_clear();
+		return;
+	}
+
+	if (git_buf_set(&backend->etag, snapshot->etag, snapshot->etag_len) < 0 ||
+	    git_buf_set(&backend->snapshot_etag, snapshot->etag, snapshot->etag_len) < 0) {
+		refs_snapshot_free(snapshot);
+		git_buf_clear(&backend->etag);
+		giterr_clear();
+		return;
+	}
+
+	backend->snapshot = snapshot;
+	backend->complete = true;
+	backend->unverified = true;
+
+	/* mtimes only have whole seconds, err on the side of checking */
+	age = time(NULL) - st.st_mtime;
+	if (backend->refresh_interval >= 0 && age >= 0 &&
+	    age + 1 < backend->refresh_interval) {
+		backend->refreshed = git__timer() - age - 1;
+		backend->unverified = false;
+	}
+}
+
+/*
+ * Bring the snapshot up to date after the refs were revalidated, or
+ * only mark it as confirmed if the server still has the state it
+ * holds.  Failing to do either only costs the next process a full
+ * listing.
+ */
+static void refs_snapshot_update(refdb_rs_backend *backend)
+{
+	int error;
+
+	if (!git_buf_len(&backend->snapshot_path) || !git_buf_len(&backend->etag))
+		return;
+
+	if (backend->snapshot ||
+	    !git__strcmp(git_buf_cstr(&backend->etag), git_buf_cstr(&backend->snapshot_etag)))
+		error = git_futils_touch(git_buf_cstr(&backend->snapshot_path), NULL);
+	else
+		error = refs_snapshot_write(backend);
+
+	if (error < 0)
+		giterr_clear();
+}
+
+static int encode_query(git_buf *buf, const char *param, const char *value)
+{
+	static const char *hex = "0123456789ABCDEF";
+	const char *c;
+
+	git_buf_printf(buf, "?%s=", param);
+
+	for (c = value; *c; c++) {
+		if (git__isalpha(*c) || git__isdigit(*c) || strchr("-._~/", *c))
+			git_buf_putc(buf, *c);
+		else {
+			git_buf_putc(buf, '%');
+			git_buf_putc(buf, hex[(unsigned char)*c >> 4]);
+			git_buf_putc(buf, hex[*c & 0xf]);
+		}
+	}
+
+	return git_buf_oom(buf) ? -1 : 0;
+}
+
+int git_refdb_repospanner__retrieve_init(struct refretrieve *retriever)
+{
+	memset(retriever, 0, sizeof(*retriever));
+	git_buf_init(&retriever->buffer, 0);
+	git_buf_init(&retriever->etag, 0);
+	git_buf_init(&retriever->name, 0);
+
+	return git_sortedcache_new(
+		&retriever->target, offsetof(struct packref, name), NULL, NULL,
+		packref_cmp, NULL);
+}
+
+void git_refdb_repospanner__retrieve_dispose(struct refretrieve *retriever)
+{
+	git_buf_dispose(&retriever->buffer);
+	git_buf_dispose(&retriever->etag);
+	git_buf_dispose(&retriever->name);
+	git_sortedcache_free(retriever->target);
+}
+
+#ifdef GIT_THREADS
+static int subscription_progress(
+	void *payload, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
+{
+	git_repospanner_subscription *subscription = payload;
+
+	GIT_UNUSED(dltotal);
+	GIT_UNUSED(dlnow);
+	GIT_UNUSED(ultotal);
+	GIT_UNUSED(ulnow);
+
+	return git_atomic_get(&subscription->stop);
+}
+#endif
+
+/*
+ * Request refs from the server into `retriever`: the complete listing
+ * without a `param`, otherwise the single ref (`name`) or the refs
+ * under a prefix (`prefix`) given by `value`.  A complete listing is
+ * only sent if the refs changed since the state tagged `etag`, and
+ * for a `subscription` the server may hold the request until they do.
+ */
+static int refs_request(
+	struct refretrieve *retriever, long *response_code, refdb_rs_backend *backend,
+	const char *param, const char *value, const char *etag,
+	git_repospanner_subscription *subscription)
+{
+	struct curl_slist *headers = NULL;
+	git_buf path = GIT_BUF_INIT, header = GIT_BUF_INIT, wait = GIT_BUF_INIT;
+	bool revalidate = etag && *etag;
+	CURL *req = NULL;
+	int error;
+
+	if ((error = git_buf_puts(&path, "simple/refs")) < 0 ||
+	    (param && (error = encode_query(&path, param, value)) < 0))
+		goto done;
+
+	if ((error = repospanner_prepare_request(&req, backend->client, git_buf_cstr(&path))) != GIT_OK)
+		goto done;
+
+	if ((revalidate &&
+	     (error = git_buf_printf(&header, "If-None-Match: %s", etag)) < 0) ||
+	    (subscription &&
+	     (error = git_buf_printf(&wait, "Prefer: wait=%d", subscription->wait)) < 0))
+		goto done;
+
+	/* servers which do not know the binary listing send lines */
+	if ((headers = curl_slist_append(headers, "Accept: " REPOSPANNER_REFS_BINARY ", text/plain;q=0.5")) == NULL ||
+	    (revalidate &&
+	     ((headers = curl_slist_append(headers, git_buf_cstr(&header))) == NULL ||
+	      (headers = curl_slist_append(headers, "A-IM: " REPOSPANNER_REFS_DELTA)) == NULL)) ||
+	    (subscription &&
+	     (headers = curl_slist_append(headers, git_buf_cstr(&wait))) == NULL)) {
+		giterr_set_oom();
+		error = -1;
+		goto done;
+	}
 
-typedef struct refdb_rs_iter {
-	git_reference_iterator backend;
+	curl_easy_setopt(req, CURLOPT_HTTPHEADER, headers);
+	repospanner_accept_compression(backend->client, req);
 
-	git_pool pool;
-	char *glob;
+	curl_easy_setopt(req, CURLOPT_WRITEFUNCTION, git_refdb_repospanner__write_cb);
+	curl_easy_setopt(req, CURLOPT_WRITEDATA, retriever);
+	curl_easy_setopt(req, CURLOPT_HEADERFUNCTION, git_refdb_repospanner__header_cb);
+	curl_easy_setopt(req, CURLOPT_HEADERDATA, retriever);
+
+#ifdef GIT_THREADS
+	/* give up on requests the server holds too long, or once unsubscribed */
+	if (subscription) {
+		curl_easy_setopt(req, CURLOPT_TIMEOUT, (long)(subscription->wait + REPOSPANNER_REFS_WAIT_SLACK));
+		curl_easy_setopt(req, CURLOPT_NOPROGRESS, 0L);
+		curl_easy_setopt(req, CURLOPT_XFERINFOFUNCTION, subscription_progress);
+		curl_easy_setopt(req, CURLOPT_XFERINFODATA, subscription);
+	}
+#endif
 
-	git_sortedcache *refcache;
-	size_t current_pos;
-} refdb_rs_iter;
+	if ((error = (repospanner_check_curl(req))) != GIT_OK)
+		goto done;
 
-enum {
-	PACKREF_IS_SYMBOLIC = 1,
-};
+	curl_easy_getinfo(req, CURLINFO_RESPONSE_CODE, response_code);
 
-struct packref {
-	git_oid oid;
-	git_oid peel;
-	const char *targetref;
-	char flags;
-	char name[GIT_FLEX_ARRAY];
-};
+	if (*response_code != 304)
+		error = git_refdb_repospanner__write_finish(retriever);
 
-struct refretrieve {
-	git_buf buffer;
-	git_sortedcache *target;
-};
+done:
+	repospanner_release_request(backend->client, req);
+	curl_slist_free_all(headers);
+	git_buf_dispose(&path);
+	git_buf_dispose(&header);
+	git_buf_dispose(&wait);
+	return error;
+}
 
-static int parse_symb_ref(git_sortedcache *target, const char *name, const char *val)
+int git_refdb_repospanner__apply(
+	bool *changed, refdb_rs_backend *backend, struct refretrieve *retriever,
+	long response_code, const char *param, const char *value, bool revalidate,
+	double now)
 {
-	struct packref *realref;
-	struct packref *ref;
+	const char *scope;
+	int error;
 
-	realref = git_sortedcache_lookup(target, val);
-	if (!realref)  // If the real ref didn't exist... Let's skip for now
-		return GIT_OK;
+	/* nothing changed since the state we sent */
+	if (response_code == 304)
+		return 0;
 
-	ref = git__calloc(1, sizeof(struct packref));
-	if (ref == NULL) {
-		giterr_set_oom();
+	/* only accept a delta against the state we asked about */
+	if (retriever->delta && (response_code != 226 || !revalidate)) {
+		giterr_set(GITERR_ODB, "unexpected delta of repoSpanner refs");
 		return GIT_ERROR;
 	}
 
-	if (git_sortedcache_upsert((void **)&ref, target, name) < 0) {
-		giterr_set(GITERR_ODB, "Unable to insert into target refcache");
-		return GIT_ERROR;
-	}
+	/* what the listing covers: all refs, a prefix, or just what it names */
+	if (retriever->delta || (param && strcmp(param, "prefix")))
+		scope = NULL;
+	else
+		scope = param ? value : "";
 
-	// ref->oid = realref->oid;
-	ref->targetref = realref->name;
-	ref->flags = PACKREF_IS_SYMBOLIC;
+	if ((error = refs_snapshot_unpack_locked(backend)) < 0 ||
+	    (error = refcache_apply(changed, backend, retriever->target, scope, now)) < 0)
+		return error;
 
-	// TODO: Get other flags and peeled
+	if (param && !strcmp(param, "name") && !git_sortedcache_lookup(retriever->target, value) &&
+	    (error = refcache_mark_missing(changed, backend->refcache, value, now)) < 0)
+		return error;
 
-	return GIT_OK;
+	/* without a tag, every refresh has to get the complete listing */
+	if (!param)
+		git_buf_swap(&backend->etag, &retriever->etag);
+
+	return 0;
 }
 
-static int parse_ref(git_sortedcache *target, const char *start, const char *end)
+/* Fetch refs from the server into the refcache, see `refs_request` */
+static int refs_fetch(
+	bool *changed, refdb_rs_backend *backend,
+	const char *param, const char *value, double now)
 {
-	struct packref *ref;
-	const char *type = NULL, *name = NULL, *val = NULL;
-	const char *pos;
+	struct refretrieve retriever;
+	const char *etag = param ? NULL : git_buf_cstr(&backend->etag);
+	long response_code = 0;
+	int error;
 
-	type = start;
-	for (pos = start; pos < end; pos++) {
-		if (*pos != '\0') {
-			continue;
-		}
-		if (name == NULL)
-			name = pos+1;
-		else {
-			val = pos+1;
-			break;
-		}
-	}
+	if ((error = git_refdb_repospanner__retrieve_init(&retriever)) == 0 &&
+	    (error = refs_request(&retriever, &response_code, backend, param, value, etag, NULL)) == 0)
+		error = git_refdb_repospanner__apply(changed, backend, &retriever,
+			response_code, param, value, etag && *etag, now);
 
-	if ((type == NULL) || (name == NULL) || (val == NULL)) {
-		giterr_set(GITERR_ODB, "invalid ref parsed");
-		return GIT_ERROR;
-	}
+	git_refdb_repospanner__retrieve_dispose(&retriever);
+	return error;
+}
 
-	if (!strcmp(type, "real") && !strcmp(type, "symb")) {
-		giterr_set(GITERR_ODB, "ref has invalid type '%s'", type);
-		return GIT_ERROR;
-	}
+static bool is_fresh(refdb_rs_backend *backend, double fetched, double now)
+{
+	return backend->refresh_interval < 0 || git_atomic_get(&backend->watched) ||
+		now - fetched < backend->refresh_interval;
+}
 
-	if (!strcmp(type, "symb"))
-		return parse_symb_ref(target, name, val);
+/*
+ * Load all refs, or make sure they are reasonably recent.  Once they
+ * are loaded, the server is asked again at most every
+ * `repospanner.refsinterval` milliseconds, and failing to reach it
+ * leaves us with the refs we already know.  Refs from the snapshot
+ * stay unverified until the server could be asked.  Call with the
+ * refresh lock held.
+ */
+static int refs_refresh_locked(refdb_rs_backend *backend)
+{
+	bool changed = false;
+	double now = git__timer();
+	int error = GIT_OK;
 
-	if (strcmp(type, "real") && strlen(val) != 40) {
-		giterr_set(GITERR_ODB, "ref of type real has invalid val '%s'", val);
-		return GIT_ERROR;
-	}
+	/* unverified refs are tried again once an interval after failing */
+	if (backend->complete && (!backend->unverified || backend->refreshed > 0) &&
+	    is_fresh(backend, backend->refreshed, now))
+		return GIT_OK;
 
-	ref = git__calloc(1, sizeof(struct packref));
-	if (ref == NULL) {
-		giterr_set_oom();
-		return GIT_ERROR;
-	}
+	if ((error = refs_fetch(&changed, backend, NULL, NULL, now)) < 0) {
+		if (!backend->complete)
+			return error;
 
-	if (git_sortedcache_upsert((void **)&ref, target, name) < 0) {
-		giterr_set(GITERR_ODB, "Unable to insert into target refcache");
-		return GIT_ERROR;
+		/* stale refs beat no refs at all; retry at the next interval */
+		giterr_clear();
+		error = GIT_OK;
+	} else {
+		refs_snapshot_update(backend);
+		backend->unverified = false;
 	}
 
-	if (git_oid_fromstrn(&ref->oid, val, 40) != GIT_OK) {
-		giterr_set(GITERR_ODB, "Could not parse oid");
-		return GIT_ERROR;
-	}
+	backend->complete = true;
+	backend->refreshed = now;
 
-	return GIT_OK;
+	if (changed)
+		repospanner_refs_changed(backend->client);
+
+	return error;
 }
 
-int ref_write_parse(struct refretrieve *data, bool final)
+static int refs_refresh(refdb_rs_backend *backend)
 {
 	int error;
-	const char *possiblebreak, *newlinepoint, *bufval;
-
-	// Now, see if we got a newline (end of a ref)
-	while(true) {  // We might have gotten multiple refs, parse until we have nothing left
-		bufval = git_buf_cstr(&data->buffer);
-		newlinepoint = NULL;
 
-		for (possiblebreak = bufval; possiblebreak < bufval + git_buf_len(&data->buffer); possiblebreak++) {
-			if (*possiblebreak == '\n') {
-				newlinepoint = possiblebreak;
-				break;
-			}
-		}
+	if (backend->complete && !backend->unverified &&
+	    (backend->refresh_interval < 0 || git_atomic_get(&backend->watched)))
+		return GIT_OK;
 
-		if (newlinepoint == NULL) {  // No newlines received
-			if (!final)
-				return GIT_OK;  // Not yet final, we might still get more data
-			else {
-				if (git_buf_len(&data->buffer) == 0)
-					return GIT_OK;  // We exhausted the buffer, nothing to see here
-				else
-					return GIT_ERROR;  // We have a partial line without more data inbound
-			}
-		}
+	if ((error = refresh_lock(backend)) < 0)
+		return error;
 
-		if ((error = parse_ref(data->target, bufval, newlinepoint)) != GIT_OK)
-			return error;
+	error = refs_refresh_locked(backend);
 
-		git_buf_consume(&data->buffer, newlinepoint+1);
-	}
+	git_mutex_unlock(&backend->refresh_lock);
+	return error;
 }
 
-size_t ref_write_callback(char *ptr, size_t UNUSED(size), size_t nmemb, void *userdata)
+/* Whether all refs starting with `prefix` were fetched recently; call locked */
+static bool prefix_is_loaded(refdb_rs_backend *backend, const char *name, double now)
 {
-	struct refretrieve *data = (struct refretrieve *)userdata;
+	struct loaded_prefix *loaded;
+	size_t i;
 
-	// First, just add the data we just got to the buffer
-	if(git_buf_put(&data->buffer, ptr, nmemb) != GIT_OK) {  // Sane would be to use "size", but not for curl
-		return GIT_ERROR;
+	git_vector_foreach(&backend->prefixes, i, loaded) {
+		if (!git__prefixcmp(name, loaded->prefix) && is_fresh(backend, loaded->fetched, now))
+			return true;
 	}
 
-	if(ref_write_parse(data, false) == GIT_OK) {
-		return nmemb;
-	} else {
-		return GIT_ERROR;
-	}
+	return false;
 }
 
-
-static int packref_cmp(const void *a_, const void *b_)
+/*
+ * Make sure what we know about the ref `name` is reasonably recent,
+ * fetching just that ref unless all refs are loaded anyway.
+ */
+static int ref_load(refdb_rs_backend *backend, const char *name)
 {
-	const struct packref *a = a_, *b = b_;
-	return strcmp(a->name, b->name);
-}
+	struct packref *ref;
+	bool fresh = false, changed = false;
+	double now = git__timer();
+	int error;
 
+	if (backend->complete)
+		return refs_refresh(backend);
 
-static int _ensure_refs_loaded(refdb_rs_backend *backend)
-{
-	git_sortedcache *newcache;
-	CURL *req;
-	struct refretrieve *retriever;
-	int error = GIT_ERROR;;
+	if ((error = git_sortedcache_rlock(backend->refcache)) < 0)
+		return error;
+
+	ref = git_sortedcache_lookup(backend->refcache, name);
+	fresh = ref && is_fresh(backend, ref->fetched, now);
 
-	if(backend->refcache != NULL)
+	git_sortedcache_runlock(backend->refcache);
+
+	if (fresh)
 		return GIT_OK;
 
-	if ((error = git_sortedcache_new(
-			&newcache, offsetof(struct packref, name), NULL, NULL,
-			packref_cmp, NULL)) < 0) {
+	if ((error = refresh_lock(backend)) < 0)
 		return error;
+
+	if (backend->complete)
+		error = refs_refresh_locked(backend);
+	else if (!prefix_is_loaded(backend, name, now) &&
+	         (error = refs_fetch(&changed, backend, "name", name, now)) < 0 && ref) {
+		/* keep using what we knew */
+		giterr_clear();
+		error = GIT_OK;
 	}
 
-	if ((error = repospanner_prepare_request(&req, backend->client, "simple/refs")) != GIT_OK)
-		goto fail;
+	git_mutex_unlock(&backend->refresh_lock);
 
-	retriever = git__calloc(1, sizeof(struct refretrieve));
-	if (!retriever)
-		goto fail;
-	retriever->target = newcache;
-	if ((error = git_buf_init(&retriever->buffer, 0)) != GIT_OK)
-		goto fail;
+	if (changed)
+		repospanner_refs_changed(backend->client);
 
-	curl_easy_setopt(req, CURLOPT_WRITEFUNCTION, ref_write_callback);
-	curl_easy_setopt(req, CURLOPT_WRITEDATA, retriever);
+	return error;
+}
 
-	if ((error = (repospanner_check_curl(req))) != GIT_OK)
-		goto fail;
+/*
+ * Make sure the refs matching `glob` are loaded, fetching only the
+ * ones under its leading directories where possible.
+ */
+static int refs_load_glob(refdb_rs_backend *backend, const char *glob)
+{
+	struct loaded_prefix *loaded = NULL;
+	git_buf prefix = GIT_BUF_INIT;
+	bool changed = false;
+	double now = git__timer();
+	size_t i, len;
+	int error;
 
-	if(ref_write_parse(retriever, true) != GIT_OK) {
-		giterr_set(GITERR_ODB, "Parsing failed");
-		goto fail;
+	if (backend->complete || !glob)
+		return refs_refresh(backend);
+
+	/* everything up to the last directory before the first wildcard */
+	for (len = strcspn(glob, "*?[\\"); len > 0 && glob[len - 1] != '/'; len--)
+		;
+
+	if (len == 0)
+		return refs_refresh(backend);
+
+	if ((error = git_buf_put(&prefix, glob, len)) < 0 ||
+	    (error = refresh_lock(backend)) < 0)
+		goto out;
+
+	if (backend->complete) {
+		error = refs_refresh_locked(backend);
+		goto done;
 	}
 
-	backend->refcache = newcache;
-	return GIT_OK;
+	if (prefix_is_loaded(backend, prefix.ptr, now))
+		goto done;
 
-fail:
-	if (req)
-		curl_free(req);
-	if (retriever)
-		git_buf_free(&retriever->buffer);
-	git_sortedcache_free(newcache);
+	if ((error = refs_fetch(&changed, backend, "prefix", prefix.ptr, now)) < 0)
+		goto done;
+
+	git_vector_foreach(&backend->prefixes, i, loaded) {
+		if (!strcmp(loaded->prefix, prefix.ptr))
+			break;
+	}
+
+	if (i == backend->prefixes.length) {
+		if ((loaded = git__calloc(1, sizeof(struct loaded_prefix) + prefix.size + 1)) == NULL) {
+			error = -1;
+			goto done;
+		}
+
+		memcpy(loaded->prefix, prefix.ptr, prefix.size);
+
+		if ((error = git_vector_insert(&backend->prefixes, loaded)) < 0) {
+			git__free(loaded);
+			goto done;
+		}
+	}
+
+	loaded->fetched = now;
+
+done:
+	git_mutex_unlock(&backend->refresh_lock);
 
-	return error ? error : GIT_ERROR;
+	if (changed)
+		repospanner_refs_changed(backend->client);
+
+out:
+	git_buf_dispose(&prefix);
+	return error;
 }
 
 static int refdb_rs__exists(
@@ -270,22 +1439,21 @@ static int refdb_rs__exists(
 	const char *ref_name)
 {
 	int error = GIT_OK;
-	void *entry;
+	struct packref *entry, scratch;
 
 	refdb_rs_backend *backend = (refdb_rs_backend *)_backend;
 
-	if ((error = _ensure_refs_loaded(backend)) != GIT_OK)
+	if ((error = ref_load(backend, ref_name)) != GIT_OK)
 		return error;
 
 	if((error = git_sortedcache_rlock(backend->refcache)) < 0)
 		return error;
 
-	entry = git_sortedcache_lookup(backend->refcache, ref_name);
+	entry = refcache_lookup(backend, ref_name, &scratch);
+	*exists = entry != NULL && !(entry->flags & PACKREF_IS_MISSING);
 
 	git_sortedcache_runlock(backend->refcache);
 
-	*exists = entry != NULL;
-
 	return GIT_OK;
 }
 
@@ -300,19 +1468,19 @@ static int refdb_rs__lookup(
 	git_refdb_backend *_backend,
 	const char *ref_name)
 {
-	struct packref *entry;
+	struct packref *entry, scratch;
 	int error = GIT_OK;
 
 	refdb_rs_backend *backend = (refdb_rs_backend *)_backend;
 
-	if ((error = _ensure_refs_loaded(backend)) != GIT_OK)
+	if ((error = ref_load(backend, ref_name)) != GIT_OK)
 		return error;
 
 	if((error = git_sortedcache_rlock(backend->refcache)) < 0)
 		return error;
 
-	entry = git_sortedcache_lookup(backend->refcache, ref_name);
-	if (!entry) {
+	entry = refcache_lookup(backend, ref_name, &scratch);
+	if (!entry || (entry->flags & PACKREF_IS_MISSING)) {
 		if (strcmp(ref_name, GIT_HEAD_FILE) == 0)
 			// If we didn't have a HEAD ref, say it's on master
 			*out = git_reference__alloc_symbolic(GIT_HEAD_FILE, "refs/heads/master");
@@ -348,6 +1516,9 @@ static int refdb_rs__iterator_next(
 		if (!ref)  // If we have NULL even though there should be something, the world blew up
 			break;
 
+		if (ref->flags & PACKREF_IS_MISSING)
+			continue;
+
 		if (iter->glob && p_fnmatch(iter->glob, ref->name, 0) != 0)
 			continue;
 
@@ -356,117 +1527,399 @@ static int refdb_rs__iterator_next(
 		break;
 	}
 
-	return error;
+	return error;
+}
+
+static int refdb_rs__iterator_next_name(
+	const char **out, git_reference_iterator *_iter)
+{
+	int error = GIT_ITEROVER;
+	refdb_rs_iter *iter = (refdb_rs_iter *)_iter;
+	struct packref *ref;
+
+	while(iter->current_pos < git_sortedcache_entrycount(iter->refcache)) {
+		ref = git_sortedcache_entry(iter->refcache, iter->current_pos++);
+		if (!ref)  // If we have NULL even though there should be something, the world blew up
+			break;
+
+		if (ref->flags & PACKREF_IS_MISSING)
+			continue;
+
+		if (iter->glob && p_fnmatch(iter->glob, ref->name, 0) != 0)
+			continue;
+
+		*out = ref->name;
+		error = GIT_OK;
+		break;
+	}
+
+	return error;
+}
+
+static void refdb_rs__iterator_free(git_reference_iterator *_iter)
+{
+	refdb_rs_iter *iter = (refdb_rs_iter *)_iter;
+
+	git_pool_clear(&iter->pool);
+	git_sortedcache_free(iter->refcache);
+	git__free(iter);
+}
+
+static int refdb_rs__iterator(
+	git_reference_iterator **out,
+	git_refdb_backend *_backend,
+	const char *glob)
+{
+	refdb_rs_iter *iter;
+	int error = GIT_OK;
+
+	refdb_rs_backend *backend = (refdb_rs_backend *)_backend;
+
+	if ((error = refs_load_glob(backend, glob)) != GIT_OK ||
+	    (error = refs_snapshot_unpack(backend)) != GIT_OK)
+		return error;
+
+	iter = git__calloc(1, sizeof(refdb_rs_iter));
+	GITERR_CHECK_ALLOC(iter);
+
+	iter->current_pos = 0;
+
+	if ((error = git_sortedcache_copy(&iter->refcache, backend->refcache, 1, NULL, NULL)) < 0)
+		goto fail;
+
+	git_pool_init(&iter->pool, 1);
+	if (glob != NULL &&
+		(iter->glob = git_pool_strdup(&iter->pool, glob)) == NULL)
+		goto fail;
+
+	iter->backend.next = refdb_rs__iterator_next;
+	iter->backend.next_name = refdb_rs__iterator_next_name;
+	iter->backend.free = refdb_rs__iterator_free;
+
+	*out = (git_reference_iterator *)iter;
+
+	return GIT_OK;
+
+fail:
+	refdb_rs__iterator_free((git_reference_iterator *)iter);
+	return -1;
+}
+
+static int rs_not_implemented(const char *fname)
+{
+	giterr_set(GITERR_INVALID, "function %s not implemented for repoSpanner", fname);
+	return GIT_EINVALID;
+}
+
+static int ref_error_exists(const char *name)
+{
+	giterr_set(GITERR_REFERENCE,
+		"failed to write reference '%s': a reference with that name already exists.", name);
+	return GIT_EEXISTS;
+}
+
+static int put_packref_value(git_buf *buf, const struct packref *ref)
+{
+	char hex[GIT_OID_HEXSZ];
+
+	if (ref && (ref->flags & PACKREF_IS_SYMBOLIC))
+		return git_buf_printf(buf, "ref: %s", ref->targetref);
+
+	if (ref && !(ref->flags & PACKREF_IS_MISSING))
+		git_oid_fmt(hex, &ref->oid);
+	else
+		memset(hex, '0', sizeof(hex));
+
+	return git_buf_put(buf, hex, sizeof(hex));
+}
+
+static int put_reference_value(git_buf *buf, const git_reference *ref)
+{
+	char hex[GIT_OID_HEXSZ];
+
+	if (ref && ref->type == GIT_REF_SYMBOLIC)
+		return git_buf_printf(buf, "ref: %s", ref->target.symbolic);
+
+	if (ref)
+		git_oid_fmt(hex, &ref->target.oid);
+	else
+		memset(hex, '0', sizeof(hex));
+
+	return git_buf_put(buf, hex, sizeof(hex));
+}
+
+static int ref_batch_new(struct ref_batch **out)
+{
+	struct ref_batch *batch;
+
+	batch = git__calloc(1, sizeof(struct ref_batch));
+	GITERR_CHECK_ALLOC(batch);
+
+	git_buf_init(&batch->body, 0);
+
+	if (git_sortedcache_new(
+			&batch->updates, offsetof(struct packref, name), NULL, NULL,
+			packref_cmp, NULL) < 0) {
+		git__free(batch);
+		return -1;
+	}
+
+	*out = batch;
+	return 0;
+}
+
+static void ref_batch_free(struct ref_batch *batch)
+{
+	if (!batch)
+		return;
+
+	git_buf_dispose(&batch->body);
+	git_sortedcache_free(batch->updates);
+	git__free(batch);
+}
+
+/* Stage setting `name` to `ref`, or deleting it if `ref` is NULL */
+static int ref_batch_add(
+	struct ref_batch *batch, const char *name,
+	const char *expected, const git_reference *ref)
+{
+	struct packref *update;
+	int error;
+
+	if ((error = git_sortedcache_upsert((void **)&update, batch->updates, name)) < 0)
+		return error;
+
+	memset(update, 0, offsetof(struct packref, name));
+
+	if (!ref)
+		update->flags = PACKREF_IS_DELETED;
+	else if (ref->type == GIT_REF_SYMBOLIC) {
+		update->flags = PACKREF_IS_SYMBOLIC;
+		update->targetref = git_pool_strdup(&batch->updates->pool, ref->target.symbolic);
+		GITERR_CHECK_ALLOC(update->targetref);
+	} else {
+		git_oid_cpy(&update->oid, &ref->target.oid);
+	}
+
+	git_buf_puts(&batch->body, name);
+	git_buf_putc(&batch->body, '\0');
+	git_buf_puts(&batch->body, expected);
+	git_buf_putc(&batch->body, '\0');
+	put_reference_value(&batch->body, ref);
+	git_buf_putc(&batch->body, '\n');
+
+	return git_buf_oom(&batch->body) ? -1 : 0;
 }
 
-static int refdb_rs__iterator_next_name(
-	const char **out, git_reference_iterator *_iter)
+/* Make sure the refs in `names` are fetched again before their next use */
+static void refcache_expire(refdb_rs_backend *backend, git_sortedcache *names)
 {
-	int error = GIT_ITEROVER;
-	refdb_rs_iter *iter = (refdb_rs_iter *)_iter;
-	struct packref *ref;
+	struct loaded_prefix *loaded;
+	struct packref *name, *ref;
+	size_t i;
 
-	while(iter->current_pos < git_sortedcache_entrycount(iter->refcache)) {
-		ref = git_sortedcache_entry(iter->refcache, iter->current_pos++);
-		if (!ref)  // If we have NULL even though there should be something, the world blew up
-			break;
+	if (refresh_lock(backend) == 0) {
+		backend->refreshed = 0;
 
-		if (iter->glob && p_fnmatch(iter->glob, ref->name, 0) != 0)
-			continue;
+		git_vector_foreach(&backend->prefixes, i, loaded)
+			loaded->fetched = 0;
 
-		*out = ref->name;
-		error = GIT_OK;
-		break;
+		git_mutex_unlock(&backend->refresh_lock);
 	}
 
-	return error;
-}
+	if (git_sortedcache_wlock(backend->refcache) < 0)
+		return;
 
-static void refdb_rs__iterator_free(git_reference_iterator *_iter)
-{
-	refdb_rs_iter *iter = (refdb_rs_iter *)_iter;
+	for (i = 0; i < git_sortedcache_entrycount(names); i++) {
+		name = git_sortedcache_entry(names, i);
 
-	git_pool_clear(&iter->pool);
-	git_sortedcache_free(iter->refcache);
-	git__free(iter);
+		if ((ref = git_sortedcache_lookup(backend->refcache, name->name)) != NULL)
+			ref->fetched = 0;
+	}
+
+	git_sortedcache_wunlock(backend->refcache);
 }
 
-static int refdb_rs__iterator(
-	git_reference_iterator **out,
-	git_refdb_backend *_backend,
-	const char *glob)
+/*
+ * Apply the updates of a batch on the server, all at once or not at
+ * all, and then to the refcache.
+ */
+static int ref_batch_send(refdb_rs_backend *backend, struct ref_batch *batch)
 {
-	refdb_rs_iter *iter;
-	int error = GIT_OK;
+	struct curl_slist *headers = NULL;
+	bool changed = false;
+	CURL *req = NULL;
+	long response_code = 0;
+	int error;
 
-	refdb_rs_backend *backend = (refdb_rs_backend *)_backend;
+	if (!git_buf_len(&batch->body))
+		return 0;
 
-	if ((error = _ensure_refs_loaded(backend)) != GIT_OK)
+	/* the refs may point to objects the server has yet to see */
+	if ((error = git_repospanner_upload_objects(backend->repo)) < 0 &&
+	    error != GIT_ENOTFOUND)
 		return error;
 
-	iter = git__calloc(1, sizeof(refdb_rs_iter));
-	GITERR_CHECK_ALLOC(iter);
+	if ((error = repospanner_prepare_request(&req, backend->client, "simple/refs/update")) < 0)
+		return error;
 
-	iter->current_pos = 0;
+	if ((headers = curl_slist_append(headers, "Content-Type: application/x-repospanner-ref-updates")) == NULL) {
+		giterr_set_oom();
+		error = -1;
+		goto done;
+	}
 
-	if ((error = git_sortedcache_copy(&iter->refcache, backend->refcache, 1, NULL, NULL)) < 0)
-		goto fail;
+	curl_easy_setopt(req, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(req, CURLOPT_POSTFIELDS, git_buf_cstr(&batch->body));
+	curl_easy_setopt(req, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)git_buf_len(&batch->body));
 
-	git_pool_init(&iter->pool, 1);
-	if (glob != NULL &&
-		(iter->glob = git_pool_strdup(&iter->pool, glob)) == NULL)
-		goto fail;
+	if ((error = repospanner_check_curl(req)) < 0) {
+		curl_easy_getinfo(req, CURLINFO_RESPONSE_CODE, &response_code);
 
-	iter->backend.next = refdb_rs__iterator_next;
-	iter->backend.next_name = refdb_rs__iterator_next_name;
-	iter->backend.free = refdb_rs__iterator_free;
+		if (response_code == 409) {
+			/* what we know about these refs is out of date */
+			refcache_expire(backend, batch->updates);
 
-	*out = (git_reference_iterator *)iter;
+			giterr_set(GITERR_REFERENCE,
+				"references were modified on the repoSpanner server; none were updated");
+			error = GIT_EMODIFIED;
+		}
 
-	return GIT_OK;
+		goto done;
+	}
 
-fail:
-	refdb_rs__iterator_free((git_reference_iterator *)iter);
-	return -1;
+	if ((error = refs_snapshot_unpack(backend)) == 0)
+		error = refcache_apply(&changed, backend, batch->updates, NULL, git__timer());
+
+done:
+	repospanner_release_request(backend->client, req);
+	curl_slist_free_all(headers);
+	return error;
 }
 
-static int rs_not_implemented(const char *fname)
+/* Send a batch of a single update, outside of any transaction */
+static int ref_update(
+	refdb_rs_backend *backend, const char *name,
+	const char *expected, const git_reference *ref)
 {
-	giterr_set(GITERR_INVALID, "function %s not implemented for repoSpanner", fname);
-	return GIT_EINVALID;
+	struct ref_batch *batch;
+	int error;
+
+	if ((error = ref_batch_new(&batch)) < 0)
+		return error;
+
+	if ((error = ref_batch_add(batch, name, expected, ref)) == 0)
+		error = ref_batch_send(backend, batch);
+
+	ref_batch_free(batch);
+	return error;
+}
+
+static int put_expected(git_buf *buf, const git_oid *old, const char *old_target, int must_not_exist)
+{
+	char hex[GIT_OID_HEXSZ];
+
+	if (old_target)
+		return git_buf_printf(buf, "ref: %s", old_target);
+
+	if (old) {
+		git_oid_fmt(hex, old);
+		return git_buf_put(buf, hex, sizeof(hex));
+	}
+
+	return must_not_exist ? put_packref_value(buf, NULL) : 0;
 }
 
 static int refdb_rs__write(
-	git_refdb_backend *UNUSED(backend),
-	const git_reference *UNUSED(ref),
-	int UNUSED(force),
-	const git_signature *UNUSED(Who),
+	git_refdb_backend *_backend,
+	const git_reference *ref,
+	int force,
+	const git_signature *UNUSED(who),
 	const char *UNUSED(message),
-	const git_oid *UNUSED(old),
-	const char *UNUSED(old_target))
+	const git_oid *old,
+	const char *old_target)
 {
-	return rs_not_implemented("write");
+	refdb_rs_backend *backend = (refdb_rs_backend *)_backend;
+	git_buf expected = GIT_BUF_INIT;
+	int error;
+
+	if ((error = put_expected(&expected, old, old_target, !force)) == 0)
+		error = ref_update(backend, ref->name, git_buf_cstr(&expected), ref);
+
+	if (error == GIT_EMODIFIED && !force && !old && !old_target)
+		error = ref_error_exists(ref->name);
+
+	git_buf_dispose(&expected);
+	return error;
 }
 
 static int refdb_rs__rename(
-	git_reference **UNUSED(out),
-	git_refdb_backend *UNUSED(backend),
-	const char *UNUSED(old_name),
-	const char *UNUSED(new_name),
-	int UNUSED(force),
+	git_reference **out,
+	git_refdb_backend *_backend,
+	const char *old_name,
+	const char *new_name,
+	int force,
 	const git_signature *UNUSED(who),
 	const char *UNUSED(message))
 {
-	return rs_not_implemented("rename");
+	refdb_rs_backend *backend = (refdb_rs_backend *)_backend;
+	git_reference *old = NULL, *new = NULL;
+	git_buf expected = GIT_BUF_INIT;
+	struct ref_batch *batch = NULL;
+	int error;
+
+	if ((error = refdb_rs__lookup(&old, _backend, old_name)) < 0)
+		return error;
+
+	if (old->type == GIT_REF_SYMBOLIC)
+		new = git_reference__alloc_symbolic(new_name, old->target.symbolic);
+	else
+		new = git_reference__alloc(new_name, &old->target.oid, NULL);
+
+	if (!new) {
+		error = -1;
+		goto done;
+	}
+
+	/* both refs change together: the old one goes, the new one appears */
+	if ((error = ref_batch_new(&batch)) < 0 ||
+	    (error = put_reference_value(&expected, old)) < 0 ||
+	    (error = ref_batch_add(batch, old_name, git_buf_cstr(&expected), NULL)) < 0)
+		goto done;
+
+	git_buf_clear(&expected);
+
+	if ((error = put_expected(&expected, NULL, NULL, !force)) < 0 ||
+	    (error = ref_batch_add(batch, new_name, git_buf_cstr(&expected), new)) < 0 ||
+	    (error = ref_batch_send(backend, batch)) < 0)
+		goto done;
+
+	*out = new;
+	new = NULL;
+
+done:
+	git_reference_free(old);
+	git_reference_free(new);
+	git_buf_dispose(&expected);
+	ref_batch_free(batch);
+	return error;
 }
 
 static int refdb_rs__del(
-	git_refdb_backend *UNUSED(backend),
-	const char *UNUSED(ref_name),
-	const git_oid *UNUSED(old_id),
-	const char *UNUSED(old_target))
+	git_refdb_backend *_backend,
+	const char *ref_name,
+	const git_oid *old_id,
+	const char *old_target)
 {
-	return rs_not_implemented("del");
+	refdb_rs_backend *backend = (refdb_rs_backend *)_backend;
+	git_buf expected = GIT_BUF_INIT;
+	int error;
+
+	if ((error = put_expected(&expected, old_id, old_target, false)) == 0)
+		error = ref_update(backend, ref_name, git_buf_cstr(&expected), NULL);
+
+	git_buf_dispose(&expected);
+	return error;
 }
 
 static int refdb_rs__compress(git_refdb_backend *UNUSED(backend))
@@ -519,24 +1972,93 @@ static int refdb_reflog_rs__delete(
 	return rs_not_implemented("reflog_delete");
 }
 
+/*
+ * Locks only exist on our side; what they buy is that all updates made
+ * under the locks of a transaction are applied together.  A lock taken
+ * along with another one, passed in `payload_out`, joins its batch.  It
+ * remembers the value its ref has, fetching it unless we know it
+ * already, and the update is only applied if the ref still has that
+ * value, or still does not exist.
+ */
 static int refdb_rs__lock(
-	void **UNUSED(payload_out),
-	git_refdb_backend *UNUSED(backend),
-	const char *UNUSED(refname))
+	void **payload_out,
+	git_refdb_backend *_backend,
+	const char *refname)
 {
-	return rs_not_implemented("lock");
+	refdb_rs_backend *backend = (refdb_rs_backend *)_backend;
+	struct ref_lock *lock, *with = *payload_out;
+	struct packref *ref, scratch;
+	size_t namelen = strlen(refname);
+	int error;
+
+	if ((error = ref_load(backend, refname)) < 0)
+		return error;
+
+	lock = git__calloc(1, sizeof(struct ref_lock) + namelen + 1);
+	GITERR_CHECK_ALLOC(lock);
+
+	memcpy(lock->name, refname, namelen);
+	git_buf_init(&lock->expected, 0);
+
+	if ((error = git_sortedcache_rlock(backend->refcache)) < 0)
+		goto fail;
+
+	ref = refcache_lookup(backend, refname, &scratch);
+	error = put_packref_value(&lock->expected, ref);
+
+	git_sortedcache_runlock(backend->refcache);
+
+	if (error < 0)
+		goto fail;
+
+	if (with)
+		lock->batch = with->batch;
+	else if ((error = ref_batch_new(&lock->batch)) < 0)
+		goto fail;
+
+	lock->batch->locks++;
+
+	*payload_out = lock;
+	return 0;
+
+fail:
+	git_buf_dispose(&lock->expected);
+	git__free(lock);
+	return error;
 }
 
 static int refdb_rs__unlock(
-	git_refdb_backend *UNUSED(backend),
-	void *UNUSED(payload),
-	int UNUSED(success),
+	git_refdb_backend *_backend,
+	void *payload,
+	int success,
 	int UNUSED(update_reflog),
-	const git_reference *UNUSED(ref),
+	const git_reference *ref,
 	const git_signature *UNUSED(sig),
 	const char *UNUSED(message))
 {
-	return rs_not_implemented("unlock");
+	refdb_rs_backend *backend = (refdb_rs_backend *)_backend;
+	struct ref_lock *lock = payload;
+	struct ref_batch *batch = lock->batch;
+	int error = 0;
+
+	/* giving up a lock after an update was staged fails the transaction */
+	if (!success)
+		batch->aborted |= git_buf_len(&batch->body) > 0;
+	else if (!batch->aborted &&
+	         (error = ref_batch_add(batch, lock->name,
+	                  git_buf_cstr(&lock->expected), success == 2 ? NULL : ref)) < 0)
+		batch->aborted = true;
+
+	if (--batch->locks == 0) {
+		if (!batch->aborted)
+			error = ref_batch_send(backend, batch);
+
+		ref_batch_free(batch);
+	}
+
+	git_buf_dispose(&lock->expected);
+	git__free(lock);
+	return error;
 }
 
 static void refdb_rs__free(git_refdb_backend *_backend)
@@ -545,8 +2067,14 @@ static void refdb_rs__free(git_refdb_backend *_backend)
 
 	assert(backend);
 
-	if (backend->refcache != NULL)
-		git_sortedcache_free(backend->refcache);
+	git_sortedcache_free(backend->refcache);
+	git_vector_free_deep(&backend->prefixes);
+	git_buf_dispose(&backend->etag);
+	git_buf_dispose(&backend->snapshot_path);
+	git_buf_dispose(&backend->snapshot_etag);
+	refs_snapshot_free(backend->snapshot);
+	git_mutex_free(&backend->refresh_lock);
+	repospanner_client_free(backend->client);
 	git__free(backend);
 }
 
@@ -557,16 +2085,65 @@ int git_refdb_backend_repospanner(
 	int error = GIT_OK;
 	refdb_rs_backend *backend;
 	repoSpanner_client *client;
+	int64_t interval;
+	int snapshot;
 
 	if ((error = repospanner_get_client(&client, repository)) != 0)
 		return error;
 
+	if ((error = git_config_get_bool(&snapshot, repository->_config, "repospanner.refsnapshot")) < 0) {
+		if (error != GIT_ENOTFOUND)
+			goto fail;
+		giterr_clear();
+		snapshot = 1;
+	}
+
+	/* negative values never check again once the refs are loaded */
+	if ((error = repospanner_config_get_int64(&interval, repository,
+			"repospanner.refsinterval", REPOSPANNER_REFS_INTERVAL)) < 0)
+		goto fail;
+
 	backend = git__calloc(1, sizeof(refdb_rs_backend));
-	GITERR_CHECK_ALLOC(backend);
+	if (backend == NULL) {
+		repospanner_client_free(client);
+		return -1;
+	}
 
 	backend->client = client;
 	backend->repo = repository;
-	backend->refcache = NULL;
+	backend->refresh_interval = interval < 0 ? -1.0 : interval / 1000.0;
+	git_buf_init(&backend->etag, 0);
+	git_buf_init(&backend->snapshot_path, 0);
+	git_buf_init(&backend->snapshot_etag, 0);
+
+	if ((error = git_sortedcache_new(
+			&backend->refcache, offsetof(struct packref, name), NULL, NULL,
+			packref_cmp, NULL)) < 0 ||
+	    (error = git_vector_init(&backend->prefixes, 0, NULL)) < 0) {
+		git_sortedcache_free(backend->refcache);
+		repospanner_client_free(client);
+		git__free(backend);
+		return error;
+	}
+
+	if (git_mutex_init(&backend->refresh_lock) < 0) {
+		giterr_set(GITERR_OS, "failed to initialize repoSpanner refs lock");
+		git_sortedcache_free(backend->refcache);
+		git_vector_free(&backend->prefixes);
+		repospanner_client_free(client);
+		git__free(backend);
+		return -1;
+	}
+
+	if (snapshot) {
+		if (git_buf_joinpath(&backend->snapshot_path,
+				git_repository_path(repository), REFS_SNAPSHOT_FILE) < 0) {
+			refdb_rs__free((git_refdb_backend *)backend);
+			return -1;
+		}
+
+		refs_snapshot_load(backend);
+	}
 
 	backend->parent.exists = &refdb_rs__exists;
 	backend->parent.lookup = &refdb_rs__lookup;
@@ -587,4 +2164,238 @@ int git_refdb_backend_repospanner(
 
 	*backend_out = (git_refdb_backend *)backend;
 	return GIT_OK;
+
+fail:
+	repospanner_client_free(client);
+	return error;
+}
+
+#ifdef GIT_THREADS
+/* Report the changes collected so far; only the subscription's thread does */
+static void subscription_deliver(git_repospanner_subscription *subscription)
+{
+	git_sortedcache *refcache = subscription->backend->refcache, *changes;
+	struct packref *ref;
+	size_t i;
+
+	if (git_sortedcache_wlock(refcache) < 0) {
+		giterr_clear();
+		return;
+	}
+
+	changes = subscription->pending;
+	subscription->pending = subscription->delivering;
+	subscription->delivering = changes;
+
+	git_sortedcache_wunlock(refcache);
+
+	for (i = 0; i < git_sortedcache_entrycount(changes); i++) {
+		ref = git_sortedcache_entry(changes, i);
+
+		subscription->cb(ref->name,
+			ref->flags & (PACKREF_IS_DELETED | PACKREF_IS_SYMBOLIC) ? NULL : &ref->oid,
+			ref->targetref, subscription->payload);
+	}
+
+	git_sortedcache_clear(changes, true);
+}
+
+/* Wait for up to `seconds`, or until unsubscribed */
+static void subscription_pause(git_repospanner_subscription *subscription, double seconds)
+{
+	double until = git__timer() + seconds;
+
+	while (!git_atomic_get(&subscription->stop) && git__timer() < until) {
+#ifdef GIT_WIN32
+		Sleep(50);
+#else
+		usleep(50000);
+#endif
+	}
+}
+
+/*
+ * Ask for the changes since the refs we have, apply them, report them
+ * and start over.  Servers which answer right away are not asked more
+ * often than the refresh interval, and unreachable ones are retried
+ * at most every second.
+ */
+static void *subscription_thread(void *arg)
+{
+	git_repospanner_subscription *subscription = arg;
+	refdb_rs_backend *backend = subscription->backend;
+	struct refretrieve retriever;
+	git_buf etag = GIT_BUF_INIT;
+	long response_code;
+	double started, pause;
+	bool changed;
+	int error;
+
+	while (!git_atomic_get(&subscription->stop)) {
+		started = git__timer();
+		response_code = 0;
+		changed = false;
+
+		if ((error = git_refdb_repospanner__retrieve_init(&retriever)) == 0 &&
+		    (error = refresh_lock(backend)) == 0) {
+			error = git_buf_set(&etag, backend->etag.ptr, backend->etag.size);
+			git_mutex_unlock(&backend->refresh_lock);
+		}
+
+		/* nothing is locked while the server holds the request */
+		if (error == 0)
+			error = refs_request(&retriever, &response_code, backend,
+				NULL, NULL, git_buf_cstr(&etag), subscription);
+
+		if (error == 0 && (error = refresh_lock(backend)) == 0) {
+			/* a delta is only good for the state it was asked against */
+			if (!strcmp(git_buf_cstr(&etag), git_buf_cstr(&backend->etag)) &&
+			    (error = git_refdb_repospanner__apply(&changed, backend, &retriever,
+					response_code, NULL, NULL, git_buf_len(&etag) > 0, git__timer())) == 0) {
+				refs_snapshot_update(backend);
+				backend->refreshed = git__timer();
+			}
+
+			git_mutex_unlock(&backend->refresh_lock);
+		}
+
+		git_refdb_repospanner__retrieve_dispose(&retriever);
+
+		git_atomic_set(&backend->watched, error == 0);
+		if (error < 0)
+			giterr_clear();
+
+		if (changed)
+			repospanner_refs_changed(backend->client);
+
+		subscription_deliver(subscription);
+
+		pause = subscription->interval;
+		if (error < 0 && pause < 1)
+			pause = 1;
+
+		subscription_pause(subscription, pause - (git__timer() - started));
+	}
+
+	git_buf_dispose(&etag);
+	return NULL;
+}
+#endif
+
+static void subscription_free(git_repospanner_subscription *subscription)
+{
+	git_sortedcache_free(subscription->pending);
+	git_sortedcache_free(subscription->delivering);
+	git__free(subscription);
+}
+
+int git_repospanner_subscribe(
+	git_repospanner_subscription **out, git_repository *repo,
+	git_repospanner_ref_change_cb cb, void *payload)
+{
+#ifdef GIT_THREADS
+	git_repospanner_subscription *subscription;
+	refdb_rs_backend *backend;
+	git_refdb *refdb;
+	int64_t wait;
+	int error;
+
+	assert(out && repo && cb);
+
+	if ((error = git_repository_refdb__weakptr(&refdb, repo)) < 0)
+		return error;
+
+	if (refdb->backend->free != &refdb_rs__free) {
+		giterr_set(GITERR_REFERENCE, "repository has no repoSpanner refs database");
+		return GIT_ENOTFOUND;
+	}
+
+	backend = (refdb_rs_backend *)refdb->backend;
+
+	if ((error = repospanner_config_get_int64(&wait, repo,
+			"repospanner.refswait", REPOSPANNER_REFS_WAIT)) < 0)
+		return error;
+
+	/* changes are reported against the complete refs */
+	if ((error = refs_refresh(backend)) < 0)
+		return error;
+
+	subscription = git__calloc(1, sizeof(git_repospanner_subscription));
+	GITERR_CHECK_ALLOC(subscription);
+
+	subscription->backend = backend;
+	subscription->cb = cb;
+	subscription->payload = payload;
+	subscription->wait = wait < 0 ? 0 : wait > INT_MAX ? INT_MAX : (int)wait;
+	subscription->interval = backend->refresh_interval < 0 ?
+		REPOSPANNER_REFS_INTERVAL / 1000.0 : backend->refresh_interval;
+
+	if ((error = git_sortedcache_new(&subscription->pending,
+			offsetof(struct packref, name), NULL, NULL, packref_cmp, NULL)) < 0 ||
+	    (error = git_sortedcache_new(&subscription->delivering,
+			offsetof(struct packref, name), NULL, NULL, packref_cmp, NULL)) < 0 ||
+	    (error = git_sortedcache_wlock(backend->refcache)) < 0)
+		goto fail;
+
+	if (backend->subscription) {
+		git_sortedcache_wunlock(backend->refcache);
+		giterr_set(GITERR_REFERENCE, "repository is already subscribed to");
+		error = GIT_EEXISTS;
+		goto fail;
+	}
+
+	backend->subscription = subscription;
+	git_sortedcache_wunlock(backend->refcache);
+
+	if (git_thread_create(&subscription->thread, subscription_thread, subscription) != 0) {
+		giterr_set(GITERR_THREAD, "failed to start repoSpanner subscription");
+		error = -1;
+
+		if (git_sortedcache_wlock(backend->refcache) == 0) {
+			backend->subscription = NULL;
+			git_sortedcache_wunlock(backend->refcache);
+		}
+
+		goto fail;
+	}
+
+	*out = subscription;
+	return 0;
+
+fail:
+	subscription_free(subscription);
+	return error;
+#else
+	GIT_UNUSED(out);
+	GIT_UNUSED(repo);
+	GIT_UNUSED(cb);
+	GIT_UNUSED(payload);
+
+	giterr_set(GITERR_THREAD, "repoSpanner subscriptions need thread support");
+	return -1;
+#endif
+}
+
+void git_repospanner_unsubscribe(git_repospanner_subscription *subscription)
+{
+	refdb_rs_backend *backend;
+
+	if (!subscription)
+		return;
+
+	backend = subscription->backend;
+
+#ifdef GIT_THREADS
+	git_atomic_set(&subscription->stop, 1);
+	git_thread_join(&subscription->thread, NULL);
+#endif
+
+	/* the refs are checked every interval again, as before */
+	if (git_sortedcache_wlock(backend->refcache) == 0) {
+		backend->subscription = NULL;
+		git_atomic_set(&backend->watched, 0);
+		git_sortedcache_wunlock(backend->refcache);
+	}
+
+	subscription_free(subscription);
 }
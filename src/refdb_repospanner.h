@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) the libgit2 contributors. All rights reserved.
+ *
+ * This file is part of libgit2, distributed under the GNU GPL v2 with
+ * a Linking Exception. For full terms see the included COPYING file.
+ */
+#ifndef INCLUDE_refdb_repospanner_h__
+#define INCLUDE_refdb_repospanner_h__
+
+#include "common.h"
+
+#include "buffer.h"
+#include "sortedcache.h"
+
+#include <git2/sys/refdb_backend.h>
+
+typedef struct refdb_rs_backend refdb_rs_backend;
+
+/*
+ * Open the refs of a repoSpanner-enabled repository, or return
+ * GIT_ENOTFOUND if `repo` is not one.
+ */
+extern int git_refdb_backend_repospanner(git_refdb_backend **out, git_repository *repo);
+
+enum {
+	PACKREF_IS_SYMBOLIC = 1,
+	PACKREF_IS_DELETED = 2,
+	PACKREF_IS_MISSING = 4,
+};
+
+struct packref {
+	git_oid oid;
+	git_oid peel;
+	const char *targetref;
+	double fetched;
+	char flags;
+	char name[GIT_FLEX_ARRAY];
+};
+
+/*
+ * The answer to a refs request.  curl hands its headers to
+ * `git_refdb_repospanner__header_cb` and its body to
+ * `git_refdb_repospanner__write_cb`, in chunks of any size, which parse
+ * the refs into `target`.
+ */
+struct refretrieve {
+	git_buf buffer;
+	git_sortedcache *target;
+
+	/* response headers we care about */
+	git_buf etag;
+	bool delta;
+	bool binary;
+
+	/* the binary listing's signature was seen, and the last name */
+	bool signature;
+	git_buf name;
+};
+
+extern int git_refdb_repospanner__retrieve_init(struct refretrieve *retriever);
+extern void git_refdb_repospanner__retrieve_dispose(struct refretrieve *retriever);
+extern size_t git_refdb_repospanner__header_cb(
+	char *ptr, size_t size, size_t nitems, void *userdata);
+extern size_t git_refdb_repospanner__write_cb(
+	char *ptr, size_t size, size_t nmemb, void *userdata);
+
+/* Check that nothing is left over once the listing is complete */
+extern int git_refdb_repospanner__write_finish(struct refretrieve *retriever);
+
+/*
+ * Apply the answer with `response_code` to a request for the refs
+ * given by `param` and `value` to the refcache of `backend`, setting
+ * `changed` if any of them did.  `revalidate` tells whether the
+ * request sent the state of the refs we knew, which the server may
+ * answer with a delta.
+ */
+extern int git_refdb_repospanner__apply(
+	bool *changed, refdb_rs_backend *backend, struct refretrieve *retriever,
+	long response_code, const char *param, const char *value, bool revalidate,
+	double now);
+
+#endif
@@ -31,6 +31,7 @@
 #include "annotated_commit.h"
 #include "submodule.h"
 #include "worktree.h"
+#include "repospanner.h"
 
 #include "strmap.h"
 
@@ -145,6 +146,10 @@ void git_repository__cleanup(git_repository *repo)
 	git_cache_clear(&repo->objects);
 	git_attr_cache_flush(repo);
 
+	/* before the configuration is gone, as building a pack needs it */
+	if (repo->_odb)
+		git_odb__repospanner_flush(repo->_odb);
+
 	set_config(repo, NULL);
 	set_index(repo, NULL);
 	set_odb(repo, NULL);
@@ -855,6 +860,9 @@ int git_repository_open_ext(
 			goto cleanup;
 	}
 
+	if (config)
+		repospanner_warmup(repo, config);
+
 cleanup:
 	git_buf_dispose(&gitdir);
 	git_buf_dispose(&workdir);
@@ -9,21 +9,39 @@
 #include "repository.h"
 #include "fileops.h"
 #include "filebuf.h"
+#include "hash.h"
 #include "iterator.h"
-#include "sortedcache.h"
+#include "strmap.h"
 #include "signature.h"
 #include "repospanner.h"
+#include "oidmap.h"
+#include "array.h"
+#include "thread-utils.h"
+#include "vector.h"
+#include "netops.h"
+#include "global.h"
+#include "trace.h"
 
 #include <git2/version.h>
 #include <git2/tag.h>
 #include <git2/sys/refdb_backend.h>
 #include <git2/sys/refs.h>
 #include <git2/sys/reflog.h>
+#include <git2/sys/repospanner.h>
 
 #ifndef GIT_CURL
 # error "GIT_CURL required for repoSpanner support"
 #endif
 
+/*
+ * TLS sessions can only be carried over to other processes when curl
+ * uses the same OpenSSL as we do.
+ */
+#ifdef GIT_OPENSSL
+# include <openssl/ssl.h>
+# define REPOSPANNER_TLS_SESSIONS
+#endif
+
 #ifdef __GNUC__
 #  define UNUSED(x) UNUSED_ ## x __attribute__((__unused__))
 #else
@@ -31,32 +49,282 @@
 #endif
 
 
+/* Number of clients kept for reuse once no repository uses them */
+#define REPOSPANNER_IDLE_CLIENTS 16
+
+/* How long warming up a connection may take */
+#define REPOSPANNER_WARMUP_TIMEOUT 10
+
+/* Default number of idle handles each client keeps around */
+#define REPOSPANNER_HANDLE_POOL 32
+
+/* Defaults for the negative lookup cache */
+#define REPOSPANNER_NEGATIVE_TTL 60
+#define REPOSPANNER_NEGATIVE_MAX 16384
+
+/* Default number of objects in the index of known objects */
+#define REPOSPANNER_KNOWN_MAX 65536
+
+/* Defaults for reads spread over several nodes */
+#define REPOSPANNER_NODE_SAMPLES 64
+#define REPOSPANNER_HEDGE_PERCENTILE 95
+#define REPOSPANNER_HEDGE_DELAY 100
+#define REPOSPANNER_NODE_BACKOFF_MAX 60.0
+
+/* Defaults for the local object cache */
+#define REPOSPANNER_CACHE_SIZE (512 * 1024 * 1024)
+#define REPOSPANNER_CACHE_PACKS 32
+
+struct negative_entry {
+	git_oid oid;
+	double expires;
+};
+
+struct known_object {
+	git_oid oid;
+
+	/* the shortest abbreviation the server told us is unique, or 0 */
+	unsigned char unique;
+};
+
+/* curl_multi_poll can be woken up when new transfers are submitted */
+#if LIBCURL_VERSION_NUM >= 0x074400
+# define REPOSPANNER_MULTI_POLL
+#endif
+
+/* How long the transfer thread waits for activity before checking for new work */
+#ifdef REPOSPANNER_MULTI_POLL
+# define REPOSPANNER_MULTI_TIMEOUT 1000
+#else
+# define REPOSPANNER_MULTI_TIMEOUT 10
+#endif
+
+/*
+ * A node able to serve reads, with its recent latencies.  A node
+ * which fails is left alone for a while, twice as long every time.
+ */
+struct repospanner_node {
+	git_buf url;
+	double ewma;
+	double samples[REPOSPANNER_NODE_SAMPLES];
+	size_t samples_len;
+	size_t samples_pos;
+	unsigned int failures;
+	double retry_at;
+};
+
+struct pooled_handle {
+	CURL *handle;
+	size_t thread;
+};
+
+#ifdef GIT_THREADS
+struct transfer {
+	CURL *req;
+	repospanner_transfer_cb done;
+	void *payload;
+};
+#endif
+
+/*
+ * A download of an object which other readers can wait for.  The
+ * result is only copied into the flight if someone is waiting.
+ */
+struct repospanner_flight {
+	git_oid oid;
+	size_t refcount;
+	size_t waiting;
+	bool done;
+	int error;
+	git_rawobj raw;
+#ifdef GIT_THREADS
+	git_cond cond;
+#endif
+};
+
 typedef struct repoSpanner_client {
-	CURL *basehandle;
 	// TODO: At some point move the Share object globally so cross-repo can also
 	// use the same TLS cache?
 	// Will need to see about whether sharing depends on the client cert used.
 	CURLSH *share;
 
+	/*
+	 * repositories and threads using the client, only released with
+	 * the registry write-locked
+	 */
+	git_atomic refcount;
+
+	/* when it was last released, to evict the oldest idle client first */
+	unsigned int idle_since;
+
 	git_buf baseurl;
 
-	const char gitdir[GIT_FLEX_ARRAY];
+	/* settings applied to every handle */
+	git_buf useragent;
+	git_buf cert;
+	git_buf key;
+	git_buf cacert;
+	bool verbose;
+
+	/* whether compressible responses may be sent compressed */
+	bool compression;
+
+	/*
+	 * Directory in which TLS sessions are kept, one file per server,
+	 * so that other processes can resume them rather than go through
+	 * a full handshake; empty if they are not.  Handshakes which
+	 * resumed one are counted along with the handle stats.
+	 */
+	git_buf tls_sessions;
+	git_atomic_ssize tls_resumed;
+
+	/*
+	 * Idle easy handles.  Reusing them rather than creating new ones
+	 * keeps their buffers and lets curl pick up their connections
+	 * again.  A thread gets back the handle it last used if there is
+	 * one, as that is the connection most likely to still be warm.
+	 */
+	git_mutex pool_lock;
+	struct pooled_handle *pool;
+	size_t pool_len;
+	size_t pool_max;
+	git_repospanner_handle_stats stats;
+
+	/*
+	 * Idle multi handles for reads spread over several nodes, under
+	 * the pool lock.  Connections belong to the multi handle a request
+	 * ran on, so these are kept for as long as the easy handles are.
+	 */
+	git_vector multis;
+
+	/* requests made, kept along with the handle stats */
+	git_repospanner_endpoint_stats endpoints[GIT_REPOSPANNER_ENDPOINT__LAST];
+
+	/* lookups answered without a request, counted without a lock */
+	git_atomic_ssize cache_hits;
+	git_atomic_ssize negative_hits;
+	git_atomic_ssize coalesced;
+	git_atomic_ssize hedged;
+
+	/*
+	 * Objects the server recently told us it does not have.  Entries
+	 * live in a ring in insertion order, and since they all share the
+	 * same TTL the oldest one is always the first to expire.
+	 */
+	git_mutex negative_lock;
+	git_oidmap *negative;
+	struct negative_entry *negative_ring;
+	size_t negative_head;
+	size_t negative_count;
+	size_t negative_max;
+	double negative_ttl;
+
+	/*
+	 * Objects the server told us about, to resolve abbreviated ids
+	 * without asking it again.  An abbreviation resolves locally if
+	 * the server told us it is unique, or if we listed all objects
+	 * since the refs last changed.  Sorted lazily, on lookup.
+	 */
+	git_mutex known_lock;
+	git_array_t(struct known_object) known;
+	size_t known_max;
+	bool known_sorted;
+	bool known_complete;
+	bool known_overflow;
+	unsigned int known_generation;
+
+	/*
+	 * Nodes reads can go to: the one at `baseurl` first, then the
+	 * replicas.  Reads still pending after the hedge percentile of
+	 * the node's latency are sent to a second node as well.
+	 */
+	git_mutex node_lock;
+	struct repospanner_node *nodes;
+	size_t nodes_len;
+	unsigned int hedge_percentile;
+	double hedge_delay;
+
+	/* objects fetched before, kept in packs under the objects directory */
+	repospanner_cache *cache;
+
+#ifdef GIT_THREADS
+	/* the share handle is used from several threads */
+	git_mutex share_locks[CURL_LOCK_DATA_LAST];
+
+	/*
+	 * Asynchronous transfers are run concurrently on the multi handle
+	 * by a thread of their own, which is started on first use.  New
+	 * transfers wait in `transfers` until that thread picks them up.
+	 */
+	CURLM *multi;
+	git_mutex transfer_lock;
+	git_cond transfer_cond;
+	git_vector transfers;
+	git_thread transfer_thread;
+	bool transfer_running;
+	bool transfer_stop;
+
+	/*
+	 * A handle connecting ahead of the first request, on a thread of
+	 * its own.  It then goes to the pool as if last used by the thread
+	 * that opened the repository, for that thread to pick it up.
+	 */
+	git_thread warmup_thread;
+	git_cond warmup_cond;
+	CURL *warmup_req;
+	size_t warmup_owner;
+	bool warmed_up;
+	bool warming_up;
+
+	/* object downloads in progress, by object id */
+	git_mutex flight_lock;
+	git_oidmap *flights;
+#endif
+
+	char gitdir[GIT_FLEX_ARRAY];
 } repoSpanner_client;
 
-git_sortedcache *global_clients;
+/*
+ * Clients by git directory.  Looking up an existing client only takes
+ * the lock for reading, so that repositories can be opened from many
+ * threads at once.  Clients no repository uses any more are kept for
+ * a while, so that their connections and caches serve the next one
+ * opened from the same directory.
+ */
+#ifdef GIT_THREADS
+static git_rwlock clients_lock;
+#endif
+static git_strmap *clients;
+static unsigned int clients_tick;
+
+static void client_dispose(repoSpanner_client *client);
 
-static int client_cmp(const void *a_, const void *b_)
+static void repospanner_global_shutdown(void)
 {
-	const struct repoSpanner_client *a = a_, *b = b_;
-	return strcmp(a->gitdir, b->gitdir);
+	repoSpanner_client *client;
+
+	git_strmap_foreach_value(clients, client, {
+		client_dispose(client);
+	});
+
+	git_strmap_free(clients);
+	clients = NULL;
+
+	git_rwlock_free(&clients_lock);
 }
 
-int repospanner_global_init()
+int repospanner_global_init(void)
 {
-	return git_sortedcache_new(
-		&global_clients, offsetof(struct repoSpanner_client, gitdir),
-		NULL, NULL, client_cmp, NULL
-	);
+	if (git_rwlock_init(&clients_lock) < 0) {
+		giterr_set(GITERR_OS, "failed to initialize repoSpanner client lock");
+		return -1;
+	}
+
+	if (git_strmap_alloc(&clients) < 0)
+		return -1;
+
+	git__on_shutdown(repospanner_global_shutdown);
+	return 0;
 }
 
 /* Returns GIT_ENOTFOUND if not repospanner repo, GIT_OK if so */
@@ -81,160 +349,1996 @@ int repo_check_repospanner(git_repository *repo)
 	return GIT_OK;
 }
 
-GIT_INLINE(int) repospanner_user_agent(git_buf *buf)
+int repospanner_config_get_int64(
+	int64_t *out, git_repository *repo, const char *name, int64_t dflt)
 {
-	return git_buf_printf(buf, "git/2.0 (libgit2 %s) repospanner/1", LIBGIT2_VERSION);
+	int error;
+
+	if ((error = git_config_get_int64(out, repo->_config, name)) == GIT_ENOTFOUND) {
+		giterr_clear();
+		*out = dflt;
+		error = 0;
+	}
+
+	return error;
 }
 
-int repospanner_get_client(repoSpanner_client **out, git_repository *repo)
+static int negative_cache_init(repoSpanner_client *client, git_repository *repo)
 {
-	git_buf baseurlbuf = GIT_BUF_INIT;
-	git_buf bufval = GIT_BUF_INIT;
-	int error = GIT_ERROR;
-	repoSpanner_client *client;
+	int64_t ttl, max;
+	int error;
 
-	if((error = repo_check_repospanner(repo)) != GIT_OK)
+	if ((error = repospanner_config_get_int64(&ttl, repo, "repospanner.negativecachettl", REPOSPANNER_NEGATIVE_TTL)) < 0 ||
+	    (error = repospanner_config_get_int64(&max, repo, "repospanner.negativecachesize", REPOSPANNER_NEGATIVE_MAX)) < 0)
 		return error;
 
-	if (git_sortedcache_wlock(global_clients) != GIT_OK)
-		return GIT_ERROR;
+	/* a TTL or size of zero disables the cache */
+	if (ttl <= 0 || max <= 0)
+		return 0;
 
-	client = git_sortedcache_lookup(global_clients, repo->gitdir);
-	if (client) {
-		*out = client;
-		git_sortedcache_wunlock(global_clients);
-		return GIT_OK;
-	}
+	client->negative_ttl = (double)ttl;
+	client->negative_max = (size_t)max;
 
-	if ((error = git_sortedcache_upsert((void**)&client, global_clients, repo->gitdir)) != GIT_OK)
-		goto fail;
+	client->negative = git_oidmap_alloc();
+	GITERR_CHECK_ALLOC(client->negative);
 
-	client->basehandle = curl_easy_init();
-	if (!client->basehandle)
-		goto fail;
+	client->negative_ring = git__calloc(client->negative_max, sizeof(struct negative_entry));
+	GITERR_CHECK_ALLOC(client->negative_ring);
 
-	client->share = curl_share_init();
-	if (!client->share)
-		goto fail;
+	if (git_mutex_init(&client->negative_lock) < 0) {
+		giterr_set(GITERR_OS, "failed to initialize repoSpanner negative cache lock");
+		return -1;
+	}
 
-	// Debugging
-	if (getenv("REPOSPANNER_CURL_DEBUG"))
-		curl_easy_setopt(client->basehandle, CURLOPT_VERBOSE, 1L);
+	return 0;
+}
 
-	curl_easy_setopt(client->basehandle, CURLOPT_FAILONERROR, 1L);
-	curl_easy_setopt(client->basehandle, CURLOPT_PROTOCOLS, CURLPROTO_HTTPS);
-	curl_easy_setopt(client->basehandle, CURLOPT_FOLLOWLOCATION, 0L);
-	curl_easy_setopt(client->basehandle, CURLOPT_SHARE, client->share);
-	// These should be default, but still going to set it explicitly
-	curl_easy_setopt(client->basehandle, CURLOPT_USE_SSL, CURLUSESSL_ALL);
-	curl_easy_setopt(client->basehandle, CURLOPT_SSL_VERIFYHOST, 2L);
-	curl_easy_setopt(client->basehandle, CURLOPT_SSL_VERIFYPEER, 1L);
+static int known_init(repoSpanner_client *client, git_repository *repo)
+{
+	int64_t max;
+	int error;
 
-	curl_share_setopt(client->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS |
-													  CURL_LOCK_DATA_SSL_SESSION |
-													  CURL_LOCK_DATA_CONNECT);
+	if ((error = repospanner_config_get_int64(&max, repo, "repospanner.knownobjects", REPOSPANNER_KNOWN_MAX)) < 0)
+		return error;
 
-	if ((error = repospanner_user_agent(&bufval)) != GIT_OK)
-		goto fail;
-	curl_easy_setopt(client->basehandle, CURLOPT_USERAGENT, git_buf_cstr(&bufval));
-	git_buf_clear(&bufval);
+	/* zero disables the index */
+	client->known_max = max > 0 ? (size_t)max : 0;
 
-	client->baseurl = baseurlbuf;
-	if ((error = git_config_get_string_buf(&client->baseurl, repo->_config, "repospanner.url")) != GIT_OK) {
-		if (error == GIT_ENOTFOUND) {
-			giterr_set(GITERR_ODB, "Required config option url missing");
-			error = GIT_ERROR;
-		}
-		goto fail;
+	if (git_mutex_init(&client->known_lock) < 0) {
+		giterr_set(GITERR_OS, "failed to initialize repoSpanner known object lock");
+		return -1;
 	}
 
-	if ((error = git_config_get_string_buf(&bufval, repo->_config, "repospanner.cert")) != GIT_OK) {
-		if (error == GIT_ENOTFOUND) {
-			giterr_set(GITERR_ODB, "Required config option cert missing");
-			error = GIT_ERROR;
-		}
-		goto fail;
-	}
-	curl_easy_setopt(client->basehandle, CURLOPT_SSLCERT, git_buf_cstr(&bufval));
-	git_buf_clear(&bufval);
+	return 0;
+}
 
-	if ((error = git_config_get_string_buf(&bufval, repo->_config, "repospanner.key")) != GIT_OK) {
-		if (error == GIT_ENOTFOUND) {
-			giterr_set(GITERR_ODB, "Required config option key missing");
-			error = GIT_ERROR;
-		}
-		goto fail;
-	}
-	curl_easy_setopt(client->basehandle, CURLOPT_SSLKEY, git_buf_cstr(&bufval));
-	git_buf_clear(&bufval);
+/*
+ * The cache is kept with the repository, unless `repospanner.cachedir`
+ * names a directory shared by all clones on the machine.  Only clones
+ * of the same repository share a cache there: objects found in it are
+ * taken to be on the server, so they are never uploaded.
+ */
+static int object_cache_path(git_buf *out, repoSpanner_client *client, git_repository *repo)
+{
+	git_oid url_id;
+	int error;
 
-	if ((error = git_config_get_string_buf(&bufval, repo->_config, "repospanner.cacert")) != GIT_OK) {
-		if (error == GIT_ENOTFOUND) {
-			giterr_set(GITERR_ODB, "Required config option cacert missing");
-			error = GIT_ERROR;
-		}
-		goto fail;
+	if ((error = git_config_get_path(out, repo->_config, "repospanner.cachedir")) == 0) {
+		if ((error = git_hash_buf(&url_id, client->baseurl.ptr, client->baseurl.size)) < 0)
+			return error;
+
+		return git_buf_joinpath(out, out->ptr, git_oid_tostr_s(&url_id));
 	}
-	curl_easy_setopt(client->basehandle, CURLOPT_CAINFO, git_buf_cstr(&bufval));
-	git_buf_clear(&bufval);
 
-	// Data normalizaton
-	if (git_buf_cstr(&client->baseurl)[git_buf_len(&client->baseurl)] == '/')
-		git_buf_shorten(&client->baseurl, 1);
+	if (error != GIT_ENOTFOUND)
+		return error;
 
+	giterr_clear();
 
-	git_sortedcache_wunlock(global_clients);
+	if ((error = git_repository_item_path(out, repo, GIT_REPOSITORY_ITEM_OBJECTS)) < 0)
+		return error;
 
-	*out = client;
-	return GIT_OK;
+	return git_buf_joinpath(out, out->ptr, "repospanner");
+}
 
-fail:
-	git_sortedcache_wunlock(global_clients);
+static int object_cache_init(repoSpanner_client *client, git_repository *repo)
+{
+	git_buf path = GIT_BUF_INIT;
+	int64_t size, packs;
+	int error;
+
+	if ((error = repospanner_config_get_int64(&size, repo, "repospanner.cachesize", REPOSPANNER_CACHE_SIZE)) < 0 ||
+	    (error = repospanner_config_get_int64(&packs, repo, "repospanner.cachepacks", REPOSPANNER_CACHE_PACKS)) < 0)
+		return error;
+
+	if ((error = object_cache_path(&path, client, repo)) < 0)
+		goto done;
 
-	git_buf_free(&client->baseurl);
-	git_buf_free(&bufval);
+	error = repospanner_cache_open(&client->cache, path.ptr,
+		size > 0 ? (size_t)size : 0, packs > 0 ? (size_t)packs : 0);
+
+done:
+	git_buf_dispose(&path);
 	return error;
 }
 
-int repospanner_prepare_request(CURL **out, repoSpanner_client *client, const char *path)
+static int node_add__cb(const git_config_entry *entry, void *payload)
+{
+	repoSpanner_client *client = payload;
+	struct repospanner_node *node = &client->nodes[client->nodes_len];
+
+	git_buf_init(&node->url, 0);
+
+	if (git_buf_puts(&node->url, entry->value) < 0)
+		return -1;
+
+	git_buf_rtrim(&node->url);
+	while (git_buf_len(&node->url) && node->url.ptr[node->url.size - 1] == '/')
+		git_buf_shorten(&node->url, 1);
+
+	client->nodes_len++;
+	return 0;
+}
+
+static int count__cb(const git_config_entry *entry, void *payload)
+{
+	GIT_UNUSED(entry);
+	(*(size_t *)payload)++;
+	return 0;
+}
+
+static int nodes_init(repoSpanner_client *client, git_repository *repo)
 {
+	git_config_entry primary = { 0 };
+	int64_t percentile, delay;
+	size_t replicas = 0;
 	int error;
-	CURL *newreq;
-	git_buf pathbuf = GIT_BUF_INIT;
 
-	if ((error = git_buf_joinpath(&pathbuf, git_buf_cstr(&client->baseurl), path)) != GIT_OK)
+	if ((error = repospanner_config_get_int64(&percentile, repo, "repospanner.hedgepercentile", REPOSPANNER_HEDGE_PERCENTILE)) < 0 ||
+	    (error = repospanner_config_get_int64(&delay, repo, "repospanner.hedgedelay", REPOSPANNER_HEDGE_DELAY)) < 0)
 		return error;
 
-	newreq = curl_easy_duphandle(client->basehandle);
-	if(newreq == NULL)
-		return GIT_ERROR;
-	if (curl_easy_setopt(newreq, CURLOPT_URL, git_buf_cstr(&pathbuf)))
-		return GIT_ERROR;
-	git_buf_free(&pathbuf);
+	/* a percentile of 0 (or 100 and above) disables hedging */
+	client->hedge_percentile = (percentile > 0 && percentile < 100) ? (unsigned int)percentile : 0;
+	client->hedge_delay = delay > 0 ? delay / 1000.0 : 0;
 
-	*out = newreq;
-	return GIT_OK;
+	if ((error = git_config_get_multivar_foreach(repo->_config,
+			"repospanner.replica", NULL, count__cb, &replicas)) < 0 &&
+	    error != GIT_ENOTFOUND)
+		return error;
+
+	client->nodes = git__calloc(replicas + 1, sizeof(struct repospanner_node));
+	GITERR_CHECK_ALLOC(client->nodes);
+
+	primary.value = git_buf_cstr(&client->baseurl);
+	if ((error = node_add__cb(&primary, client)) < 0)
+		return error;
+
+	if (replicas &&
+	    (error = git_config_get_multivar_foreach(repo->_config,
+			"repospanner.replica", NULL, node_add__cb, client)) < 0)
+		return error;
+
+	if (git_mutex_init(&client->node_lock) < 0) {
+		giterr_set(GITERR_OS, "failed to initialize repoSpanner node lock");
+		return -1;
+	}
+
+	return 0;
 }
 
-int repospanner_check_curl(CURL *req)
+size_t repospanner_node_count(repoSpanner_client *client)
 {
-	int error;
-	long response_code;
+	return client->nodes_len;
+}
 
-	error = curl_easy_perform(req);
+/*
+ * Healthy nodes first, fastest first; then the ones we expect to
+ * recover first.  Nodes never used sort first, so they get tried.
+ */
+static bool node_before(const struct repospanner_node *a, const struct repospanner_node *b, double now)
+{
+	bool a_up = a->retry_at <= now, b_up = b->retry_at <= now;
 
-	if (error == CURLE_OK)
-		return GIT_OK;
+	if (a_up != b_up)
+		return a_up;
 
-	if (error == CURLE_HTTP_RETURNED_ERROR) {
-		// Check for 404
-		curl_easy_getinfo(req, CURLINFO_RESPONSE_CODE, &response_code);
-		giterr_set(GITERR_NET, "Error received from repoSpanner: %ld", response_code);
-		if (response_code == 404)
-			return GIT_ENOTFOUND;
+	return a_up ? a->ewma < b->ewma : a->retry_at < b->retry_at;
+}
+
+size_t repospanner_nodes_rank(size_t *out, size_t max, repoSpanner_client *client)
+{
+	double now = git__timer();
+	size_t i, j, len = 0;
+
+	if (git_mutex_lock(&client->node_lock) < 0) {
+		out[0] = 0;
+		return 1;
+	}
+
+	for (i = 0; i < client->nodes_len; i++) {
+		for (j = len; j > 0 && node_before(&client->nodes[i], &client->nodes[out[j - 1]], now); j--) {
+			if (j < max)
+				out[j] = out[j - 1];
+		}
+
+		if (j < max) {
+			out[j] = i;
+			len = min(len + 1, max);
+		}
+	}
+
+	git_mutex_unlock(&client->node_lock);
+	return len;
+}
+
+void repospanner_node_report(repoSpanner_client *client, size_t node, double seconds, int error)
+{
+	struct repospanner_node *n = &client->nodes[node];
+
+	if (git_mutex_lock(&client->node_lock) < 0)
+		return;
+
+	/* a node telling us it does not have something is working fine */
+	if (error < 0 && error != GIT_ENOTFOUND) {
+		n->failures++;
+		n->retry_at = git__timer() +
+			min(REPOSPANNER_NODE_BACKOFF_MAX, (double)(1u << min(n->failures - 1, 6u)));
 	} else {
-		giterr_set(GITERR_ODB, "Error performing curl request: (%d): %s", error, curl_easy_strerror(error));
+		n->failures = 0;
+		n->retry_at = 0;
+
+		n->ewma = n->samples_len ? 0.8 * n->ewma + 0.2 * seconds : seconds;
+		n->samples[n->samples_pos] = seconds;
+		n->samples_pos = (n->samples_pos + 1) % REPOSPANNER_NODE_SAMPLES;
+		if (n->samples_len < REPOSPANNER_NODE_SAMPLES)
+			n->samples_len++;
 	}
 
-	return GIT_ERROR;
+	git_mutex_unlock(&client->node_lock);
+}
+
+static int double_cmp(const void *a_, const void *b_)
+{
+	double a = *(const double *)a_, b = *(const double *)b_;
+	return (a > b) - (a < b);
+}
+
+double repospanner_node_hedge_delay(repoSpanner_client *client, size_t node)
+{
+	double samples[REPOSPANNER_NODE_SAMPLES];
+	size_t len;
+
+	if (!client->hedge_percentile || client->nodes_len < 2)
+		return -1;
+
+	if (git_mutex_lock(&client->node_lock) < 0)
+		return -1;
+
+	len = client->nodes[node].samples_len;
+	memcpy(samples, client->nodes[node].samples, len * sizeof(double));
+
+	git_mutex_unlock(&client->node_lock);
+
+	/* too few samples to tell what is slow for this node */
+	if (len < REPOSPANNER_NODE_SAMPLES / 4)
+		return client->hedge_delay;
+
+	qsort(samples, len, sizeof(double), double_cmp);
+	return samples[(len * client->hedge_percentile) / 100];
+}
+
+repospanner_cache *repospanner_client_cache(repoSpanner_client *client)
+{
+	return client->cache;
+}
+
+static void negative_cache_evict_oldest(repoSpanner_client *client)
+{
+	struct negative_entry *entry = &client->negative_ring[client->negative_head];
+
+	git_oidmap_delete(client->negative, &entry->oid);
+	client->negative_head = (client->negative_head + 1) % client->negative_max;
+	client->negative_count--;
+}
+
+bool repospanner_negative_cache_contains(repoSpanner_client *client, const git_oid *oid)
+{
+	struct negative_entry *entry;
+	bool found = false;
+	size_t pos;
+
+	if (!client->negative || git_mutex_lock(&client->negative_lock) < 0)
+		return false;
+
+	pos = git_oidmap_lookup_index(client->negative, oid);
+	if (git_oidmap_valid_index(client->negative, pos)) {
+		entry = git_oidmap_value_at(client->negative, pos);
+		found = (entry->expires > git__timer());
+	}
+
+	git_mutex_unlock(&client->negative_lock);
+
+	if (found)
+		git_atomic_ssize_add(&client->negative_hits, 1);
+
+	return found;
+}
+
+void repospanner_negative_cache_add(repoSpanner_client *client, const git_oid *oid)
+{
+	struct negative_entry *entry;
+	double now = git__timer();
+	size_t pos;
+	int rval;
+
+	if (!client->negative || git_mutex_lock(&client->negative_lock) < 0)
+		return;
+
+	/* drop whatever has expired, and make room if we are full */
+	while (client->negative_count &&
+	       (client->negative_count == client->negative_max ||
+		client->negative_ring[client->negative_head].expires <= now))
+		negative_cache_evict_oldest(client);
+
+	/* it may have expired without reaching the head of the ring yet */
+	pos = git_oidmap_lookup_index(client->negative, oid);
+	if (git_oidmap_valid_index(client->negative, pos)) {
+		entry = git_oidmap_value_at(client->negative, pos);
+		entry->expires = now + client->negative_ttl;
+		goto done;
+	}
+
+	entry = &client->negative_ring[
+		(client->negative_head + client->negative_count) % client->negative_max];
+	git_oid_cpy(&entry->oid, oid);
+	entry->expires = now + client->negative_ttl;
+
+	git_oidmap_insert(client->negative, &entry->oid, entry, &rval);
+	if (rval >= 0)
+		client->negative_count++;
+
+done:
+	git_mutex_unlock(&client->negative_lock);
+}
+
+/*
+ * Forget that an object was missing, once we gave it to the server.
+ * The entry stays in the ring, expired, until it is evicted.
+ */
+void repospanner_negative_cache_remove(repoSpanner_client *client, const git_oid *oid)
+{
+	struct negative_entry *entry;
+	size_t pos;
+
+	if (!client->negative || git_mutex_lock(&client->negative_lock) < 0)
+		return;
+
+	pos = git_oidmap_lookup_index(client->negative, oid);
+	if (git_oidmap_valid_index(client->negative, pos)) {
+		entry = git_oidmap_value_at(client->negative, pos);
+		entry->expires = 0;
+	}
+
+	git_mutex_unlock(&client->negative_lock);
+}
+
+static int known_cmp(const void *a_, const void *b_)
+{
+	const struct known_object *a = a_, *b = b_;
+	return git_oid__cmp(&a->oid, &b->oid);
+}
+
+/* Sort the index and merge duplicates; called with the lock held */
+static void known_sort(repoSpanner_client *client)
+{
+	struct known_object *entries = client->known.ptr, *last = NULL;
+	size_t i, len = 0;
+
+	if (client->known_sorted)
+		return;
+
+	qsort(entries, client->known.size, sizeof(struct known_object), known_cmp);
+
+	for (i = 0; i < client->known.size; i++) {
+		if (last && git_oid_equal(&last->oid, &entries[i].oid)) {
+			if (entries[i].unique && (!last->unique || entries[i].unique < last->unique))
+				last->unique = entries[i].unique;
+			continue;
+		}
+
+		last = &entries[len++];
+		if (last != &entries[i])
+			memcpy(last, &entries[i], sizeof(struct known_object));
+	}
+
+	client->known.size = len;
+	client->known_sorted = true;
+}
+
+int repospanner_known_resolve(
+	git_oid *out, repoSpanner_client *client,
+	const git_oid *short_id, size_t len)
+{
+	struct known_object *entries, *match = NULL;
+	size_t lo, hi, mid, matches = 0;
+	int error = GIT_PASSTHROUGH;
+
+	if (!client->known_max || git_mutex_lock(&client->known_lock) < 0)
+		return GIT_PASSTHROUGH;
+
+	known_sort(client);
+	entries = client->known.ptr;
+
+	/* `short_id` is padded with zeroes, so it sorts before its matches */
+	for (lo = 0, hi = client->known.size; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (git_oid__cmp(&entries[mid].oid, short_id) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < client->known.size && matches < 2; lo++) {
+		if (git_oid_ncmp(&entries[lo].oid, short_id, len) != 0)
+			break;
+
+		match = &entries[lo];
+		matches++;
+	}
+
+	if (matches > 1)
+		error = GIT_EAMBIGUOUS;
+	else if (matches == 1 && (client->known_complete || (match->unique && match->unique <= len)))
+		error = 0;
+	else if (!matches && client->known_complete)
+		error = GIT_ENOTFOUND;
+
+	if (!error)
+		git_oid_cpy(out, &match->oid);
+
+	git_mutex_unlock(&client->known_lock);
+	return error;
+}
+
+void repospanner_known_add(
+	repoSpanner_client *client, const git_oid *ids, size_t count, size_t unique)
+{
+	struct known_object *entry;
+	size_t i;
+
+	if (!client->known_max || git_mutex_lock(&client->known_lock) < 0)
+		return;
+
+	for (i = 0; i < count; i++) {
+		/* start over when full; we no longer know all objects then */
+		if (client->known.size >= client->known_max) {
+			git_array_clear(client->known);
+			client->known_complete = false;
+			client->known_overflow = true;
+		}
+
+		if ((entry = git_array_alloc(client->known)) == NULL) {
+			giterr_clear();
+			break;
+		}
+
+		git_oid_cpy(&entry->oid, &ids[i]);
+		entry->unique = (unsigned char)min(unique, GIT_OID_HEXSZ);
+		client->known_sorted = false;
+	}
+
+	git_mutex_unlock(&client->known_lock);
+}
+
+unsigned int repospanner_known_listing_start(repoSpanner_client *client)
+{
+	unsigned int generation = 0;
+
+	if (!client->known_max || git_mutex_lock(&client->known_lock) < 0)
+		return 0;
+
+	client->known_overflow = false;
+	generation = client->known_generation;
+
+	git_mutex_unlock(&client->known_lock);
+	return generation;
+}
+
+void repospanner_known_listing_done(repoSpanner_client *client, unsigned int generation)
+{
+	if (!client->known_max || git_mutex_lock(&client->known_lock) < 0)
+		return;
+
+	/* nothing may have been pushed, or dropped, in the meantime */
+	if (generation == client->known_generation && !client->known_overflow)
+		client->known_complete = true;
+
+	git_mutex_unlock(&client->known_lock);
+}
+
+static void known_refs_changed(repoSpanner_client *client)
+{
+	struct known_object *entry;
+	size_t i;
+
+	if (!client->known_max || git_mutex_lock(&client->known_lock) < 0)
+		return;
+
+	/* new objects may share their abbreviations with the ones we know */
+	git_array_foreach(client->known, i, entry)
+		entry->unique = 0;
+
+	client->known_complete = false;
+	client->known_generation++;
+
+	git_mutex_unlock(&client->known_lock);
+}
+
+void repospanner_refs_changed(repoSpanner_client *client)
+{
+	known_refs_changed(client);
+
+	/* objects which were missing may well be reachable now */
+	if (!client->negative || git_mutex_lock(&client->negative_lock) < 0)
+		return;
+
+	git_oidmap_clear(client->negative);
+	client->negative_head = 0;
+	client->negative_count = 0;
+
+	git_mutex_unlock(&client->negative_lock);
+}
+
+#ifdef GIT_THREADS
+
+static void share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+	repoSpanner_client *client = userptr;
+
+	GIT_UNUSED(handle);
+	GIT_UNUSED(access);
+
+	git_mutex_lock(&client->share_locks[data]);
+}
+
+static void share_unlock(CURL *handle, curl_lock_data data, void *userptr)
+{
+	repoSpanner_client *client = userptr;
+
+	GIT_UNUSED(handle);
+
+	git_mutex_unlock(&client->share_locks[data]);
+}
+
+static int transfers_init(repoSpanner_client *client)
+{
+	size_t i;
+
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+		if (git_mutex_init(&client->share_locks[i]) < 0)
+			goto on_error;
+	}
+
+	curl_share_setopt(client->share, CURLSHOPT_LOCKFUNC, share_lock);
+	curl_share_setopt(client->share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+	curl_share_setopt(client->share, CURLSHOPT_USERDATA, client);
+
+	if ((client->multi = curl_multi_init()) == NULL) {
+		giterr_set(GITERR_NET, "failed to initialize curl multi handle");
+		return -1;
+	}
+
+#ifdef CURLPIPE_MULTIPLEX
+	curl_multi_setopt(client->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+
+	if (git_mutex_init(&client->transfer_lock) < 0 ||
+	    git_cond_init(&client->transfer_cond) < 0 ||
+	    git_cond_init(&client->warmup_cond) < 0)
+		goto on_error;
+
+	return git_vector_init(&client->transfers, 0, NULL);
+
+on_error:
+	giterr_set(GITERR_OS, "failed to initialize repoSpanner client locks");
+	return -1;
+}
+
+static void transfers_add(repoSpanner_client *client, git_vector *transfers)
+{
+	struct transfer *t;
+	size_t i;
+
+	git_vector_foreach(transfers, i, t) {
+		curl_easy_setopt(t->req, CURLOPT_PRIVATE, t);
+
+		if (curl_multi_add_handle(client->multi, t->req) != CURLM_OK) {
+			giterr_set(GITERR_NET, "failed to start repoSpanner transfer");
+			t->done(t->req, -1, t->payload);
+			git__free(t);
+		}
+	}
+
+	git_vector_clear(transfers);
+}
+
+static void transfers_complete(repoSpanner_client *client)
+{
+	struct transfer *t;
+	CURLMsg *msg;
+	CURLcode result;
+	int left;
+
+	while ((msg = curl_multi_info_read(client->multi, &left)) != NULL) {
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+
+		result = msg->data.result;
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&t);
+		curl_multi_remove_handle(client->multi, t->req);
+
+		t->done(t->req, repospanner_curl_result(t->req, result), t->payload);
+		git__free(t);
+
+		/* nobody is going to look at errors raised on this thread */
+		giterr_clear();
+	}
+}
+
+static void *transfer_thread(void *arg)
+{
+	repoSpanner_client *client = arg;
+	git_vector submitted = GIT_VECTOR_INIT;
+	int running = 0;
+
+	while (true) {
+		git_mutex_lock(&client->transfer_lock);
+
+		while (!running && !git_vector_length(&client->transfers) && !client->transfer_stop)
+			git_cond_wait(&client->transfer_cond, &client->transfer_lock);
+
+		/* nobody waits for transfers of a client being freed */
+		if (!running && !git_vector_length(&client->transfers)) {
+			git_mutex_unlock(&client->transfer_lock);
+			break;
+		}
+
+		git_vector_swap(&submitted, &client->transfers);
+		git_mutex_unlock(&client->transfer_lock);
+
+		/* completion callbacks may submit new transfers, so unlocked */
+		transfers_add(client, &submitted);
+
+		curl_multi_perform(client->multi, &running);
+		transfers_complete(client);
+
+		if (running) {
+#ifdef REPOSPANNER_MULTI_POLL
+			curl_multi_poll(client->multi, NULL, 0, REPOSPANNER_MULTI_TIMEOUT, NULL);
+#else
+			curl_multi_wait(client->multi, NULL, 0, REPOSPANNER_MULTI_TIMEOUT, NULL);
+#endif
+		}
+	}
+
+	git_vector_free(&submitted);
+	return NULL;
+}
+
+static void transfers_shutdown(repoSpanner_client *client)
+{
+	if (!client->transfer_running)
+		return;
+
+	git_mutex_lock(&client->transfer_lock);
+	client->transfer_stop = true;
+	git_cond_signal(&client->transfer_cond);
+	git_mutex_unlock(&client->transfer_lock);
+
+	git_thread_join(&client->transfer_thread, NULL);
+	client->transfer_running = false;
+}
+
+int repospanner_transfer_submit(
+	repoSpanner_client *client, CURL *req,
+	repospanner_transfer_cb done, void *payload)
+{
+	struct transfer *t;
+	int error = 0;
+
+	t = git__malloc(sizeof(struct transfer));
+	GITERR_CHECK_ALLOC(t);
+
+	t->req = req;
+	t->done = done;
+	t->payload = payload;
+
+#if LIBCURL_VERSION_NUM >= 0x072B00
+	/* rather wait for a connection we can multiplex over than open more */
+	curl_easy_setopt(req, CURLOPT_PIPEWAIT, 1L);
+#endif
+
+	if (git_mutex_lock(&client->transfer_lock) < 0) {
+		git__free(t);
+		return -1;
+	}
+
+	if (!client->transfer_running) {
+		if (git_thread_create(&client->transfer_thread, transfer_thread, client) != 0) {
+			giterr_set(GITERR_OS, "failed to start repoSpanner transfer thread");
+			error = -1;
+			goto done;
+		}
+		client->transfer_running = true;
+	}
+
+	if ((error = git_vector_insert(&client->transfers, t)) < 0)
+		goto done;
+
+	git_cond_signal(&client->transfer_cond);
+
+done:
+	git_mutex_unlock(&client->transfer_lock);
+
+	if (error < 0)
+		git__free(t);
+#ifdef REPOSPANNER_MULTI_POLL
+	else
+		curl_multi_wakeup(client->multi);
+#endif
+
+	return error;
+}
+
+#endif
+
+#ifdef GIT_THREADS
+
+static int flights_init(repoSpanner_client *client)
+{
+	client->flights = git_oidmap_alloc();
+	GITERR_CHECK_ALLOC(client->flights);
+
+	if (git_mutex_init(&client->flight_lock) < 0) {
+		giterr_set(GITERR_OS, "failed to initialize repoSpanner download lock");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void flight_release(struct repospanner_flight *flight)
+{
+	if (--flight->refcount)
+		return;
+
+	git__free(flight->raw.data);
+	git_cond_free(&flight->cond);
+	git__free(flight);
+}
+
+int repospanner_flight_join(
+	repospanner_flight **out, git_rawobj *raw,
+	repoSpanner_client *client, const git_oid *oid)
+{
+	struct repospanner_flight *flight;
+	khiter_t pos;
+	int error = 0;
+
+	*out = NULL;
+
+	if (git_mutex_lock(&client->flight_lock) < 0) {
+		giterr_set(GITERR_OS, "failed to lock repoSpanner downloads");
+		return -1;
+	}
+
+	pos = git_oidmap_lookup_index(client->flights, oid);
+
+	if (!git_oidmap_valid_index(client->flights, pos)) {
+		if ((flight = git__calloc(1, sizeof(struct repospanner_flight))) == NULL) {
+			error = -1;
+			goto done;
+		}
+
+		git_oid_cpy(&flight->oid, oid);
+		flight->refcount = 1;
+
+		if (git_cond_init(&flight->cond) < 0) {
+			git__free(flight);
+			giterr_set(GITERR_OS, "failed to initialize repoSpanner download");
+			error = -1;
+			goto done;
+		}
+
+		git_oidmap_insert(client->flights, &flight->oid, flight, &error);
+		if (error < 0) {
+			git_cond_free(&flight->cond);
+			git__free(flight);
+			goto done;
+		}
+
+		*out = flight;
+		error = 1;
+		goto done;
+	}
+
+	/* somebody is downloading it already, wait for them */
+	flight = git_oidmap_value_at(client->flights, pos);
+	flight->refcount++;
+	flight->waiting++;
+	git_atomic_ssize_add(&client->coalesced, 1);
+
+	while (!flight->done)
+		git_cond_wait(&flight->cond, &client->flight_lock);
+
+	if ((error = flight->error) == 0) {
+		raw->type = flight->raw.type;
+		raw->len = flight->raw.len;
+
+		if ((raw->data = git__malloc(raw->len + 1)) == NULL)
+			error = -1;
+		else
+			memcpy(raw->data, flight->raw.data, raw->len + 1);
+	} else if (error != GIT_ENOTFOUND) {
+		giterr_set(GITERR_NET, "failed to download object %s from repoSpanner",
+			git_oid_tostr_s(oid));
+	}
+
+	flight_release(flight);
+
+done:
+	git_mutex_unlock(&client->flight_lock);
+	return error;
+}
+
+void repospanner_flight_land(
+	repoSpanner_client *client, repospanner_flight *flight,
+	int error, const git_rawobj *raw)
+{
+	khiter_t pos;
+
+	if (!flight || git_mutex_lock(&client->flight_lock) < 0)
+		return;
+
+	pos = git_oidmap_lookup_index(client->flights, &flight->oid);
+	if (git_oidmap_valid_index(client->flights, pos))
+		git_oidmap_delete_at(client->flights, pos);
+
+	flight->error = error;
+
+	if (!error && flight->waiting) {
+		flight->raw.type = raw->type;
+		flight->raw.len = raw->len;
+
+		/* let the others try on their own rather than fail them */
+		if ((flight->raw.data = git__malloc(raw->len + 1)) == NULL)
+			flight->error = -1;
+		else
+			memcpy(flight->raw.data, raw->data, raw->len + 1);
+	}
+
+	flight->done = true;
+	git_cond_broadcast(&flight->cond);
+	flight_release(flight);
+
+	git_mutex_unlock(&client->flight_lock);
+}
+
+#else
+
+int repospanner_flight_join(
+	repospanner_flight **out, git_rawobj *raw,
+	repoSpanner_client *client, const git_oid *oid)
+{
+	GIT_UNUSED(raw);
+	GIT_UNUSED(client);
+	GIT_UNUSED(oid);
+
+	/* without threads, nobody can be downloading it at the same time */
+	*out = NULL;
+	return 1;
+}
+
+void repospanner_flight_land(
+	repoSpanner_client *client, repospanner_flight *flight,
+	int error, const git_rawobj *raw)
+{
+	GIT_UNUSED(client);
+	GIT_UNUSED(flight);
+	GIT_UNUSED(error);
+	GIT_UNUSED(raw);
+}
+
+#endif
+
+GIT_INLINE(int) repospanner_user_agent(git_buf *buf)
+{
+	return git_buf_printf(buf, "git/2.0 (libgit2 %s) repospanner/1", LIBGIT2_VERSION);
+}
+
+#ifdef GIT_THREADS
+# define current_thread() git_thread_currentid()
+#else
+# define current_thread() 0
+#endif
+
+#ifdef REPOSPANNER_TLS_SESSIONS
+
+#define REPOSPANNER_TLS_SESSIONS_DIR "repospanner-tls"
+
+/* What the SSL_CTX of a connection needs to save its sessions */
+struct tls_ctx_data {
+	repoSpanner_client *client;
+
+	/* curl's own callback, which keeps them for this process */
+	int (*new_session)(SSL *ssl, SSL_SESSION *session);
+	char path[GIT_FLEX_ARRAY];
+};
+
+static int tls_ctx_index = -1;
+
+/* Set on connections whose resumed handshake we counted */
+static int tls_ssl_index = -1;
+
+static void tls_ctx_data_free(
+	void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+	GIT_UNUSED(parent);
+	GIT_UNUSED(ad);
+	GIT_UNUSED(idx);
+	GIT_UNUSED(argl);
+	GIT_UNUSED(argp);
+
+	git__free(ptr);
+}
+
+static bool tls_sessions_supported(void)
+{
+	curl_version_info_data *info = curl_version_info(CURLVERSION_NOW);
+
+	/* a curl built with several backends has the inactive ones in parentheses */
+	return info && info->ssl_version && !git__prefixcmp(info->ssl_version, "OpenSSL");
+}
+
+static void tls_session_save(const char *path, SSL_SESSION *session)
+{
+	git_filebuf file = GIT_FILEBUF_INIT;
+	unsigned char *der = NULL;
+	int len;
+
+	if ((len = i2d_SSL_SESSION(session, &der)) <= 0)
+		return;
+
+	/* another process saving one at the same time is just as good */
+	if (git_filebuf_open(&file, path, 0, 0600) < 0 ||
+	    git_filebuf_write(&file, der, (size_t)len) < 0 ||
+	    git_filebuf_commit(&file) < 0)
+		giterr_clear();
+
+	git_filebuf_cleanup(&file);
+	OPENSSL_free(der);
+}
+
+static SSL_SESSION *tls_session_load(const char *path)
+{
+	git_buf buf = GIT_BUF_INIT;
+	const unsigned char *der;
+	SSL_SESSION *session = NULL;
+
+	if (git_futils_readbuffer(&buf, path) < 0) {
+		giterr_clear();
+		return NULL;
+	}
+
+	der = (const unsigned char *)buf.ptr;
+	session = d2i_SSL_SESSION(NULL, &der, (long)buf.size);
+
+	if (session &&
+	    SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session) < (long)time(NULL)) {
+		SSL_SESSION_free(session);
+		session = NULL;
+	}
+
+	git_buf_dispose(&buf);
+	return session;
+}
+
+static int tls_new_session(SSL *ssl, SSL_SESSION *session)
+{
+	struct tls_ctx_data *data = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), tls_ctx_index);
+
+	if (!data)
+		return 0;
+
+	tls_session_save(data->path, session);
+
+	return data->new_session ? data->new_session(ssl, session) : 0;
+}
+
+/*
+ * Resume the session another process saved, unless curl already set
+ * one it had for the server.  This is the last chance to do so before
+ * the client hello goes out.  Once done, count the handshake if it
+ * resumed a session; with TLS 1.3, session tickets arriving later go
+ * through here again.
+ */
+static void tls_handshake_info(const SSL *ssl, int where, int ret)
+{
+	struct tls_ctx_data *data;
+	SSL_SESSION *session;
+
+	GIT_UNUSED(ret);
+
+	if ((data = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), tls_ctx_index)) == NULL)
+		return;
+
+	if (where == SSL_CB_HANDSHAKE_DONE && SSL_session_reused((SSL *)ssl) &&
+	    SSL_get_ex_data(ssl, tls_ssl_index) == NULL &&
+	    SSL_set_ex_data((SSL *)ssl, tls_ssl_index, data))
+		git_atomic_ssize_add(&data->client->tls_resumed, 1);
+
+	if (where != SSL_CB_HANDSHAKE_START || SSL_get_session(ssl) != NULL)
+		return;
+
+	if ((session = tls_session_load(data->path)) != NULL) {
+		SSL_set_session((SSL *)ssl, session);
+		SSL_SESSION_free(session);
+	}
+}
+
+/*
+ * Called by curl with the SSL_CTX of each new connection.  The file the
+ * sessions of its server go to is named after its host and port.
+ */
+static CURLcode tls_ctx_setup(CURL *curl, void *ctx, void *payload)
+{
+	repoSpanner_client *client = payload;
+	struct tls_ctx_data *data;
+	git_buf path = GIT_BUF_INIT;
+	char *url = NULL, *host = NULL, *port = NULL, *user = NULL, *pass = NULL, *c;
+	size_t alloclen;
+
+	/* not being able to resume is no reason to fail the connection */
+	if (SSL_CTX_get_ex_data(ctx, tls_ctx_index) != NULL ||
+	    curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url) != CURLE_OK || !url ||
+	    gitno_extract_url_parts(&host, &port, NULL, &user, &pass, url, "443") < 0)
+		goto done;
+
+	for (c = host; *c; c++) {
+		if (!git__isalpha(*c) && !git__isdigit(*c) && *c != '.' && *c != '-')
+			*c = '_';
+	}
+
+	if (git_buf_joinpath(&path, git_buf_cstr(&client->tls_sessions), host) < 0 ||
+	    git_buf_printf(&path, "_%s", port) < 0)
+		goto done;
+
+	if (GIT_ADD_SIZET_OVERFLOW(&alloclen, sizeof(struct tls_ctx_data), path.size + 1) ||
+	    (data = git__calloc(1, alloclen)) == NULL)
+		goto done;
+
+	data->client = client;
+	data->new_session = SSL_CTX_sess_get_new_cb(ctx);
+	memcpy(data->path, path.ptr, path.size);
+
+	if (!SSL_CTX_set_ex_data(ctx, tls_ctx_index, data)) {
+		git__free(data);
+		goto done;
+	}
+
+	SSL_CTX_sess_set_new_cb(ctx, tls_new_session);
+	SSL_CTX_set_info_callback(ctx, tls_handshake_info);
+
+done:
+	git__free(host);
+	git__free(port);
+	git__free(user);
+	git__free(pass);
+	git_buf_dispose(&path);
+	giterr_clear();
+	return CURLE_OK;
+}
+
+#endif
+
+/*
+ * TLS sessions are only saved if asked to: whoever can read them can
+ * resume them, so they are kept in a directory only we have access to.
+ */
+static int tls_sessions_init(repoSpanner_client *client, git_repository *repo)
+{
+	int enabled, error;
+
+	if ((error = git_config_get_bool(&enabled, repo->_config, "repospanner.tlssessions")) < 0) {
+		if (error != GIT_ENOTFOUND)
+			return error;
+		giterr_clear();
+		enabled = 0;
+	}
+
+#ifdef REPOSPANNER_TLS_SESSIONS
+	if (!enabled || !tls_sessions_supported())
+		return 0;
+
+	/* called with the client registry locked, so this happens once */
+	if ((tls_ctx_index < 0 &&
+	     (tls_ctx_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, tls_ctx_data_free)) < 0) ||
+	    (tls_ssl_index < 0 &&
+	     (tls_ssl_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL)) < 0)) {
+		giterr_set(GITERR_SSL, "failed to allocate repoSpanner TLS data index");
+		return -1;
+	}
+
+	if ((error = git_buf_joinpath(&client->tls_sessions, repo->gitdir, REPOSPANNER_TLS_SESSIONS_DIR)) < 0)
+		return error;
+
+	if (git_futils_mkdir(git_buf_cstr(&client->tls_sessions), 0700, 0) < 0 ||
+	    p_chmod(git_buf_cstr(&client->tls_sessions), 0700) < 0) {
+		/* resuming sessions is not worth failing for */
+		git_buf_clear(&client->tls_sessions);
+		giterr_clear();
+	}
+#else
+	GIT_UNUSED(client);
+	GIT_UNUSED(enabled);
+#endif
+
+	return 0;
+}
+
+/*
+ * Compression is on unless `repospanner.compression` is off, provided
+ * curl can decompress anything at all.
+ */
+static int compression_init(repoSpanner_client *client, git_repository *repo)
+{
+	curl_version_info_data *info = curl_version_info(CURLVERSION_NOW);
+	int enabled, error;
+
+	if ((error = git_config_get_bool(&enabled, repo->_config, "repospanner.compression")) < 0) {
+		if (error != GIT_ENOTFOUND)
+			return error;
+		giterr_clear();
+		enabled = 1;
+	}
+
+	client->compression = enabled && (info->features & CURL_VERSION_LIBZ);
+	return 0;
+}
+
+void repospanner_accept_compression(repoSpanner_client *client, CURL *req)
+{
+	/* an empty list offers every encoding curl supports */
+	if (client->compression)
+		curl_easy_setopt(req, CURLOPT_ACCEPT_ENCODING, "");
+}
+
+static void setup_handle(repoSpanner_client *client, CURL *handle)
+{
+	// Debugging
+	if (client->verbose)
+		curl_easy_setopt(handle, CURLOPT_VERBOSE, 1L);
+
+	curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1L);
+	curl_easy_setopt(handle, CURLOPT_PROTOCOLS, CURLPROTO_HTTPS);
+	curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 0L);
+	curl_easy_setopt(handle, CURLOPT_SHARE, client->share);
+	// These should be default, but still going to set it explicitly
+	curl_easy_setopt(handle, CURLOPT_USE_SSL, CURLUSESSL_ALL);
+	curl_easy_setopt(handle, CURLOPT_SSL_VERIFYHOST, 2L);
+	curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, 1L);
+#if LIBCURL_VERSION_NUM >= 0x072F00
+	/* HTTP/2 lets concurrent transfers share a single connection */
+	curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+#endif
+
+	curl_easy_setopt(handle, CURLOPT_USERAGENT, git_buf_cstr(&client->useragent));
+	curl_easy_setopt(handle, CURLOPT_SSLCERT, git_buf_cstr(&client->cert));
+	curl_easy_setopt(handle, CURLOPT_SSLKEY, git_buf_cstr(&client->key));
+	curl_easy_setopt(handle, CURLOPT_CAINFO, git_buf_cstr(&client->cacert));
+
+#ifdef REPOSPANNER_TLS_SESSIONS
+	if (git_buf_len(&client->tls_sessions)) {
+		curl_easy_setopt(handle, CURLOPT_SSL_CTX_FUNCTION, tls_ctx_setup);
+		curl_easy_setopt(handle, CURLOPT_SSL_CTX_DATA, client);
+	}
+#endif
+}
+
+static int handle_pool_init(repoSpanner_client *client, git_repository *repo)
+{
+	int64_t max;
+	int error;
+
+	if ((error = repospanner_config_get_int64(&max, repo, "repospanner.handlepoolsize", REPOSPANNER_HANDLE_POOL)) < 0)
+		return error;
+
+	client->pool_max = max > 0 ? (size_t)max : 0;
+
+	if (client->pool_max) {
+		client->pool = git__calloc(client->pool_max, sizeof(struct pooled_handle));
+		GITERR_CHECK_ALLOC(client->pool);
+	}
+
+	if (git_vector_init(&client->multis, 0, NULL) < 0)
+		return -1;
+
+	if (git_mutex_init(&client->pool_lock) < 0) {
+		giterr_set(GITERR_OS, "failed to initialize repoSpanner handle pool lock");
+		return -1;
+	}
+
+	return 0;
+}
+
+static CURL *handle_acquire(repoSpanner_client *client)
+{
+	size_t thread = current_thread(), i;
+	CURL *handle = NULL;
+
+	if (git_mutex_lock(&client->pool_lock) < 0)
+		return NULL;
+
+	client->stats.requests++;
+
+	if (client->pool_len) {
+		/* prefer the handle this thread used last, otherwise the most recent one */
+		for (i = client->pool_len; i > 0; i--) {
+			if (client->pool[i - 1].thread == thread) {
+				client->stats.affine++;
+				break;
+			}
+		}
+
+		i = i ? i - 1 : client->pool_len - 1;
+		handle = client->pool[i].handle;
+		client->pool[i] = client->pool[--client->pool_len];
+		client->stats.reused++;
+	} else {
+		client->stats.created++;
+	}
+
+	git_mutex_unlock(&client->pool_lock);
+
+	if (handle == NULL && (handle = curl_easy_init()) != NULL)
+		setup_handle(client, handle);
+
+	return handle;
+}
+
+static const char *endpoint_names[GIT_REPOSPANNER_ENDPOINT__LAST] = {
+	"simple/object",
+	"simple/objects",
+	"simple/objects/tree",
+	"simple/objects/prefix",
+	"simple/objects/list",
+	"simple/objects/pack",
+	"simple/refs",
+	"simple/refs/update",
+	"other",
+};
+
+const char *git_repospanner_endpoint_name(git_repospanner_endpoint_t endpoint)
+{
+	if ((unsigned int)endpoint >= GIT_REPOSPANNER_ENDPOINT__LAST)
+		return NULL;
+
+	return endpoint_names[endpoint];
+}
+
+/* The endpoint whose name is the longest prefix of the path of a URL */
+static git_repospanner_endpoint_t endpoint_of(const char *url)
+{
+	git_repospanner_endpoint_t endpoint = GIT_REPOSPANNER_ENDPOINT_OTHER;
+	const char *path = strstr(url, "/simple/");
+	size_t i, len, best = 0;
+
+	if (path == NULL)
+		return endpoint;
+
+	for (path++, i = 0; i < GIT_REPOSPANNER_ENDPOINT_OTHER; i++) {
+		len = strlen(endpoint_names[i]);
+
+		if (len > best && !git__prefixcmp(path, endpoint_names[i]) &&
+		    (path[len] == '\0' || path[len] == '/' || path[len] == '?')) {
+			endpoint = (git_repospanner_endpoint_t)i;
+			best = len;
+		}
+	}
+
+	return endpoint;
+}
+
+/* What a handle tells about the request it made */
+struct request_info {
+	git_repospanner_endpoint_t endpoint;
+	long status;
+	double seconds;
+	uint64_t sent;
+	uint64_t received;
+};
+
+static uint64_t request_size(CURL *req, bool upload)
+{
+#if LIBCURL_VERSION_NUM >= 0x073700
+	curl_off_t size = 0;
+
+	curl_easy_getinfo(req, upload ? CURLINFO_SIZE_UPLOAD_T : CURLINFO_SIZE_DOWNLOAD_T, &size);
+#else
+	double size = 0;
+
+	curl_easy_getinfo(req, upload ? CURLINFO_SIZE_UPLOAD : CURLINFO_SIZE_DOWNLOAD, &size);
+#endif
+
+	return size > 0 ? (uint64_t)size : 0;
+}
+
+/*
+ * Find out about the request a handle made, and trace it.  Returns
+ * false for handles which never got to make one.
+ */
+static bool request_inspect(struct request_info *info, CURL *req)
+{
+	git_trace_level_t level;
+	char *url = NULL;
+
+	memset(info, 0, sizeof(struct request_info));
+
+	curl_easy_getinfo(req, CURLINFO_TOTAL_TIME, &info->seconds);
+	curl_easy_getinfo(req, CURLINFO_EFFECTIVE_URL, &url);
+
+	if (info->seconds <= 0 || url == NULL)
+		return false;
+
+	curl_easy_getinfo(req, CURLINFO_RESPONSE_CODE, &info->status);
+	info->endpoint = endpoint_of(url);
+	info->sent = request_size(req, true);
+	info->received = request_size(req, false);
+
+	level = (info->status == 0 || (info->status >= 400 && info->status != 404)) ?
+		GIT_TRACE_WARN : GIT_TRACE_DEBUG;
+
+	git_trace(level, "repoSpanner: %s: status %ld in %.1f ms, %" PRIu64 " bytes sent, %" PRIu64 " received",
+		url, info->status, info->seconds * 1000, info->sent, info->received);
+
+	return true;
+}
+
+/* Called with the pool locked */
+static void request_record(repoSpanner_client *client, const struct request_info *info)
+{
+	git_repospanner_endpoint_stats *stats = &client->endpoints[info->endpoint];
+	double ms = info->seconds * 1000;
+	size_t bucket;
+
+	stats->requests++;
+	if (info->status == 404)
+		stats->not_found++;
+	else if (info->status == 0 || info->status >= 400)
+		stats->failures++;
+
+	stats->bytes_sent += info->sent;
+	stats->bytes_received += info->received;
+	stats->time += info->seconds;
+
+	for (bucket = 0; bucket < GIT_REPOSPANNER_LATENCY_BUCKETS - 1; bucket++) {
+		if (ms < (double)(1 << bucket))
+			break;
+	}
+
+	stats->latency[bucket]++;
+}
+
+static void handle_release(repoSpanner_client *client, CURL *req, size_t thread)
+{
+	struct request_info info;
+	bool made_request;
+	long connects = 0;
+
+	if (req == NULL)
+		return;
+
+	curl_easy_getinfo(req, CURLINFO_NUM_CONNECTS, &connects);
+	made_request = request_inspect(&info, req);
+
+	/* forget about the last request, but keep connections and caches */
+	curl_easy_reset(req);
+	setup_handle(client, req);
+
+	if (git_mutex_lock(&client->pool_lock) < 0) {
+		curl_easy_cleanup(req);
+		return;
+	}
+
+	client->stats.connections += (size_t)connects;
+
+	if (made_request)
+		request_record(client, &info);
+
+	if (client->pool_len < client->pool_max) {
+		client->pool[client->pool_len].handle = req;
+		client->pool[client->pool_len].thread = thread;
+		client->pool_len++;
+		req = NULL;
+	} else {
+		client->stats.discarded++;
+	}
+
+	git_mutex_unlock(&client->pool_lock);
+
+	if (req)
+		curl_easy_cleanup(req);
+}
+
+void repospanner_release_request(repoSpanner_client *client, CURL *req)
+{
+	handle_release(client, req, current_thread());
+}
+
+CURLM *repospanner_multi_acquire(repoSpanner_client *client)
+{
+	CURLM *multi = NULL;
+
+	if (git_mutex_lock(&client->pool_lock) == 0) {
+		multi = git_vector_last(&client->multis);
+		if (multi)
+			git_vector_pop(&client->multis);
+
+		git_mutex_unlock(&client->pool_lock);
+	}
+
+	if (multi == NULL && (multi = curl_multi_init()) == NULL)
+		giterr_set(GITERR_NET, "failed to initialize curl multi handle");
+
+	return multi;
+}
+
+void repospanner_multi_release(repoSpanner_client *client, CURLM *multi)
+{
+	if (multi == NULL)
+		return;
+
+	if (git_mutex_lock(&client->pool_lock) == 0) {
+		if (git_vector_length(&client->multis) < client->pool_max &&
+		    git_vector_insert(&client->multis, multi) == 0)
+			multi = NULL;
+
+		git_mutex_unlock(&client->pool_lock);
+	}
+
+	if (multi)
+		curl_multi_cleanup(multi);
+}
+
+static void client_dispose(repoSpanner_client *client)
+{
+	size_t i;
+
+	if (client == NULL)
+		return;
+
+#ifdef GIT_THREADS
+	transfers_shutdown(client);
+
+	if (client->warmed_up)
+		git_thread_join(&client->warmup_thread, NULL);
+
+	if (client->multi)
+		curl_multi_cleanup(client->multi);
+	git_vector_free(&client->transfers);
+	git_oidmap_free(client->flights);
+#endif
+
+	/* the handles must be gone before what they share */
+	for (i = 0; i < client->pool_len; i++)
+		curl_easy_cleanup(client->pool[i].handle);
+	git__free(client->pool);
+
+	for (i = 0; i < git_vector_length(&client->multis); i++)
+		curl_multi_cleanup(git_vector_get(&client->multis, i));
+	git_vector_free(&client->multis);
+
+	if (client->share)
+		curl_share_cleanup(client->share);
+
+#ifdef GIT_THREADS
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		git_mutex_free(&client->share_locks[i]);
+
+	git_mutex_free(&client->transfer_lock);
+	git_cond_free(&client->transfer_cond);
+	git_cond_free(&client->warmup_cond);
+	git_mutex_free(&client->flight_lock);
+#endif
+
+	git_mutex_free(&client->pool_lock);
+
+	git_oidmap_free(client->negative);
+	git__free(client->negative_ring);
+	git_mutex_free(&client->negative_lock);
+
+	git_array_clear(client->known);
+	git_mutex_free(&client->known_lock);
+
+	for (i = 0; i < client->nodes_len; i++)
+		git_buf_dispose(&client->nodes[i].url);
+	git__free(client->nodes);
+	git_mutex_free(&client->node_lock);
+
+	repospanner_cache_free(client->cache);
+
+	git_buf_dispose(&client->baseurl);
+	git_buf_dispose(&client->useragent);
+	git_buf_dispose(&client->cert);
+	git_buf_dispose(&client->key);
+	git_buf_dispose(&client->cacert);
+	git_buf_dispose(&client->tls_sessions);
+	git__free(client);
+}
+
+static int client_config_string(
+	git_buf *out, git_repository *repo, const char *name, const char *what)
+{
+	int error;
+
+	if ((error = git_config_get_string_buf(out, repo->_config, name)) == GIT_ENOTFOUND) {
+		giterr_set(GITERR_ODB, "Required config option %s missing", what);
+		error = GIT_ERROR;
+	}
+
+	return error;
+}
+
+static int client_new(repoSpanner_client **out, git_repository *repo)
+{
+	repoSpanner_client *client;
+	size_t len = strlen(repo->gitdir), alloclen;
+	int error;
+
+	GITERR_CHECK_ALLOC_ADD(&alloclen, sizeof(repoSpanner_client), len);
+	GITERR_CHECK_ALLOC_ADD(&alloclen, alloclen, 1);
+
+	client = git__calloc(1, alloclen);
+	GITERR_CHECK_ALLOC(client);
+
+	memcpy(client->gitdir, repo->gitdir, len);
+
+	client->share = curl_share_init();
+	if (!client->share) {
+		giterr_set(GITERR_NET, "failed to initialize curl share handle");
+		error = GIT_ERROR;
+		goto fail;
+	}
+
+	client->verbose = (getenv("REPOSPANNER_CURL_DEBUG") != NULL);
+
+	/*
+	 * One kind of data at a time, these are not flags.  Connections
+	 * stay with their handles: curl does not support sharing them
+	 * between threads.
+	 */
+	curl_share_setopt(client->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(client->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+	if ((error = repospanner_user_agent(&client->useragent)) != GIT_OK ||
+	    (error = client_config_string(&client->baseurl, repo, "repospanner.url", "url")) != GIT_OK ||
+	    (error = client_config_string(&client->cert, repo, "repospanner.cert", "cert")) != GIT_OK ||
+	    (error = client_config_string(&client->key, repo, "repospanner.key", "key")) != GIT_OK ||
+	    (error = client_config_string(&client->cacert, repo, "repospanner.cacert", "cacert")) != GIT_OK)
+		goto fail;
+
+	// Data normalizaton
+	if (git_buf_len(&client->baseurl) && client->baseurl.ptr[git_buf_len(&client->baseurl) - 1] == '/')
+		git_buf_shorten(&client->baseurl, 1);
+
+	if ((error = tls_sessions_init(client, repo)) < 0 ||
+	    (error = compression_init(client, repo)) < 0 ||
+	    (error = handle_pool_init(client, repo)) < 0 ||
+	    (error = nodes_init(client, repo)) < 0 ||
+	    (error = negative_cache_init(client, repo)) < 0 ||
+	    (error = known_init(client, repo)) < 0 ||
+	    (error = object_cache_init(client, repo)) < 0)
+		goto fail;
+
+#ifdef GIT_THREADS
+	if ((error = transfers_init(client)) < 0 ||
+	    (error = flights_init(client)) < 0)
+		goto fail;
+#endif
+
+	*out = client;
+	return 0;
+
+fail:
+	client_dispose(client);
+	return error;
+}
+
+static repoSpanner_client *client_lookup(const char *gitdir)
+{
+	size_t pos = git_strmap_lookup_index(clients, gitdir);
+
+	if (!git_strmap_valid_index(clients, pos))
+		return NULL;
+
+	return git_strmap_value_at(clients, pos);
+}
+
+/*
+ * Once there are too many clients nobody uses, take the one released
+ * the longest ago out of the registry.  Called with it write-locked.
+ */
+static repoSpanner_client *clients_evict(void)
+{
+	repoSpanner_client *client, *oldest = NULL;
+	size_t idle = 0;
+
+	git_strmap_foreach_value(clients, client, {
+		if (git_atomic_get(&client->refcount))
+			continue;
+
+		idle++;
+		if (!oldest || client->idle_since < oldest->idle_since)
+			oldest = client;
+	});
+
+	if (idle <= REPOSPANNER_IDLE_CLIENTS)
+		return NULL;
+
+	git_strmap_delete(clients, oldest->gitdir);
+	return oldest;
+}
+
+int repospanner_get_client(repoSpanner_client **out, git_repository *repo)
+{
+	repoSpanner_client *client;
+	int error;
+
+	if ((error = repo_check_repospanner(repo)) != GIT_OK)
+		return error;
+
+	if (git_rwlock_rdlock(&clients_lock) < 0) {
+		giterr_set(GITERR_OS, "failed to lock repoSpanner clients");
+		return -1;
+	}
+
+	if ((client = client_lookup(repo->gitdir)) != NULL)
+		git_atomic_inc(&client->refcount);
+
+	git_rwlock_rdunlock(&clients_lock);
+
+	if (client) {
+		*out = client;
+		return 0;
+	}
+
+	if (git_rwlock_wrlock(&clients_lock) < 0) {
+		giterr_set(GITERR_OS, "failed to lock repoSpanner clients");
+		return -1;
+	}
+
+	/* someone else may have set it up while we were not holding the lock */
+	if ((client = client_lookup(repo->gitdir)) == NULL) {
+		if ((error = client_new(&client, repo)) < 0)
+			goto done;
+
+		git_strmap_insert(clients, client->gitdir, client, &error);
+		if (error < 0) {
+			client_dispose(client);
+			goto done;
+		}
+	}
+
+	git_atomic_inc(&client->refcount);
+	*out = client;
+	error = 0;
+
+done:
+	git_rwlock_wrunlock(&clients_lock);
+	return error;
+}
+
+void repospanner_client_free(repoSpanner_client *client)
+{
+	repoSpanner_client *evicted = NULL;
+
+	if (client == NULL)
+		return;
+
+	/*
+	 * Let go of it with the registry locked: once nobody uses it, it
+	 * may be evicted or flushed, which must not happen before it is
+	 * marked idle here.
+	 */
+	if (git_rwlock_wrlock(&clients_lock) < 0)
+		return;
+
+	if (git_atomic_dec(&client->refcount) == 0) {
+		client->idle_since = ++clients_tick;
+		evicted = clients_evict();
+	}
+
+	git_rwlock_wrunlock(&clients_lock);
+
+	client_dispose(evicted);
+}
+
+void repospanner_clients_flush(void)
+{
+	git_vector idle = GIT_VECTOR_INIT;
+	repoSpanner_client *client;
+	size_t i;
+
+	if (git_rwlock_wrlock(&clients_lock) < 0)
+		return;
+
+	git_strmap_foreach_value(clients, client, {
+		if (git_atomic_get(&client->refcount))
+			continue;
+
+		/* out of memory: the rest stays for the next flush */
+		if (git_vector_insert(&idle, client) < 0)
+			break;
+	});
+
+	git_vector_foreach(&idle, i, client)
+		git_strmap_delete(clients, client->gitdir);
+
+	git_rwlock_wrunlock(&clients_lock);
+
+	git_vector_foreach(&idle, i, client)
+		client_dispose(client);
+
+	git_vector_free(&idle);
+}
+
+#ifdef GIT_THREADS
+static size_t warmup_write(char *ptr, size_t size, size_t nmemb, void *payload)
+{
+	GIT_UNUSED(ptr);
+	GIT_UNUSED(payload);
+
+	return size * nmemb;
+}
+
+static void *warmup_thread(void *arg)
+{
+	repoSpanner_client *client = arg;
+
+	/* errors are for the first real request to find out about */
+	curl_easy_perform(client->warmup_req);
+	handle_release(client, client->warmup_req, client->warmup_owner);
+	giterr_clear();
+
+	git_mutex_lock(&client->transfer_lock);
+	client->warmup_req = NULL;
+	client->warming_up = false;
+	git_cond_broadcast(&client->warmup_cond);
+	git_mutex_unlock(&client->transfer_lock);
+
+	return NULL;
+}
+
+/*
+ * Wait for the warmup connection rather than open a second one next
+ * to it; it is further along than a new one would be.
+ */
+static void warmup_wait(repoSpanner_client *client)
+{
+	if (!client->warming_up || git_mutex_lock(&client->transfer_lock) < 0)
+		return;
+
+	while (client->warming_up)
+		git_cond_wait(&client->warmup_cond, &client->transfer_lock);
+
+	git_mutex_unlock(&client->transfer_lock);
+}
+#endif
+
+void repospanner_warmup(git_repository *repo, git_config *config)
+{
+#ifdef GIT_THREADS
+	repoSpanner_client *client = NULL;
+	git_buf url = GIT_BUF_INIT;
+	CURL *req = NULL;
+	int enabled = 0;
+
+	if (git_config_get_bool(&enabled, config, "repospanner.warmup") < 0 || !enabled ||
+	    repospanner_get_client(&client, repo) < 0)
+		goto done;
+
+	/* a request that is cheap to serve gets the handshake out of the way */
+	if (git_buf_joinpath(&url, git_buf_cstr(&client->baseurl), "simple/refs?name=HEAD") < 0 ||
+	    git_mutex_lock(&client->transfer_lock) < 0)
+		goto done;
+
+	/* once per client is enough, later repositories share its handles */
+	if (client->warmed_up || (req = handle_acquire(client)) == NULL)
+		goto unlock;
+
+	curl_easy_setopt(req, CURLOPT_URL, git_buf_cstr(&url));
+	curl_easy_setopt(req, CURLOPT_WRITEFUNCTION, warmup_write);
+
+	/* freeing the client waits for this */
+	curl_easy_setopt(req, CURLOPT_TIMEOUT, (long)REPOSPANNER_WARMUP_TIMEOUT);
+
+	client->warmup_req = req;
+	client->warmup_owner = current_thread();
+
+	if (git_thread_create(&client->warmup_thread, warmup_thread, client) != 0) {
+		client->warmup_req = NULL;
+		repospanner_release_request(client, req);
+		goto unlock;
+	}
+
+	client->warmed_up = client->warming_up = true;
+
+unlock:
+	git_mutex_unlock(&client->transfer_lock);
+done:
+	repospanner_client_free(client);
+	git_buf_dispose(&url);
+	giterr_clear();
+#else
+	GIT_UNUSED(repo);
+	GIT_UNUSED(config);
+#endif
+}
+
+int repospanner_prepare_request(CURL **out, repoSpanner_client *client, const char *path)
+{
+	int error;
+	CURL *newreq;
+	git_buf pathbuf = GIT_BUF_INIT;
+
+	if ((error = git_buf_joinpath(&pathbuf, git_buf_cstr(&client->baseurl), path)) != GIT_OK)
+		return error;
+
+#ifdef GIT_THREADS
+	warmup_wait(client);
+#endif
+
+	if ((newreq = handle_acquire(client)) == NULL) {
+		giterr_set(GITERR_NET, "failed to create repoSpanner request");
+		error = GIT_ERROR;
+		goto done;
+	}
+
+	if (curl_easy_setopt(newreq, CURLOPT_URL, git_buf_cstr(&pathbuf)) != CURLE_OK) {
+		giterr_set(GITERR_NET, "failed to set repoSpanner request url");
+		repospanner_release_request(client, newreq);
+		error = GIT_ERROR;
+		goto done;
+	}
+
+	*out = newreq;
+
+done:
+	git_buf_dispose(&pathbuf);
+	return error;
+}
+
+int repospanner_prepare_node_request(
+	CURL **out, repoSpanner_client *client, size_t node, const char *path)
+{
+	git_buf url = GIT_BUF_INIT;
+	int error;
+
+	assert(node < client->nodes_len);
+
+	/* the primary one gets the same treatment as any other request */
+	if (node == 0)
+		return repospanner_prepare_request(out, client, path);
+
+	if ((error = git_buf_joinpath(&url, git_buf_cstr(&client->nodes[node].url), path)) < 0)
+		return error;
+
+	if ((*out = handle_acquire(client)) == NULL ||
+	    curl_easy_setopt(*out, CURLOPT_URL, git_buf_cstr(&url)) != CURLE_OK) {
+		giterr_set(GITERR_NET, "failed to create repoSpanner request");
+		repospanner_release_request(client, *out);
+		*out = NULL;
+		error = -1;
+	}
+
+	git_buf_dispose(&url);
+	return error;
+}
+
+int git_repospanner_get_handle_stats(git_repospanner_handle_stats *out, git_repository *repo)
+{
+	repoSpanner_client *client;
+	int error;
+
+	assert(out && repo);
+
+	if ((error = repospanner_get_client(&client, repo)) < 0)
+		return error;
+
+	if ((error = git_mutex_lock(&client->pool_lock)) == 0) {
+		memcpy(out, &client->stats, sizeof(git_repospanner_handle_stats));
+		out->idle = client->pool_len;
+		out->resumed = (size_t)git_atomic_ssize_add(&client->tls_resumed, 0);
+
+		git_mutex_unlock(&client->pool_lock);
+	}
+
+	repospanner_client_free(client);
+	return error;
+}
+
+int git_repospanner_get_stats(git_repospanner_stats *out, git_repository *repo)
+{
+	repoSpanner_client *client;
+	int error;
+
+	assert(out && repo);
+
+	if ((error = repospanner_get_client(&client, repo)) < 0)
+		return error;
+
+	if ((error = git_mutex_lock(&client->pool_lock)) == 0) {
+		memcpy(out->endpoints, client->endpoints, sizeof(client->endpoints));
+		git_mutex_unlock(&client->pool_lock);
+	}
+
+	out->cache_hits = (size_t)git_atomic_ssize_add(&client->cache_hits, 0);
+	out->negative_hits = (size_t)git_atomic_ssize_add(&client->negative_hits, 0);
+	out->coalesced = (size_t)git_atomic_ssize_add(&client->coalesced, 0);
+	out->hedged = (size_t)git_atomic_ssize_add(&client->hedged, 0);
+
+	repospanner_client_free(client);
+	return error;
+}
+
+void repospanner_count_cache_hit(repoSpanner_client *client)
+{
+	git_atomic_ssize_add(&client->cache_hits, 1);
+}
+
+void repospanner_count_hedge(repoSpanner_client *client)
+{
+	git_atomic_ssize_add(&client->hedged, 1);
+}
+
+int git_repospanner_cache_compact(git_repository *repo)
+{
+	repoSpanner_client *client;
+	int error;
+
+	assert(repo);
+
+	if ((error = repospanner_get_client(&client, repo)) < 0)
+		return error;
+
+	error = repospanner_cache_compact(client->cache);
+
+	repospanner_client_free(client);
+	return error;
+}
+
+int repospanner_curl_result(CURL *req, CURLcode error)
+{
+	long response_code;
+
+	if (error == CURLE_OK)
+		return GIT_OK;
+
+	if (error == CURLE_HTTP_RETURNED_ERROR) {
+		// Check for 404
+		curl_easy_getinfo(req, CURLINFO_RESPONSE_CODE, &response_code);
+		giterr_set(GITERR_NET, "Error received from repoSpanner: %ld", response_code);
+		if (response_code == 404)
+			return GIT_ENOTFOUND;
+	} else {
+		giterr_set(GITERR_ODB, "Error performing curl request: (%d): %s", error, curl_easy_strerror(error));
+	}
+
+	return GIT_ERROR;
+}
+
+int repospanner_check_curl(CURL *req)
+{
+	return repospanner_curl_result(req, curl_easy_perform(req));
 }
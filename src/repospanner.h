@@ -11,11 +11,147 @@
 
 #include <curl/curl.h>
 
+#include "repospanner_cache.h"
+
 typedef struct repoSpanner_client repoSpanner_client;
 
 extern int repospanner_global_init(void);
+
+/*
+ * Get the client of a repository, set up on first use and shared by
+ * all repositories opened from the same directory.  Every client got
+ * this way must be released with `repospanner_client_free`.
+ */
 extern int repospanner_get_client(repoSpanner_client **out, git_repository *repo);
+extern void repospanner_client_free(repoSpanner_client *client);
+
+/*
+ * Dispose of the clients no repository uses anymore, rather than keep
+ * them around for the next one.  Their caches' packs are closed with
+ * them.
+ */
+extern void repospanner_clients_flush(void);
+
+/*
+ * Connect to the server in the background if `repospanner.warmup` is
+ * set, so that the first request of a newly opened repository finds
+ * the connection ready.  Failures are left for that request to find.
+ */
+extern void repospanner_warmup(git_repository *repo, git_config *config);
 extern int repospanner_prepare_request(CURL **out, repoSpanner_client *client, const char *path);
 extern int repospanner_check_curl(CURL *req);
 
+/*
+ * Let the server compress the response to a request, which pays off
+ * for ref listings and responses covering many objects.  Handles
+ * forget this once released.
+ */
+extern void repospanner_accept_compression(repoSpanner_client *client, CURL *req);
+
+/* Map the outcome of a request we ran ourselves to an error code */
+extern int repospanner_curl_result(CURL *req, CURLcode result);
+
+/* Hand a request back to the client's pool once done with it */
+extern void repospanner_release_request(repoSpanner_client *client, CURL *req);
+extern int repospanner_config_get_int64(
+	int64_t *out, git_repository *repo, const char *name, int64_t dflt);
+
+/*
+ * Nodes reads can be sent to: 0 is `repospanner.url`, which all other
+ * requests go to, followed by the `repospanner.replica` ones.
+ * `repospanner_nodes_rank` fills `out` with up to `max` of them, best
+ * first, and returns how many it put there.
+ */
+extern size_t repospanner_node_count(repoSpanner_client *client);
+extern size_t repospanner_nodes_rank(size_t *out, size_t max, repoSpanner_client *client);
+extern int repospanner_prepare_node_request(
+	CURL **out, repoSpanner_client *client, size_t node, const char *path);
+
+/*
+ * Borrow a multi handle to run requests on, and give it back once none
+ * are left on it, so that the connections they opened can be reused.
+ */
+extern CURLM *repospanner_multi_acquire(repoSpanner_client *client);
+extern void repospanner_multi_release(repoSpanner_client *client, CURLM *multi);
+
+/* Record how a request to a node went, and how long it took */
+extern void repospanner_node_report(
+	repoSpanner_client *client, size_t node, double seconds, int error);
+
+/*
+ * How long a read from `node` may take before it is worth asking
+ * another node too, or a negative value to never do so.
+ */
+extern double repospanner_node_hedge_delay(repoSpanner_client *client, size_t node);
+
+/* The local object cache shared by everyone using the client */
+extern repospanner_cache *repospanner_client_cache(repoSpanner_client *client);
+
+/* Count a lookup answered by the cache, or by objects not in it yet */
+extern void repospanner_count_cache_hit(repoSpanner_client *client);
+
+/* Count a read sent to another node while the first one is still running */
+extern void repospanner_count_hedge(repoSpanner_client *client);
+
+#ifdef GIT_THREADS
+/*
+ * Called on the client's transfer thread once an asynchronous request
+ * has finished, with the same error code `repospanner_check_curl`
+ * would have returned.  The callback owns `req` and must clean it up.
+ */
+typedef void (*repospanner_transfer_cb)(CURL *req, int error, void *payload);
+
+/*
+ * Run a request in the background, concurrently with the other ones
+ * submitted to the same client.  Until this succeeds, `req` remains
+ * owned by the caller.
+ */
+extern int repospanner_transfer_submit(
+	repoSpanner_client *client, CURL *req,
+	repospanner_transfer_cb done, void *payload);
+#endif
+
+/*
+ * Concurrent downloads of the same object are coalesced.  Joining
+ * returns 1 if the caller is the first to ask for the object: it must
+ * then download it and hand the outcome to `repospanner_flight_land`.
+ * Otherwise, it waits for that download and returns 0 with a copy of
+ * the object in `raw`, or the error the download failed with.
+ */
+typedef struct repospanner_flight repospanner_flight;
+
+extern int repospanner_flight_join(
+	repospanner_flight **out, git_rawobj *raw,
+	repoSpanner_client *client, const git_oid *oid);
+extern void repospanner_flight_land(
+	repoSpanner_client *client, repospanner_flight *flight,
+	int error, const git_rawobj *raw);
+
+/*
+ * Negative lookup cache: remembers objects the server reported as
+ * missing for a while, so repeated probes stay local.  It is emptied
+ * whenever the refs are known to have changed.
+ */
+extern bool repospanner_negative_cache_contains(repoSpanner_client *client, const git_oid *oid);
+extern void repospanner_negative_cache_add(repoSpanner_client *client, const git_oid *oid);
+extern void repospanner_negative_cache_remove(repoSpanner_client *client, const git_oid *oid);
+extern void repospanner_refs_changed(repoSpanner_client *client);
+
+/*
+ * Index of objects known to exist on the server, used to resolve
+ * abbreviated ids locally.  Resolving returns GIT_PASSTHROUGH when
+ * the index does not know enough and the server has to be asked.
+ * Objects are added along with the abbreviation length the server
+ * said is unique for them, if any.  A complete listing of the objects
+ * is bracketed by the listing calls, so that afterwards everything
+ * resolves locally until the refs change.
+ */
+extern int repospanner_known_resolve(
+	git_oid *out, repoSpanner_client *client,
+	const git_oid *short_id, size_t len);
+extern void repospanner_known_add(
+	repoSpanner_client *client, const git_oid *ids, size_t count, size_t unique);
+extern unsigned int repospanner_known_listing_start(repoSpanner_client *client);
+extern void repospanner_known_listing_done(repoSpanner_client *client, unsigned int generation);
+
 #endif
@@ -0,0 +1,894 @@
+/*
+ * Copyright (C) the libgit2 contributors. All rights reserved.
+ *
+ * This file is part of libgit2, distributed under the GNU GPL v2 with
+ * a Linking Exception. For full terms see the included COPYING file.
+ */
+
+#include "repospanner_cache.h"
+
+#include "git2/indexer.h"
+#include "array.h"
+#include "fileops.h"
+#include "hash.h"
+#include "mwindow.h"
+#include "oidmap.h"
+#include "pack.h"
+#include "path.h"
+#include "thread-utils.h"
+#include "vector.h"
+#include "zstream.h"
+
+/* Taken by the process merging or dropping packs */
+#define CACHE_LOCK_FILE "maintenance.lock"
+
+/* Seconds after which a lock is assumed to be left over from a crash */
+#define CACHE_LOCK_STALE 600
+
+struct repospanner_cache {
+	char *path;
+	size_t max_size;
+	size_t max_packs;
+
+	/*
+	 * The packs in the cache, oldest first.  Readers hold `lock` for
+	 * as long as they use a pack, and only the writer, which holds
+	 * `write_lock`, modifies the list.
+	 */
+	git_rwlock lock;
+	git_vector packs;
+	size_t size;
+
+	git_mutex write_lock;
+
+	/*
+	 * Packs other processes added to the directory, found by looking
+	 * again whenever it changed and an object was not in the cache.
+	 * They are modified with `lock` held for writing, and are taken
+	 * over into `packs` by the next writer.
+	 */
+	git_mutex scan_lock;
+	git_futils_filestamp stamp;
+	git_vector found;
+};
+
+/* Streams a packfile of whole objects into the indexer */
+struct pack_writer {
+	git_indexer *indexer;
+	git_hash_ctx hash;
+	bool hash_init;
+	git_buf zbuf;
+	git_transfer_progress stats;
+};
+
+struct repospanner_cache_stream {
+	repospanner_cache *cache;
+	git_indexer *indexer;
+	git_transfer_progress stats;
+};
+
+struct merge_entry {
+	const git_oid *oid;
+	struct git_pack_file *p;
+};
+
+struct merge {
+	git_oidmap *seen;
+	git_array_t(struct merge_entry) entries;
+	struct git_pack_file *current;
+};
+
+static int pack_writer_put(struct pack_writer *w, const void *data, size_t len)
+{
+	if (git_hash_update(&w->hash, data, len) < 0)
+		return -1;
+
+	return git_indexer_append(w->indexer, data, len, &w->stats);
+}
+
+static int pack_writer_init(struct pack_writer *w, const char *dir, uint32_t count)
+{
+	git_indexer_options opts = GIT_INDEXER_OPTIONS_INIT;
+	struct git_pack_header hdr;
+
+	if (git_indexer_new(&w->indexer, dir, 0, NULL, &opts) < 0 ||
+	    git_hash_ctx_init(&w->hash) < 0)
+		return -1;
+
+	w->hash_init = true;
+
+	hdr.hdr_signature = htonl(PACK_SIGNATURE);
+	hdr.hdr_version = htonl(PACK_VERSION);
+	hdr.hdr_entries = htonl(count);
+
+	return pack_writer_put(w, &hdr, sizeof(hdr));
+}
+
+static int pack_writer_add(struct pack_writer *w, const git_rawobj *raw)
+{
+	unsigned char hdr[10];
+	size_t hdr_len;
+
+	hdr_len = git_packfile__object_header(hdr, raw->len, raw->type);
+	git_buf_clear(&w->zbuf);
+
+	if (pack_writer_put(w, hdr, hdr_len) < 0 ||
+	    git_zstream_deflatebuf(&w->zbuf, raw->data, raw->len) < 0)
+		return -1;
+
+	return pack_writer_put(w, w->zbuf.ptr, w->zbuf.size);
+}
+
+/* Write the trailer and have the indexer move the pack into place */
+static int pack_writer_finish(git_buf *idx_path, struct pack_writer *w, const char *dir)
+{
+	git_oid trailer;
+
+	if (git_hash_final(&trailer, &w->hash) < 0 ||
+	    git_indexer_append(w->indexer, trailer.id, GIT_OID_RAWSZ, &w->stats) < 0 ||
+	    git_indexer_commit(w->indexer, &w->stats) < 0)
+		return -1;
+
+	return git_buf_printf(idx_path, "%s/pack-%s.idx",
+		dir, git_oid_tostr_s(git_indexer_hash(w->indexer)));
+}
+
+static void pack_writer_dispose(struct pack_writer *w)
+{
+	if (w->hash_init) {
+		git_hash_ctx_cleanup(&w->hash);
+	}
+
+	git_indexer_free(w->indexer);
+	git_buf_dispose(&w->zbuf);
+}
+
+/* Close a pack we no longer want and remove its files */
+static void pack_drop(struct git_pack_file *p)
+{
+	git_buf path = GIT_BUF_INIT;
+
+	if (git_buf_sets(&path, p->pack_name) < 0) {
+		git_mwindow_put_pack(p);
+		giterr_clear();
+		return;
+	}
+
+	git_mwindow_put_pack(p);
+
+	/* somebody else may still have it open; that is fine */
+	p_unlink(path.ptr);
+	git_buf_shorten(&path, strlen(".pack"));
+	git_buf_puts(&path, ".idx");
+	if (!git_buf_oom(&path))
+		p_unlink(path.ptr);
+
+	git_buf_dispose(&path);
+}
+
+static int pack_cmp_mtime(const void *a_, const void *b_)
+{
+	const struct git_pack_file *a = a_, *b = b_;
+
+	if (a->mtime != b->mtime)
+		return a->mtime < b->mtime ? -1 : 1;
+
+	return strcmp(a->pack_name, b->pack_name);
+}
+
+static bool pack_known(git_vector *packs, struct git_pack_file *p)
+{
+	struct git_pack_file *known;
+	size_t i;
+
+	git_vector_foreach(packs, i, known) {
+		if (known == p)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Take over the packs other processes added, and forget the ones they
+ * removed.  Called with the write lock held.
+ */
+static int cache_adopt(repospanner_cache *cache)
+{
+	struct git_pack_file *p;
+	size_t i;
+	int error;
+
+	if ((error = git_rwlock_wrlock(&cache->lock)) < 0)
+		return error;
+
+	git_vector_foreach(&cache->found, i, p) {
+		if (pack_known(&cache->packs, p) || git_vector_insert(&cache->packs, p) < 0) {
+			git_mwindow_put_pack(p);
+			continue;
+		}
+
+		cache->size += (size_t)p->mwf.size;
+	}
+
+	git_vector_clear(&cache->found);
+
+	for (i = git_vector_length(&cache->packs); i > 0; i--) {
+		p = git_vector_get(&cache->packs, i - 1);
+
+		if (git_path_exists(p->pack_name))
+			continue;
+
+		git_vector_remove(&cache->packs, i - 1);
+		cache->size -= (size_t)p->mwf.size;
+		git_mwindow_put_pack(p);
+	}
+
+	git_vector_sort(&cache->packs);
+
+	git_rwlock_wrunlock(&cache->lock);
+	return 0;
+}
+
+/*
+ * Several processes may use the same directory, but only one of them
+ * at a time merges or drops packs.  Returns GIT_ELOCKED if another one
+ * is doing so.
+ */
+static int maintenance_lock(git_buf *path, repospanner_cache *cache)
+{
+	struct stat st;
+	int fd, attempt;
+
+	if (git_buf_joinpath(path, cache->path, CACHE_LOCK_FILE) < 0)
+		return -1;
+
+	for (attempt = 0; attempt < 2; attempt++) {
+		if ((fd = p_open(path->ptr, O_WRONLY | O_CREAT | O_EXCL, 0666)) >= 0) {
+			p_close(fd);
+			return 0;
+		}
+
+		if (errno != EEXIST) {
+			giterr_set(GITERR_OS, "failed to lock repoSpanner cache '%s'", cache->path);
+			return -1;
+		}
+
+		/* gone already, or left behind by a process that died */
+		if (p_stat(path->ptr, &st) == 0 &&
+		    (time(NULL) - st.st_mtime < CACHE_LOCK_STALE || p_unlink(path->ptr) < 0))
+			break;
+	}
+
+	giterr_set(GITERR_ODB, "repoSpanner cache '%s' is being maintained by another process", cache->path);
+	return GIT_ELOCKED;
+}
+
+static void maintenance_unlock(git_buf *path)
+{
+	p_unlink(path->ptr);
+	git_buf_dispose(path);
+}
+
+/* Add a newly written pack; called with the write lock held */
+static int cache_insert(repospanner_cache *cache, const char *idx_path)
+{
+	struct git_pack_file *p, *existing;
+	size_t i;
+	int error;
+
+	if ((error = git_mwindow_get_pack(&p, idx_path)) < 0)
+		return error;
+
+	/* the very same objects were written before */
+	git_vector_foreach(&cache->packs, i, existing) {
+		if (existing == p) {
+			git_mwindow_put_pack(p);
+			return 0;
+		}
+	}
+
+	if ((error = git_rwlock_wrlock(&cache->lock)) < 0) {
+		git_mwindow_put_pack(p);
+		return error;
+	}
+
+	if ((error = git_vector_insert(&cache->packs, p)) < 0)
+		git_mwindow_put_pack(p);
+	else
+		cache->size += (size_t)p->mwf.size;
+
+	git_rwlock_wrunlock(&cache->lock);
+	return error;
+}
+
+/* Drop the oldest packs until we are within the size limit */
+static void cache_evict(repospanner_cache *cache)
+{
+	struct git_pack_file *p;
+
+	if (git_rwlock_wrlock(&cache->lock) < 0) {
+		giterr_clear();
+		return;
+	}
+
+	while (cache->size > cache->max_size && git_vector_length(&cache->packs) > 1) {
+		p = git_vector_get(&cache->packs, 0);
+		git_vector_remove(&cache->packs, 0);
+
+		cache->size -= (size_t)p->mwf.size;
+		pack_drop(p);
+	}
+
+	git_rwlock_wrunlock(&cache->lock);
+}
+
+static int merge_collect__cb(const git_oid *oid, void *payload)
+{
+	struct merge *m = payload;
+	struct merge_entry *entry;
+	int rval;
+
+	/* newer packs come first, and have the same objects anyway */
+	if (git_oidmap_exists(m->seen, oid))
+		return 0;
+
+	git_oidmap_insert(m->seen, oid, NULL, &rval);
+	if (rval < 0)
+		return -1;
+
+	entry = git_array_alloc(m->entries);
+	GITERR_CHECK_ALLOC(entry);
+
+	entry->oid = oid;
+	entry->p = m->current;
+	return 0;
+}
+
+/*
+ * Replace the packs from `first` on with a single one.  The newest
+ * packs are merged until they would take up more than `budget`; the
+ * older ones are dropped.  Called with the write lock held.
+ */
+static int cache_merge(repospanner_cache *cache, size_t first, size_t budget)
+{
+	struct merge m = { 0 };
+	struct pack_writer w = { 0 };
+	struct git_pack_entry e;
+	struct merge_entry *entry;
+	struct git_pack_file *p;
+	git_buf idx_path = GIT_BUF_INIT;
+	git_rawobj raw;
+	size_t i, used = 0;
+	int error = 0;
+
+	if ((m.seen = git_oidmap_alloc()) == NULL) {
+		giterr_set_oom();
+		return -1;
+	}
+
+	for (i = git_vector_length(&cache->packs); i > first; i--) {
+		m.current = git_vector_get(&cache->packs, i - 1);
+
+		if (used && used + (size_t)m.current->mwf.size > budget)
+			break;
+		used += (size_t)m.current->mwf.size;
+
+		if ((error = git_pack_foreach_entry(m.current, merge_collect__cb, &m)) < 0)
+			goto done;
+	}
+
+	if ((error = pack_writer_init(&w, cache->path, (uint32_t)m.entries.size)) < 0)
+		goto done;
+
+	for (i = 0; i < m.entries.size; i++) {
+		entry = git_array_get(m.entries, i);
+
+		if ((error = git_pack_entry_find(&e, entry->p, entry->oid, GIT_OID_HEXSZ)) < 0 ||
+		    (error = git_packfile_unpack(&raw, e.p, &e.offset)) < 0)
+			goto done;
+
+		error = pack_writer_add(&w, &raw);
+		git__free(raw.data);
+
+		if (error < 0)
+			goto done;
+	}
+
+	if ((error = pack_writer_finish(&idx_path, &w, cache->path)) < 0 ||
+	    (error = git_mwindow_get_pack(&p, idx_path.ptr)) < 0)
+		goto done;
+
+	if ((error = git_rwlock_wrlock(&cache->lock)) < 0) {
+		git_mwindow_put_pack(p);
+		goto done;
+	}
+
+	while (git_vector_length(&cache->packs) > first) {
+		struct git_pack_file *old = git_vector_last(&cache->packs);
+
+		git_vector_pop(&cache->packs);
+		cache->size -= (size_t)old->mwf.size;
+
+		/* the merge came out the same as one of its inputs */
+		if (old == p)
+			git_mwindow_put_pack(old);
+		else
+			pack_drop(old);
+	}
+
+	if ((error = git_vector_insert(&cache->packs, p)) < 0)
+		pack_drop(p);
+	else
+		cache->size += (size_t)p->mwf.size;
+
+	git_rwlock_wrunlock(&cache->lock);
+
+done:
+	pack_writer_dispose(&w);
+	git_buf_dispose(&idx_path);
+	git_array_clear(m.entries);
+	git_oidmap_free(m.seen);
+	return error;
+}
+
+/*
+ * Keep the number of packs in check.  The newest packs are merged
+ * together with older ones no larger than all of them combined, so
+ * pack sizes grow geometrically and each object is only rewritten a
+ * logarithmic number of times.  Called with the write lock held.
+ */
+static int cache_maintain(repospanner_cache *cache)
+{
+	struct git_pack_file *p;
+	git_buf lock = GIT_BUF_INIT;
+	size_t len, first, run;
+	int error = 0;
+
+	/* whoever has the lock tidies up for everyone */
+	if ((error = maintenance_lock(&lock, cache)) < 0) {
+		git_buf_dispose(&lock);
+		return error == GIT_ELOCKED ? 0 : error;
+	}
+
+	while (!error && (len = git_vector_length(&cache->packs)) > cache->max_packs) {
+		first = len - 1;
+		p = git_vector_get(&cache->packs, first);
+		run = (size_t)p->mwf.size;
+
+		while (first > 0) {
+			p = git_vector_get(&cache->packs, first - 1);
+			if ((size_t)p->mwf.size > run)
+				break;
+
+			run += (size_t)p->mwf.size;
+			first--;
+		}
+
+		if (first == len - 1)
+			first--;
+
+		error = cache_merge(cache, first, SIZE_MAX);
+	}
+
+	cache_evict(cache);
+	maintenance_unlock(&lock);
+	return error;
+}
+
+int repospanner_cache_add(
+	repospanner_cache *cache,
+	repospanner_cache_object **objects, size_t count)
+{
+	struct pack_writer w = { 0 };
+	git_buf idx_path = GIT_BUF_INIT;
+	size_t i;
+	int error;
+
+	if (!count)
+		return 0;
+
+	if (count > UINT32_MAX) {
+		giterr_set(GITERR_ODB, "too many objects for the repoSpanner cache");
+		return -1;
+	}
+
+	if ((error = git_mutex_lock(&cache->write_lock)) < 0)
+		return error;
+
+	if ((error = git_futils_mkdir(cache->path, 0777, GIT_MKDIR_PATH)) < 0 ||
+	    (error = cache_adopt(cache)) < 0 ||
+	    (error = pack_writer_init(&w, cache->path, (uint32_t)count)) < 0)
+		goto done;
+
+	for (i = 0; i < count; i++) {
+		if ((error = pack_writer_add(&w, &objects[i]->raw)) < 0)
+			goto done;
+	}
+
+	if ((error = pack_writer_finish(&idx_path, &w, cache->path)) < 0 ||
+	    (error = cache_insert(cache, idx_path.ptr)) < 0)
+		goto done;
+
+	/* the objects made it in, even if tidying up fails */
+	if (cache_maintain(cache) < 0)
+		giterr_clear();
+
+done:
+	pack_writer_dispose(&w);
+	git_buf_dispose(&idx_path);
+	git_mutex_unlock(&cache->write_lock);
+	return error;
+}
+
+int repospanner_cache_stream_new(
+	repospanner_cache_stream **out, repospanner_cache *cache)
+{
+	git_indexer_options opts = GIT_INDEXER_OPTIONS_INIT;
+	repospanner_cache_stream *stream;
+
+	stream = git__calloc(1, sizeof(repospanner_cache_stream));
+	GITERR_CHECK_ALLOC(stream);
+
+	stream->cache = cache;
+
+	if (git_futils_mkdir(cache->path, 0777, GIT_MKDIR_PATH) < 0 ||
+	    git_indexer_new(&stream->indexer, cache->path, 0, NULL, &opts) < 0) {
+		git__free(stream);
+		return -1;
+	}
+
+	*out = stream;
+	return 0;
+}
+
+int repospanner_cache_stream_append(
+	repospanner_cache_stream *stream, const void *data, size_t len)
+{
+	return git_indexer_append(stream->indexer, data, len, &stream->stats);
+}
+
+int repospanner_cache_stream_commit(repospanner_cache_stream *stream)
+{
+	repospanner_cache *cache = stream->cache;
+	git_buf idx_path = GIT_BUF_INIT;
+	int error;
+
+	if ((error = git_indexer_commit(stream->indexer, &stream->stats)) < 0)
+		return error;
+
+	/* there is nothing to add */
+	if (!stream->stats.total_objects)
+		return 0;
+
+	if ((error = git_buf_printf(&idx_path, "%s/pack-%s.idx",
+		cache->path, git_oid_tostr_s(git_indexer_hash(stream->indexer)))) < 0)
+		return error;
+
+	if ((error = git_mutex_lock(&cache->write_lock)) < 0)
+		goto done;
+
+	if ((error = cache_adopt(cache)) == 0 &&
+	    (error = cache_insert(cache, idx_path.ptr)) == 0 && cache_maintain(cache) < 0)
+		giterr_clear();
+
+	git_mutex_unlock(&cache->write_lock);
+
+done:
+	git_buf_dispose(&idx_path);
+	return error;
+}
+
+void repospanner_cache_stream_free(repospanner_cache_stream *stream)
+{
+	if (!stream)
+		return;
+
+	git_indexer_free(stream->indexer);
+	git__free(stream);
+}
+
+int repospanner_cache_compact(repospanner_cache *cache)
+{
+	git_buf lock = GIT_BUF_INIT;
+	int error;
+
+	if ((error = git_mutex_lock(&cache->write_lock)) < 0)
+		return error;
+
+	if (!git_path_isdir(cache->path))
+		goto done;
+
+	if ((error = cache_adopt(cache)) < 0 ||
+	    (error = maintenance_lock(&lock, cache)) < 0)
+		goto done;
+
+	if (git_vector_length(&cache->packs) > 1 || cache->size > cache->max_size / 2)
+		error = cache_merge(cache, 0, cache->max_size / 2);
+
+	maintenance_unlock(&lock);
+
+done:
+	git_buf_dispose(&lock);
+	git_mutex_unlock(&cache->write_lock);
+	return error;
+}
+
+/* Find the newest copy of an object; called with the lock held */
+static int cache_find(struct git_pack_entry *e, repospanner_cache *cache, const git_oid *oid)
+{
+	size_t i;
+
+	for (i = git_vector_length(&cache->packs); i > 0; i--) {
+		if (git_pack_entry_find(e, git_vector_get(&cache->packs, i - 1), oid, GIT_OID_HEXSZ) == 0)
+			return 0;
+	}
+
+	for (i = git_vector_length(&cache->found); i > 0; i--) {
+		if (git_pack_entry_find(e, git_vector_get(&cache->found, i - 1), oid, GIT_OID_HEXSZ) == 0)
+			return 0;
+	}
+
+	giterr_clear();
+	return GIT_ENOTFOUND;
+}
+
+static int cache_scan__cb(void *payload, git_buf *path)
+{
+	git_vector *scanned = payload;
+	struct git_pack_file *p;
+
+	if (git__suffixcmp(path->ptr, ".idx") != 0)
+		return 0;
+
+	/* packs still being written have no index yet, broken ones are skipped */
+	if (git_mwindow_get_pack(&p, path->ptr) < 0) {
+		giterr_clear();
+		return 0;
+	}
+
+	if (git_vector_insert(scanned, p) < 0) {
+		git_mwindow_put_pack(p);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Look for packs other processes added since the directory was last
+ * looked at, and return whether there were any.
+ */
+static bool cache_rescan(repospanner_cache *cache)
+{
+	git_vector scanned = GIT_VECTOR_INIT;
+	git_buf dir = GIT_BUF_INIT;
+	struct git_pack_file *p;
+	bool added = false;
+	size_t i;
+
+	if (git_mutex_lock(&cache->scan_lock) < 0) {
+		giterr_clear();
+		return false;
+	}
+
+	if (git_futils_filestamp_check(&cache->stamp, cache->path) <= 0 ||
+	    git_buf_sets(&dir, cache->path) < 0 ||
+	    git_path_direach(&dir, 0, cache_scan__cb, &scanned) < 0 ||
+	    git_rwlock_wrlock(&cache->lock) < 0) {
+		giterr_clear();
+		goto done;
+	}
+
+	git_vector_foreach(&scanned, i, p) {
+		if (pack_known(&cache->packs, p) || pack_known(&cache->found, p) ||
+		    git_vector_insert(&cache->found, p) < 0)
+			continue;
+
+		scanned.contents[i] = NULL;
+		added = true;
+	}
+
+	git_rwlock_wrunlock(&cache->lock);
+
+done:
+	git_vector_foreach(&scanned, i, p) {
+		if (p)
+			git_mwindow_put_pack(p);
+	}
+
+	git_vector_free(&scanned);
+	git_buf_dispose(&dir);
+	git_mutex_unlock(&cache->scan_lock);
+	return added;
+}
+
+static int cache_read(git_rawobj *out, repospanner_cache *cache, const git_oid *oid)
+{
+	struct git_pack_entry e;
+	int error;
+
+	if ((error = git_rwlock_rdlock(&cache->lock)) < 0)
+		return error;
+
+	/* a damaged cache just means fetching the object again */
+	if ((error = cache_find(&e, cache, oid)) == 0 &&
+	    (error = git_packfile_unpack(out, e.p, &e.offset)) < 0) {
+		giterr_clear();
+		error = GIT_ENOTFOUND;
+	}
+
+	git_rwlock_rdunlock(&cache->lock);
+	return error;
+}
+
+int repospanner_cache_read(git_rawobj *out, repospanner_cache *cache, const git_oid *oid)
+{
+	int error = cache_read(out, cache, oid);
+
+	if (error == GIT_ENOTFOUND && cache_rescan(cache))
+		error = cache_read(out, cache, oid);
+
+	return error;
+}
+
+static int cache_read_header(
+	size_t *len_p, git_otype *type_p,
+	repospanner_cache *cache, const git_oid *oid)
+{
+	struct git_pack_entry e;
+	int error;
+
+	if ((error = git_rwlock_rdlock(&cache->lock)) < 0)
+		return error;
+
+	if ((error = cache_find(&e, cache, oid)) == 0 &&
+	    (error = git_packfile_resolve_header(len_p, type_p, e.p, e.offset)) < 0) {
+		giterr_clear();
+		error = GIT_ENOTFOUND;
+	}
+
+	git_rwlock_rdunlock(&cache->lock);
+	return error;
+}
+
+int repospanner_cache_read_header(
+	size_t *len_p, git_otype *type_p,
+	repospanner_cache *cache, const git_oid *oid)
+{
+	int error = cache_read_header(len_p, type_p, cache, oid);
+
+	if (error == GIT_ENOTFOUND && cache_rescan(cache))
+		error = cache_read_header(len_p, type_p, cache, oid);
+
+	return error;
+}
+
+static bool cache_exists(repospanner_cache *cache, const git_oid *oid)
+{
+	struct git_pack_entry e;
+	bool found;
+
+	if (git_rwlock_rdlock(&cache->lock) < 0) {
+		giterr_clear();
+		return false;
+	}
+
+	found = (cache_find(&e, cache, oid) == 0);
+
+	git_rwlock_rdunlock(&cache->lock);
+	return found;
+}
+
+bool repospanner_cache_exists(repospanner_cache *cache, const git_oid *oid)
+{
+	return cache_exists(cache, oid) ||
+		(cache_rescan(cache) && cache_exists(cache, oid));
+}
+
+static int cache_load__cb(void *payload, git_buf *path)
+{
+	repospanner_cache *cache = payload;
+	struct git_pack_file *p;
+
+	if (git__suffixcmp(path->ptr, ".idx") != 0)
+		return 0;
+
+	/* leftovers from an interrupted write are of no use */
+	if (git_mwindow_get_pack(&p, path->ptr) < 0) {
+		giterr_clear();
+		return 0;
+	}
+
+	if (git_vector_insert(&cache->packs, p) < 0) {
+		git_mwindow_put_pack(p);
+		return -1;
+	}
+
+	cache->size += (size_t)p->mwf.size;
+	return 0;
+}
+
+int repospanner_cache_open(
+	repospanner_cache **out, const char *path,
+	size_t max_size, size_t max_packs)
+{
+	repospanner_cache *cache;
+	git_buf dir = GIT_BUF_INIT;
+	int error = 0;
+
+	assert(out && path);
+
+	cache = git__calloc(1, sizeof(repospanner_cache));
+	GITERR_CHECK_ALLOC(cache);
+
+	cache->max_size = max_size;
+	cache->max_packs = max_packs ? max_packs : 1;
+
+	if ((cache->path = git__strdup(path)) == NULL ||
+	    git_vector_init(&cache->packs, 0, pack_cmp_mtime) < 0 ||
+	    git_vector_init(&cache->found, 0, NULL) < 0) {
+		error = -1;
+		goto fail;
+	}
+
+	if (git_rwlock_init(&cache->lock) < 0 || git_mutex_init(&cache->write_lock) < 0 ||
+	    git_mutex_init(&cache->scan_lock) < 0) {
+		giterr_set(GITERR_OS, "failed to initialize repoSpanner cache lock");
+		error = -1;
+		goto fail;
+	}
+
+	/* anything added while we look is found by the next rescan */
+	if (git_path_isdir(path)) {
+		git_futils_filestamp_check(&cache->stamp, path);
+
+		if ((error = git_buf_sets(&dir, path)) < 0 ||
+		    (error = git_path_direach(&dir, 0, cache_load__cb, cache)) < 0)
+			goto fail;
+	}
+
+	git_vector_sort(&cache->packs);
+
+	/* the limits may have changed since the packs were written */
+	if (git_vector_length(&cache->packs)) {
+		if (maintenance_lock(&dir, cache) == 0) {
+			cache_evict(cache);
+			maintenance_unlock(&dir);
+		} else {
+			giterr_clear();
+		}
+	}
+
+	git_buf_dispose(&dir);
+	*out = cache;
+	return 0;
+
+fail:
+	git_buf_dispose(&dir);
+	repospanner_cache_free(cache);
+	return error;
+}
+
+void repospanner_cache_free(repospanner_cache *cache)
+{
+	struct git_pack_file *p;
+	size_t i;
+
+	if (!cache)
+		return;
+
+	git_vector_foreach(&cache->packs, i, p)
+		git_mwindow_put_pack(p);
+	git_vector_free(&cache->packs);
+
+	git_vector_foreach(&cache->found, i, p)
+		git_mwindow_put_pack(p);
+	git_vector_free(&cache->found);
+
+	git_rwlock_free(&cache->lock);
+	git_mutex_free(&cache->write_lock);
+	git_mutex_free(&cache->scan_lock);
+	git__free(cache->path);
+	git__free(cache);
+}
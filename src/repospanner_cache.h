@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) the libgit2 contributors. All rights reserved.
+ *
+ * This file is part of libgit2, distributed under the GNU GPL v2 with
+ * a Linking Exception. For full terms see the included COPYING file.
+ */
+#ifndef INCLUDE_repospanner_cache_h__
+#define INCLUDE_repospanner_cache_h__
+
+#include "common.h"
+
+#include "git2/oid.h"
+#include "odb.h"
+
+/*
+ * Local cache of objects fetched from repoSpanner.
+ *
+ * Objects are appended in batches, each batch becoming a packfile of
+ * its own in the cache directory, so that lookups go through the pack
+ * indexes rather than one file per object.  Once there are too many
+ * packs, the newest ones are merged; once the cache grows beyond its
+ * size limit, the oldest packs are dropped.
+ *
+ * Several processes may share the directory.  Packs only appear once
+ * complete, lookups that miss pick up the ones others added since, and
+ * a lock file lets a single process at a time merge or drop packs.
+ */
+typedef struct repospanner_cache repospanner_cache;
+
+typedef struct {
+	git_oid oid;
+	git_rawobj raw;
+} repospanner_cache_object;
+
+extern int repospanner_cache_open(
+	repospanner_cache **out, const char *path,
+	size_t max_size, size_t max_packs);
+extern void repospanner_cache_free(repospanner_cache *cache);
+
+/* These return GIT_ENOTFOUND, without an error set, on a miss */
+extern int repospanner_cache_read(
+	git_rawobj *out, repospanner_cache *cache, const git_oid *oid);
+extern int repospanner_cache_read_header(
+	size_t *len_p, git_otype *type_p,
+	repospanner_cache *cache, const git_oid *oid);
+extern bool repospanner_cache_exists(repospanner_cache *cache, const git_oid *oid);
+
+/* Write a batch of objects to the cache as one pack */
+extern int repospanner_cache_add(
+	repospanner_cache *cache,
+	repospanner_cache_object **objects, size_t count);
+
+/*
+ * Index a pack as it is being received, and add it to the cache once
+ * complete.  The pack must not be thin.
+ */
+typedef struct repospanner_cache_stream repospanner_cache_stream;
+
+extern int repospanner_cache_stream_new(
+	repospanner_cache_stream **out, repospanner_cache *cache);
+extern int repospanner_cache_stream_append(
+	repospanner_cache_stream *stream, const void *data, size_t len);
+extern int repospanner_cache_stream_commit(repospanner_cache_stream *stream);
+extern void repospanner_cache_stream_free(repospanner_cache_stream *stream);
+
+/*
+ * Merge all packs into one, dropping the oldest objects so the result
+ * only takes up half of the size limit.
+ */
+extern int repospanner_cache_compact(repospanner_cache *cache);
+
+#endif
@@ -52,6 +52,9 @@ struct git_transaction {
 
 	git_strmap *locks;
 	git_pool pool;
+
+	/* the payload of the last lock taken, which the next one joins */
+	void *last_lock;
 };
 
 int git_transaction_config_new(git_transaction **out, git_config *cfg)
@@ -116,6 +119,7 @@ int git_transaction_lock_ref(git_transaction *tx, const char *refname)
 	node->name = git_pool_strdup(&tx->pool, refname);
 	GITERR_CHECK_ALLOC(node->name);
 
+	node->payload = tx->last_lock;
 	if ((error = git_refdb_lock(&node->payload, tx->db, refname)) < 0)
 		return error;
 
@@ -123,6 +127,7 @@ int git_transaction_lock_ref(git_transaction *tx, const char *refname)
 	if (error < 0) 
 		goto cleanup;
 
+	tx->last_lock = node->payload;
 	return 0;
 
 cleanup:
@@ -338,7 +343,25 @@ int git_transaction_commit(git_transaction *tx)
 			if ((error = tx->db->backend->reflog_write(tx->db->backend, node->reflog)) < 0)
 				return error;
 		}
+	});
+
+	/*
+	 * Release the refs we are not updating before the ones we are,
+	 * so that backends which apply all updates at once can do so
+	 * when the last lock goes away.
+	 */
+	git_strmap_foreach_value(tx->locks, node, {
+		if (node->ref_type != GIT_REF_INVALID)
+			continue;
+
+		error = git_refdb_unlock(tx->db, node->payload, false, false, NULL, NULL, NULL);
+		node->committed = true;
 
+		if (error < 0)
+			return error;
+	});
+
+	git_strmap_foreach_value(tx->locks, node, {
 		if (node->ref_type != GIT_REF_INVALID) {
 			if ((error = update_target(tx->db, node)) < 0)
 				return error;
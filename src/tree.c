@@ -13,6 +13,7 @@
 #include "fileops.h"
 #include "tree-cache.h"
 #include "index.h"
+#include "odb.h"
 
 #define DEFAULT_TREE_SIZE 16
 #define MAX_FILEMODE_BYTES 6
@@ -949,6 +950,52 @@ int git_tree_entry_bypath(
 	return error;
 }
 
+void git_tree__prefetch(const git_tree *tree, bool blobs)
+{
+	git_array_t(git_oid) ids = GIT_ARRAY_INIT;
+	const git_tree_entry *entry;
+	git_odb *odb;
+	git_oid *id;
+	size_t i;
+
+	if (git_repository_odb__weakptr(&odb, tree->object.repo) < 0)
+		goto on_error;
+
+	if (!git_odb__has_prefetch(odb))
+		return;
+
+	git_array_foreach(tree->entries, i, entry) {
+		if (!git_tree_entry__is_tree(entry) &&
+		    (!blobs || S_ISGITLINK(entry->attr)))
+			continue;
+
+		if ((id = git_array_alloc(ids)) == NULL)
+			goto on_error;
+		git_oid_cpy(id, entry->oid);
+	}
+
+	if (git_odb_prefetch(odb, ids.ptr, ids.size) < 0)
+		goto on_error;
+
+	git_array_clear(ids);
+	return;
+
+on_error:
+	/* this is only a hint, so failing to give it is not an error */
+	giterr_clear();
+	git_array_clear(ids);
+}
+
+void git_tree__prefetch_closure(const git_tree *tree)
+{
+	git_odb *odb;
+
+	/* as with the other hints, failing to give it is not an error */
+	if (git_repository_odb__weakptr(&odb, tree->object.repo) < 0 ||
+	    git_odb_prefetch_tree(odb, git_tree_id(tree)) < 0)
+		giterr_clear();
+}
+
 static int tree_walk(
 	const git_tree *tree,
 	git_treewalk_cb callback,
@@ -960,6 +1007,9 @@ static int tree_walk(
 	size_t i;
 	const git_tree_entry *entry;
 
+	/* we are going to descend into all of the subtrees */
+	git_tree__prefetch(tree, false);
+
 	git_array_foreach(tree->entries, i, entry) {
 		if (preorder) {
 			error = callback(path->ptr, entry, payload);
@@ -1024,6 +1074,8 @@ int git_tree_walk(
 		return -1;
 	}
 
+	git_tree__prefetch_closure(tree);
+
 	error = tree_walk(
 		tree, callback, &root_path, payload, (mode == GIT_TREEWALK_PRE));
 
@@ -43,6 +43,18 @@ void git_tree__free(void *tree);
 int git_tree__parse(void *tree, git_odb_object *obj);
 int git_tree__parse_raw(void *_tree, const char *data, size_t size);
 
+/**
+ * Hint the object database that the subtrees of `tree` (and its blobs,
+ * if `blobs` is set) are about to be read.  Failures are ignored.
+ */
+void git_tree__prefetch(const git_tree *tree, bool blobs);
+
+/**
+ * Hint the object database that all of `tree` is about to be walked,
+ * so its subtrees can be fetched in one go.  Failures are ignored.
+ */
+void git_tree__prefetch_closure(const git_tree *tree);
+
 /**
  * Write a tree to the given repository
  */
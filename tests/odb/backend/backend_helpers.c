@@ -123,6 +123,48 @@ static int fake_backend__read_prefix(
 	return 0;
 }
 
+static int fake_backend__read_many(
+	git_odb_backend *backend, const git_oid *ids, size_t count,
+	git_odb_backend_read_cb cb, void *payload)
+{
+	const fake_object *obj;
+	fake_backend *fake;
+	size_t i;
+	int error;
+
+	fake = (fake_backend *)backend;
+
+	fake->read_many_calls++;
+
+	for (i = 0; i < count; i++) {
+		if ((error = search_object(&obj, fake, &ids[i], GIT_OID_HEXSZ)) == GIT_ENOTFOUND)
+			continue;
+		if (error < 0)
+			return error;
+
+		if ((error = cb(&ids[i], git__strdup(obj->content),
+				strlen(obj->content), GIT_OBJ_BLOB, payload)) < 0)
+			return error;
+	}
+
+	return 0;
+}
+
+static int fake_backend__prefetch(
+	git_odb_backend *backend, const git_oid *ids, size_t count)
+{
+	fake_backend *fake;
+
+	GIT_UNUSED(ids);
+
+	fake = (fake_backend *)backend;
+
+	fake->prefetch_calls++;
+	fake->prefetched += count;
+
+	return 0;
+}
+
 static void fake_backend__free(git_odb_backend *_backend)
 {
 	fake_backend *backend;
@@ -151,6 +193,8 @@ int build_fake_backend(
 	backend->parent.read_header = fake_backend__read_header;
 	backend->parent.exists = fake_backend__exists;
 	backend->parent.exists_prefix = fake_backend__exists_prefix;
+	backend->parent.read_many = fake_backend__read_many;
+	backend->parent.prefetch = fake_backend__prefetch;
 	backend->parent.free = &fake_backend__free;
 
 	*out = (git_odb_backend *)backend;
@@ -13,6 +13,9 @@ typedef struct {
 	int read_calls;
 	int read_header_calls;
 	int read_prefix_calls;
+	int read_many_calls;
+	int prefetch_calls;
+	size_t prefetched;
 
 	const fake_object *objects;
 } fake_backend;
@@ -0,0 +1,87 @@
+#include "clar_libgit2.h"
+#include "repository.h"
+#include "backend_helpers.h"
+#include "tree.h"
+
+#define FOOBAR_HASH "f6ea0495187600e7b2288c8ac19c5886383a4632"
+#define PACKED_HASH "a65fedf39aefe402d3bb6e24df4d4f5fe4547750"
+#define LOOSE_HASH "a71586c1dfe8a71c6cbf6c129f404c5642ff31bd"
+
+static git_repository *_repo;
+static git_odb *_odb;
+static fake_backend *_fake;
+
+static const fake_object _objects[] = {
+	{ FOOBAR_HASH, "foobar" },
+	{ NULL, NULL }
+};
+
+void test_odb_backend_prefetch__initialize(void)
+{
+	git_odb_backend *backend;
+
+	_repo = cl_git_sandbox_init("testrepo.git");
+
+	cl_git_pass(build_fake_backend(&backend, _objects));
+	cl_git_pass(git_repository_odb__weakptr(&_odb, _repo));
+	cl_git_pass(git_odb_add_backend(_odb, backend, 0));
+
+	_fake = (fake_backend *)backend;
+}
+
+void test_odb_backend_prefetch__cleanup(void)
+{
+	cl_git_sandbox_cleanup();
+}
+
+void test_odb_backend_prefetch__only_remote_objects_are_prefetched(void)
+{
+	git_oid ids[3];
+
+	cl_git_pass(git_oid_fromstr(&ids[0], PACKED_HASH));
+	cl_git_pass(git_oid_fromstr(&ids[1], FOOBAR_HASH));
+	cl_git_pass(git_oid_fromstr(&ids[2], LOOSE_HASH));
+
+	cl_git_pass(git_odb_prefetch(_odb, ids, 3));
+
+	cl_assert_equal_i(1, _fake->prefetch_calls);
+	cl_assert_equal_sz(1, _fake->prefetched);
+}
+
+void test_odb_backend_prefetch__nothing_to_prefetch(void)
+{
+	git_oid ids[2];
+
+	cl_git_pass(git_oid_fromstr(&ids[0], PACKED_HASH));
+	cl_git_pass(git_oid_fromstr(&ids[1], LOOSE_HASH));
+
+	cl_git_pass(git_odb_prefetch(_odb, ids, 2));
+
+	cl_assert_equal_i(0, _fake->prefetch_calls);
+}
+
+void test_odb_backend_prefetch__trees_hint_their_entries(void)
+{
+	git_treebuilder *builder;
+	git_tree *tree;
+	git_oid id;
+
+	cl_git_pass(git_treebuilder_new(&builder, _repo, NULL));
+	cl_git_pass(git_oid_fromstr(&id, FOOBAR_HASH));
+	cl_git_pass(git_treebuilder_insert(NULL, builder, "foobar", &id, GIT_FILEMODE_BLOB));
+	cl_git_pass(git_oid_fromstr(&id, LOOSE_HASH));
+	cl_git_pass(git_treebuilder_insert(NULL, builder, "new.txt", &id, GIT_FILEMODE_BLOB));
+	cl_git_pass(git_treebuilder_write(&id, builder));
+	cl_git_pass(git_tree_lookup(&tree, _repo, &id));
+
+	/* there are no subtrees */
+	git_tree__prefetch(tree, false);
+	cl_assert_equal_i(0, _fake->prefetch_calls);
+
+	git_tree__prefetch(tree, true);
+	cl_assert_equal_i(1, _fake->prefetch_calls);
+	cl_assert_equal_sz(1, _fake->prefetched);
+
+	git_tree_free(tree);
+	git_treebuilder_free(builder);
+}
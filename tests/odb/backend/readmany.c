@@ -0,0 +1,108 @@
+#include "clar_libgit2.h"
+#include "repository.h"
+#include "backend_helpers.h"
+
+#define EXISTING_HASH "e69de29bb2d1d6434b8b29ae775ad8c2e48c5391"
+#define FOOBAR_HASH "f6ea0495187600e7b2288c8ac19c5886383a4632"
+#define NONEXISTING_HASH "deadbeefdeadbeefdeadbeefdeadbeefdeadbeef"
+#define PACKED_HASH "a65fedf39aefe402d3bb6e24df4d4f5fe4547750"
+
+static git_repository *_repo;
+static git_odb *_odb;
+static fake_backend *_fake;
+static git_odb_object *_objs[4];
+
+static const fake_object _objects[] = {
+	{ EXISTING_HASH, "" },
+	{ FOOBAR_HASH, "foobar" },
+	{ NULL, NULL }
+};
+
+void test_odb_backend_readmany__initialize(void)
+{
+	git_odb_backend *backend;
+
+	_repo = cl_git_sandbox_init("testrepo.git");
+
+	cl_git_pass(build_fake_backend(&backend, _objects));
+	cl_git_pass(git_repository_odb__weakptr(&_odb, _repo));
+	cl_git_pass(git_odb_add_backend(_odb, backend, 0));
+
+	_fake = (fake_backend *)backend;
+	memset(_objs, 0, sizeof(_objs));
+}
+
+void test_odb_backend_readmany__cleanup(void)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(_objs); i++)
+		git_odb_object_free(_objs[i]);
+
+	cl_git_sandbox_cleanup();
+}
+
+void test_odb_backend_readmany__reads_all_objects_in_one_call(void)
+{
+	git_oid ids[3];
+
+	cl_git_pass(git_oid_fromstr(&ids[0], EXISTING_HASH));
+	cl_git_pass(git_oid_fromstr(&ids[1], FOOBAR_HASH));
+	cl_git_pass(git_oid_fromstr(&ids[2], PACKED_HASH));
+
+	cl_git_pass(git_odb_read_many(_objs, _odb, ids, 3));
+
+	cl_assert_equal_s("", git_odb_object_data(_objs[0]));
+	cl_assert_equal_s("foobar", git_odb_object_data(_objs[1]));
+	cl_assert_equal_i(GIT_OBJ_COMMIT, git_odb_object_type(_objs[2]));
+
+	/* the packed commit is found before the fake backend is asked */
+	cl_assert_equal_i(1, _fake->read_many_calls);
+	cl_assert_equal_i(0, _fake->read_calls);
+}
+
+void test_odb_backend_readmany__missing_objects_are_reported(void)
+{
+	git_oid ids[3];
+
+	cl_git_pass(git_oid_fromstr(&ids[0], FOOBAR_HASH));
+	cl_git_pass(git_oid_fromstr(&ids[1], NONEXISTING_HASH));
+	cl_git_pass(git_oid_fromstr(&ids[2], EXISTING_HASH));
+
+	cl_git_fail_with(GIT_ENOTFOUND, git_odb_read_many(_objs, _odb, ids, 3));
+
+	cl_assert(_objs[0] != NULL);
+	cl_assert(_objs[1] == NULL);
+	cl_assert(_objs[2] != NULL);
+}
+
+void test_odb_backend_readmany__duplicates_are_read_once(void)
+{
+	git_oid ids[4];
+
+	cl_git_pass(git_oid_fromstr(&ids[0], FOOBAR_HASH));
+	cl_git_pass(git_oid_fromstr(&ids[1], EXISTING_HASH));
+	cl_git_pass(git_oid_fromstr(&ids[2], FOOBAR_HASH));
+	cl_git_pass(git_oid_fromstr(&ids[3], FOOBAR_HASH));
+
+	cl_git_pass(git_odb_read_many(_objs, _odb, ids, 4));
+
+	cl_assert_equal_s("foobar", git_odb_object_data(_objs[0]));
+	cl_assert_equal_s("foobar", git_odb_object_data(_objs[2]));
+	cl_assert_equal_s("foobar", git_odb_object_data(_objs[3]));
+	cl_assert_equal_i(1, _fake->read_many_calls);
+}
+
+void test_odb_backend_readmany__local_objects_do_not_reach_the_backend(void)
+{
+	git_oid ids[2];
+
+	cl_git_pass(git_oid_fromstr(&ids[0], PACKED_HASH));
+	cl_git_pass(git_oid_fromstr(&ids[1], "be3563ae3f795b2b4353bcce3a527ad0a4f7f644"));
+
+	cl_git_pass(git_odb_read_many(_objs, _odb, ids, 2));
+
+	cl_assert_equal_i(GIT_OBJ_COMMIT, git_odb_object_type(_objs[0]));
+	cl_assert_equal_i(GIT_OBJ_COMMIT, git_odb_object_type(_objs[1]));
+	cl_assert_equal_i(0, _fake->read_many_calls);
+}
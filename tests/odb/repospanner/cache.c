@@ -0,0 +1,212 @@
+#include "clar_libgit2.h"
+#include "fileops.h"
+#include "repospanner_cache.h"
+
+#define CACHE_DIR "rscache"
+
+static repospanner_cache *_cache;
+
+static const char *_contents[] = {
+	"one\n", "two\n", "three\n", "four\n", "five\n", "six\n"
+};
+
+void test_odb_repospanner_cache__cleanup(void)
+{
+	repospanner_cache_free(_cache);
+	_cache = NULL;
+
+	if (git_path_isdir(CACHE_DIR))
+		cl_git_pass(git_futils_rmdir_r(CACHE_DIR, NULL, GIT_RMDIR_REMOVE_FILES));
+}
+
+static void object_for(repospanner_cache_object *obj, size_t i)
+{
+	obj->raw.data = (void *)_contents[i];
+	obj->raw.len = strlen(_contents[i]);
+	obj->raw.type = GIT_OBJ_BLOB;
+
+	cl_git_pass(git_odb_hash(&obj->oid, obj->raw.data, obj->raw.len, obj->raw.type));
+}
+
+/* Add the objects from `first` to `last`, inclusive, as one batch */
+static void add_objects_to(repospanner_cache *cache, size_t first, size_t last)
+{
+	repospanner_cache_object objects[ARRAY_SIZE(_contents)];
+	repospanner_cache_object *batch[ARRAY_SIZE(_contents)];
+	size_t i;
+
+	for (i = first; i <= last; i++) {
+		object_for(&objects[i], i);
+		batch[i - first] = &objects[i];
+	}
+
+	cl_git_pass(repospanner_cache_add(cache, batch, last - first + 1));
+}
+
+static void add_objects(size_t first, size_t last)
+{
+	add_objects_to(_cache, first, last);
+}
+
+static bool has_object(size_t i)
+{
+	repospanner_cache_object obj;
+	git_rawobj raw;
+	size_t len;
+	git_otype type;
+	int error;
+
+	object_for(&obj, i);
+
+	if ((error = repospanner_cache_read(&raw, _cache, &obj.oid)) == GIT_ENOTFOUND) {
+		cl_assert(giterr_last() == NULL);
+		cl_assert(!repospanner_cache_exists(_cache, &obj.oid));
+		return false;
+	}
+
+	cl_git_pass(error);
+	cl_assert_equal_i(GIT_OBJ_BLOB, raw.type);
+	cl_assert_equal_s(_contents[i], raw.data);
+	git__free(raw.data);
+
+	cl_git_pass(repospanner_cache_read_header(&len, &type, _cache, &obj.oid));
+	cl_assert_equal_sz(strlen(_contents[i]), len);
+	cl_assert_equal_i(GIT_OBJ_BLOB, type);
+
+	cl_assert(repospanner_cache_exists(_cache, &obj.oid));
+	return true;
+}
+
+static int count_packs__cb(void *payload, git_buf *path)
+{
+	size_t *count = payload;
+
+	if (!git__suffixcmp(path->ptr, ".idx"))
+		(*count)++;
+
+	return 0;
+}
+
+static size_t count_packs(void)
+{
+	git_buf path = GIT_BUF_INIT;
+	size_t count = 0;
+
+	cl_git_pass(git_buf_sets(&path, CACHE_DIR));
+	cl_git_pass(git_path_direach(&path, 0, count_packs__cb, &count));
+	git_buf_dispose(&path);
+
+	return count;
+}
+
+void test_odb_repospanner_cache__read_back(void)
+{
+	cl_git_pass(repospanner_cache_open(&_cache, CACHE_DIR, SIZE_MAX, 8));
+	cl_assert(!has_object(0));
+
+	add_objects(0, 2);
+
+	cl_assert(has_object(0));
+	cl_assert(has_object(1));
+	cl_assert(has_object(2));
+	cl_assert(!has_object(3));
+	cl_assert_equal_sz(1, count_packs());
+}
+
+void test_odb_repospanner_cache__reopen(void)
+{
+	cl_git_pass(repospanner_cache_open(&_cache, CACHE_DIR, SIZE_MAX, 8));
+	add_objects(0, 1);
+	add_objects(2, 3);
+	repospanner_cache_free(_cache);
+
+	cl_git_pass(repospanner_cache_open(&_cache, CACHE_DIR, SIZE_MAX, 8));
+	cl_assert(has_object(0));
+	cl_assert(has_object(3));
+}
+
+void test_odb_repospanner_cache__packs_are_merged(void)
+{
+	size_t i;
+
+	cl_git_pass(repospanner_cache_open(&_cache, CACHE_DIR, SIZE_MAX, 2));
+
+	for (i = 0; i < ARRAY_SIZE(_contents); i++) {
+		add_objects(i, i);
+		cl_assert(count_packs() <= 2);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(_contents); i++)
+		cl_assert(has_object(i));
+}
+
+void test_odb_repospanner_cache__oldest_packs_are_evicted(void)
+{
+	/* too small for anything but the newest pack */
+	cl_git_pass(repospanner_cache_open(&_cache, CACHE_DIR, 1, 8));
+
+	add_objects(0, 1);
+	add_objects(2, 3);
+
+	cl_assert(!has_object(0));
+	cl_assert(!has_object(1));
+	cl_assert(has_object(2));
+	cl_assert(has_object(3));
+	cl_assert_equal_sz(1, count_packs());
+}
+
+void test_odb_repospanner_cache__compact(void)
+{
+	size_t i;
+
+	cl_git_pass(repospanner_cache_open(&_cache, CACHE_DIR, SIZE_MAX, 8));
+
+	add_objects(0, 1);
+	add_objects(1, 3);
+	add_objects(4, 5);
+	cl_assert_equal_sz(3, count_packs());
+
+	cl_git_pass(repospanner_cache_compact(_cache));
+	cl_assert_equal_sz(1, count_packs());
+
+	for (i = 0; i < ARRAY_SIZE(_contents); i++)
+		cl_assert(has_object(i));
+}
+
+void test_odb_repospanner_cache__packs_of_other_processes_are_found(void)
+{
+	repospanner_cache *other;
+
+	cl_git_pass(repospanner_cache_open(&_cache, CACHE_DIR, SIZE_MAX, 8));
+	cl_assert(!has_object(0));
+
+	/* as if another process using the same directory wrote them */
+	cl_git_pass(repospanner_cache_open(&other, CACHE_DIR, SIZE_MAX, 8));
+	add_objects_to(other, 0, 1);
+	repospanner_cache_free(other);
+
+	cl_assert(has_object(0));
+	cl_assert(has_object(1));
+	cl_assert(!has_object(2));
+}
+
+void test_odb_repospanner_cache__maintenance_is_left_to_the_lock_holder(void)
+{
+	cl_git_pass(repospanner_cache_open(&_cache, CACHE_DIR, SIZE_MAX, 1));
+	add_objects(0, 0);
+
+	/* as if another process were merging packs right now */
+	cl_git_mkfile(CACHE_DIR "/maintenance.lock", "");
+
+	add_objects(1, 1);
+	add_objects(2, 2);
+	cl_assert_equal_sz(3, count_packs());
+	cl_git_fail_with(GIT_ELOCKED, repospanner_cache_compact(_cache));
+
+	cl_must_pass(p_unlink(CACHE_DIR "/maintenance.lock"));
+
+	add_objects(3, 3);
+	cl_assert_equal_sz(1, count_packs());
+	cl_assert(has_object(0));
+	cl_assert(has_object(3));
+}
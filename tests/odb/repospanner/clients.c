@@ -0,0 +1,127 @@
+#include "clar_libgit2.h"
+#include "git2/sys/repospanner.h"
+#include "thread-utils.h"
+#include "repospanner_helpers.h"
+
+/* more than the registry keeps once nobody uses them */
+#define REPO_COUNT 20
+#define THREAD_COUNT 8
+
+static git_repository *_repo;
+
+void test_odb_repospanner_clients__initialize(void)
+{
+	repospanner_helpers_configure(cl_git_sandbox_init("testrepo.git"), REPOSPANNER_UNREACHABLE_URL);
+	_repo = NULL;
+}
+
+void test_odb_repospanner_clients__cleanup(void)
+{
+	git_repository_free(_repo);
+	cl_git_sandbox_cleanup();
+}
+
+static void read_missing(git_repository *repo)
+{
+	git_odb_object *obj;
+	git_odb *odb;
+	git_oid id;
+
+	cl_git_pass(git_repository_odb(&odb, repo));
+	cl_git_pass(git_oid_fromstr(&id, "deadbeefdeadbeefdeadbeefdeadbeefdeadbeef"));
+	cl_git_fail(git_odb_read(&obj, odb, &id));
+	git_odb_free(odb);
+}
+
+void test_odb_repospanner_clients__are_shared_by_repositories_of_a_directory(void)
+{
+	git_repospanner_handle_stats before, after;
+	git_repository *other;
+
+	cl_git_pass(git_repository_open(&_repo, "testrepo.git"));
+	cl_git_pass(git_repository_open(&other, "testrepo.git"));
+
+	cl_git_pass(git_repospanner_get_handle_stats(&before, other));
+	read_missing(_repo);
+	cl_git_pass(git_repospanner_get_handle_stats(&after, other));
+
+	cl_assert(after.requests > before.requests);
+
+	git_repository_free(other);
+}
+
+void test_odb_repospanner_clients__outlive_their_repositories(void)
+{
+	git_repospanner_handle_stats before, after;
+
+	cl_git_pass(git_repository_open(&_repo, "testrepo.git"));
+	read_missing(_repo);
+	cl_git_pass(git_repospanner_get_handle_stats(&before, _repo));
+	git_repository_free(_repo);
+	cl_assert(before.requests > 0);
+
+	cl_git_pass(git_repository_open(&_repo, "testrepo.git"));
+	cl_git_pass(git_repospanner_get_handle_stats(&after, _repo));
+	cl_assert_equal_i(before.requests, after.requests);
+}
+
+void test_odb_repospanner_clients__idle_ones_are_freed(void)
+{
+	git_repository *repo;
+	char path[32];
+	int i;
+
+	for (i = 0; i < REPO_COUNT; i++) {
+		p_snprintf(path, sizeof(path), "clients%d.git", i);
+		cl_git_pass(git_repository_init(&repo, path, true));
+		repospanner_helpers_configure(repo, REPOSPANNER_UNREACHABLE_URL);
+		git_repository_free(repo);
+
+		cl_git_pass(git_repository_open(&repo, path));
+		read_missing(repo);
+		git_repository_free(repo);
+	}
+
+	/* the first ones are gone, and set up again when needed */
+	for (i = 0; i < REPO_COUNT; i++) {
+		p_snprintf(path, sizeof(path), "clients%d.git", i);
+		cl_git_pass(git_repository_open(&repo, path));
+		read_missing(repo);
+		git_repository_free(repo);
+		cl_fixture_cleanup(path);
+	}
+}
+
+#ifdef GIT_THREADS
+static void *open_and_read(void *arg)
+{
+	git_repository *repo;
+	int i;
+
+	GIT_UNUSED(arg);
+
+	for (i = 0; i < 10; i++) {
+		cl_git_pass(git_repository_open(&repo, "testrepo.git"));
+		read_missing(repo);
+		git_repository_free(repo);
+	}
+
+	return NULL;
+}
+#endif
+
+void test_odb_repospanner_clients__can_be_used_from_many_threads(void)
+{
+#ifdef GIT_THREADS
+	git_thread threads[THREAD_COUNT];
+	int i;
+
+	for (i = 0; i < THREAD_COUNT; i++)
+		cl_git_pass(git_thread_create(&threads[i], open_and_read, NULL));
+
+	for (i = 0; i < THREAD_COUNT; i++)
+		cl_git_pass(git_thread_join(&threads[i], NULL));
+#else
+	cl_skip();
+#endif
+}
@@ -0,0 +1,78 @@
+#include "clar_libgit2.h"
+#include "repospanner_helpers.h"
+
+static git_repository *_repo;
+static git_odb *_odb;
+
+void test_odb_repospanner_prefix__initialize(void)
+{
+	git_repository *repo = cl_git_sandbox_init("testrepo.git");
+
+	repospanner_helpers_configure(repo, REPOSPANNER_UNREACHABLE_URL);
+	cl_git_pass(git_repository_open(&_repo, "testrepo.git"));
+	cl_git_pass(git_repository_odb(&_odb, _repo));
+}
+
+void test_odb_repospanner_prefix__cleanup(void)
+{
+	git_odb_free(_odb);
+	git_repository_free(_repo);
+	cl_git_sandbox_cleanup();
+}
+
+void test_odb_repospanner_prefix__full_ids_need_no_server(void)
+{
+	git_odb_object *obj;
+	git_oid id, found;
+
+	cl_git_pass(git_oid_fromstr(&id, "a65fedf39aefe402d3bb6e24df4d4f5fe4547750"));
+
+	cl_git_pass(git_odb_read_prefix(&obj, _odb, &id, GIT_OID_HEXSZ));
+	git_odb_object_free(obj);
+
+	cl_git_pass(git_odb_exists_prefix(&found, _odb, &id, GIT_OID_HEXSZ));
+	cl_assert_equal_oid(&id, &found);
+}
+
+void test_odb_repospanner_prefix__local_abbreviations_need_no_server(void)
+{
+	git_odb_object *obj;
+	git_oid id, expected, found;
+
+	cl_git_pass(git_oid_fromstr(&expected, "a65fedf39aefe402d3bb6e24df4d4f5fe4547750"));
+	cl_git_pass(git_oid_fromstrn(&id, "a65fedf3", 8));
+
+	cl_git_pass(git_odb_read_prefix(&obj, _odb, &id, 8));
+	cl_assert_equal_oid(&expected, git_odb_object_id(obj));
+	git_odb_object_free(obj);
+
+	cl_git_pass(git_odb_exists_prefix(&found, _odb, &id, 8));
+	cl_assert_equal_oid(&expected, &found);
+}
+
+void test_odb_repospanner_prefix__unknown_abbreviations_are_not_found(void)
+{
+	git_odb_object *obj;
+	git_oid id, found;
+
+	cl_git_pass(git_oid_fromstrn(&id, "deadbeef", 8));
+
+	cl_git_fail_with(GIT_ENOTFOUND, git_odb_read_prefix(&obj, _odb, &id, 8));
+	cl_git_fail_with(GIT_ENOTFOUND, git_odb_exists_prefix(&found, _odb, &id, 8));
+}
+
+static int count_objects(const git_oid *id, void *payload)
+{
+	GIT_UNUSED(id);
+
+	(*(size_t *)payload)++;
+	return 0;
+}
+
+void test_odb_repospanner_prefix__local_objects_are_listed_without_server(void)
+{
+	size_t count = 0;
+
+	cl_git_pass(git_odb_foreach(_odb, count_objects, &count));
+	cl_assert(count > 0);
+}
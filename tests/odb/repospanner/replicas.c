@@ -0,0 +1,60 @@
+#include "clar_libgit2.h"
+#include "repospanner_helpers.h"
+
+static git_repository *_repo;
+static git_odb *_odb;
+
+void test_odb_repospanner_replicas__initialize(void)
+{
+	git_repository *repo = cl_git_sandbox_init("testrepo.git");
+	git_config *cfg;
+
+	repospanner_helpers_configure(repo, REPOSPANNER_UNREACHABLE_URL);
+
+	/* nothing listens on the replicas either */
+	cl_git_pass(git_repository_config(&cfg, repo));
+	cl_git_pass(git_config_set_multivar(cfg,
+		"repospanner.replica", "^$", "https://127.0.0.1:2/repo/testrepo.git"));
+	cl_git_pass(git_config_set_multivar(cfg,
+		"repospanner.replica", "^$", "https://127.0.0.1:3/repo/testrepo.git"));
+	git_config_free(cfg);
+
+	cl_git_pass(git_repository_open(&_repo, "testrepo.git"));
+	cl_git_pass(git_repository_odb(&_odb, _repo));
+}
+
+void test_odb_repospanner_replicas__cleanup(void)
+{
+	git_odb_free(_odb);
+	git_repository_free(_repo);
+	cl_git_sandbox_cleanup();
+}
+
+void test_odb_repospanner_replicas__local_objects_are_read(void)
+{
+	git_odb_object *obj;
+	git_oid id;
+
+	cl_git_pass(git_oid_fromstr(&id, "a65fedf39aefe402d3bb6e24df4d4f5fe4547750"));
+	cl_git_pass(git_odb_read(&obj, _odb, &id));
+	git_odb_object_free(obj);
+}
+
+void test_odb_repospanner_replicas__unreachable_nodes_are_not_missing_objects(void)
+{
+	git_odb_object *obj;
+	git_oid id;
+	int error;
+
+	cl_git_pass(git_oid_fromstr(&id, "0000000000000000000000000000000000000001"));
+
+	/* every node failed, which does not mean the object does not exist */
+	error = git_odb_read(&obj, _odb, &id);
+	cl_assert(error < 0);
+	cl_assert(error != GIT_ENOTFOUND);
+
+	/* and the nodes having backed off does not change that */
+	error = git_odb_read(&obj, _odb, &id);
+	cl_assert(error < 0);
+	cl_assert(error != GIT_ENOTFOUND);
+}
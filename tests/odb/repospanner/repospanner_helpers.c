@@ -0,0 +1,23 @@
+#include "clar_libgit2.h"
+#include "repospanner_helpers.h"
+
+void repospanner_helpers_configure(git_repository *repo, const char *url)
+{
+	cl_repo_set_bool(repo, "repospanner.enabled", true);
+	cl_repo_set_string(repo, "repospanner.url", url);
+	cl_repo_set_string(repo, "repospanner.cert", "client.crt");
+	cl_repo_set_string(repo, "repospanner.key", "client.key");
+	cl_repo_set_string(repo, "repospanner.cacert", "ca.crt");
+}
+
+void repospanner_helpers_sandbox(const char *path, const char *url)
+{
+	git_repository *repo;
+
+	cl_fixture_sandbox("testrepo.git");
+	cl_must_pass(p_rename("testrepo.git", path));
+
+	cl_git_pass(git_repository_open(&repo, path));
+	repospanner_helpers_configure(repo, url);
+	git_repository_free(repo);
+}
@@ -0,0 +1,16 @@
+#include "git2/repository.h"
+
+/* Where no repoSpanner server listens, so every request to it fails */
+#define REPOSPANNER_UNREACHABLE_URL "https://127.0.0.1:1/repo/testrepo.git"
+
+/*
+ * Enable repoSpanner for `repo`, talking to the server at `url`.
+ */
+extern void repospanner_helpers_configure(git_repository *repo, const char *url);
+
+/*
+ * Copy testrepo.git to `path` and configure it for the server at
+ * `url`.  Clients outlive their repositories, so tests which need one
+ * to start from scratch use a path of their own.
+ */
+extern void repospanner_helpers_sandbox(const char *path, const char *url);
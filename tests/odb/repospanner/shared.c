@@ -0,0 +1,110 @@
+#include "clar_libgit2.h"
+#include "git2/sys/repospanner.h"
+#include "fileops.h"
+#include "repospanner.h"
+#include "repospanner_cache.h"
+#include "repospanner_helpers.h"
+
+/*
+ * Clients outlive their repositories, so every test uses repositories
+ * of its own for their clients to start from zero.
+ */
+#define SHARED_DIR "rssharedcache"
+#define CACHED_CONTENTS "in the shared repoSpanner cache\n"
+
+static git_repository *_repo;
+static git_vector _paths;
+
+static void sandbox(const char *path, const char *url)
+{
+	git_repository *repo;
+
+	cl_git_pass(git_vector_insert(&_paths, (void *)path));
+	repospanner_helpers_sandbox(path, url);
+
+	cl_git_pass(git_repository_open(&repo, path));
+	cl_repo_set_string(repo, "repospanner.cachedir", SHARED_DIR);
+	git_repository_free(repo);
+}
+
+void test_odb_repospanner_shared__initialize(void)
+{
+	_repo = NULL;
+	cl_git_pass(git_vector_init(&_paths, 0, NULL));
+}
+
+void test_odb_repospanner_shared__cleanup(void)
+{
+	const char *path;
+	size_t i;
+
+	git_repository_free(_repo);
+
+	/* their caches' packs would stay open in the global pack cache */
+	repospanner_clients_flush();
+
+	git_vector_foreach(&_paths, i, path)
+		cl_fixture_cleanup(path);
+	git_vector_free(&_paths);
+
+	if (git_path_isdir(SHARED_DIR))
+		cl_git_pass(git_futils_rmdir_r(SHARED_DIR, NULL, GIT_RMDIR_REMOVE_FILES));
+}
+
+/* What fetching an object through the repository would leave behind */
+static void cache_object(git_oid *out, const char *path)
+{
+	repospanner_cache_object obj, *batch[1] = { &obj };
+	repoSpanner_client *client;
+	git_repository *repo;
+
+	obj.raw.data = CACHED_CONTENTS;
+	obj.raw.len = strlen(CACHED_CONTENTS);
+	obj.raw.type = GIT_OBJ_BLOB;
+	cl_git_pass(git_odb_hash(&obj.oid, obj.raw.data, obj.raw.len, obj.raw.type));
+
+	cl_git_pass(git_repository_open(&repo, path));
+	cl_git_pass(repospanner_get_client(&client, repo));
+	cl_git_pass(repospanner_cache_add(repospanner_client_cache(client), batch, 1));
+	repospanner_client_free(client);
+	git_repository_free(repo);
+
+	git_oid_cpy(out, &obj.oid);
+}
+
+void test_odb_repospanner_shared__clones_share_the_cache(void)
+{
+	git_repospanner_stats stats;
+	git_blob *blob;
+	git_oid id;
+
+	sandbox("sharedone.git", "https://127.0.0.1:1/repo/shared.git");
+	sandbox("sharedtwo.git", "https://127.0.0.1:1/repo/shared.git");
+
+	cache_object(&id, "sharedone.git");
+	cl_assert(!git_path_exists("sharedone.git/objects/repospanner"));
+
+	cl_git_pass(git_repository_open(&_repo, "sharedtwo.git"));
+	cl_git_pass(git_blob_lookup(&blob, _repo, &id));
+	cl_assert_equal_s(CACHED_CONTENTS, git_blob_rawcontent(blob));
+	git_blob_free(blob);
+
+	cl_git_pass(git_repospanner_get_stats(&stats, _repo));
+	cl_assert_equal_i(1, stats.cache_hits);
+	cl_assert_equal_i(0, stats.endpoints[GIT_REPOSPANNER_ENDPOINT_OBJECT].requests);
+}
+
+void test_odb_repospanner_shared__other_repositories_have_their_own(void)
+{
+	git_blob *blob;
+	git_oid id;
+
+	sandbox("sharedmine.git", "https://127.0.0.1:1/repo/mine.git");
+	sandbox("sharedtheirs.git", "https://127.0.0.1:1/repo/theirs.git");
+
+	cache_object(&id, "sharedmine.git");
+
+	/* their server may not have it, so it must not look like it */
+	cl_git_pass(git_repository_open(&_repo, "sharedtheirs.git"));
+	cl_git_fail(git_blob_lookup(&blob, _repo, &id));
+}
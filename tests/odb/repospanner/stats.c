@@ -0,0 +1,152 @@
+#include "clar_libgit2.h"
+#include "clar_libgit2_trace.h"
+#include "git2/sys/repospanner.h"
+#include "fileops.h"
+#include "repospanner.h"
+#include "repospanner_cache.h"
+#include "trace.h"
+#include "repospanner_helpers.h"
+
+/*
+ * Clients outlive their repositories, so every test uses a repository
+ * of its own for its client to start from zero.
+ */
+#define CACHE_PATH "/objects/repospanner"
+#define CACHED_CONTENTS "only in the repoSpanner cache\n"
+
+static git_repository *_repo;
+static git_odb *_odb;
+static const char *_path;
+static int _traced;
+
+static void sandbox(const char *path)
+{
+	_path = path;
+	repospanner_helpers_sandbox(_path, REPOSPANNER_UNREACHABLE_URL);
+}
+
+void test_odb_repospanner_stats__initialize(void)
+{
+	_repo = NULL;
+	_odb = NULL;
+	_path = NULL;
+	_traced = 0;
+}
+
+void test_odb_repospanner_stats__cleanup(void)
+{
+	git_trace_set(GIT_TRACE_NONE, NULL);
+	cl_global_trace_register();
+
+	git_odb_free(_odb);
+	git_repository_free(_repo);
+
+	/* their caches' packs would stay open in the global pack cache */
+	repospanner_clients_flush();
+
+	if (_path)
+		cl_fixture_cleanup(_path);
+}
+
+static void open_repo(void)
+{
+	cl_git_pass(git_repository_open(&_repo, _path));
+	cl_git_pass(git_repository_odb(&_odb, _repo));
+}
+
+static void read_missing(void)
+{
+	git_odb_object *obj;
+	git_oid id;
+
+	cl_git_pass(git_oid_fromstr(&id, "deadbeefdeadbeefdeadbeefdeadbeefdeadbeef"));
+	cl_git_fail(git_odb_read(&obj, _odb, &id));
+}
+
+void test_odb_repospanner_stats__requests_are_counted_by_endpoint(void)
+{
+	git_repospanner_stats stats;
+	git_repospanner_endpoint_stats *object;
+	size_t i, total = 0;
+
+	sandbox("statsrequests.git");
+	open_repo();
+	read_missing();
+
+	cl_git_pass(git_repospanner_get_stats(&stats, _repo));
+	object = &stats.endpoints[GIT_REPOSPANNER_ENDPOINT_OBJECT];
+
+	cl_assert(object->requests > 0);
+	cl_assert_equal_i(object->requests, object->failures);
+	cl_assert_equal_i(0, object->not_found);
+
+	for (i = 0; i < GIT_REPOSPANNER_LATENCY_BUCKETS; i++)
+		total += object->latency[i];
+	cl_assert_equal_i(object->requests, total);
+
+	cl_assert_equal_i(0, stats.endpoints[GIT_REPOSPANNER_ENDPOINT_UPLOAD].requests);
+	cl_assert_equal_i(0, stats.cache_hits);
+}
+
+void test_odb_repospanner_stats__cache_hits_are_counted(void)
+{
+	repospanner_cache_object obj, *batch[1] = { &obj };
+	repospanner_cache *cache;
+	git_repospanner_stats stats;
+	git_odb_object *read;
+	git_buf path = GIT_BUF_INIT;
+
+	obj.raw.data = CACHED_CONTENTS;
+	obj.raw.len = strlen(CACHED_CONTENTS);
+	obj.raw.type = GIT_OBJ_BLOB;
+	cl_git_pass(git_odb_hash(&obj.oid, obj.raw.data, obj.raw.len, obj.raw.type));
+
+	sandbox("statscache.git");
+	cl_git_pass(git_buf_joinpath(&path, _path, CACHE_PATH));
+	cl_git_pass(repospanner_cache_open(&cache, path.ptr, 0, 0));
+	cl_git_pass(repospanner_cache_add(cache, batch, 1));
+	repospanner_cache_free(cache);
+	git_buf_dispose(&path);
+
+	open_repo();
+	cl_git_pass(git_odb_read(&read, _odb, &obj.oid));
+	cl_assert_equal_s(CACHED_CONTENTS, git_odb_object_data(read));
+	git_odb_object_free(read);
+
+	cl_git_pass(git_repospanner_get_stats(&stats, _repo));
+	cl_assert_equal_i(1, stats.cache_hits);
+	cl_assert_equal_i(0, stats.endpoints[GIT_REPOSPANNER_ENDPOINT_OBJECT].requests);
+}
+
+void test_odb_repospanner_stats__endpoints_have_names(void)
+{
+	cl_assert_equal_s("simple/object",
+		git_repospanner_endpoint_name(GIT_REPOSPANNER_ENDPOINT_OBJECT));
+	cl_assert_equal_s("simple/refs/update",
+		git_repospanner_endpoint_name(GIT_REPOSPANNER_ENDPOINT_REFS_UPDATE));
+	cl_assert(git_repospanner_endpoint_name(GIT_REPOSPANNER_ENDPOINT__LAST) == NULL);
+}
+
+#ifdef GIT_TRACE
+static void trace_callback(git_trace_level_t level, const char *message)
+{
+	if (level == GIT_TRACE_WARN && strstr(message, "/simple/object/deadbeef") != NULL)
+		_traced++;
+}
+#endif
+
+void test_odb_repospanner_stats__requests_are_traced(void)
+{
+#ifdef GIT_TRACE
+	cl_global_trace_disable();
+	git_trace_set(GIT_TRACE_DEBUG, trace_callback);
+
+	sandbox("statstrace.git");
+	open_repo();
+	read_missing();
+
+	cl_assert(_traced > 0);
+#else
+	cl_skip();
+#endif
+}
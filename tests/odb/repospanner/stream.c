@@ -0,0 +1,60 @@
+#include "clar_libgit2.h"
+#include "git2/sys/odb_backend.h"
+#include "repospanner_helpers.h"
+
+static git_repository *_repo;
+static git_odb *_odb;
+
+void test_odb_repospanner_stream__initialize(void)
+{
+	git_repository *repo = cl_git_sandbox_init("testrepo.git");
+
+	repospanner_helpers_configure(repo, REPOSPANNER_UNREACHABLE_URL);
+	cl_git_pass(git_repository_open(&_repo, "testrepo.git"));
+	cl_git_pass(git_repository_odb(&_odb, _repo));
+}
+
+void test_odb_repospanner_stream__cleanup(void)
+{
+	git_odb_free(_odb);
+	git_repository_free(_repo);
+	cl_git_sandbox_cleanup();
+}
+
+/* Streaming from the server is tested against the mock, in online::repospanner */
+void test_odb_repospanner_stream__written_objects_are_streamed(void)
+{
+	git_odb_stream *stream;
+	char buf[64];
+	size_t len;
+	git_otype type;
+	git_oid id;
+	int read;
+
+	cl_git_pass(git_odb_write(&id, _odb, "streamed\n", 9, GIT_OBJ_BLOB));
+
+	cl_git_pass(git_odb_open_rstream(&stream, &len, &type, _odb, &id));
+	cl_assert_equal_sz(9, len);
+	cl_assert_equal_i(GIT_OBJ_BLOB, type);
+
+	read = git_odb_stream_read(stream, buf, sizeof(buf));
+	cl_assert_equal_i(9, read);
+	cl_assert(memcmp(buf, "streamed\n", 9) == 0);
+
+	git_odb_stream_free(stream);
+}
+
+void test_odb_repospanner_stream__unreachable_server(void)
+{
+	git_odb_stream *stream = NULL;
+	size_t len;
+	git_otype type;
+	git_oid id;
+	int error;
+
+	cl_git_pass(git_oid_fromstr(&id, "0000000000000000000000000000000000000001"));
+
+	error = git_odb_open_rstream(&stream, &len, &type, _odb, &id);
+	cl_assert(error < 0 && error != GIT_ENOTFOUND);
+	cl_assert(stream == NULL);
+}
@@ -0,0 +1,74 @@
+#include "clar_libgit2.h"
+#include "fileops.h"
+#include "repospanner_helpers.h"
+
+/*
+ * Clients outlive the repositories using them, so this uses a
+ * repository of its own to have one set up with these options.
+ */
+#define REPO_PATH "tlsrepo.git"
+#define SESSIONS_PATH REPO_PATH "/repospanner-tls"
+
+static git_repository *_repo;
+
+void test_odb_repospanner_tls__initialize(void)
+{
+	git_repository *repo;
+
+	repospanner_helpers_sandbox(REPO_PATH, REPOSPANNER_UNREACHABLE_URL);
+
+	cl_git_pass(git_repository_open(&repo, REPO_PATH));
+	cl_repo_set_bool(repo, "repospanner.tlssessions", true);
+	cl_repo_set_bool(repo, "repospanner.warmup", true);
+	git_repository_free(repo);
+
+	_repo = NULL;
+}
+
+void test_odb_repospanner_tls__cleanup(void)
+{
+	git_repository_free(_repo);
+	cl_fixture_cleanup(REPO_PATH);
+}
+
+void test_odb_repospanner_tls__sessions_are_kept_privately(void)
+{
+	struct stat st;
+	git_odb *odb;
+
+	/* the client is set up along with the objects, warmup or not */
+	cl_git_pass(git_repository_open(&_repo, REPO_PATH));
+	cl_git_pass(git_repository_odb(&odb, _repo));
+	git_odb_free(odb);
+
+#ifdef GIT_OPENSSL
+	cl_must_pass(p_stat(SESSIONS_PATH, &st));
+	cl_assert(S_ISDIR(st.st_mode));
+# ifndef GIT_WIN32
+	cl_assert_equal_i(0700, st.st_mode & 0777);
+# endif
+#else
+	GIT_UNUSED(st);
+#endif
+}
+
+void test_odb_repospanner_tls__failed_warmups_are_not_errors(void)
+{
+	git_odb_object *obj;
+	git_odb *odb;
+	git_oid id;
+
+	/* the warmup fails in the background, reads go on as usual */
+	cl_git_pass(git_repository_open(&_repo, REPO_PATH));
+	cl_git_pass(git_repository_odb(&odb, _repo));
+
+	cl_git_pass(git_oid_fromstr(&id, "a65fedf39aefe402d3bb6e24df4d4f5fe4547750"));
+	cl_git_pass(git_odb_read(&obj, odb, &id));
+	git_odb_object_free(obj);
+
+	/* and the server is asked, and fails, for what is missing locally */
+	cl_git_pass(git_oid_fromstr(&id, "deadbeefdeadbeefdeadbeefdeadbeefdeadbeef"));
+	cl_git_fail(git_odb_read(&obj, odb, &id));
+
+	git_odb_free(odb);
+}
@@ -0,0 +1,80 @@
+#include "clar_libgit2.h"
+#include "git2/sys/repospanner.h"
+#include "repospanner_helpers.h"
+
+static git_repository *_repo;
+
+void test_odb_repospanner_trees__initialize(void)
+{
+	git_repository *repo = cl_git_sandbox_init("testrepo.git");
+
+	repospanner_helpers_configure(repo, REPOSPANNER_UNREACHABLE_URL);
+	cl_git_pass(git_repository_open(&_repo, "testrepo.git"));
+}
+
+void test_odb_repospanner_trees__cleanup(void)
+{
+	git_repository_free(_repo);
+	cl_git_sandbox_cleanup();
+}
+
+static int count_entries(const char *root, const git_tree_entry *entry, void *payload)
+{
+	GIT_UNUSED(root);
+	GIT_UNUSED(entry);
+
+	(*(size_t *)payload)++;
+	return 0;
+}
+
+void test_odb_repospanner_trees__local_trees_are_walked(void)
+{
+	git_tree *tree;
+	git_oid id;
+	size_t entries = 0;
+
+	/* this one is in the repository's packs already */
+	cl_git_pass(git_oid_fromstr(&id, "53fc32d17276939fc79ed05badaef2db09990016"));
+	cl_git_pass(git_tree_lookup(&tree, _repo, &id));
+
+	cl_git_pass(git_tree_walk(tree, GIT_TREEWALK_PRE, count_entries, &entries));
+	cl_assert(entries > 0);
+
+	git_tree_free(tree);
+}
+
+void test_odb_repospanner_trees__fetching_fails_without_server(void)
+{
+	git_repospanner_fetch_tree_options opts = GIT_REPOSPANNER_FETCH_TREE_OPTIONS_INIT;
+	char *paths[] = { "a/b" };
+	git_oid id;
+	int error;
+
+	cl_git_pass(git_oid_fromstr(&id, "53fc32d17276939fc79ed05badaef2db09990016"));
+
+	error = git_repospanner_fetch_tree(_repo, &id, NULL);
+	cl_assert(error < 0 && error != GIT_ENOTFOUND);
+
+	opts.depth = 2;
+	opts.blobs = 1;
+	opts.paths.strings = paths;
+	opts.paths.count = 1;
+
+	error = git_repospanner_fetch_tree(_repo, &id, &opts);
+	cl_assert(error < 0 && error != GIT_ENOTFOUND);
+}
+
+void test_odb_repospanner_trees__paths_cannot_span_lines(void)
+{
+	git_repospanner_fetch_tree_options opts = GIT_REPOSPANNER_FETCH_TREE_OPTIONS_INIT;
+	char *paths[] = { "a\nb" };
+	git_oid id;
+
+	cl_git_pass(git_oid_fromstr(&id, "53fc32d17276939fc79ed05badaef2db09990016"));
+
+	opts.paths.strings = paths;
+	opts.paths.count = 1;
+
+	cl_git_fail(git_repospanner_fetch_tree(_repo, &id, &opts));
+	cl_assert_equal_i(GITERR_INVALID, giterr_last()->klass);
+}
@@ -0,0 +1,117 @@
+#include "clar_libgit2.h"
+#include "git2/sys/repospanner.h"
+#include "path.h"
+#include "fileops.h"
+#include "repospanner_helpers.h"
+
+#define BLOB_CONTENTS "written to a repoSpanner repository\n"
+
+static git_repository *_repo;
+static git_odb *_odb;
+
+void test_odb_repospanner_write__initialize(void)
+{
+	git_repository *repo = cl_git_sandbox_init("testrepo.git");
+
+	repospanner_helpers_configure(repo, REPOSPANNER_UNREACHABLE_URL);
+	cl_repo_set_string(repo, "repospanner.uploadbatch", "0");
+
+	cl_git_pass(git_repository_open(&_repo, "testrepo.git"));
+	cl_git_pass(git_repository_odb(&_odb, _repo));
+}
+
+void test_odb_repospanner_write__cleanup(void)
+{
+	git_odb_free(_odb);
+	git_repository_free(_repo);
+	cl_git_sandbox_cleanup();
+}
+
+void test_odb_repospanner_write__objects_are_kept_locally(void)
+{
+	git_buf path = GIT_BUF_INIT;
+	char loose[GIT_OID_HEXSZ + 2] = { 0 };
+	git_odb_object *obj;
+	git_oid id;
+
+	cl_git_pass(git_odb_write(&id, _odb, BLOB_CONTENTS, strlen(BLOB_CONTENTS), GIT_OBJ_BLOB));
+
+	cl_git_pass(git_odb_read(&obj, _odb, &id));
+	cl_assert_equal_s(BLOB_CONTENTS, git_odb_object_data(obj));
+	git_odb_object_free(obj);
+
+	git_oid_pathfmt(loose, &id);
+	cl_git_pass(git_buf_joinpath(&path, "testrepo.git/objects", loose));
+	cl_assert(git_path_exists(path.ptr));
+	git_buf_dispose(&path);
+}
+
+void test_odb_repospanner_write__nothing_to_upload(void)
+{
+	cl_git_pass(git_repospanner_upload_objects(_repo));
+}
+
+void test_odb_repospanner_write__failed_uploads_are_retried(void)
+{
+	git_oid id;
+
+	cl_git_pass(git_odb_write(&id, _odb, BLOB_CONTENTS, strlen(BLOB_CONTENTS), GIT_OBJ_BLOB));
+
+	cl_git_fail(git_repospanner_upload_objects(_repo));
+	cl_git_fail(git_repospanner_upload_objects(_repo));
+}
+
+void test_odb_repospanner_write__existing_objects_are_not_uploaded(void)
+{
+	git_odb_object *obj;
+	git_oid id, written;
+
+	/* this one is in the repository's packs already */
+	cl_git_pass(git_oid_fromstr(&id, "a65fedf39aefe402d3bb6e24df4d4f5fe4547750"));
+	cl_git_pass(git_odb_read(&obj, _odb, &id));
+
+	cl_git_pass(git_odb_write(&written, _odb,
+		git_odb_object_data(obj), git_odb_object_size(obj), git_odb_object_type(obj)));
+	cl_assert_equal_oid(&id, &written);
+	git_odb_object_free(obj);
+
+	cl_git_pass(git_repospanner_upload_objects(_repo));
+}
+
+void test_odb_repospanner_write__pending_objects_outlive_the_repository(void)
+{
+	git_buf path = GIT_BUF_INIT, pending = GIT_BUF_INIT;
+	char line[GIT_OID_HEXSZ + 2] = { 0 };
+	char loose[GIT_OID_HEXSZ + 2] = { 0 };
+	git_oid id;
+
+	cl_git_pass(git_odb_write(&id, _odb, BLOB_CONTENTS, strlen(BLOB_CONTENTS), GIT_OBJ_BLOB));
+
+	git_odb_free(_odb);
+	git_repository_free(_repo);
+
+	git_oid_fmt(line, &id);
+	line[GIT_OID_HEXSZ] = '\n';
+	cl_git_pass(git_futils_readbuffer(&pending, "testrepo.git/repospanner-pending"));
+	cl_assert_equal_s(line, pending.ptr);
+
+	/* the next one to open the repository still has it to upload */
+	cl_git_pass(git_repository_open(&_repo, "testrepo.git"));
+	cl_git_pass(git_repository_odb(&_odb, _repo));
+	cl_git_fail(git_repospanner_upload_objects(_repo));
+
+	git_odb_free(_odb);
+	git_repository_free(_repo);
+
+	/* unless it is gone */
+	git_oid_pathfmt(loose, &id);
+	cl_git_pass(git_buf_joinpath(&path, "testrepo.git/objects", loose));
+	cl_must_pass(p_unlink(path.ptr));
+
+	cl_git_pass(git_repository_open(&_repo, "testrepo.git"));
+	cl_git_pass(git_repository_odb(&_odb, _repo));
+	cl_git_pass(git_repospanner_upload_objects(_repo));
+
+	git_buf_dispose(&pending);
+	git_buf_dispose(&path);
+}
@@ -0,0 +1,1106 @@
+#include "clar_libgit2.h"
+#include "git2/sys/repospanner.h"
+#include "fileops.h"
+#include "array.h"
+#include "git2/transaction.h"
+#include "git2/sys/odb_backend.h"
+
+/*
+ * These run against a server serving a copy of testrepo.git, like the
+ * one started by script/repospanner-mock.py, and are skipped unless
+ * GITTEST_REPOSPANNER_URL and GITTEST_REPOSPANNER_CERTS point at it.
+ */
+#define MASTER_ID "a65fedf39aefe402d3bb6e24df4d4f5fe4547750"
+#define README_ID "a8233120f6ad708f843d861ce2b7228ec4e3dec6"
+#define MISSING_ID "deadbeefdeadbeefdeadbeefdeadbeefdeadbeef"
+#define BR2_ID "a4a7dce85cf63874e984719f4fdd239f5145052f"
+
+static char *_remote_url;
+static char *_remote_certs;
+static git_repository *_repo;
+static const char *_path;
+static git_repospanner_subscription *_subscription;
+
+void test_online_repospanner__initialize(void)
+{
+	_remote_url = cl_getenv("GITTEST_REPOSPANNER_URL");
+	_remote_certs = cl_getenv("GITTEST_REPOSPANNER_CERTS");
+	_repo = NULL;
+	_path = NULL;
+	_subscription = NULL;
+
+	if (!_remote_url || !_remote_certs)
+		cl_skip();
+}
+
+void test_online_repospanner__cleanup(void)
+{
+	git_repospanner_unsubscribe(_subscription);
+	git_repository_free(_repo);
+
+	if (_path)
+		cl_fixture_cleanup(_path);
+
+	git__free(_remote_url);
+	git__free(_remote_certs);
+}
+
+static void set_cert(git_repository *repo, const char *name, const char *file)
+{
+	git_buf path = GIT_BUF_INIT;
+
+	cl_git_pass(git_buf_joinpath(&path, _remote_certs, file));
+	cl_repo_set_string(repo, name, path.ptr);
+	git_buf_dispose(&path);
+}
+
+/*
+ * Clients outlive their repositories, so every repository gets a path
+ * of its own for its client to start from scratch.
+ */
+static git_repository *open_repo_at(const char *path, bool bare, const char *url)
+{
+	git_repository *repo;
+
+	cl_git_pass(git_repository_init(&repo, path, bare));
+	cl_repo_set_bool(repo, "repospanner.enabled", true);
+	cl_repo_set_string(repo, "repospanner.url", url);
+	set_cert(repo, "repospanner.cert", "client.crt");
+	set_cert(repo, "repospanner.key", "client.key");
+	set_cert(repo, "repospanner.cacert", "ca.crt");
+	git_repository_free(repo);
+
+	cl_git_pass(git_repository_open(&repo, path));
+	return repo;
+}
+
+static git_repository *open_repo(const char *path, bool bare)
+{
+	return open_repo_at(path, bare, _remote_url);
+}
+
+/* The URL of the repository as the mock serves it under `prefix` */
+static void mock_url(git_buf *url, const char *prefix)
+{
+	const char *host_end;
+
+	cl_assert((host_end = strchr(_remote_url + strlen("https://"), '/')) != NULL);
+	cl_git_pass(git_buf_put(url, _remote_url, host_end - _remote_url));
+	cl_git_pass(git_buf_printf(url, "/%s%s", prefix, host_end));
+}
+
+/* The mock serves repositories under /legacy/ like an older server */
+static git_repository *open_legacy_repo(const char *path, bool bare)
+{
+	git_buf url = GIT_BUF_INIT;
+	git_repository *repo;
+
+	mock_url(&url, "legacy");
+	repo = open_repo_at(path, bare, url.ptr);
+	git_buf_dispose(&url);
+	return repo;
+}
+
+static void add_replica(git_repository *repo, const char *url)
+{
+	git_config *cfg;
+
+	cl_git_pass(git_repository_config(&cfg, repo));
+	cl_git_pass(git_config_set_multivar(cfg, "repospanner.replica", "^$", url));
+	git_config_free(cfg);
+}
+
+static int count_refs(git_reference *ref, void *payload)
+{
+	(*(size_t *)payload)++;
+	git_reference_free(ref);
+	return 0;
+}
+
+void test_online_repospanner__refs_are_read(void)
+{
+	git_reference *head;
+	git_oid id;
+	size_t count = 0;
+
+	_repo = open_repo(_path = "rsrefs.git", true);
+
+	cl_git_pass(git_repository_head(&head, _repo));
+	cl_assert_equal_s("refs/heads/master", git_reference_name(head));
+	cl_git_pass(git_oid_fromstr(&id, MASTER_ID));
+	cl_assert_equal_oid(&id, git_reference_target(head));
+	git_reference_free(head);
+
+	cl_git_pass(git_reference_foreach(_repo, count_refs, &count));
+	cl_assert(count > 1);
+}
+
+void test_online_repospanner__ref_listings_are_compact(void)
+{
+	git_repospanner_stats stats;
+	size_t count = 0;
+
+	_repo = open_repo(_path = "rscompact.git", true);
+	cl_git_pass(git_reference_foreach(_repo, count_refs, &count));
+
+	/* binary ids, shared name prefixes and compression, if offered */
+	cl_git_pass(git_repospanner_get_stats(&stats, _repo));
+	cl_assert(stats.endpoints[GIT_REPOSPANNER_ENDPOINT_REFS].bytes_received < count * GIT_OID_HEXSZ);
+}
+
+void test_online_repospanner__ref_changes_are_seen(void)
+{
+	git_repository *writer;
+	git_reference *ref;
+	git_oid id;
+	size_t count = 0;
+
+	_repo = open_repo(_path = "rschanges.git", true);
+	cl_repo_set_string(_repo, "repospanner.refsinterval", "0");
+	git_repository_free(_repo);
+	cl_git_pass(git_repository_open(&_repo, _path));
+
+	cl_git_pass(git_reference_foreach(_repo, count_refs, &count));
+
+	/* these come as changes to the listing the reader already has */
+	writer = open_repo("rschanges-writer.git", true);
+	cl_git_pass(git_oid_fromstr(&id, MASTER_ID));
+	cl_git_pass(git_reference_create(&ref, writer, "refs/heads/changes", &id, 0, NULL));
+	git_reference_free(ref);
+
+	cl_git_pass(git_reference_lookup(&ref, _repo, "refs/heads/changes"));
+	cl_assert_equal_oid(&id, git_reference_target(ref));
+	git_reference_free(ref);
+
+	cl_git_pass(git_reference_lookup(&ref, writer, "refs/heads/changes"));
+	cl_git_pass(git_reference_delete(ref));
+	git_reference_free(ref);
+
+	cl_git_fail_with(GIT_ENOTFOUND, git_reference_lookup(&ref, _repo, "refs/heads/changes"));
+
+	git_repository_free(writer);
+	cl_fixture_cleanup("rschanges-writer.git");
+}
+
+#ifdef GIT_THREADS
+struct ref_changes {
+	git_mutex lock;
+	int created;
+	int deleted;
+};
+
+static void record_change(const char *name, const git_oid *id, const char *target, void *payload)
+{
+	struct ref_changes *changes = payload;
+
+	GIT_UNUSED(target);
+
+	if (strcmp(name, "refs/heads/subscribed"))
+		return;
+
+	git_mutex_lock(&changes->lock);
+	if (id)
+		changes->created++;
+	else
+		changes->deleted++;
+	git_mutex_unlock(&changes->lock);
+}
+
+/* Wait for the change to be pushed, but not forever */
+static void wait_for(struct ref_changes *changes, int *count)
+{
+	double deadline = git__timer() + 30;
+	int seen;
+
+	for (;;) {
+		git_mutex_lock(&changes->lock);
+		seen = *count;
+		git_mutex_unlock(&changes->lock);
+
+		if (seen || git__timer() >= deadline)
+			break;
+
+#ifdef GIT_WIN32
+		Sleep(50);
+#else
+		usleep(50000);
+#endif
+	}
+
+	cl_assert_(seen, "the change was not pushed in time");
+}
+#endif
+
+void test_online_repospanner__ref_changes_are_pushed(void)
+{
+#ifdef GIT_THREADS
+	git_repospanner_subscription *second;
+	struct ref_changes changes;
+	git_repository *writer;
+	git_reference *ref;
+	git_oid id;
+
+	memset(&changes, 0, sizeof(changes));
+	cl_git_pass(git_mutex_init(&changes.lock));
+
+	_repo = open_repo(_path = "rssubscribed.git", true);
+	cl_git_pass(git_repospanner_subscribe(&_subscription, _repo, record_change, &changes));
+	cl_git_fail_with(GIT_EEXISTS, git_repospanner_subscribe(&second, _repo, record_change, &changes));
+
+	writer = open_repo("rssubscribed-writer.git", true);
+	cl_git_pass(git_oid_fromstr(&id, MASTER_ID));
+	cl_git_pass(git_reference_create(&ref, writer, "refs/heads/subscribed", &id, 0, NULL));
+	git_reference_free(ref);
+
+	/* by the time the callback hears of it, the repository knows */
+	wait_for(&changes, &changes.created);
+	cl_git_pass(git_reference_lookup(&ref, _repo, "refs/heads/subscribed"));
+	cl_assert_equal_oid(&id, git_reference_target(ref));
+	git_reference_free(ref);
+
+	cl_git_pass(git_reference_lookup(&ref, writer, "refs/heads/subscribed"));
+	cl_git_pass(git_reference_delete(ref));
+	git_reference_free(ref);
+
+	wait_for(&changes, &changes.deleted);
+	cl_git_fail_with(GIT_ENOTFOUND, git_reference_lookup(&ref, _repo, "refs/heads/subscribed"));
+
+	git_repospanner_unsubscribe(_subscription);
+	_subscription = NULL;
+
+	git_repository_free(writer);
+	cl_fixture_cleanup("rssubscribed-writer.git");
+
+	git_mutex_free(&changes.lock);
+#else
+	cl_skip();
+#endif
+}
+
+static void assert_ref(git_repository *repo, const char *name, const char *id)
+{
+	git_reference *ref;
+	git_oid expected;
+
+	cl_git_pass(git_reference_lookup(&ref, repo, name));
+	cl_git_pass(git_oid_fromstr(&expected, id));
+	cl_assert_equal_oid(&expected, git_reference_target(ref));
+	git_reference_free(ref);
+}
+
+void test_online_repospanner__transactions_are_applied_at_once(void)
+{
+	git_repospanner_stats stats;
+	git_transaction *tx;
+	git_repository *other;
+	git_oid master, br2;
+
+	_repo = open_repo(_path = "rstransaction.git", true);
+	cl_git_pass(git_oid_fromstr(&master, MASTER_ID));
+	cl_git_pass(git_oid_fromstr(&br2, BR2_ID));
+
+	cl_git_pass(git_transaction_new(&tx, _repo));
+	cl_git_pass(git_transaction_lock_ref(tx, "refs/heads/tx-one"));
+	cl_git_pass(git_transaction_lock_ref(tx, "refs/heads/tx-two"));
+	cl_git_pass(git_transaction_lock_ref(tx, "refs/heads/tx-untouched"));
+	cl_git_pass(git_transaction_set_target(tx, "refs/heads/tx-one", &master, NULL, NULL));
+	cl_git_pass(git_transaction_set_target(tx, "refs/heads/tx-two", &br2, NULL, NULL));
+	cl_git_pass(git_transaction_commit(tx));
+	git_transaction_free(tx);
+
+	cl_git_pass(git_repospanner_get_stats(&stats, _repo));
+	cl_assert_equal_i(1, stats.endpoints[GIT_REPOSPANNER_ENDPOINT_REFS_UPDATE].requests);
+
+	other = open_repo("rstransaction-other.git", true);
+	assert_ref(other, "refs/heads/tx-one", MASTER_ID);
+	assert_ref(other, "refs/heads/tx-two", BR2_ID);
+	git_repository_free(other);
+	cl_fixture_cleanup("rstransaction-other.git");
+}
+
+void test_online_repospanner__transactions_are_staged_separately(void)
+{
+	git_transaction *first, *second;
+	git_repository *other;
+	git_reference *ref;
+	git_oid id;
+
+	_repo = open_repo(_path = "rstransactions.git", true);
+	cl_git_pass(git_oid_fromstr(&id, MASTER_ID));
+
+	cl_git_pass(git_transaction_new(&first, _repo));
+	cl_git_pass(git_transaction_new(&second, _repo));
+	cl_git_pass(git_transaction_lock_ref(first, "refs/heads/tx-first"));
+	cl_git_pass(git_transaction_lock_ref(second, "refs/heads/tx-second"));
+	cl_git_pass(git_transaction_set_target(first, "refs/heads/tx-first", &id, NULL, NULL));
+	cl_git_pass(git_transaction_set_target(second, "refs/heads/tx-second", &id, NULL, NULL));
+
+	/* the second one does not wait for the first one to be done */
+	cl_git_pass(git_transaction_commit(second));
+	git_transaction_free(second);
+
+	other = open_repo("rstransactions-other.git", true);
+	assert_ref(other, "refs/heads/tx-second", MASTER_ID);
+	cl_git_fail_with(GIT_ENOTFOUND, git_reference_lookup(&ref, other, "refs/heads/tx-first"));
+	git_repository_free(other);
+	cl_fixture_cleanup("rstransactions-other.git");
+
+	cl_git_pass(git_transaction_commit(first));
+	git_transaction_free(first);
+
+	other = open_repo("rstransactions-other.git", true);
+	assert_ref(other, "refs/heads/tx-first", MASTER_ID);
+	git_repository_free(other);
+	cl_fixture_cleanup("rstransactions-other.git");
+}
+
+void test_online_repospanner__conflicting_transactions_change_nothing(void)
+{
+	git_transaction *tx;
+	git_repository *writer;
+	git_reference *ref;
+	git_oid master, br2;
+
+	cl_git_pass(git_oid_fromstr(&master, MASTER_ID));
+	cl_git_pass(git_oid_fromstr(&br2, BR2_ID));
+
+	writer = open_repo("rsconflict-writer.git", true);
+	cl_git_pass(git_reference_create(&ref, writer, "refs/heads/conflicted", &master, 1, NULL));
+	git_reference_free(ref);
+
+	/* the lock remembers the value read here */
+	_repo = open_repo(_path = "rsconflict.git", true);
+	assert_ref(_repo, "refs/heads/conflicted", MASTER_ID);
+
+	cl_git_pass(git_reference_create(&ref, writer, "refs/heads/conflicted", &br2, 1, NULL));
+	git_reference_free(ref);
+
+	cl_git_pass(git_transaction_new(&tx, _repo));
+	cl_git_pass(git_transaction_lock_ref(tx, "refs/heads/conflicted"));
+	cl_git_pass(git_transaction_lock_ref(tx, "refs/heads/conflict-bystander"));
+	cl_git_pass(git_transaction_set_target(tx, "refs/heads/conflicted", &master, NULL, NULL));
+	cl_git_pass(git_transaction_set_target(tx, "refs/heads/conflict-bystander", &master, NULL, NULL));
+	cl_git_fail_with(GIT_EMODIFIED, git_transaction_commit(tx));
+	git_transaction_free(tx);
+
+	/* the server's value is fetched again, and the other ref was not created */
+	assert_ref(_repo, "refs/heads/conflicted", BR2_ID);
+	cl_git_fail_with(GIT_ENOTFOUND, git_reference_lookup(&ref, writer, "refs/heads/conflict-bystander"));
+
+	git_repository_free(writer);
+	cl_fixture_cleanup("rsconflict-writer.git");
+}
+
+void test_online_repospanner__locks_fetch_refs_not_looked_up(void)
+{
+	git_transaction *tx;
+	git_repository *writer;
+	git_reference *ref;
+	git_oid master, br2;
+
+	cl_git_pass(git_oid_fromstr(&master, MASTER_ID));
+	cl_git_pass(git_oid_fromstr(&br2, BR2_ID));
+
+	writer = open_repo("rsunseen-writer.git", true);
+	cl_git_pass(git_reference_create(&ref, writer, "refs/heads/unseen", &master, 1, NULL));
+	git_reference_free(ref);
+
+	/* nothing was looked up, so the locks ask the server */
+	_repo = open_repo(_path = "rsunseen.git", true);
+	cl_git_pass(git_transaction_new(&tx, _repo));
+	cl_git_pass(git_transaction_lock_ref(tx, "refs/heads/unseen"));
+	cl_git_pass(git_transaction_lock_ref(tx, "refs/heads/unseen-new"));
+
+	cl_git_pass(git_reference_create(&ref, writer, "refs/heads/unseen", &br2, 1, NULL));
+	git_reference_free(ref);
+
+	cl_git_pass(git_transaction_set_target(tx, "refs/heads/unseen", &master, NULL, NULL));
+	cl_git_pass(git_transaction_set_target(tx, "refs/heads/unseen-new", &master, NULL, NULL));
+	cl_git_fail_with(GIT_EMODIFIED, git_transaction_commit(tx));
+	git_transaction_free(tx);
+
+	assert_ref(writer, "refs/heads/unseen", BR2_ID);
+
+	/* a ref that did not exist must still not exist */
+	cl_git_pass(git_transaction_new(&tx, _repo));
+	cl_git_pass(git_transaction_lock_ref(tx, "refs/heads/unseen-new"));
+
+	cl_git_pass(git_reference_create(&ref, writer, "refs/heads/unseen-new", &br2, 1, NULL));
+	git_reference_free(ref);
+
+	cl_git_pass(git_transaction_set_target(tx, "refs/heads/unseen-new", &master, NULL, NULL));
+	cl_git_fail_with(GIT_EMODIFIED, git_transaction_commit(tx));
+	git_transaction_free(tx);
+
+	assert_ref(writer, "refs/heads/unseen-new", BR2_ID);
+
+	git_repository_free(writer);
+	cl_fixture_cleanup("rsunseen-writer.git");
+}
+
+void test_online_repospanner__refs_are_renamed(void)
+{
+	git_repository *other;
+	git_reference *ref, *renamed;
+	git_oid id;
+
+	_repo = open_repo(_path = "rsrename.git", true);
+	cl_git_pass(git_oid_fromstr(&id, MASTER_ID));
+
+	cl_git_pass(git_reference_create(&ref, _repo, "refs/heads/rename-from", &id, 1, NULL));
+	cl_git_pass(git_reference_rename(&renamed, ref, "refs/heads/rename-to", 0, NULL));
+	git_reference_free(ref);
+	git_reference_free(renamed);
+
+	other = open_repo("rsrename-other.git", true);
+	assert_ref(other, "refs/heads/rename-to", MASTER_ID);
+	cl_git_fail_with(GIT_ENOTFOUND, git_reference_lookup(&ref, other, "refs/heads/rename-from"));
+
+	/* renaming onto an existing ref needs force, and changes nothing */
+	cl_git_pass(git_reference_create(&ref, other, "refs/heads/rename-from", &id, 1, NULL));
+	cl_git_fail(git_reference_rename(&renamed, ref, "refs/heads/master", 0, NULL));
+	git_reference_free(ref);
+
+	assert_ref(_repo, "refs/heads/rename-from", MASTER_ID);
+	assert_ref(_repo, "refs/heads/master", MASTER_ID);
+
+	git_repository_free(other);
+	cl_fixture_cleanup("rsrename-other.git");
+}
+
+void test_online_repospanner__objects_are_read(void)
+{
+	git_repospanner_stats stats;
+	git_commit *commit;
+	git_tree *tree;
+	git_blob *blob;
+	git_oid id;
+
+	_repo = open_repo(_path = "rsobjects.git", true);
+
+	cl_git_pass(git_oid_fromstr(&id, MASTER_ID));
+	cl_git_pass(git_commit_lookup(&commit, _repo, &id));
+	cl_git_pass(git_commit_tree(&tree, commit));
+	cl_assert(git_tree_entry_byname(tree, "README") != NULL);
+
+	cl_git_pass(git_oid_fromstr(&id, README_ID));
+	cl_git_pass(git_blob_lookup(&blob, _repo, &id));
+	cl_assert_equal_s("hey there\n", git_blob_rawcontent(blob));
+
+	cl_git_pass(git_repospanner_get_stats(&stats, _repo));
+	cl_assert(stats.endpoints[GIT_REPOSPANNER_ENDPOINT_OBJECT].requests > 0);
+	cl_assert_equal_i(0, stats.endpoints[GIT_REPOSPANNER_ENDPOINT_OBJECT].failures);
+
+	git_blob_free(blob);
+	git_tree_free(tree);
+	git_commit_free(commit);
+}
+
+void test_online_repospanner__missing_objects_are_not_found(void)
+{
+	git_repospanner_stats stats;
+	git_object *obj;
+	git_oid id;
+
+	_repo = open_repo(_path = "rsmissing.git", true);
+
+	cl_git_pass(git_oid_fromstr(&id, MISSING_ID));
+	cl_git_fail_with(GIT_ENOTFOUND, git_object_lookup(&obj, _repo, &id, GIT_OBJ_ANY));
+
+	/* the server said so recently enough not to ask again */
+	cl_git_fail_with(GIT_ENOTFOUND, git_object_lookup(&obj, _repo, &id, GIT_OBJ_ANY));
+
+	cl_git_pass(git_repospanner_get_stats(&stats, _repo));
+	cl_assert(stats.endpoints[GIT_REPOSPANNER_ENDPOINT_OBJECT].not_found > 0);
+	cl_assert(stats.negative_hits > 0);
+}
+
+void test_online_repospanner__headers_are_read_without_the_objects(void)
+{
+	git_repospanner_stats stats;
+	git_odb *odb;
+	git_otype type;
+	size_t len;
+	git_oid id;
+
+	_repo = open_repo(_path = "rsheaders.git", true);
+	cl_git_pass(git_repository_odb(&odb, _repo));
+
+	cl_git_pass(git_oid_fromstr(&id, README_ID));
+	cl_git_pass(git_odb_read_header(&len, &type, odb, &id));
+	cl_assert_equal_sz(10, len);
+	cl_assert_equal_i(GIT_OBJ_BLOB, type);
+
+	cl_git_pass(git_repospanner_get_stats(&stats, _repo));
+	cl_assert_equal_i(1, stats.endpoints[GIT_REPOSPANNER_ENDPOINT_OBJECT].requests);
+	cl_assert_equal_i(0, stats.endpoints[GIT_REPOSPANNER_ENDPOINT_OBJECT].bytes_received);
+
+	git_odb_free(odb);
+}
+
+void test_online_repospanner__headers_are_read_from_servers_without_head(void)
+{
+	git_repospanner_stats stats;
+	git_odb *odb;
+	git_otype type;
+	size_t len;
+	git_oid id;
+
+	_repo = open_legacy_repo(_path = "rslegacyheaders.git", true);
+	cl_git_pass(git_repository_odb(&odb, _repo));
+
+	/* the first one finds out HEAD is not allowed */
+	cl_git_pass(git_oid_fromstr(&id, README_ID));
+	cl_git_pass(git_odb_read_header(&len, &type, odb, &id));
+	cl_assert_equal_sz(10, len);
+	cl_assert_equal_i(GIT_OBJ_BLOB, type);
+
+	cl_git_pass(git_oid_fromstr(&id, MASTER_ID));
+	cl_git_pass(git_odb_read_header(&len, &type, odb, &id));
+	cl_assert_equal_i(GIT_OBJ_COMMIT, type);
+
+	cl_git_pass(git_oid_fromstr(&id, MISSING_ID));
+	cl_assert_equal_i(0, git_odb_exists(odb, &id));
+
+	cl_git_pass(git_repospanner_get_stats(&stats, _repo));
+	cl_assert_equal_i(4, stats.endpoints[GIT_REPOSPANNER_ENDPOINT_OBJECT].requests);
+	cl_assert_equal_i(1, stats.endpoints[GIT_REPOSPANNER_ENDPOINT_OBJECT].failures);
+	cl_assert_equal_i(1, stats.endpoints[GIT_REPOSPANNER_ENDPOINT_OBJECT].not_found);
+
+	git_odb_free(odb);
+}
+
+void test_online_repospanner__lagging_replicas_are_checked_with_the_primary(void)
+{
+	git_buf url = GIT_BUF_INIT;
+	git_odb_object *obj;
+	git_odb *odb;
+	git_oid id;
+
+	_repo = open_repo(_path = "rslagging.git", true);
+	mock_url(&url, "lagging");
+	add_replica(_repo, url.ptr);
+	git_buf_dispose(&url);
+
+	cl_git_pass(git_repository_odb(&odb, _repo));
+
+	cl_git_pass(git_oid_fromstr(&id, README_ID));
+	cl_git_pass(git_odb_read(&obj, odb, &id));
+	cl_assert_equal_sz(10, git_odb_object_size(obj));
+	git_odb_object_free(obj);
+
+	cl_git_pass(git_oid_fromstr(&id, MISSING_ID));
+	cl_git_fail_with(GIT_ENOTFOUND, git_odb_read(&obj, odb, &id));
+
+	git_odb_free(odb);
+}
+
+void test_online_repospanner__replicas_alone_cannot_tell_objects_are_missing(void)
+{
+	git_buf url = GIT_BUF_INIT;
+	git_odb_object *obj;
+	git_odb *odb;
+	git_oid id;
+	int error;
+
+	/* nothing listens on the primary node */
+	_repo = open_repo_at(_path = "rsnoprimary.git", true, "https://127.0.0.1:1/repo/test.git");
+	mock_url(&url, "lagging");
+	add_replica(_repo, url.ptr);
+	git_buf_dispose(&url);
+
+	cl_git_pass(git_repository_odb(&odb, _repo));
+	cl_git_pass(git_oid_fromstr(&id, README_ID));
+
+	/* twice, as it must not have been remembered as missing either */
+	error = git_odb_read(&obj, odb, &id);
+	cl_assert(error < 0 && error != GIT_ENOTFOUND);
+	error = git_odb_read(&obj, odb, &id);
+	cl_assert(error < 0 && error != GIT_ENOTFOUND);
+
+	git_odb_free(odb);
+}
+
+static int collect_id(const git_oid *id, void *payload)
+{
+	git_array_t(git_oid) *ids = payload;
+	git_oid *entry = git_array_alloc(*ids);
+
+	cl_assert(entry != NULL);
+	git_oid_cpy(entry, id);
+	return 0;
+}
+
+/* Run with --jitter, the mock answers some reads much later than others */
+void test_online_repospanner__slow_reads_are_hedged(void)
+{
+	git_array_t(git_oid) ids = GIT_ARRAY_INIT;
+	git_repospanner_stats stats;
+	git_odb_object *obj;
+	git_odb *odb;
+	char *jitter;
+	git_oid actual;
+	size_t i;
+
+	_repo = open_repo(_path = "rshedged.git", true);
+	add_replica(_repo, _remote_url);
+	cl_repo_set_string(_repo, "repospanner.hedgepercentile", "50");
+	cl_repo_set_string(_repo, "repospanner.hedgedelay", "20");
+
+	cl_git_pass(git_repository_odb(&odb, _repo));
+	cl_git_pass(git_odb_foreach(odb, collect_id, &ids));
+	cl_assert(ids.size > 0);
+
+	/* whichever node answers first, it is the right object */
+	for (i = 0; i < ids.size && i < 64; i++) {
+		cl_git_pass(git_odb_read(&obj, odb, git_array_get(ids, i)));
+		cl_git_pass(git_odb_hash(&actual, git_odb_object_data(obj),
+			git_odb_object_size(obj), git_odb_object_type(obj)));
+		cl_assert_equal_oid(git_array_get(ids, i), &actual);
+		git_odb_object_free(obj);
+	}
+
+	cl_git_pass(git_repospanner_get_stats(&stats, _repo));
+	cl_assert_equal_i(0, stats.endpoints[GIT_REPOSPANNER_ENDPOINT_OBJECT].not_found);
+
+	if ((jitter = cl_getenv("GITTEST_REPOSPANNER_JITTER")) != NULL)
+		cl_assert(stats.hedged > 0);
+
+	git__free(jitter);
+	git_array_clear(ids);
+	git_odb_free(odb);
+}
+
+#define SUBTREES_TREE_ID "ae90f12eea699729ed24555e40b9fd669da12a12"
+#define SUBTREES_DE_ID "b6361fc6a97178d8fc8639fdeed71c775ab52593"
+
+static int count_entries(const char *root, const git_tree_entry *entry, void *payload)
+{
+	GIT_UNUSED(root);
+	GIT_UNUSED(entry);
+
+	(*(size_t *)payload)++;
+	return 0;
+}
+
+static size_t walk_tree(const char *tree_id)
+{
+	git_tree *tree;
+	git_oid id;
+	size_t entries = 0;
+
+	cl_git_pass(git_oid_fromstr(&id, tree_id));
+	cl_git_pass(git_tree_lookup(&tree, _repo, &id));
+	cl_git_pass(git_tree_walk(tree, GIT_TREEWALK_PRE, count_entries, &entries));
+	git_tree_free(tree);
+
+	return entries;
+}
+
+void test_online_repospanner__trees_are_fetched_with_their_subtrees(void)
+{
+	git_repospanner_stats stats;
+
+	_repo = open_repo(_path = "rstrees.git", true);
+
+	cl_assert_equal_sz(11, walk_tree(SUBTREES_TREE_ID));
+
+	/* the root tree, and then everything below it at once */
+	cl_git_pass(git_repospanner_get_stats(&stats, _repo));
+	cl_assert_equal_i(1, stats.endpoints[GIT_REPOSPANNER_ENDPOINT_OBJECT].requests);
+	cl_assert_equal_i(1, stats.endpoints[GIT_REPOSPANNER_ENDPOINT_TREE].requests);
+
+	cl_assert_equal_sz(11, walk_tree(SUBTREES_TREE_ID));
+
+	cl_git_pass(git_repospanner_get_stats(&stats, _repo));
+	cl_assert_equal_i(1, stats.endpoints[GIT_REPOSPANNER_ENDPOINT_OBJECT].requests);
+	cl_assert_equal_i(1, stats.endpoints[GIT_REPOSPANNER_ENDPOINT_TREE].requests);
+}
+
+void test_online_repospanner__trees_are_walked_on_servers_without_fetching_them(void)
+{
+	git_repospanner_stats stats;
+
+	_repo = open_legacy_repo(_path = "rslegacytrees.git", true);
+
+	/* the first one finds out the server cannot send them */
+	cl_assert_equal_sz(3, walk_tree(SUBTREES_DE_ID));
+	cl_assert_equal_sz(11, walk_tree(SUBTREES_TREE_ID));
+
+	cl_git_pass(git_repospanner_get_stats(&stats, _repo));
+	cl_assert_equal_i(1, stats.endpoints[GIT_REPOSPANNER_ENDPOINT_TREE].requests);
+	cl_assert_equal_i(0, stats.endpoints[GIT_REPOSPANNER_ENDPOINT_OBJECT].not_found);
+}
+
+void test_online_repospanner__paths_are_checked_out_without_the_whole_tree(void)
+{
+	git_checkout_options opts = GIT_CHECKOUT_OPTIONS_INIT;
+	git_repospanner_stats stats;
+	char *paths[] = { "ab/de/fgh" };
+	git_object *tree;
+
+	_repo = open_repo(_path = "rscheckoutpaths", false);
+
+	opts.checkout_strategy = GIT_CHECKOUT_FORCE;
+	opts.paths.strings = paths;
+	opts.paths.count = 1;
+
+	cl_git_pass(git_revparse_single(&tree, _repo, SUBTREES_TREE_ID));
+	cl_git_pass(git_checkout_tree(_repo, tree, &opts));
+	git_object_free(tree);
+
+	cl_assert_equal_file("1.txt\n", 0, "rscheckoutpaths/ab/de/fgh/1.txt");
+	cl_assert(!git_path_exists("rscheckoutpaths/ab/4.txt"));
+
+	cl_git_pass(git_repospanner_get_stats(&stats, _repo));
+	cl_assert_equal_i(0, stats.endpoints[GIT_REPOSPANNER_ENDPOINT_TREE].requests);
+}
+
+/* Several stream windows of data which does not compress */
+#define LARGE_BLOB_SIZE (3 * 1024 * 1024 + 17)
+
+static void upload_large_blob(git_oid *out, git_buf *data)
+{
+	git_repository *repo;
+	git_odb *odb;
+	uint32_t seed = 42;
+	size_t i;
+
+	cl_git_pass(git_buf_grow(data, LARGE_BLOB_SIZE));
+	for (i = 0; i < LARGE_BLOB_SIZE; i++) {
+		seed = seed * 1103515245 + 12345;
+		data->ptr[i] = (char)(seed >> 16);
+	}
+	data->size = LARGE_BLOB_SIZE;
+
+	repo = open_repo("rsstream-upload.git", true);
+	cl_git_pass(git_repository_odb(&odb, repo));
+	cl_git_pass(git_odb_write(out, odb, data->ptr, data->size, GIT_OBJ_BLOB));
+	git_odb_free(odb);
+	git_repository_free(repo);
+	cl_fixture_cleanup("rsstream-upload.git");
+}
+
+/* Read `stream` a little at a time, returning the first error if any */
+static int read_stream(git_buf *out, git_odb_stream *stream)
+{
+	char buf[4096];
+	int read;
+
+	while ((read = git_odb_stream_read(stream, buf, sizeof(buf))) > 0)
+		cl_git_pass(git_buf_put(out, buf, read));
+
+	return read;
+}
+
+void test_online_repospanner__large_objects_are_streamed(void)
+{
+	git_buf expected = GIT_BUF_INIT, actual = GIT_BUF_INIT;
+	git_repospanner_stats stats;
+	git_odb_stream *stream;
+	git_odb *odb;
+	git_otype type;
+	size_t len;
+	git_oid id;
+
+	upload_large_blob(&id, &expected);
+
+	_repo = open_repo(_path = "rsstream.git", true);
+	cl_git_pass(git_repository_odb(&odb, _repo));
+
+	/* read slower than it arrives, so it stops and resumes a few times */
+	cl_git_pass(git_odb_open_rstream(&stream, &len, &type, odb, &id));
+	cl_assert_equal_sz(LARGE_BLOB_SIZE, len);
+	cl_assert_equal_i(GIT_OBJ_BLOB, type);
+
+	cl_git_pass(read_stream(&actual, stream));
+	cl_assert_equal_sz(expected.size, actual.size);
+	cl_assert(memcmp(expected.ptr, actual.ptr, expected.size) == 0);
+	git_odb_stream_free(stream);
+
+	cl_git_pass(git_repospanner_get_stats(&stats, _repo));
+	cl_assert_equal_i(1, stats.endpoints[GIT_REPOSPANNER_ENDPOINT_OBJECT].requests);
+	cl_assert(stats.endpoints[GIT_REPOSPANNER_ENDPOINT_OBJECT].bytes_received > LARGE_BLOB_SIZE);
+
+	git_buf_dispose(&expected);
+	git_buf_dispose(&actual);
+	git_odb_free(odb);
+}
+
+void test_online_repospanner__streamed_objects_are_verified(void)
+{
+	git_buf url = GIT_BUF_INIT, actual = GIT_BUF_INIT;
+	git_odb_stream *stream;
+	git_odb *odb;
+	git_otype type;
+	size_t len;
+	git_oid id;
+
+	/* the right type and size, but not the right contents */
+	mock_url(&url, "corrupt");
+	_repo = open_repo_at(_path = "rsstreamcorrupt.git", true, url.ptr);
+	git_buf_dispose(&url);
+
+	cl_git_pass(git_repository_odb(&odb, _repo));
+	cl_git_pass(git_oid_fromstr(&id, README_ID));
+
+	cl_git_pass(git_odb_open_rstream(&stream, &len, &type, odb, &id));
+	cl_assert_equal_sz(10, len);
+	cl_git_fail(read_stream(&actual, stream));
+	git_odb_stream_free(stream);
+
+	git_buf_dispose(&actual);
+	git_odb_free(odb);
+}
+
+void test_online_repospanner__truncated_streams_fail(void)
+{
+	git_buf url = GIT_BUF_INIT, expected = GIT_BUF_INIT, actual = GIT_BUF_INIT;
+	git_odb_stream *stream;
+	git_odb *odb;
+	git_otype type;
+	size_t len;
+	git_oid id;
+
+	upload_large_blob(&id, &expected);
+
+	mock_url(&url, "truncated");
+	_repo = open_repo_at(_path = "rsstreamtruncated.git", true, url.ptr);
+	git_buf_dispose(&url);
+
+	cl_git_pass(git_repository_odb(&odb, _repo));
+
+	/* the connection is closed well after the start */
+	cl_git_pass(git_odb_open_rstream(&stream, &len, &type, odb, &id));
+	cl_assert_equal_sz(LARGE_BLOB_SIZE, len);
+	cl_git_fail(read_stream(&actual, stream));
+	cl_assert(actual.size < LARGE_BLOB_SIZE);
+	git_odb_stream_free(stream);
+
+	git_buf_dispose(&expected);
+	git_buf_dispose(&actual);
+	git_odb_free(odb);
+}
+
+void test_online_repospanner__abbreviations_are_resolved(void)
+{
+	git_repospanner_stats stats;
+	git_odb_object *obj;
+	git_odb *odb;
+	git_oid id, expected;
+
+	_repo = open_repo(_path = "rsprefix.git", true);
+	cl_git_pass(git_repository_odb(&odb, _repo));
+
+	cl_git_pass(git_oid_fromstr(&expected, README_ID));
+	cl_git_pass(git_oid_fromstrn(&id, README_ID, 8));
+
+	cl_git_pass(git_odb_read_prefix(&obj, odb, &id, 8));
+	cl_assert_equal_oid(&expected, git_odb_object_id(obj));
+	git_odb_object_free(obj);
+
+	cl_git_pass(git_oid_fromstrn(&id, MISSING_ID, 8));
+	cl_git_fail_with(GIT_ENOTFOUND, git_odb_read_prefix(&obj, odb, &id, 8));
+
+	cl_git_pass(git_repospanner_get_stats(&stats, _repo));
+	cl_assert_equal_i(2, stats.endpoints[GIT_REPOSPANNER_ENDPOINT_PREFIX].requests);
+	cl_assert_equal_i(1, stats.endpoints[GIT_REPOSPANNER_ENDPOINT_OBJECT].requests);
+
+	git_odb_free(odb);
+}
+
+void test_online_repospanner__local_abbreviations_are_not_downloaded(void)
+{
+	git_repospanner_stats stats;
+	git_odb_backend *loose;
+	git_odb_object *obj;
+	git_odb *odb;
+	git_oid id, expected;
+
+	_repo = open_repo(_path = "rsprefixlocal.git", true);
+
+	cl_git_pass(git_oid_fromstr(&expected, README_ID));
+	cl_git_pass(git_odb_backend_loose(&loose, "rsprefixlocal.git/objects", -1, 0, 0, 0));
+	cl_git_pass(loose->write(loose, &expected, "hey there\n", 10, GIT_OBJ_BLOB));
+	loose->free(loose);
+
+	cl_git_pass(git_repository_odb(&odb, _repo));
+	cl_git_pass(git_oid_fromstrn(&id, README_ID, 8));
+
+	/* the server is only asked whether it has another object like it */
+	cl_git_pass(git_odb_read_prefix(&obj, odb, &id, 8));
+	cl_assert_equal_oid(&expected, git_odb_object_id(obj));
+	git_odb_object_free(obj);
+
+	cl_git_pass(git_repospanner_get_stats(&stats, _repo));
+	cl_assert_equal_i(1, stats.endpoints[GIT_REPOSPANNER_ENDPOINT_PREFIX].requests);
+	cl_assert_equal_i(0, stats.endpoints[GIT_REPOSPANNER_ENDPOINT_OBJECT].requests);
+
+	git_odb_free(odb);
+}
+
+static void read_readme(git_repository *repo)
+{
+	git_blob *blob;
+	git_oid id;
+
+	cl_git_pass(git_oid_fromstr(&id, README_ID));
+	cl_git_pass(git_blob_lookup(&blob, repo, &id));
+	git_blob_free(blob);
+}
+
+void test_online_repospanner__tls_sessions_are_resumed_by_other_clients(void)
+{
+#ifdef GIT_OPENSSL
+	git_repospanner_handle_stats stats;
+	git_repository *other;
+
+	_repo = open_repo(_path = "rstls.git", true);
+	cl_repo_set_bool(_repo, "repospanner.tlssessions", true);
+
+	read_readme(_repo);
+	cl_git_pass(git_repospanner_get_handle_stats(&stats, _repo));
+	cl_assert_equal_i(0, stats.resumed);
+
+	/* as another process would find it, its client knowing nothing yet */
+	other = open_repo("rstls-other.git", true);
+	cl_repo_set_bool(other, "repospanner.tlssessions", true);
+	cl_git_pass(git_futils_cp_r("rstls.git/repospanner-tls", "rstls-other.git/repospanner-tls",
+		GIT_CPDIR_CREATE_EMPTY_DIRS, 0700));
+
+	read_readme(other);
+	cl_git_pass(git_repospanner_get_handle_stats(&stats, other));
+	cl_assert_equal_i(1, stats.connections);
+	cl_assert_equal_i(1, stats.resumed);
+
+	git_repository_free(other);
+	cl_fixture_cleanup("rstls-other.git");
+#else
+	cl_skip();
+#endif
+}
+
+void test_online_repospanner__requests_are_measured(void)
+{
+	git_repospanner_endpoint_stats *object;
+	git_repospanner_stats stats;
+	size_t i, timed = 0;
+
+	_repo = open_repo(_path = "rsmeasured.git", true);
+	read_readme(_repo);
+
+	cl_git_pass(git_repospanner_get_stats(&stats, _repo));
+	object = &stats.endpoints[GIT_REPOSPANNER_ENDPOINT_OBJECT];
+
+	cl_assert_equal_i(1, object->requests);
+	cl_assert_equal_i(0, object->failures);
+	cl_assert(object->bytes_received > 0);
+	cl_assert(object->time > 0);
+
+	for (i = 0; i < GIT_REPOSPANNER_LATENCY_BUCKETS; i++)
+		timed += object->latency[i];
+	cl_assert_equal_sz(1, timed);
+}
+
+void test_online_repospanner__head_is_checked_out(void)
+{
+	git_checkout_options opts = GIT_CHECKOUT_OPTIONS_INIT;
+
+	_repo = open_repo(_path = "rscheckout", false);
+
+	opts.checkout_strategy = GIT_CHECKOUT_FORCE;
+	cl_git_pass(git_checkout_head(_repo, &opts));
+
+	cl_assert_equal_file("hey there\n", 0, "rscheckout/README");
+	cl_assert(git_path_isfile("rscheckout/new.txt"));
+}
+
+void test_online_repospanner__writes_reach_the_server(void)
+{
+	git_reference *ref;
+	git_repository *other;
+	git_odb *odb;
+	git_blob *blob;
+	git_oid blob_id, master_id;
+
+	_repo = open_repo(_path = "rswrite.git", true);
+
+	cl_git_pass(git_repository_odb(&odb, _repo));
+	cl_git_pass(git_odb_write(&blob_id, odb, "pushed\n", 7, GIT_OBJ_BLOB));
+	git_odb_free(odb);
+	cl_git_pass(git_repospanner_upload_objects(_repo));
+	cl_assert(!git_path_exists("rswrite.git/repospanner-pending"));
+
+	cl_git_pass(git_oid_fromstr(&master_id, MASTER_ID));
+	cl_git_pass(git_reference_create(&ref, _repo, "refs/heads/online", &master_id, 1, NULL));
+	git_reference_free(ref);
+
+	/* another repository only has the server to get them from */
+	other = open_repo("rswrite-other.git", true);
+
+	cl_git_pass(git_blob_lookup(&blob, other, &blob_id));
+	cl_assert_equal_s("pushed\n", git_blob_rawcontent(blob));
+	git_blob_free(blob);
+
+	cl_git_pass(git_reference_lookup(&ref, other, "refs/heads/online"));
+	cl_assert_equal_oid(&master_id, git_reference_target(ref));
+	git_reference_free(ref);
+
+	git_repository_free(other);
+	cl_fixture_cleanup("rswrite-other.git");
+}
+
+void test_online_repospanner__writes_are_uploaded_when_the_repository_is_freed(void)
+{
+	git_repository *other;
+	git_odb *odb;
+	git_blob *blob;
+	git_oid id;
+
+	_repo = open_repo(_path = "rsflush.git", true);
+
+	cl_git_pass(git_repository_odb(&odb, _repo));
+	cl_git_pass(git_odb_write(&id, odb, "flushed\n", 8, GIT_OBJ_BLOB));
+	git_odb_free(odb);
+
+	git_repository_free(_repo);
+	_repo = NULL;
+
+	other = open_repo("rsflush-other.git", true);
+	cl_git_pass(git_blob_lookup(&blob, other, &id));
+	cl_assert_equal_s("flushed\n", git_blob_rawcontent(blob));
+	git_blob_free(blob);
+
+	git_repository_free(other);
+	cl_fixture_cleanup("rsflush-other.git");
+}
+
+void test_online_repospanner__uploaded_objects_are_not_missing_anymore(void)
+{
+	git_buf path = GIT_BUF_INIT;
+	char loose[GIT_OID_HEXSZ + 2] = { 0 };
+	git_object *obj;
+	git_odb *odb;
+	git_oid id;
+
+	_repo = open_repo(_path = "rsuploaded.git", true);
+	cl_git_pass(git_odb_hash(&id, "uploaded\n", 9, GIT_OBJ_BLOB));
+	cl_git_fail_with(GIT_ENOTFOUND, git_object_lookup(&obj, _repo, &id, GIT_OBJ_ANY));
+
+	cl_git_pass(git_repository_odb(&odb, _repo));
+	cl_git_pass(git_odb_write(&id, odb, "uploaded\n", 9, GIT_OBJ_BLOB));
+	git_odb_free(odb);
+	cl_git_pass(git_repospanner_upload_objects(_repo));
+
+	/* without the local copy, only the server has it */
+	git_oid_pathfmt(loose, &id);
+	cl_git_pass(git_buf_joinpath(&path, "rsuploaded.git/objects", loose));
+	cl_must_pass(p_unlink(path.ptr));
+	git_buf_dispose(&path);
+
+	git_repository_free(_repo);
+	cl_git_pass(git_repository_open(&_repo, _path));
+
+	cl_git_pass(git_object_lookup(&obj, _repo, &id, GIT_OBJ_BLOB));
+	git_object_free(obj);
+}
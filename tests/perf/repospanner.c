@@ -0,0 +1,261 @@
+#include "clar_libgit2.h"
+#include "git2/sys/repospanner.h"
+#include "fileops.h"
+#include "oidarray.h"
+#include "helper__perf__timer.h"
+
+/*
+ * Benchmarks of the repoSpanner backends against a server, like the
+ * one started by script/repospanner-mock.py.  They are skipped unless
+ * GITTEST_REPOSPANNER_URL and GITTEST_REPOSPANNER_CERTS point at it.
+ *
+ * Any repository works, the bigger the better; "cold" runs start with
+ * nothing cached, "warm" ones repeat the same work right after.
+ * Running the server with --latency shows what a round trip costs.
+ */
+
+static char *_remote_url;
+static char *_remote_certs;
+static git_repository *_repo;
+static const char *_path;
+
+void test_perf_repospanner__initialize(void)
+{
+	_remote_url = cl_getenv("GITTEST_REPOSPANNER_URL");
+	_remote_certs = cl_getenv("GITTEST_REPOSPANNER_CERTS");
+	_repo = NULL;
+	_path = NULL;
+
+	if (!_remote_url || !_remote_certs)
+		cl_skip();
+}
+
+void test_perf_repospanner__cleanup(void)
+{
+	git_repository_free(_repo);
+
+	if (_path)
+		cl_fixture_cleanup(_path);
+
+	git__free(_remote_url);
+	git__free(_remote_certs);
+}
+
+static void set_cert(git_repository *repo, const char *name, const char *file)
+{
+	git_buf path = GIT_BUF_INIT;
+
+	cl_git_pass(git_buf_joinpath(&path, _remote_certs, file));
+	cl_repo_set_string(repo, name, path.ptr);
+	git_buf_dispose(&path);
+}
+
+/* Clients outlive their repositories, so every benchmark has its own */
+static git_repository *open_repo(const char *path, bool bare)
+{
+	git_repository *repo;
+
+	cl_git_pass(git_repository_init(&repo, path, bare));
+	cl_repo_set_bool(repo, "repospanner.enabled", true);
+	cl_repo_set_string(repo, "repospanner.url", _remote_url);
+	set_cert(repo, "repospanner.cert", "client.crt");
+	set_cert(repo, "repospanner.key", "client.key");
+	set_cert(repo, "repospanner.cacert", "ca.crt");
+	git_repository_free(repo);
+
+	cl_git_pass(git_repository_open(&repo, path));
+	return repo;
+}
+
+static void report_stats(git_repository *repo, const char *name)
+{
+	git_repospanner_stats stats;
+	git_repospanner_endpoint_stats *endpoint;
+	int i;
+
+	cl_git_pass(git_repospanner_get_stats(&stats, repo));
+
+	for (i = 0; i < GIT_REPOSPANNER_ENDPOINT__LAST; i++) {
+		endpoint = &stats.endpoints[i];
+
+		if (endpoint->requests)
+			printf("%10s  %s: %"PRIuZ" requests to %s, %.3f s, %"PRIu64" bytes\n", "",
+				name, endpoint->requests, git_repospanner_endpoint_name(i),
+				endpoint->time, endpoint->bytes_received);
+	}
+
+	printf("%10s  %s: %"PRIuZ" cache hits\n", "", name, stats.cache_hits);
+}
+
+static int remove_entry(void *payload, git_buf *path)
+{
+	GIT_UNUSED(payload);
+
+	if (!strcmp(git_path_basename(path->ptr), ".git"))
+		return 0;
+
+	if (git_path_isdir(path->ptr))
+		return git_futils_rmdir_r(path->ptr, NULL, GIT_RMDIR_REMOVE_FILES);
+
+	return p_unlink(path->ptr);
+}
+
+void test_perf_repospanner__checkout(void)
+{
+	git_checkout_options opts = GIT_CHECKOUT_OPTIONS_INIT;
+	perf_timer cold = PERF_TIMER_INIT, warm = PERF_TIMER_INIT;
+	git_buf path = GIT_BUF_INIT;
+
+	_repo = open_repo(_path = "rsperf-checkout", false);
+	opts.checkout_strategy = GIT_CHECKOUT_FORCE;
+
+	perf__timer__start(&cold);
+	cl_git_pass(git_checkout_head(_repo, &opts));
+	perf__timer__stop(&cold);
+
+	/* everything but the repository itself goes, the cache stays */
+	cl_git_pass(git_buf_sets(&path, _path));
+	cl_git_pass(git_path_direach(&path, 0, remove_entry, NULL));
+	cl_git_pass(git_buf_joinpath(&path, _path, ".git/index"));
+	cl_must_pass(p_unlink(path.ptr));
+	git_buf_dispose(&path);
+
+	perf__timer__start(&warm);
+	cl_git_pass(git_checkout_head(_repo, &opts));
+	perf__timer__stop(&warm);
+
+	perf__timer__report(&cold, "repospanner: cold checkout");
+	perf__timer__report(&warm, "repospanner: warm checkout");
+	report_stats(_repo, "checkout");
+}
+
+static size_t walk(git_repository *repo)
+{
+	git_revwalk *walk;
+	git_commit *commit;
+	git_oid id;
+	size_t count = 0;
+
+	cl_git_pass(git_revwalk_new(&walk, repo));
+	git_revwalk_sorting(walk, GIT_SORT_TIME);
+	cl_git_pass(git_revwalk_push_glob(walk, "refs/*"));
+
+	while (git_revwalk_next(&id, walk) == 0) {
+		cl_git_pass(git_commit_lookup(&commit, repo, &id));
+		git_commit_free(commit);
+		count++;
+	}
+
+	git_revwalk_free(walk);
+	return count;
+}
+
+void test_perf_repospanner__revwalk(void)
+{
+	perf_timer cold = PERF_TIMER_INIT, warm = PERF_TIMER_INIT;
+	size_t count;
+
+	_repo = open_repo(_path = "rsperf-revwalk.git", true);
+
+	perf__timer__start(&cold);
+	count = walk(_repo);
+	perf__timer__stop(&cold);
+
+	/* a new repository, so only what the client cached helps */
+	git_repository_free(_repo);
+	cl_git_pass(git_repository_open(&_repo, _path));
+
+	perf__timer__start(&warm);
+	cl_assert_equal_i(count, walk(_repo));
+	perf__timer__stop(&warm);
+
+	perf__timer__report(&cold, "repospanner: cold revwalk (%"PRIuZ" commits)", count);
+	perf__timer__report(&warm, "repospanner: warm revwalk (%"PRIuZ" commits)", count);
+	report_stats(_repo, "revwalk");
+}
+
+static int count_refs(git_reference *ref, void *payload)
+{
+	(*(size_t *)payload)++;
+	git_reference_free(ref);
+	return 0;
+}
+
+void test_perf_repospanner__ref_listing(void)
+{
+	perf_timer cold = PERF_TIMER_INIT, warm = PERF_TIMER_INIT;
+	size_t count = 0, again = 0;
+
+	_repo = open_repo(_path = "rsperf-refs.git", true);
+
+	perf__timer__start(&cold);
+	cl_git_pass(git_reference_foreach(_repo, count_refs, &count));
+	perf__timer__stop(&cold);
+
+	/* this one starts from the snapshot the first one left behind */
+	git_repository_free(_repo);
+	cl_git_pass(git_repository_open(&_repo, _path));
+
+	perf__timer__start(&warm);
+	cl_git_pass(git_reference_foreach(_repo, count_refs, &again));
+	perf__timer__stop(&warm);
+
+	cl_assert_equal_i(count, again);
+
+	perf__timer__report(&cold, "repospanner: cold ref listing (%"PRIuZ" refs)", count);
+	perf__timer__report(&warm, "repospanner: warm ref listing (%"PRIuZ" refs)", count);
+	report_stats(_repo, "refs");
+}
+
+static int collect_blob(const char *root, const git_tree_entry *entry, void *payload)
+{
+	git_array_oid_t *ids = payload;
+	git_oid *id;
+
+	GIT_UNUSED(root);
+
+	if (git_tree_entry_type(entry) == GIT_OBJ_BLOB) {
+		id = git_array_alloc(*ids);
+		GITERR_CHECK_ALLOC(id);
+		git_oid_cpy(id, git_tree_entry_id(entry));
+	}
+
+	return 0;
+}
+
+void test_perf_repospanner__object_reads(void)
+{
+	git_array_oid_t ids = GIT_ARRAY_INIT;
+	perf_timer timer = PERF_TIMER_INIT;
+	git_repository *source;
+	git_odb_object *obj;
+	git_object *tree;
+	git_odb *odb;
+	uint64_t bytes = 0;
+	size_t i;
+
+	/* find out what to read with a repository of its own */
+	source = open_repo("rsperf-source.git", true);
+	cl_git_pass(git_revparse_single(&tree, source, "HEAD^{tree}"));
+	cl_git_pass(git_tree_walk((git_tree *)tree, GIT_TREEWALK_PRE, collect_blob, &ids));
+	git_object_free(tree);
+	git_repository_free(source);
+	cl_fixture_cleanup("rsperf-source.git");
+
+	_repo = open_repo(_path = "rsperf-objects.git", true);
+	cl_git_pass(git_repository_odb(&odb, _repo));
+
+	perf__timer__start(&timer);
+	for (i = 0; i < ids.size; i++) {
+		cl_git_pass(git_odb_read(&obj, odb, &ids.ptr[i]));
+		bytes += git_odb_object_size(obj);
+		git_odb_object_free(obj);
+	}
+	perf__timer__stop(&timer);
+
+	perf__timer__report(&timer, "repospanner: cold reads of %"PRIuZ" blobs, %"PRIu64" bytes", ids.size, bytes);
+	report_stats(_repo, "reads");
+
+	git_odb_free(odb);
+	git_array_clear(ids);
+}
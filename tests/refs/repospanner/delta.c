@@ -0,0 +1,207 @@
+#include "clar_libgit2.h"
+#include "refdb.h"
+#include "refdb_repospanner.h"
+#include "odb/repospanner/repospanner_helpers.h"
+
+#define MASTER_ID "a65fedf39aefe402d3bb6e24df4d4f5fe4547750"
+#define BR2_ID "c47800c7266a2be04c571c04d5a6614691ea99bd"
+
+static git_repository *_repo;
+static refdb_rs_backend *_backend;
+
+void test_refs_repospanner_delta__initialize(void)
+{
+	git_refdb *refdb;
+
+	_repo = cl_git_sandbox_init("testrepo.git");
+	repospanner_helpers_configure(_repo, REPOSPANNER_UNREACHABLE_URL);
+	cl_repo_set_string(_repo, "repospanner.refsinterval", "600000");
+	cl_repo_set_bool(_repo, "repospanner.refsnapshot", false);
+
+	cl_git_pass(git_repository_refdb__weakptr(&refdb, _repo));
+	_backend = (refdb_rs_backend *)refdb->backend;
+}
+
+void test_refs_repospanner_delta__cleanup(void)
+{
+	cl_git_sandbox_cleanup();
+}
+
+static void header(struct refretrieve *listing, const char *line)
+{
+	cl_assert_equal_sz(strlen(line),
+		git_refdb_repospanner__header_cb((char *)line, 1, strlen(line), listing));
+}
+
+static void body(struct refretrieve *listing, const char *data, size_t len)
+{
+	cl_assert_equal_sz(len, git_refdb_repospanner__write_cb((char *)data, 1, len, listing));
+	cl_git_pass(git_refdb_repospanner__write_finish(listing));
+}
+
+static const char full[] =
+	"real\0refs/heads/br2\0" BR2_ID "\n"
+	"real\0refs/heads/master\0" MASTER_ID "\n";
+
+/* Start from what a complete listing tagged "v1" holds */
+static void apply_full_listing(void)
+{
+	struct refretrieve listing;
+	bool changed = false;
+
+	cl_git_pass(git_refdb_repospanner__retrieve_init(&listing));
+	header(&listing, "ETag: \"v1\"\r\n");
+	body(&listing, full, sizeof(full) - 1);
+
+	cl_git_pass(git_refdb_repospanner__apply(&changed, _backend, &listing,
+		200, NULL, NULL, false, git__timer()));
+	cl_assert(changed);
+
+	git_refdb_repospanner__retrieve_dispose(&listing);
+}
+
+static void assert_ref(const char *name, const char *id)
+{
+	git_reference *ref;
+	git_oid expected;
+
+	cl_git_pass(git_reference_lookup(&ref, _repo, name));
+	cl_git_pass(git_oid_fromstr(&expected, id));
+	cl_assert_equal_oid(&expected, git_reference_target(ref));
+	git_reference_free(ref);
+}
+
+static void assert_no_ref(const char *name)
+{
+	git_reference *ref;
+
+	/* not cached, so it is asked for and the server cannot be reached */
+	cl_git_fail(git_reference_lookup(&ref, _repo, name));
+}
+
+void test_refs_repospanner_delta__headers_are_parsed(void)
+{
+	struct refretrieve listing;
+
+	cl_git_pass(git_refdb_repospanner__retrieve_init(&listing));
+
+	header(&listing, "HTTP/1.1 226 IM Used\r\n");
+	cl_assert(!listing.delta);
+
+	header(&listing, "etag:   \"v2\"  \r\n");
+	header(&listing, "IM: repospanner-refs\r\n");
+	header(&listing, "Content-Type: text/plain; charset=utf-8\r\n");
+	header(&listing, "\r\n");
+
+	cl_assert_equal_s("\"v2\"", git_buf_cstr(&listing.etag));
+	cl_assert(listing.delta);
+	cl_assert(!listing.binary);
+
+	header(&listing, "content-type: Application/X-RepoSpanner-Refs\r\n");
+	cl_assert(listing.binary);
+
+	git_refdb_repospanner__retrieve_dispose(&listing);
+}
+
+void test_refs_repospanner_delta__deltas_only_touch_the_refs_they_list(void)
+{
+	static const char delta[] =
+		"real\0refs/heads/br2\0" MASTER_ID "\n"
+		"dele\0refs/heads/master\0\n"
+		"real\0refs/tags/v1\0" BR2_ID "\n";
+	struct refretrieve listing;
+	bool changed = false;
+
+	apply_full_listing();
+
+	cl_git_pass(git_refdb_repospanner__retrieve_init(&listing));
+	header(&listing, "ETag: \"v2\"\r\n");
+	header(&listing, "IM: repospanner-refs\r\n");
+	body(&listing, delta, sizeof(delta) - 1);
+
+	cl_git_pass(git_refdb_repospanner__apply(&changed, _backend, &listing,
+		226, NULL, NULL, true, git__timer()));
+	cl_assert(changed);
+	git_refdb_repospanner__retrieve_dispose(&listing);
+
+	assert_ref("refs/heads/br2", MASTER_ID);
+	assert_ref("refs/tags/v1", BR2_ID);
+	assert_no_ref("refs/heads/master");
+}
+
+void test_refs_repospanner_delta__complete_listings_replace_all_refs(void)
+{
+	static const char listing_data[] = "real\0refs/heads/master\0" BR2_ID "\n";
+	struct refretrieve listing;
+	bool changed = false;
+
+	apply_full_listing();
+
+	cl_git_pass(git_refdb_repospanner__retrieve_init(&listing));
+	header(&listing, "ETag: \"v2\"\r\n");
+	body(&listing, listing_data, sizeof(listing_data) - 1);
+
+	/* a server that cannot send a delta sends everything */
+	cl_git_pass(git_refdb_repospanner__apply(&changed, _backend, &listing,
+		200, NULL, NULL, true, git__timer()));
+	cl_assert(changed);
+	git_refdb_repospanner__retrieve_dispose(&listing);
+
+	assert_ref("refs/heads/master", BR2_ID);
+	assert_no_ref("refs/heads/br2");
+}
+
+void test_refs_repospanner_delta__unchanged_refs_are_kept(void)
+{
+	struct refretrieve listing;
+	bool changed = false;
+
+	apply_full_listing();
+
+	cl_git_pass(git_refdb_repospanner__retrieve_init(&listing));
+	header(&listing, "ETag: \"v1\"\r\n");
+
+	cl_git_pass(git_refdb_repospanner__apply(&changed, _backend, &listing,
+		304, NULL, NULL, true, git__timer()));
+	cl_assert(!changed);
+	git_refdb_repospanner__retrieve_dispose(&listing);
+
+	/* the same listing again is no change either */
+	cl_git_pass(git_refdb_repospanner__retrieve_init(&listing));
+	body(&listing, full, sizeof(full) - 1);
+	cl_git_pass(git_refdb_repospanner__apply(&changed, _backend, &listing,
+		200, NULL, NULL, true, git__timer()));
+	cl_assert(!changed);
+	git_refdb_repospanner__retrieve_dispose(&listing);
+
+	assert_ref("refs/heads/br2", BR2_ID);
+	assert_ref("refs/heads/master", MASTER_ID);
+}
+
+void test_refs_repospanner_delta__unexpected_deltas_are_refused(void)
+{
+	static const char delta[] = "dele\0refs/heads/master\0\n";
+	struct refretrieve listing;
+	bool changed = false;
+
+	apply_full_listing();
+
+	/* a delta marked as the complete listing */
+	cl_git_pass(git_refdb_repospanner__retrieve_init(&listing));
+	header(&listing, "IM: repospanner-refs\r\n");
+	body(&listing, delta, sizeof(delta) - 1);
+	cl_git_fail(git_refdb_repospanner__apply(&changed, _backend, &listing,
+		200, NULL, NULL, true, git__timer()));
+	git_refdb_repospanner__retrieve_dispose(&listing);
+
+	/* a delta against a state we did not send */
+	cl_git_pass(git_refdb_repospanner__retrieve_init(&listing));
+	header(&listing, "IM: repospanner-refs\r\n");
+	body(&listing, delta, sizeof(delta) - 1);
+	cl_git_fail(git_refdb_repospanner__apply(&changed, _backend, &listing,
+		226, NULL, NULL, false, git__timer()));
+	git_refdb_repospanner__retrieve_dispose(&listing);
+
+	cl_assert(!changed);
+	assert_ref("refs/heads/master", MASTER_ID);
+}
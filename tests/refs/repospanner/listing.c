@@ -0,0 +1,207 @@
+#include "clar_libgit2.h"
+#include "refdb_repospanner.h"
+
+#define MASTER_ID "a65fedf39aefe402d3bb6e24df4d4f5fe4547750"
+#define BR2_ID "c47800c7266a2be04c571c04d5a6614691ea99bd"
+
+static struct refretrieve _listing;
+
+void test_refs_repospanner_listing__initialize(void)
+{
+	cl_git_pass(git_refdb_repospanner__retrieve_init(&_listing));
+}
+
+void test_refs_repospanner_listing__cleanup(void)
+{
+	git_refdb_repospanner__retrieve_dispose(&_listing);
+}
+
+static const char lines[] =
+	"symb\0HEAD\0refs/heads/master\n"
+	"real\0refs/heads/br2\0" BR2_ID "\n"
+	"dele\0refs/heads/gone\0\n"
+	"real\0refs/heads/master\0" MASTER_ID "\n";
+
+/*
+ * The same refs as a binary listing: names share a prefix with the
+ * previous one, of which the given number of bytes is stripped.
+ */
+static const char binary[] =
+	"RSRL"
+	"s\0HEAD\0refs/heads/master\0"
+	"r\4refs/heads/br2\0"
+	"\xc4\x78\x00\xc7\x26\x6a\x2b\xe0\x4c\x57"
+	"\x1c\x04\xd5\xa6\x61\x46\x91\xea\x99\xbd"
+	"d\3gone\0"
+	"r\4master\0"
+	"\xa6\x5f\xed\xf3\x9a\xef\xe4\x02\xd3\xbb"
+	"\x6e\x24\xdf\x4d\x4f\x5f\xe4\x54\x77\x50";
+
+static size_t write_chunk(const char *data, size_t len)
+{
+	return git_refdb_repospanner__write_cb((char *)data, 1, len, &_listing);
+}
+
+static void assert_listed(void)
+{
+	struct packref *ref;
+	git_oid id;
+
+	cl_assert_equal_sz(4, git_sortedcache_entrycount(_listing.target));
+
+	cl_assert((ref = git_sortedcache_lookup(_listing.target, "HEAD")) != NULL);
+	cl_assert_equal_i(PACKREF_IS_SYMBOLIC, ref->flags);
+	cl_assert_equal_s("refs/heads/master", ref->targetref);
+
+	cl_assert((ref = git_sortedcache_lookup(_listing.target, "refs/heads/br2")) != NULL);
+	cl_assert_equal_i(0, ref->flags);
+	cl_git_pass(git_oid_fromstr(&id, BR2_ID));
+	cl_assert_equal_oid(&id, &ref->oid);
+
+	cl_assert((ref = git_sortedcache_lookup(_listing.target, "refs/heads/gone")) != NULL);
+	cl_assert_equal_i(PACKREF_IS_DELETED, ref->flags);
+
+	cl_assert((ref = git_sortedcache_lookup(_listing.target, "refs/heads/master")) != NULL);
+	cl_assert_equal_i(0, ref->flags);
+	cl_git_pass(git_oid_fromstr(&id, MASTER_ID));
+	cl_assert_equal_oid(&id, &ref->oid);
+}
+
+/* Feed `data` in two chunks, split at every possible place */
+static void assert_parsed_when_split(const char *data, size_t len, bool is_binary)
+{
+	size_t split;
+
+	for (split = 0; split <= len; split++) {
+		git_refdb_repospanner__retrieve_dispose(&_listing);
+		cl_git_pass(git_refdb_repospanner__retrieve_init(&_listing));
+		_listing.binary = is_binary;
+
+		if (split > 0)
+			cl_assert_equal_sz(split, write_chunk(data, split));
+		if (split < len)
+			cl_assert_equal_sz(len - split, write_chunk(data + split, len - split));
+
+		cl_git_pass(git_refdb_repospanner__write_finish(&_listing));
+		assert_listed();
+	}
+}
+
+static void assert_parsed_bytewise(const char *data, size_t len, bool is_binary)
+{
+	size_t i;
+
+	_listing.binary = is_binary;
+
+	for (i = 0; i < len; i++)
+		cl_assert_equal_sz(1, write_chunk(data + i, 1));
+
+	cl_git_pass(git_refdb_repospanner__write_finish(&_listing));
+	assert_listed();
+}
+
+void test_refs_repospanner_listing__lines_are_parsed_across_chunks(void)
+{
+	assert_parsed_when_split(lines, sizeof(lines) - 1, false);
+}
+
+void test_refs_repospanner_listing__lines_are_parsed_bytewise(void)
+{
+	assert_parsed_bytewise(lines, sizeof(lines) - 1, false);
+}
+
+void test_refs_repospanner_listing__binary_refs_are_parsed_across_chunks(void)
+{
+	assert_parsed_when_split(binary, sizeof(binary) - 1, true);
+}
+
+void test_refs_repospanner_listing__binary_refs_are_parsed_bytewise(void)
+{
+	assert_parsed_bytewise(binary, sizeof(binary) - 1, true);
+}
+
+void test_refs_repospanner_listing__empty_listings_are_valid(void)
+{
+	cl_git_pass(git_refdb_repospanner__write_finish(&_listing));
+	cl_assert_equal_sz(0, git_sortedcache_entrycount(_listing.target));
+
+	/* binary ones still carry their signature */
+	_listing.binary = true;
+	cl_git_fail(git_refdb_repospanner__write_finish(&_listing));
+
+	cl_assert_equal_sz(4, write_chunk("RSRL", 4));
+	cl_git_pass(git_refdb_repospanner__write_finish(&_listing));
+	cl_assert_equal_sz(0, git_sortedcache_entrycount(_listing.target));
+}
+
+static void assert_malformed_line(const char *line, size_t len)
+{
+	git_refdb_repospanner__retrieve_dispose(&_listing);
+	cl_git_pass(git_refdb_repospanner__retrieve_init(&_listing));
+
+	cl_assert_equal_sz(0, write_chunk(line, len));
+}
+
+#define MALFORMED(line) assert_malformed_line(line, sizeof(line) - 1)
+
+void test_refs_repospanner_listing__malformed_lines_are_refused(void)
+{
+	MALFORMED("real refs/heads/master " MASTER_ID "\n");
+	MALFORMED("real\0refs/heads/master " MASTER_ID "\n");
+	MALFORMED("tag\0refs/tags/v1\0" MASTER_ID "\n");
+	MALFORMED("realx\0refs/heads/master\0" MASTER_ID "\n");
+	MALFORMED("real\0refs/heads/master\0a65fedf3\n");
+	MALFORMED("real\0refs/heads/master\0" MASTER_ID "0\n");
+	MALFORMED("real\0refs/heads/master\0zz5fedf39aefe402d3bb6e24df4d4f5fe4547750\n");
+	MALFORMED("\n");
+
+	/* one bad line fails the listing wherever it starts */
+	git_refdb_repospanner__retrieve_dispose(&_listing);
+	cl_git_pass(git_refdb_repospanner__retrieve_init(&_listing));
+	cl_assert_equal_sz(13, write_chunk("symb\0HEAD\0ref", 13));
+	cl_assert_equal_sz(0, write_chunk("s/heads/master\nbogus\n", 21));
+}
+
+void test_refs_repospanner_listing__truncated_lines_are_refused(void)
+{
+	cl_assert_equal_sz(sizeof(lines) - 2, write_chunk(lines, sizeof(lines) - 2));
+	cl_git_fail(git_refdb_repospanner__write_finish(&_listing));
+}
+
+static void assert_malformed_binary(const char *data, size_t len)
+{
+	git_refdb_repospanner__retrieve_dispose(&_listing);
+	cl_git_pass(git_refdb_repospanner__retrieve_init(&_listing));
+	_listing.binary = true;
+
+	cl_assert_equal_sz(0, write_chunk(data, len));
+}
+
+#define MALFORMED_BINARY(data) assert_malformed_binary(data, sizeof(data) - 1)
+
+void test_refs_repospanner_listing__malformed_binary_refs_are_refused(void)
+{
+	/* not the signature */
+	MALFORMED_BINARY("RSRX" "d\0HEAD\0");
+	/* an unknown type */
+	MALFORMED_BINARY("RSRL" "x\0HEAD\0");
+	/* stripping more than the previous name */
+	MALFORMED_BINARY("RSRL" "d\0HEAD\0" "d\5refs\0");
+	MALFORMED_BINARY("RSRL" "d\1HEAD\0");
+}
+
+void test_refs_repospanner_listing__truncated_binary_refs_are_refused(void)
+{
+	/* cut within the signature, a name, a target and an id */
+	static const size_t cuts[] = { 2, 10, 20, 40, sizeof(binary) - 2 };
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(cuts); i++) {
+		git_refdb_repospanner__retrieve_dispose(&_listing);
+		cl_git_pass(git_refdb_repospanner__retrieve_init(&_listing));
+		_listing.binary = true;
+
+		cl_assert_equal_sz(cuts[i], write_chunk(binary, cuts[i]));
+		cl_git_fail(git_refdb_repospanner__write_finish(&_listing));
+	}
+}
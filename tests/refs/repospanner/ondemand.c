@@ -0,0 +1,125 @@
+#include "clar_libgit2.h"
+#include "refdb.h"
+#include "refdb_repospanner.h"
+#include "odb/repospanner/repospanner_helpers.h"
+
+#define MASTER_ID "a65fedf39aefe402d3bb6e24df4d4f5fe4547750"
+#define BR2_ID "c47800c7266a2be04c571c04d5a6614691ea99bd"
+
+static git_repository *_repo;
+static refdb_rs_backend *_backend;
+
+void test_refs_repospanner_ondemand__initialize(void)
+{
+	git_refdb *refdb;
+
+	_repo = cl_git_sandbox_init("testrepo.git");
+	repospanner_helpers_configure(_repo, REPOSPANNER_UNREACHABLE_URL);
+	cl_repo_set_string(_repo, "repospanner.refsinterval", "600000");
+	cl_repo_set_bool(_repo, "repospanner.refsnapshot", false);
+
+	cl_git_pass(git_repository_refdb__weakptr(&refdb, _repo));
+	_backend = (refdb_rs_backend *)refdb->backend;
+}
+
+void test_refs_repospanner_ondemand__cleanup(void)
+{
+	cl_git_sandbox_cleanup();
+}
+
+/* Apply `data` as the server's answer to a request for `param`/`value` */
+static bool apply(const char *param, const char *value, const char *data, size_t len)
+{
+	struct refretrieve listing;
+	bool changed = false;
+
+	cl_git_pass(git_refdb_repospanner__retrieve_init(&listing));
+	cl_assert_equal_sz(len, git_refdb_repospanner__write_cb((char *)data, 1, len, &listing));
+	cl_git_pass(git_refdb_repospanner__write_finish(&listing));
+
+	cl_git_pass(git_refdb_repospanner__apply(&changed, _backend, &listing,
+		200, param, value, false, git__timer()));
+
+	git_refdb_repospanner__retrieve_dispose(&listing);
+	return changed;
+}
+
+#define APPLY(param, value, data) apply(param, value, data, sizeof(data) - 1)
+
+static void assert_ref(const char *name, const char *id)
+{
+	git_reference *ref;
+	git_oid expected;
+
+	cl_git_pass(git_reference_lookup(&ref, _repo, name));
+	cl_git_pass(git_oid_fromstr(&expected, id));
+	cl_assert_equal_oid(&expected, git_reference_target(ref));
+	git_reference_free(ref);
+}
+
+void test_refs_repospanner_ondemand__single_refs_are_cached(void)
+{
+	git_reference *ref;
+
+	/* nothing is known yet, and the server cannot be asked */
+	cl_git_fail(git_reference_lookup(&ref, _repo, "refs/heads/master"));
+
+	cl_assert(APPLY("name", "refs/heads/master",
+		"real\0refs/heads/master\0" MASTER_ID "\n"));
+
+	assert_ref("refs/heads/master", MASTER_ID);
+}
+
+void test_refs_repospanner_ondemand__missing_refs_are_remembered(void)
+{
+	git_reference *ref;
+
+	cl_assert(!APPLY("name", "refs/heads/missing", ""));
+
+	/* answered from the cache, without asking the server again */
+	cl_git_fail_with(GIT_ENOTFOUND, git_reference_lookup(&ref, _repo, "refs/heads/missing"));
+
+	/* and forgotten once the ref shows up */
+	cl_assert(APPLY("name", "refs/heads/missing",
+		"real\0refs/heads/missing\0" BR2_ID "\n"));
+	assert_ref("refs/heads/missing", BR2_ID);
+}
+
+void test_refs_repospanner_ondemand__single_refs_leave_others_alone(void)
+{
+	cl_assert(APPLY("name", "refs/heads/master",
+		"real\0refs/heads/master\0" MASTER_ID "\n"));
+	cl_assert(APPLY("name", "refs/heads/br2",
+		"real\0refs/heads/br2\0" BR2_ID "\n"));
+
+	/* an unchanged ref is no change */
+	cl_assert(!APPLY("name", "refs/heads/br2",
+		"real\0refs/heads/br2\0" BR2_ID "\n"));
+
+	assert_ref("refs/heads/master", MASTER_ID);
+	assert_ref("refs/heads/br2", BR2_ID);
+}
+
+void test_refs_repospanner_ondemand__prefixes_replace_the_refs_under_them(void)
+{
+	git_reference *ref;
+
+	cl_assert(APPLY("name", "refs/heads/br2",
+		"real\0refs/heads/br2\0" BR2_ID "\n"));
+	cl_assert(APPLY("name", "refs/tags/v1",
+		"real\0refs/tags/v1\0" BR2_ID "\n"));
+
+	cl_assert(APPLY("prefix", "refs/heads/",
+		"real\0refs/heads/master\0" MASTER_ID "\n"
+		"symb\0refs/heads/main\0refs/heads/master\n"));
+
+	assert_ref("refs/heads/master", MASTER_ID);
+	assert_ref("refs/tags/v1", BR2_ID);
+
+	cl_git_pass(git_reference_lookup(&ref, _repo, "refs/heads/main"));
+	cl_assert_equal_s("refs/heads/master", git_reference_symbolic_target(ref));
+	git_reference_free(ref);
+
+	/* gone from the cache, so it has to be asked for */
+	cl_git_fail(git_reference_lookup(&ref, _repo, "refs/heads/br2"));
+}
@@ -0,0 +1,155 @@
+#include "clar_libgit2.h"
+#include "hash.h"
+#include "fileops.h"
+#include "odb/repospanner/repospanner_helpers.h"
+
+#define MASTER_ID "a65fedf39aefe402d3bb6e24df4d4f5fe4547750"
+#define SNAPSHOT_PATH "testrepo.git/repospanner-refs"
+
+static git_repository *_repo;
+
+void test_refs_repospanner_snapshot__initialize(void)
+{
+	git_repository *repo = cl_git_sandbox_init("testrepo.git");
+
+	repospanner_helpers_configure(repo, REPOSPANNER_UNREACHABLE_URL);
+	cl_repo_set_string(repo, "repospanner.refsinterval", "600000");
+
+	_repo = NULL;
+}
+
+void test_refs_repospanner_snapshot__cleanup(void)
+{
+	git_repository_free(_repo);
+	cl_git_sandbox_cleanup();
+}
+
+static void put_be32(git_buf *buf, uint32_t value)
+{
+	value = htonl(value);
+	git_buf_put(buf, (const char *)&value, sizeof(value));
+}
+
+static void put_record(git_buf *records, git_buf *strings,
+	const char *name, const char *id, const char *target)
+{
+	git_oid oid;
+
+	memset(&oid, 0, sizeof(oid));
+	if (id)
+		cl_git_pass(git_oid_fromstr(&oid, id));
+
+	put_be32(records, (uint32_t)strings->size);
+	git_buf_put(strings, name, strlen(name) + 1);
+
+	put_be32(records, target ? (uint32_t)strings->size : 0xffffffff);
+	if (target)
+		git_buf_put(strings, target, strlen(target) + 1);
+
+	put_be32(records, target ? 1 : 0);
+	git_buf_put(records, (const char *)oid.id, GIT_OID_RAWSZ);
+	git_buf_put(records, (const char *)oid.id, GIT_OID_RAWSZ);
+}
+
+/* What a process that listed the refs of the server would leave behind */
+static void write_snapshot(bool corrupt)
+{
+	git_buf data = GIT_BUF_INIT, records = GIT_BUF_INIT, strings = GIT_BUF_INIT;
+	git_oid hash;
+
+	put_record(&records, &strings, "HEAD", NULL, "refs/heads/master");
+	put_record(&records, &strings, "refs/heads/br2", MASTER_ID, NULL);
+	put_record(&records, &strings, "refs/heads/master", MASTER_ID, NULL);
+
+	git_buf_puts(&data, "RSRF");
+	put_be32(&data, 1);
+	put_be32(&data, 3);
+	put_be32(&data, 4);
+	git_buf_puts(&data, "\"v1\"");
+	git_buf_put(&data, records.ptr, records.size);
+	git_buf_put(&data, strings.ptr, strings.size);
+	cl_assert(!git_buf_oom(&data));
+
+	cl_git_pass(git_hash_buf(&hash, data.ptr, data.size));
+	if (corrupt)
+		hash.id[0] ^= 0xff;
+	git_buf_put(&data, (const char *)hash.id, GIT_OID_RAWSZ);
+
+	cl_git_pass(git_futils_writebuffer(&data, SNAPSHOT_PATH, O_CREAT | O_TRUNC | O_WRONLY, 0666));
+
+	git_buf_dispose(&data);
+	git_buf_dispose(&records);
+	git_buf_dispose(&strings);
+}
+
+static int count_refs(git_reference *ref, void *payload)
+{
+	(*(size_t *)payload)++;
+	git_reference_free(ref);
+	return 0;
+}
+
+void test_refs_repospanner_snapshot__refs_are_served_from_a_recent_snapshot(void)
+{
+	git_reference *ref;
+	git_oid id;
+	size_t count = 0;
+
+	write_snapshot(false);
+	cl_git_pass(git_repository_open(&_repo, "testrepo.git"));
+
+	cl_git_pass(git_repository_head(&ref, _repo));
+	cl_assert_equal_s("refs/heads/master", git_reference_name(ref));
+	cl_git_pass(git_oid_fromstr(&id, MASTER_ID));
+	cl_assert_equal_oid(&id, git_reference_target(ref));
+	git_reference_free(ref);
+
+	cl_git_fail_with(GIT_ENOTFOUND, git_reference_lookup(&ref, _repo, "refs/heads/missing"));
+
+	cl_git_pass(git_reference_foreach(_repo, count_refs, &count));
+	cl_assert_equal_i(3, count);
+}
+
+void test_refs_repospanner_snapshot__stale_snapshots_beat_no_refs(void)
+{
+	git_reference *ref;
+	time_t old = time(NULL) - 3600;
+	struct stat st;
+
+	write_snapshot(false);
+	cl_git_pass(git_futils_touch(SNAPSHOT_PATH, &old));
+	cl_git_pass(git_repository_open(&_repo, "testrepo.git"));
+
+	/* revalidating it fails, but it is all there is */
+	cl_git_pass(git_reference_lookup(&ref, _repo, "refs/heads/br2"));
+	git_reference_free(ref);
+
+	/* and it has not been confirmed by that */
+	cl_must_pass(p_stat(SNAPSHOT_PATH, &st));
+	cl_assert_equal_i(old, st.st_mtime);
+}
+
+void test_refs_repospanner_snapshot__can_be_disabled(void)
+{
+	git_reference *ref;
+
+	write_snapshot(false);
+	cl_git_pass(git_repository_open(&_repo, "testrepo.git"));
+	cl_repo_set_bool(_repo, "repospanner.refsnapshot", false);
+	git_repository_free(_repo);
+
+	cl_git_pass(git_repository_open(&_repo, "testrepo.git"));
+	cl_git_fail(git_reference_lookup(&ref, _repo, "refs/heads/br2"));
+}
+
+void test_refs_repospanner_snapshot__corrupted_snapshots_are_dropped(void)
+{
+	size_t count = 0;
+
+	write_snapshot(true);
+	cl_git_pass(git_repository_open(&_repo, "testrepo.git"));
+
+	/* the checksum is verified once all refs are needed */
+	cl_git_fail(git_reference_foreach(_repo, count_refs, &count));
+	cl_assert(!git_path_exists(SNAPSHOT_PATH));
+}